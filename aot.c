@@ -0,0 +1,1101 @@
+#include <string.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <math.h>
+
+#include "aot.h"
+#include "verify.h"
+#include "vm.h"
+
+/*
+ * The runtime every program is written with. It has the same value layout
+ * as the vm and the helpers follow what the interpreter does for each
+ * instruction, down to the messages it prints.
+ */
+static const char *runtime[] = {
+    "/* Written by phantom --aot. Build it with a C compiler, such as cc -O2 -o prog this.c */",
+    "",
+    "#include <stdio.h>",
+    "#include <stdlib.h>",
+    "#include <string.h>",
+    "#include <stdint.h>",
+    "#include <limits.h>",
+    "#include <math.h>",
+    "#include <time.h>",
+    "",
+    "#define FRAMES_MAX 256   /* Calls that can be running at once */",
+    "#define RT_VARS    256   /* Buckets the globals are hashed into */",
+    "",
+    "typedef enum {",
+    "    OBJ_VAL_LONG,",
+    "    OBJ_VAL_DOUBLE,",
+    "    OBJ_VAL_STR,",
+    "    OBJ_VAL_BOOL,",
+    "} object_val_t;",
+    "",
+    "typedef struct {",
+    "    object_val_t type;",
+    "    union {",
+    "        long long_num;",
+    "        double double_num;",
+    "        char *str;",
+    "    } as;",
+    "} object_t;",
+    "",
+    "/* A global variable, found by its name */",
+    "typedef struct rt_var {",
+    "    char *name;",
+    "    object_t val;",
+    "    struct rt_var *next;",
+    "} rt_var_t;",
+    "",
+    "static char rt_bools[2][6] = { \"false\", \"true\" };",
+    "",
+    "#define RT_LONG(v)   ((object_t){ .type = OBJ_VAL_LONG, .as.long_num = (v) })",
+    "#define RT_DOUBLE(v) ((object_t){ .type = OBJ_VAL_DOUBLE, .as.double_num = (v) })",
+    "#define RT_STR(v)    ((object_t){ .type = OBJ_VAL_STR, .as.str = (v) })",
+    "#define RT_TRUE      ((object_t){ .type = OBJ_VAL_BOOL, .as.str = rt_bools[1] })",
+    "#define RT_FALSE     ((object_t){ .type = OBJ_VAL_BOOL, .as.str = rt_bools[0] })",
+    "",
+    "/* Whether a op b holds. Longs and doubles compare with each other and anything else is false */",
+    "#define RT_TEST(a, b, op)                                                           \\",
+    "    ((a).type == OBJ_VAL_LONG && (b).type == OBJ_VAL_LONG ? (a).as.long_num op (b).as.long_num :         \\",
+    "     (a).type == OBJ_VAL_DOUBLE && (b).type == OBJ_VAL_DOUBLE ? (a).as.double_num op (b).as.double_num : \\",
+    "     (a).type == OBJ_VAL_LONG && (b).type == OBJ_VAL_DOUBLE ? (a).as.long_num op (b).as.double_num :     \\",
+    "     (a).type == OBJ_VAL_DOUBLE && (b).type == OBJ_VAL_LONG ? (a).as.double_num op (b).as.long_num : 0)",
+    "",
+    "/* A global through the cache of the instruction that uses it, which is filled the first time */",
+    "#define RT_VAR(cache, name, create) ((cache) ? (cache) : ((cache) = rt_var((name), (create))))",
+    "",
+    "/* Marks a stack slot, as some only ever hold a value that is dropped */",
+    "#if defined(__GNUC__)",
+    "#define RT_UNUSED __attribute__((unused))",
+    "#else",
+    "#define RT_UNUSED",
+    "#endif",
+    "",
+    "static rt_var_t *rt_vars[RT_VARS];",
+    "",
+    "static int rt_frames;   /* Calls running */",
+    "",
+    "static inline int rt_truthy(object_t obj)",
+    "{",
+    "    if (obj.type == OBJ_VAL_BOOL && (obj.as.str == rt_bools[1] || strcmp(obj.as.str, \"true\") == 0))",
+    "        return 1;",
+    "",
+    "    if (obj.type == OBJ_VAL_LONG && obj.as.long_num != 0)",
+    "        return 1;",
+    "",
+    "    if (obj.type == OBJ_VAL_DOUBLE && obj.as.double_num != 0)",
+    "        return 1;",
+    "",
+    "    if (obj.type == OBJ_VAL_STR && obj.as.str)",
+    "        return 1;",
+    "",
+    "    return 0;",
+    "}",
+    "",
+    "static inline void rt_print(object_t obj)",
+    "{",
+    "    if (obj.type == OBJ_VAL_DOUBLE)",
+    "        printf(\"%f\\n\", obj.as.double_num);",
+    "    else if (obj.type == OBJ_VAL_LONG)",
+    "        printf(\"%ld\\n\", obj.as.long_num);",
+    "    else",
+    "        printf(\"%s\\n\", obj.as.str);",
+    "}",
+    "",
+    "#define RT_BINARY(name, op)                                         \\",
+    "    static inline object_t name(object_t a, object_t b)             \\",
+    "    {                                                               \\",
+    "        if (a.type == OBJ_VAL_DOUBLE && b.type == OBJ_VAL_DOUBLE)   \\",
+    "            a.as.double_num = a.as.double_num op b.as.double_num;   \\",
+    "        else if (a.type == OBJ_VAL_LONG && b.type == OBJ_VAL_LONG)  \\",
+    "            a.as.long_num = a.as.long_num op b.as.long_num;         \\",
+    "        else                                                        \\",
+    "            printf(\"Invalid operands\\n\");                           \\",
+    "                                                                    \\",
+    "        return a;                                                   \\",
+    "    }",
+    "",
+    "RT_BINARY(rt_add, +)",
+    "RT_BINARY(rt_sub, -)",
+    "RT_BINARY(rt_mul, *)",
+    "RT_BINARY(rt_div, /)",
+    "",
+    "static inline object_t rt_mod(object_t a, object_t b)",
+    "{",
+    "    if (a.type == OBJ_VAL_DOUBLE && b.type == OBJ_VAL_DOUBLE)",
+    "        printf(\"Error: unable to modulo doubles\\n\");",
+    "    else if (a.type == OBJ_VAL_LONG && b.type == OBJ_VAL_LONG)",
+    "        a.as.long_num %= b.as.long_num;",
+    "    else",
+    "        printf(\"Invalid operands\\n\");",
+    "",
+    "    return a;",
+    "}",
+    "",
+    "/* Steps a long or a double in place and gives the new value */",
+    "static inline object_t rt_step(object_t *val, int step)",
+    "{",
+    "    if (val->type == OBJ_VAL_LONG)",
+    "        val->as.long_num += step;",
+    "    else if (val->type == OBJ_VAL_DOUBLE)",
+    "        val->as.double_num += step;",
+    "",
+    "    return *val;",
+    "}",
+    "",
+    "static inline uint32_t rt_hash(const char *str)",
+    "{",
+    "    uint32_t hash = 2166136261u;",
+    "",
+    "    for (; *str; str++)",
+    "    {",
+    "        hash ^= (uint8_t)*str;",
+    "        hash *= 16777619;",
+    "    }",
+    "",
+    "    return hash;",
+    "}",
+    "",
+    "/* Integer match cases are also matched by doubles that == would find equal */",
+    "static inline int rt_match_key(object_t val, long *key)",
+    "{",
+    "    if (val.type == OBJ_VAL_LONG)",
+    "    {",
+    "        *key = val.as.long_num;",
+    "        return 1;",
+    "    }",
+    "",
+    "    if (val.type != OBJ_VAL_DOUBLE || !(val.as.double_num >= (double)LONG_MIN && val.as.double_num < (double)LONG_MAX))",
+    "        return 0;",
+    "",
+    "    *key = (long)val.as.double_num;",
+    "",
+    "    return *key == val.as.double_num;",
+    "}",
+    "",
+    "static inline char *rt_copy_str(const char *str)",
+    "{",
+    "    char *copy = malloc(strlen(str) + 1);",
+    "    strcpy(copy, str);",
+    "",
+    "    return copy;",
+    "}",
+    "",
+    "/* Finds a global, adding it if create is set. Using one that was never declared stops the program */",
+    "static inline rt_var_t *rt_var(const char *name, int create)",
+    "{",
+    "    rt_var_t **bucket = &rt_vars[rt_hash(name) & (RT_VARS - 1)];",
+    "",
+    "    for (rt_var_t *var = *bucket; var; var = var->next)",
+    "    {",
+    "        if (strcmp(var->name, name) == 0) return var;",
+    "    }",
+    "",
+    "    if (!create)",
+    "    {",
+    "        printf(\"Error: variable '%s' not declared\\n\", name);",
+    "        exit(0);",
+    "    }",
+    "",
+    "    rt_var_t *var = malloc(sizeof(rt_var_t));",
+    "    var->name = rt_copy_str(name);",
+    "    var->val = RT_LONG(0);",
+    "    var->next = *bucket;",
+    "    *bucket = var;",
+    "",
+    "    return var;",
+    "}",
+    "",
+    "/* Declares a global again. It keeps its own copy of a string */",
+    "static inline void rt_assign(rt_var_t *var, object_t val)",
+    "{",
+    "    if (val.type == OBJ_VAL_STR)",
+    "        val.as.str = rt_copy_str(val.as.str);",
+    "",
+    "    if (var->val.type == OBJ_VAL_STR)",
+    "        free(var->val.as.str);",
+    "",
+    "    var->val = val;",
+    "}",
+    "",
+    "static inline object_t rt_stdin(void)",
+    "{",
+    "    char buffer[1025] = {0};",
+    "",
+    "    if (scanf(\" %1024s\", buffer) < 1)",
+    "        buffer[0] = '\\0';",
+    "",
+    "    long str_long = atol(buffer);",
+    "",
+    "    if (buffer[0] == '0' || str_long != 0)",
+    "        return RT_LONG(str_long);",
+    "",
+    "    return RT_STR(rt_copy_str(buffer));",
+    "}",
+    "",
+    "static inline object_t rt_rand(object_t range)",
+    "{",
+    "    return RT_LONG(rand() % range.as.long_num);",
+    "}",
+    "",
+    "/* Counts a call, which stops the program if too many are running */",
+    "static inline void rt_enter(const char *name)",
+    "{",
+    "    if (rt_frames == FRAMES_MAX)",
+    "    {",
+    "        printf(\"Error: too many nested calls to '%s'\\n\", name);",
+    "        exit(0);",
+    "    }",
+    "",
+    "    rt_frames++;",
+    "}",
+    "",
+    NULL
+};
+
+typedef struct {
+    FILE *out;
+    func_table_t *funcs;
+
+    /* Text of the string constants of every chunk, each written once */
+    char **strings;
+    uint32_t string_count;
+    uint32_t string_capacity;
+
+    int bounces;        /* Set if a function tail calls another, which its caller runs through rt_bounce */
+    uint32_t max_arity;
+    uint8_t *called;    /* Set for each function the program can call. Any other is left out */
+
+    /* The chunk being written */
+    chunk_t *chunk;
+    uint32_t *depth;
+    uint8_t *labels;    /* Set for each offset a jump goes to */
+    int32_t *consts;    /* Index in strings of each constant that is a string, or -1 */
+    int32_t *names;     /* String constant each stack slot is known to hold, or -1 */
+    uint8_t *read;      /* Set for each local something reads. Any other is never declared or written */
+    int self;           /* Function being written, or -1 for the top level */
+} aot_t;
+
+static void emit(aot_t *a, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+
+    if (*fmt) fputs("    ", a->out);
+    vfprintf(a->out, fmt, args);
+    fputc('\n', a->out);
+
+    va_end(args);
+}
+
+/* Writes text as a C string literal, escaping anything that isn't plainly printable */
+static void emit_string(FILE *out, const char *str)
+{
+    fputc('"', out);
+
+    for (; *str; str++)
+    {
+        uint8_t c = (uint8_t)*str;
+
+        if (c == '"' || c == '\\') fprintf(out, "\\%c", c);
+        else if (c >= 0x20 && c < 0x7f && c != '?') fputc(c, out);
+        else fprintf(out, "\\%03o", c);
+    }
+
+    fputc('"', out);
+}
+
+static int32_t add_string(aot_t *a, const char *str)
+{
+    for (uint32_t i = 0; i < a->string_count; i++)
+    {
+        if (strcmp(a->strings[i], str) == 0) return (int32_t)i;
+    }
+
+    if (a->string_count == a->string_capacity)
+    {
+        a->string_capacity = a->string_capacity ? a->string_capacity * 2 : 16;
+        a->strings = realloc(a->strings, sizeof(char *) * a->string_capacity);
+    }
+
+    a->strings[a->string_count] = (char *)str;
+
+    return (int32_t)a->string_count++;
+}
+
+static void format_long(char *buf, size_t size, long val)
+{
+    if (val == LONG_MIN) snprintf(buf, size, "LONG_MIN");
+    else snprintf(buf, size, "%ldL", val);
+}
+
+/* The C expression for a constant of the chunk being written */
+static const char *const_expr(aot_t *a, uint32_t index, char *buf, size_t size)
+{
+    object_t obj = a->chunk->constants[index];
+    char num[32];
+
+    switch (obj.type)
+    {
+        case OBJ_VAL_LONG:
+            format_long(num, sizeof(num), obj.as.long_num);
+            snprintf(buf, size, "RT_LONG(%s)", num);
+            break;
+
+        case OBJ_VAL_DOUBLE:
+            if (isnan(obj.as.double_num)) snprintf(buf, size, "RT_DOUBLE(NAN)");
+            else if (isinf(obj.as.double_num)) snprintf(buf, size, "RT_DOUBLE(%sHUGE_VAL)", obj.as.double_num < 0 ? "-" : "");
+            else snprintf(buf, size, "RT_DOUBLE(%a)", obj.as.double_num);
+            break;
+
+        case OBJ_VAL_BOOL:
+            snprintf(buf, size, strcmp(obj.as.str, "true") == 0 ? "RT_TRUE" : "RT_FALSE");
+            break;
+
+        default:
+            snprintf(buf, size, "RT_STR(k_%d)", a->consts[index]);
+            break;
+    }
+
+    return buf;
+}
+
+/*
+ * Writes stmt with VAR in it standing for the global named by the string in
+ * slot, or by a string constant when slot is UINT32_MAX and name is its index
+ * in strings. A name known when the C is written is looked up once and kept
+ * in a cache of its own.
+ */
+static void emit_var(aot_t *a, uint32_t slot, int32_t name, int create, const char *stmt)
+{
+    char var[64];
+
+    if (slot != UINT32_MAX) name = a->names[slot];
+
+    if (name >= 0) snprintf(var, sizeof(var), "RT_VAR(var, k_%d, %d)", name, create);
+    else snprintf(var, sizeof(var), "rt_var(s%u.as.str, %d)", slot, create);
+
+    const char *at = strstr(stmt, "VAR");
+
+    fprintf(a->out, name >= 0 ? "    { static rt_var_t *var; %.*s%s%s }\n" : "    %.*s%s%s\n",
+        (int)(at - stmt), stmt, var, at + 3);
+}
+
+/* Offset a jump operand at operand goes to, from an instruction at i that is length bytes long */
+static uint32_t jump_target(uint32_t i, uint32_t length, const uint8_t *operand)
+{
+    return i + length + CHUNK_READ_U16(operand);
+}
+
+/* Marks where every jump in the code that runs goes */
+static void find_labels(aot_t *a)
+{
+    chunk_t *chunk = a->chunk;
+
+    for (uint32_t i = 0; i < chunk->count; i += vm_op_length(chunk->code[i]))
+    {
+        uint8_t code = chunk->code[i];
+        uint32_t length = vm_op_length(code);
+
+        if (a->depth[i] == VERIFY_UNREACHED || !vm_op_is_jump(code)) continue;
+
+        if (code == OP_LOOP_END)
+        {
+            a->labels[i + length - CHUNK_READ_U16(chunk->code + i + 1)] = 1;
+            continue;
+        }
+
+        const uint8_t *operand = chunk->code + i + length - CHUNK_JUMP_BYTES;
+        a->labels[jump_target(i, length, operand)] = 1;
+
+        if (vm_op_has_table(code))
+        {
+            chunk_table_t *table = &chunk->tables[CHUNK_READ_U16(chunk->code + i + 1)];
+
+            for (uint32_t slot = 0; slot < table->count; slot++)
+            {
+                if (code != OP_MATCH_HASH || table->strings[slot])
+                    a->labels[i + length + table->offsets[slot]] = 1;
+            }
+        }
+    }
+}
+
+static const char *compare_op(uint8_t code)
+{
+    static const char *typed[] = { ">", ">=", "<", "<=", "==", "!=" };
+
+    /* The typed compare and branch op codes come in runs of six */
+    if (code >= OP_JGT_LL && code <= OP_JNE_DD_K) return typed[(code - OP_JGT_LL) % 6];
+
+    switch (code)
+    {
+        case OP_GT: case OP_GT_K: case OP_GT_LL: case OP_GT_DD: case OP_JGT: case OP_JGT_K: return ">";
+        case OP_GT_EQ: case OP_GT_EQ_K: case OP_GT_EQ_LL: case OP_GT_EQ_DD: case OP_JGT_EQ: case OP_JGT_EQ_K: return ">=";
+        case OP_LT: case OP_LT_K: case OP_LT_LL: case OP_LT_DD: case OP_JLT: case OP_JLT_K: return "<";
+        case OP_LT_EQ: case OP_LT_EQ_K: case OP_LT_EQ_LL: case OP_LT_EQ_DD: case OP_JLT_EQ: case OP_JLT_EQ_K: return "<=";
+        case OP_EQ: case OP_EQ_K: case OP_EQ_LL: case OP_EQ_DD: case OP_JEQ: case OP_JEQ_K: return "==";
+        default: return "!=";
+    }
+}
+
+static const char *arith_op(uint8_t code)
+{
+    switch (code)
+    {
+        case OP_ADD: case OP_ADD_LL: case OP_ADD_DD: return "+";
+        case OP_SUB: case OP_SUB_LL: case OP_SUB_DD: return "-";
+        case OP_MUL: case OP_MUL_LL: case OP_MUL_DD: return "*";
+        case OP_DIV: case OP_DIV_LL: case OP_DIV_DD: return "/";
+        default: return "%";
+    }
+}
+
+static const char *arith_helper(uint8_t code)
+{
+    switch (code)
+    {
+        case OP_ADD: return "rt_add";
+        case OP_SUB: return "rt_sub";
+        case OP_MUL: return "rt_mul";
+        case OP_DIV: return "rt_div";
+        default: return "rt_mod";
+    }
+}
+
+/* The arguments of a call, which are the top argc stack slots */
+static void emit_args(aot_t *a, uint32_t first, uint32_t argc)
+{
+    for (uint32_t arg = 0; arg < argc; arg++)
+        fprintf(a->out, "%ss%u", arg ? ", " : "", first + arg);
+}
+
+static void emit_call(aot_t *a, uint32_t i, uint32_t d)
+{
+    uint32_t index = CHUNK_READ_U16(a->chunk->code + i + 1);
+    uint32_t argc = a->chunk->code[i + 1 + CHUNK_FUNC_BYTES];
+    uint32_t dst = d - argc;
+
+    fputs("    rt_enter(", a->out);
+    emit_string(a->out, a->funcs->funcs[index].name);
+    fputs(");\n", a->out);
+
+    fprintf(a->out, "    s%u = fn_%u(", dst, index);
+    emit_args(a, dst, argc);
+    fputs(");\n", a->out);
+
+    if (a->bounces) emit(a, "while (rt_tail >= 0) s%u = rt_bounce();", dst);
+
+    emit(a, "rt_frames--;");
+}
+
+/*
+ * A tail call of the function itself goes back to its start with the new
+ * arguments. One of another function is handed back to the caller, which
+ * runs it through rt_bounce, so a chain of them doesn't grow the C stack.
+ */
+static void emit_tail_call(aot_t *a, uint32_t i, uint32_t d)
+{
+    uint32_t index = CHUNK_READ_U16(a->chunk->code + i + 1);
+    uint32_t argc = a->chunk->code[i + 1 + CHUNK_FUNC_BYTES];
+    uint32_t first = d - argc;
+
+    if ((int)index == a->self)
+    {
+        for (uint32_t arg = 0; arg < argc; arg++)
+            emit(a, "l%u = s%u;", arg, first + arg);
+
+        for (uint32_t slot = argc; slot < a->chunk->local_count; slot++)
+            if (a->read[slot]) emit(a, "l%u = RT_LONG(0);", slot);
+
+        emit(a, "goto entry;");
+        return;
+    }
+
+    for (uint32_t arg = 0; arg < argc; arg++)
+        emit(a, "rt_args[%u] = s%u;", arg, first + arg);
+
+    emit(a, "rt_tail = %u;", index);
+    emit(a, "return RT_LONG(0);");
+}
+
+static void emit_match(aot_t *a, uint32_t i, uint32_t d)
+{
+    chunk_t *chunk = a->chunk;
+    uint8_t code = chunk->code[i];
+    uint32_t length = vm_op_length(code);
+    chunk_table_t *table = &chunk->tables[CHUNK_READ_U16(chunk->code + i + 1)];
+    uint32_t fallback = CHUNK_READ_U16(chunk->code + i + 1 + CHUNK_TABLE_BYTES);
+    uint32_t val = d - 1;
+
+    if (code == OP_MATCH_HASH)
+    {
+        emit(a, "if (s%u.type == OBJ_VAL_STR)", val);
+        emit(a, "{");
+        emit(a, "    switch (rt_hash(s%u.as.str))", val);
+        emit(a, "    {");
+
+        for (uint32_t slot = 0; slot < table->count; slot++)
+        {
+            uint32_t first = 0;
+
+            if (!table->strings[slot]) continue;
+
+            /* Strings with the same hash share a case, so it is written with the first */
+            while (first < slot && !(table->strings[first] && table->hashes[first] == table->hashes[slot]))
+                first++;
+
+            if (first < slot) continue;
+
+            emit(a, "        case %uu:", table->hashes[slot]);
+
+            for (uint32_t other = slot; other < table->count; other++)
+            {
+                if (!table->strings[other] || table->hashes[other] != table->hashes[slot]) continue;
+
+                fprintf(a->out, "            if (strcmp(s%u.as.str, ", val);
+                emit_string(a->out, table->strings[other]);
+                fprintf(a->out, ") == 0) goto L%u;\n", i + length + table->offsets[other]);
+            }
+
+            emit(a, "            break;");
+        }
+
+        emit(a, "    }");
+        emit(a, "}");
+        emit(a, "goto L%u;", i + length + fallback);
+        return;
+    }
+
+    emit(a, "{");
+    emit(a, "    long key;");
+    emit(a, "");
+    emit(a, "    if (rt_match_key(s%u, &key))", val);
+    emit(a, "    {");
+    emit(a, "        switch (key)");
+    emit(a, "        {");
+
+    for (uint32_t slot = 0; slot < table->count; slot++)
+    {
+        char key[32];
+
+        /* Gaps in a dense table go to the default */
+        if (table->offsets[slot] == fallback && code == OP_MATCH_TABLE) continue;
+
+        format_long(key, sizeof(key), code == OP_MATCH_TABLE ? (long)((unsigned long)table->min + slot) : table->keys[slot]);
+        emit(a, "            case %s: goto L%u;", key, i + length + table->offsets[slot]);
+    }
+
+    emit(a, "        }");
+    emit(a, "    }");
+    emit(a, "}");
+    emit(a, "goto L%u;", i + length + fallback);
+}
+
+/*
+ * Writes the C for the instruction at i, with d values on the stack above
+ * the locals. Slot n of the stack is the variable sn and local n is ln.
+ */
+static void emit_insn(aot_t *a, uint32_t i)
+{
+    chunk_t *chunk = a->chunk;
+    uint8_t code = chunk->code[i];
+    uint32_t length = vm_op_length(code);
+    uint32_t d = a->depth[i];
+    char buf[64];
+
+    /* Slot the instruction leaves a new value in, which no longer holds a known name */
+    uint32_t written = UINT32_MAX;
+
+    switch (code)
+    {
+        case OP_CONST:
+        {
+            uint32_t index = CHUNK_READ_U24(chunk->code + i + 1);
+
+            emit(a, "s%u = %s;", d, const_expr(a, index, buf, sizeof(buf)));
+            a->names[d] = chunk->constants[index].type == OBJ_VAL_STR ? a->consts[index] : -1;
+            break;
+        }
+        case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_MOD:
+            emit(a, "s%u = %s(s%u, s%u);", d - 2, arith_helper(code), d - 2, d - 1);
+            written = d - 2;
+            break;
+
+        case OP_ADD_LL: case OP_SUB_LL: case OP_MUL_LL: case OP_DIV_LL: case OP_MOD_LL:
+            emit(a, "s%u.as.long_num = s%u.as.long_num %s s%u.as.long_num;", d - 2, d - 2, arith_op(code), d - 1);
+            written = d - 2;
+            break;
+
+        case OP_ADD_DD: case OP_SUB_DD: case OP_MUL_DD: case OP_DIV_DD:
+            emit(a, "s%u.as.double_num = s%u.as.double_num %s s%u.as.double_num;", d - 2, d - 2, arith_op(code), d - 1);
+            written = d - 2;
+            break;
+
+        case OP_GT: case OP_GT_EQ: case OP_LT: case OP_LT_EQ: case OP_EQ: case OP_NE:
+            emit(a, "s%u = RT_TEST(s%u, s%u, %s) ? RT_TRUE : RT_FALSE;", d - 2, d - 2, d - 1, compare_op(code));
+            written = d - 2;
+            break;
+
+        case OP_GT_K: case OP_GT_EQ_K: case OP_LT_K: case OP_LT_EQ_K: case OP_EQ_K: case OP_NE_K:
+            const_expr(a, CHUNK_READ_U24(chunk->code + i + 1), buf, sizeof(buf));
+            emit(a, "s%u = RT_TEST(s%u, %s, %s) ? RT_TRUE : RT_FALSE;", d - 1, d - 1, buf, compare_op(code));
+            written = d - 1;
+            break;
+
+        case OP_GT_LL: case OP_GT_EQ_LL: case OP_LT_LL: case OP_LT_EQ_LL: case OP_EQ_LL: case OP_NE_LL:
+            emit(a, "s%u = s%u.as.long_num %s s%u.as.long_num ? RT_TRUE : RT_FALSE;", d - 2, d - 2, compare_op(code), d - 1);
+            written = d - 2;
+            break;
+
+        case OP_GT_DD: case OP_GT_EQ_DD: case OP_LT_DD: case OP_LT_EQ_DD: case OP_EQ_DD: case OP_NE_DD:
+            emit(a, "s%u = s%u.as.double_num %s s%u.as.double_num ? RT_TRUE : RT_FALSE;", d - 2, d - 2, compare_op(code), d - 1);
+            written = d - 2;
+            break;
+
+        case OP_POP:
+            emit(a, "rt_print(s%u);", d - 1);
+            break;
+
+        case OP_DROP:
+            break;
+
+        case OP_VAR_DECL:
+            snprintf(buf, sizeof(buf), "rt_assign(VAR, s%u);", d - 1);
+            emit_var(a, d - 2, -1, 1, buf);
+            break;
+
+        case OP_VAR_DECL_K:
+        {
+            uint32_t index = CHUNK_READ_U24(chunk->code + i + 1);
+
+            snprintf(buf, sizeof(buf), "rt_assign(VAR, s%u);", d - 1);
+            emit_var(a, UINT32_MAX, a->consts[index], 1, buf);
+            break;
+        }
+        case OP_VAR_GET:
+            snprintf(buf, sizeof(buf), "s%u = VAR->val;", d - 1);
+            emit_var(a, d - 1, -1, 0, buf);
+            written = d - 1;
+            break;
+
+        case OP_INC:
+        case OP_DEC:
+            snprintf(buf, sizeof(buf), "s%u = rt_step(&VAR->val, %d);", d - 1, code == OP_INC ? 1 : -1);
+            emit_var(a, d - 1, -1, 0, buf);
+            written = d - 1;
+            break;
+
+        case OP_GET_LOCAL:
+            emit(a, "s%u = l%u;", d, CHUNK_READ_U16(chunk->code + i + 1));
+            written = d;
+            break;
+
+        case OP_SET_LOCAL:
+            if (a->read[CHUNK_READ_U16(chunk->code + i + 1)])
+                emit(a, "l%u = s%u;", CHUNK_READ_U16(chunk->code + i + 1), d - 1);
+            break;
+
+        case OP_INC_LOCAL:
+        case OP_DEC_LOCAL:
+            emit(a, "s%u = rt_step(&l%u, %d);", d, CHUNK_READ_U16(chunk->code + i + 1), code == OP_INC_LOCAL ? 1 : -1);
+            written = d;
+            break;
+
+        case OP_CALL:
+            emit_call(a, i, d);
+            written = d - chunk->code[i + 1 + CHUNK_FUNC_BYTES];
+            break;
+
+        case OP_TAIL_CALL:
+            emit_tail_call(a, i, d);
+            break;
+
+        case OP_RETURN:
+            emit(a, "return s%u;", d - 1);
+            break;
+
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+            emit(a, "if (%srt_truthy(s%u)) goto L%u;", code == OP_JUMP_IF_FALSE ? "!" : "", d - 1,
+                jump_target(i, length, chunk->code + i + 1));
+            break;
+
+        case OP_JGT: case OP_JGT_EQ: case OP_JLT: case OP_JLT_EQ: case OP_JEQ: case OP_JNE:
+            emit(a, "if (!RT_TEST(s%u, s%u, %s)) goto L%u;", d - 2, d - 1, compare_op(code),
+                jump_target(i, length, chunk->code + i + 1));
+            break;
+
+        case OP_JGT_K: case OP_JGT_EQ_K: case OP_JLT_K: case OP_JLT_EQ_K: case OP_JEQ_K: case OP_JNE_K:
+            const_expr(a, CHUNK_READ_U24(chunk->code + i + 1), buf, sizeof(buf));
+            emit(a, "if (!RT_TEST(s%u, %s, %s)) goto L%u;", d - 1, buf, compare_op(code),
+                jump_target(i, length, chunk->code + i + 1 + CHUNK_CONST_BYTES));
+            break;
+
+        case OP_JGT_LL: case OP_JGT_EQ_LL: case OP_JLT_LL: case OP_JLT_EQ_LL: case OP_JEQ_LL: case OP_JNE_LL:
+            emit(a, "if (!(s%u.as.long_num %s s%u.as.long_num)) goto L%u;", d - 2, compare_op(code), d - 1,
+                jump_target(i, length, chunk->code + i + 1));
+            break;
+
+        case OP_JGT_DD: case OP_JGT_EQ_DD: case OP_JLT_DD: case OP_JLT_EQ_DD: case OP_JEQ_DD: case OP_JNE_DD:
+            emit(a, "if (!(s%u.as.double_num %s s%u.as.double_num)) goto L%u;", d - 2, compare_op(code), d - 1,
+                jump_target(i, length, chunk->code + i + 1));
+            break;
+
+        case OP_JGT_LL_K: case OP_JGT_EQ_LL_K: case OP_JLT_LL_K: case OP_JLT_EQ_LL_K: case OP_JEQ_LL_K: case OP_JNE_LL_K:
+            const_expr(a, CHUNK_READ_U24(chunk->code + i + 1), buf, sizeof(buf));
+            emit(a, "if (!(s%u.as.long_num %s %s.as.long_num)) goto L%u;", d - 1, compare_op(code), buf,
+                jump_target(i, length, chunk->code + i + 1 + CHUNK_CONST_BYTES));
+            break;
+
+        case OP_JGT_DD_K: case OP_JGT_EQ_DD_K: case OP_JLT_DD_K: case OP_JLT_EQ_DD_K: case OP_JEQ_DD_K: case OP_JNE_DD_K:
+            const_expr(a, CHUNK_READ_U24(chunk->code + i + 1), buf, sizeof(buf));
+            emit(a, "if (!(s%u.as.double_num %s %s.as.double_num)) goto L%u;", d - 1, compare_op(code), buf,
+                jump_target(i, length, chunk->code + i + 1 + CHUNK_CONST_BYTES));
+            break;
+
+        case OP_JUMP:
+            emit(a, "goto L%u;", jump_target(i, length, chunk->code + i + 1));
+            break;
+
+        case OP_MATCH_TABLE:
+        case OP_MATCH_SEARCH:
+        case OP_MATCH_HASH:
+            emit_match(a, i, d);
+            break;
+
+        case OP_LOOP:
+            /* The counter is tested through every field of the union, as the interpreter does */
+            emit(a, "if (!(s%u.as.str || s%u.as.double_num != 0 || s%u.as.long_num != 0)) goto L%u;",
+                d - 1, d - 1, d - 1, jump_target(i, length, chunk->code + i + 1));
+            emit(a, "s%u.as.long_num--;", d - 1);
+            written = d - 1;
+            break;
+
+        case OP_LOOP_END:
+            emit(a, "goto L%u;", i + length - CHUNK_READ_U16(chunk->code + i + 1));
+            break;
+
+        case OP_STDIN:
+            emit(a, "s%u = rt_stdin();", d);
+            written = d;
+            break;
+
+        case OP_RAND:
+            emit(a, "s%u = rt_rand(s%u);", d - 1, d - 1);
+            written = d - 1;
+            break;
+
+        case OP_EXIT:
+            /* The exit the compiler ends the top level with just returns */
+            if (a->self < 0 && i == chunk->count - 1) emit(a, "return;");
+            else emit(a, "exit(0);");
+            break;
+
+        default: break;
+    }
+
+    if (written != UINT32_MAX) a->names[written] = -1;
+}
+
+/* Writes the body of the chunk, which has been verified into depth */
+static void emit_body(aot_t *a, chunk_t *chunk, uint32_t *depth, uint32_t max_depth, int self)
+{
+    a->chunk = chunk;
+    a->depth = depth;
+    a->self = self;
+    a->labels = calloc(chunk->count + 1, 1);
+    a->consts = malloc(sizeof(int32_t) * (chunk->const_count + 1));
+    a->names = malloc(sizeof(int32_t) * (max_depth + 1));
+    a->read = calloc(chunk->local_count + 1, 1);
+
+    for (uint32_t k = 0; k < chunk->const_count; k++)
+        a->consts[k] = chunk->constants[k].type == OBJ_VAL_STR ? add_string(a, chunk->constants[k].as.str) : -1;
+
+    find_labels(a);
+
+    uint32_t first_local = self >= 0 ? a->funcs->funcs[self].arity : 0;
+    int tail_calls_self = 0;
+
+    for (uint32_t i = 0; i < chunk->count; i += vm_op_length(chunk->code[i]))
+    {
+        if (depth[i] == VERIFY_UNREACHED) continue;
+
+        uint8_t code = chunk->code[i];
+
+        if (code == OP_TAIL_CALL && CHUNK_READ_U16(chunk->code + i + 1) == (uint32_t)self)
+            tail_calls_self = 1;
+
+        if (code == OP_GET_LOCAL || code == OP_INC_LOCAL || code == OP_DEC_LOCAL)
+            a->read[CHUNK_READ_U16(chunk->code + i + 1)] = 1;
+    }
+
+    for (uint32_t slot = first_local; slot < chunk->local_count; slot++)
+        if (a->read[slot]) emit(a, "object_t l%u = RT_LONG(0);", slot);
+
+    for (uint32_t slot = 0; slot < max_depth; slot++)
+        emit(a, "RT_UNUSED object_t s%u;", slot);
+
+    if (tail_calls_self) fprintf(a->out, "\nentry:\n");
+
+    for (uint32_t i = 0; i < max_depth; i++)
+        a->names[i] = -1;
+
+    for (uint32_t i = 0; i < chunk->count; i += vm_op_length(chunk->code[i]))
+    {
+        if (depth[i] == VERIFY_UNREACHED) continue;
+
+        /* Other paths meet here so nothing is known about the names on the stack */
+        if (a->labels[i])
+        {
+            fprintf(a->out, "L%u:\n", i);
+
+            for (uint32_t slot = 0; slot < max_depth; slot++)
+                a->names[slot] = -1;
+        }
+
+        emit_insn(a, i);
+    }
+
+    if (a->labels[chunk->count]) fprintf(a->out, "L%u: ;\n", chunk->count);
+
+    free(a->labels);
+    free(a->consts);
+    free(a->names);
+    free(a->read);
+}
+
+static void emit_params(aot_t *a, function_t *fn)
+{
+    if (fn->arity == 0) fputs("void", a->out);
+
+    for (uint32_t arg = 0; arg < fn->arity; arg++)
+        fprintf(a->out, "%sobject_t l%u", arg ? ", " : "", arg);
+}
+
+/* Runs the function a tail call left for the caller */
+static void emit_bounce(aot_t *a)
+{
+    fprintf(a->out, "static object_t rt_bounce(void)\n{\n");
+    emit(a, "int fn = rt_tail;");
+    emit(a, "rt_tail = -1;");
+    emit(a, "");
+    emit(a, "switch (fn)");
+    emit(a, "{");
+
+    for (uint32_t f = 0; f < a->funcs->count; f++)
+    {
+        if (!a->called[f]) continue;
+
+        fprintf(a->out, "        case %u: return fn_%u(", f, f);
+
+        for (uint32_t arg = 0; arg < a->funcs->funcs[f].arity; arg++)
+            fprintf(a->out, "%srt_args[%u]", arg ? ", " : "", arg);
+
+        fputs(");\n", a->out);
+    }
+
+    emit(a, "}");
+    emit(a, "");
+    emit(a, "return RT_LONG(0);");
+    fprintf(a->out, "}\n\n");
+}
+
+static void add_strings(aot_t *a, chunk_t *chunk, uint32_t *depth)
+{
+    for (uint32_t i = 0; i < chunk->count; i += vm_op_length(chunk->code[i]))
+    {
+        if (depth[i] == VERIFY_UNREACHED || !vm_op_has_const(chunk->code[i])) continue;
+
+        object_t *obj = &chunk->constants[CHUNK_READ_U24(chunk->code + i + 1)];
+
+        if (obj->type == OBJ_VAL_STR) add_string(a, obj->as.str);
+    }
+}
+
+/* Marks the functions a chunk calls, and those they call in turn */
+static void find_called(aot_t *a, chunk_t *chunk, uint32_t *depth, uint32_t **depths)
+{
+    for (uint32_t i = 0; i < chunk->count; i += vm_op_length(chunk->code[i]))
+    {
+        if (depth[i] == VERIFY_UNREACHED || (chunk->code[i] != OP_CALL && chunk->code[i] != OP_TAIL_CALL))
+            continue;
+
+        uint32_t index = CHUNK_READ_U16(chunk->code + i + 1);
+
+        if (a->called[index]) continue;
+
+        a->called[index] = 1;
+        find_called(a, a->funcs->funcs[index].chunk, depths[index], depths);
+    }
+}
+
+/* Finds whether any function that is called tail calls another, and the most arguments one takes */
+static void scan_funcs(aot_t *a)
+{
+    for (uint32_t f = 0; f < a->funcs->count; f++)
+    {
+        chunk_t *chunk = a->funcs->funcs[f].chunk;
+
+        if (!a->called[f]) continue;
+
+        if (a->funcs->funcs[f].arity > a->max_arity)
+            a->max_arity = a->funcs->funcs[f].arity;
+
+        for (uint32_t i = 0; i < chunk->count; i += vm_op_length(chunk->code[i]))
+        {
+            if (chunk->code[i] == OP_TAIL_CALL && CHUNK_READ_U16(chunk->code + i + 1) != f)
+                a->bounces = 1;
+        }
+    }
+}
+
+/*
+ * Verifies a chunk, keeping the depth of the stack at each instruction. The
+ * errors are reported with the same messages the vm gives.
+ */
+static uint32_t *verify_for_aot(chunk_t *chunk, func_table_t *funcs, function_t *fn, uint32_t *max_depth)
+{
+    uint32_t *depth = malloc(sizeof(uint32_t) * (chunk->count + 1));
+    verify_result_t verified = verify_depths(chunk, funcs, fn != NULL, depth);
+
+    if (verified.code != VERIFY_OK)
+    {
+        if (fn)
+            printf("Error: bad bytecode in function '%s' at offset %u: %s\n",
+                fn->name, verified.offset, verify_message(verified.code));
+        else
+            printf("Error: bad bytecode at offset %u: %s\n", verified.offset, verify_message(verified.code));
+
+        free(depth);
+        return NULL;
+    }
+
+    *max_depth = verified.max_depth;
+
+    return depth;
+}
+
+/*
+ * Every chunk is lowered straight to C with the stack depth the verifier
+ * found at each instruction, so there is no stack pointer, only a variable
+ * for each slot, and a jump is a goto. A function takes its arguments by
+ * value and returns its result, and the calls running are counted against
+ * FRAMES_MAX as the vm does.
+ */
+int aot_compile(chunk_t *chunk, func_table_t *funcs, FILE *out)
+{
+    aot_t a = { 0 };
+    a.out = out;
+    a.funcs = funcs;
+
+    uint32_t top_depth;
+    uint32_t *top = verify_for_aot(chunk, funcs, NULL, &top_depth);
+
+    if (!top) return 0;
+
+    uint32_t **depths = malloc(sizeof(uint32_t *) * (funcs->count + 1));
+    uint32_t *max_depths = malloc(sizeof(uint32_t) * (funcs->count + 1));
+
+    for (uint32_t f = 0; f < funcs->count; f++)
+    {
+        depths[f] = verify_for_aot(funcs->funcs[f].chunk, funcs, &funcs->funcs[f], &max_depths[f]);
+
+        if (!depths[f])
+        {
+            while (f-- > 0)
+                free(depths[f]);
+
+            free(depths);
+            free(max_depths);
+            free(top);
+            return 0;
+        }
+    }
+
+    /* Functions that were inlined everywhere, or never called, aren't written out */
+    a.called = calloc(funcs->count + 1, 1);
+    find_called(&a, chunk, top, depths);
+    scan_funcs(&a);
+
+    for (const char **line = runtime; *line; line++)
+        fprintf(out, "%s\n", *line);
+
+    /* The string constants the code uses are written out first so every chunk can use them */
+    for (uint32_t f = 0; f < funcs->count; f++)
+        if (a.called[f]) add_strings(&a, funcs->funcs[f].chunk, depths[f]);
+
+    add_strings(&a, chunk, top);
+
+    for (uint32_t s = 0; s < a.string_count; s++)
+    {
+        fprintf(out, "static char k_%u[] = ", s);
+        emit_string(out, a.strings[s]);
+        fputs(";\n", out);
+    }
+
+    fputc('\n', out);
+
+    for (uint32_t f = 0; f < funcs->count; f++)
+    {
+        if (!a.called[f]) continue;
+
+        fprintf(out, "static object_t fn_%u(", f);
+        emit_params(&a, &funcs->funcs[f]);
+        fputs(");\n", out);
+    }
+
+    if (a.bounces)
+    {
+        fprintf(out, "\n/* Function a tail call left for its caller to run, and its arguments */\n");
+        fprintf(out, "static int rt_tail = -1;\n");
+        fprintf(out, "static object_t rt_args[%u];\n", a.max_arity ? a.max_arity : 1);
+        fprintf(out, "static object_t rt_bounce(void);\n");
+    }
+
+    fputc('\n', out);
+
+    for (uint32_t f = 0; f < funcs->count; f++)
+    {
+        function_t *fn = &funcs->funcs[f];
+
+        if (!a.called[f])
+        {
+            free(depths[f]);
+            continue;
+        }
+
+        fprintf(out, "/* %s */\nstatic object_t fn_%u(", fn->name, f);
+        emit_params(&a, fn);
+        fputs(")\n{\n", out);
+
+        emit_body(&a, fn->chunk, depths[f], max_depths[f], (int)f);
+
+        fputs("}\n\n", out);
+        free(depths[f]);
+    }
+
+    fputs("static void top_level(void)\n{\n", out);
+    emit_body(&a, chunk, top, top_depth, -1);
+    fputs("}\n\n", out);
+
+    if (a.bounces) emit_bounce(&a);
+
+    fputs("int main(void)\n{\n", out);
+    emit(&a, "srand((unsigned)time(NULL));");
+    emit(&a, "top_level();");
+    emit(&a, "");
+    emit(&a, "return 0;");
+    fputs("}\n", out);
+
+    free(a.strings);
+    free(a.called);
+    free(depths);
+    free(max_depths);
+    free(top);
+
+    return 1;
+}
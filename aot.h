@@ -0,0 +1,20 @@
+#ifndef __PHANTOM_AOT_H_
+#define __PHANTOM_AOT_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "chunk.h"
+#include "function.h"
+
+/*
+ * Writes a compiled program out as C that a C compiler builds into a
+ * standalone executable. Each chunk becomes a C function with its stack slots
+ * and locals as C variables, and the values are handled by a small runtime
+ * written at the top of the file. Returns 0 if the bytecode fails
+ * verification, which is reported as vm_run would.
+ */
+int aot_compile(chunk_t *chunk, func_table_t *funcs, FILE *out);
+
+#endif // __PHANTOM_AOT_H_
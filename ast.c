@@ -4,6 +4,7 @@ ast_node_t *init_ast_node(ast_type_t type)
 {
     ast_node_t *node = malloc(sizeof(ast_node_t));
     node->next = NULL;
+    node->expr = NULL;
     node->type = type;
 
     return node;
@@ -14,7 +15,9 @@ expr_t *init_expr(token_t tok)
     expr_t *expr = malloc(sizeof(expr_t));
     expr->left  = NULL;
     expr->right = NULL;
+    expr->next  = NULL;
     expr->tok   = tok;
+    expr->has_value = 0;
 
     return expr;
 }
@@ -23,9 +26,17 @@ void expr_free(expr_t *expr)
 {
     //printf("freeing %.*s\n", expr->tok.len, expr->tok.start);
 
-    if (expr->left) expr_free(expr->left);
-    if (expr->right) expr_free(expr->right);
-    if (expr) free(expr);
+    /* The rest of a block is freed with its first statement */
+    while (expr)
+    {
+        expr_t *next = expr->next;
+
+        if (expr->left) expr_free(expr->left);
+        if (expr->right) expr_free(expr->right);
+        free(expr);
+
+        expr = next;
+    }
 }
 
 void ast_node_free(ast_node_t *node)
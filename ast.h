@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include "lexer.h"
+#include "object.h"
 
 typedef enum {
     AST_EXPR,
@@ -20,7 +21,11 @@ typedef enum {
 typedef struct expr {
     struct expr *left;
     struct expr *right;
+    struct expr *next;  /* The statement after this one in a block */
     token_t tok;
+
+    object_t value;     /* Set for literals and subexpressions folded at compile time */
+    int has_value;
 } expr_t;
 
 typedef struct ast_node {
@@ -0,0 +1,477 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "bytecode.h"
+
+#define BYTECODE_MAGIC 0x434E5450  /* "PTNC" */
+
+/* Where the arrays of a chunk are in the file. Offsets are from the start of the file, and 0 is none */
+typedef struct {
+    uint64_t code;
+    uint64_t lines;
+    uint64_t constants;
+    uint64_t tables;
+    uint64_t name;          /* Name of the function, 0 for the top level */
+    uint32_t count;
+    uint32_t local_count;
+    uint32_t const_count;
+    uint32_t table_count;
+    uint32_t arity;
+    uint32_t pad;
+} bytecode_chunk_t;
+
+/*
+ * Constants and tables are kept as the structs themselves with offsets where
+ * the pointers go, so they are only usable by a build that lays them out the
+ * same, which the sizes are there to check.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t key;
+    uint64_t size;          /* Bytes in the whole file */
+    uint32_t chunk_count;   /* The top level, then the functions in order */
+    uint8_t object_size;
+    uint8_t table_size;
+    uint8_t pointer_size;
+    uint8_t pad;
+} bytecode_header_t;
+
+uint64_t bytecode_key(const char *source, size_t len, const int *options, uint32_t option_count)
+{
+    /* FNV-1a over the source and then the options */
+    uint64_t hash = 14695981039346656037ull;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= (uint8_t)source[i];
+        hash *= 1099511628211ull;
+    }
+
+    for (uint32_t i = 0; i < option_count; i++)
+    {
+        hash ^= (uint32_t)options[i];
+        hash *= 1099511628211ull;
+    }
+
+    return hash;
+}
+
+#if !defined(_WIN32)
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Whether fd is a directory or file this user owns and no one else can write to */
+static int is_private(int fd, int want_dir)
+{
+    struct stat st;
+
+    return fstat(fd, &st) == 0 && (want_dir ? S_ISDIR(st.st_mode) : S_ISREG(st.st_mode)) &&
+           st.st_uid == geteuid() && !(st.st_mode & (S_IWGRP | S_IWOTH));
+}
+
+char *bytecode_path(const char *script, const char *dir, uint64_t key)
+{
+    size_t len = strlen(dir ? dir : script) + 32;
+    char *path = malloc(len);
+
+    if (dir)
+    {
+        /* Made on first use. If it is already there it has to be private all the same, and not a link */
+        mkdir(dir, 0700);
+
+        int fd = open(dir, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        int ok = fd >= 0 && is_private(fd, 1);
+
+        if (fd >= 0) close(fd);
+
+        if (!ok)
+        {
+            free(path);
+            return NULL;
+        }
+
+        snprintf(path, len, "%s/%016llx.ptnc", dir, (unsigned long long)key);
+        return path;
+    }
+
+    /* script.ptn is kept in script.ptnc */
+    size_t n = strlen(script);
+
+    if (n > 4 && strcmp(script + n - 4, ".ptn") == 0) snprintf(path, len, "%sc", script);
+    else snprintf(path, len, "%s.ptnc", script);
+
+    return path;
+}
+
+/* The file being built up in memory */
+typedef struct {
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+
+    /* Offsets of the strings in the pool by their hash, so each is only written once */
+    uint64_t *pool;
+    uint32_t pool_count;
+    uint32_t pool_capacity;
+} writer_t;
+
+/* Adds size bytes at a multiple of align. Returns their offset */
+static uint64_t put(writer_t *w, const void *data, size_t size, size_t align)
+{
+    size_t start = (w->size + align - 1) / align * align;
+
+    if (start + size > w->capacity)
+    {
+        while (start + size > w->capacity) w->capacity = w->capacity ? w->capacity * 2 : 4096;
+        w->data = realloc(w->data, w->capacity);
+    }
+
+    /* Without data the room is zeroed, to be filled in later */
+    memset(w->data + w->size, 0, start - w->size);
+    if (data) memcpy(w->data + start, data, size);
+    else memset(w->data + start, 0, size);
+    w->size = start + size;
+
+    return start;
+}
+
+static uint64_t *pool_slot(writer_t *w, const char *str)
+{
+    uint32_t mask = w->pool_capacity - 1;
+
+    for (uint32_t i = chunk_hash_str(str) & mask; ; i = (i + 1) & mask)
+    {
+        if (!w->pool[i] || strcmp((char *)w->data + w->pool[i], str) == 0) return &w->pool[i];
+    }
+}
+
+/* The offset of the string in the pool, which it is added to the first time */
+static uint64_t put_str(writer_t *w, const char *str)
+{
+    if (w->pool_count * 2 >= w->pool_capacity)
+    {
+        uint64_t *old = w->pool;
+        uint32_t old_capacity = w->pool_capacity;
+
+        w->pool_capacity = old_capacity ? old_capacity * 2 : 64;
+        w->pool = calloc(w->pool_capacity, sizeof(uint64_t));
+
+        for (uint32_t i = 0; i < old_capacity; i++)
+        {
+            if (old[i]) *pool_slot(w, (char *)w->data + old[i]) = old[i];
+        }
+
+        free(old);
+    }
+
+    uint64_t *slot = pool_slot(w, str);
+
+    if (!*slot)
+    {
+        *slot = put(w, str, strlen(str) + 1, 1);
+        w->pool_count++;
+    }
+
+    return *slot;
+}
+
+/* Writes the arrays of a chunk, with the offsets of its strings and arrays in place of pointers */
+static void put_chunk(writer_t *w, bytecode_chunk_t *rec, chunk_t *chunk)
+{
+    rec->count = chunk->count;
+    rec->local_count = chunk->local_count;
+    rec->const_count = chunk->const_count;
+    rec->table_count = chunk->table_count;
+
+    rec->code = put(w, chunk->code, chunk->count, 1);
+    rec->lines = chunk->lines ? put(w, chunk->lines, sizeof(uint32_t) * chunk->count, sizeof(uint32_t)) : 0;
+
+    object_t *constants = malloc(sizeof(object_t) * (chunk->const_count + 1));
+
+    for (uint32_t i = 0; i < chunk->const_count; i++)
+    {
+        constants[i] = chunk->constants[i];
+
+        if (constants[i].type == OBJ_VAL_STR || constants[i].type == OBJ_VAL_BOOL)
+            constants[i].as.str = (char *)(uintptr_t)put_str(w, chunk->constants[i].as.str);
+    }
+
+    rec->constants = put(w, constants, sizeof(object_t) * chunk->const_count, sizeof(uint64_t));
+    free(constants);
+
+    chunk_table_t *tables = malloc(sizeof(chunk_table_t) * (chunk->table_count + 1));
+
+    for (uint32_t i = 0; i < chunk->table_count; i++)
+    {
+        chunk_table_t *table = &chunk->tables[i];
+        uint32_t count = table->count;
+
+        tables[i] = *table;
+        tables[i].keys = table->keys ? (long *)(uintptr_t)put(w, table->keys, sizeof(long) * count, sizeof(uint64_t)) : NULL;
+        tables[i].hashes = table->hashes ? (uint32_t *)(uintptr_t)put(w, table->hashes, sizeof(uint32_t) * count, sizeof(uint32_t)) : NULL;
+        tables[i].offsets = table->offsets ? (uint32_t *)(uintptr_t)put(w, table->offsets, sizeof(uint32_t) * count, sizeof(uint32_t)) : NULL;
+
+        if (table->strings)
+        {
+            uint64_t *strings = malloc(sizeof(uint64_t) * (count + 1));
+
+            for (uint32_t j = 0; j < count; j++)
+                strings[j] = table->strings[j] ? put_str(w, table->strings[j]) : 0;
+
+            tables[i].strings = (char **)(uintptr_t)put(w, strings, sizeof(uint64_t) * count, sizeof(uint64_t));
+            free(strings);
+        }
+    }
+
+    rec->tables = put(w, tables, sizeof(chunk_table_t) * chunk->table_count, sizeof(uint64_t));
+    free(tables);
+}
+
+int bytecode_save(const char *path, uint64_t key, chunk_t *chunk, func_table_t *funcs)
+{
+    writer_t w = { 0 };
+    uint32_t chunk_count = funcs->count + 1;
+    bytecode_chunk_t *recs = calloc(chunk_count, sizeof(bytecode_chunk_t));
+
+    /* Room for the header and the chunk records, which are filled in last as the data moves while it grows */
+    put(&w, NULL, sizeof(bytecode_header_t), sizeof(uint64_t));
+    uint64_t recs_at = put(&w, NULL, sizeof(bytecode_chunk_t) * chunk_count, sizeof(uint64_t));
+
+    put_chunk(&w, &recs[0], chunk);
+
+    for (uint32_t i = 0; i < funcs->count; i++)
+    {
+        function_t *fn = &funcs->funcs[i];
+
+        put_chunk(&w, &recs[i + 1], fn->chunk);
+        recs[i + 1].name = put_str(&w, fn->name);
+        recs[i + 1].arity = fn->arity;
+    }
+
+    bytecode_header_t header = {
+        .magic = BYTECODE_MAGIC,
+        .version = BYTECODE_VERSION,
+        .key = key,
+        .size = w.size,
+        .chunk_count = chunk_count,
+        .object_size = sizeof(object_t),
+        .table_size = sizeof(chunk_table_t),
+        .pointer_size = sizeof(void *),
+    };
+
+    memcpy(w.data, &header, sizeof(header));
+    memcpy(w.data + recs_at, recs, sizeof(bytecode_chunk_t) * chunk_count);
+
+    /* Written under another name and moved into place whole, so a run never maps half a file */
+    size_t len = strlen(path) + 32;
+    char *temp = malloc(len);
+    snprintf(temp, len, "%s.%d.tmp", path, (int)getpid());
+
+    int fd = open(temp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0644);
+    FILE *out = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    int ok = out && fwrite(w.data, 1, w.size, out) == w.size;
+
+    if (fd >= 0 && !out) close(fd), remove(temp);
+    if (out) ok = fclose(out) == 0 && ok;
+    if (out && (!ok || rename(temp, path) != 0)) ok = 0, remove(temp);
+
+    free(temp);
+    free(recs);
+    free(w.pool);
+    free(w.data);
+
+    return ok;
+}
+
+/* The count items of size at offset, or NULL if there are none or they don't all lie inside the file */
+static void *array_at(bytecode_t *b, uint64_t offset, uint64_t count, size_t size, size_t align)
+{
+    if (offset == 0 || offset % align || offset > b->size || count > (b->size - offset) / size) return NULL;
+
+    return (uint8_t *)b->base + offset;
+}
+
+/* The string at offset, or NULL if it runs off the end of the file */
+static char *string_at(bytecode_t *b, uint64_t offset)
+{
+    if (offset == 0 || offset >= b->size) return NULL;
+
+    char *str = (char *)b->base + offset;
+
+    return memchr(str, '\0', b->size - offset) ? str : NULL;
+}
+
+/* Points the pointer that holds an offset at what it is the offset of. Returns 0 if that is outside the file */
+static int relocate_array(bytecode_t *b, void **ptr, uint64_t count, size_t size, size_t align)
+{
+    if (!*ptr) return 1;
+
+    *ptr = array_at(b, (uint64_t)(uintptr_t)*ptr, count, size, align);
+
+    return *ptr != NULL;
+}
+
+/* Fills in a chunk from its record, pointing it into the file. Returns 0 if any of it is outside the file */
+static int map_chunk(bytecode_t *b, bytecode_chunk_t *rec, chunk_t *chunk)
+{
+    chunk->code = array_at(b, rec->code, rec->count, 1, 1);
+    chunk->lines = rec->lines ? array_at(b, rec->lines, rec->count, sizeof(uint32_t), sizeof(uint32_t)) : NULL;
+    chunk->constants = array_at(b, rec->constants, rec->const_count, sizeof(object_t), sizeof(uint64_t));
+    chunk->tables = array_at(b, rec->tables, rec->table_count, sizeof(chunk_table_t), sizeof(uint64_t));
+
+    if (!chunk->code || (rec->lines && !chunk->lines) || !chunk->constants || !chunk->tables) return 0;
+
+    chunk->count = chunk->capacity = rec->count;
+    chunk->const_count = chunk->const_capacity = rec->const_count;
+    chunk->table_count = chunk->table_capacity = rec->table_count;
+    chunk->local_count = rec->local_count;
+    chunk->line = 0;
+    chunk->borrowed = 1;
+
+    for (uint32_t i = 0; i < chunk->const_count; i++)
+    {
+        object_t *obj = &chunk->constants[i];
+
+        switch (obj->type)
+        {
+            case OBJ_VAL_LONG:
+            case OBJ_VAL_DOUBLE:
+                break;
+
+            case OBJ_VAL_STR:
+            case OBJ_VAL_BOOL:
+                obj->as.str = string_at(b, (uint64_t)(uintptr_t)obj->as.str);
+                if (!obj->as.str) return 0;
+                break;
+
+            default:
+                return 0;
+        }
+    }
+
+    for (uint32_t i = 0; i < chunk->table_count; i++)
+    {
+        chunk_table_t *table = &chunk->tables[i];
+
+        if (!relocate_array(b, (void **)&table->keys, table->count, sizeof(long), sizeof(uint64_t)) ||
+            !relocate_array(b, (void **)&table->hashes, table->count, sizeof(uint32_t), sizeof(uint32_t)) ||
+            !relocate_array(b, (void **)&table->offsets, table->count, sizeof(uint32_t), sizeof(uint32_t)) ||
+            !relocate_array(b, (void **)&table->strings, table->count, sizeof(uint64_t), sizeof(uint64_t)))
+            return 0;
+
+        for (uint32_t j = 0; table->strings && j < table->count; j++)
+        {
+            uint64_t offset = (uint64_t)(uintptr_t)table->strings[j];
+
+            if (offset && !(table->strings[j] = string_at(b, offset))) return 0;
+        }
+    }
+
+    return 1;
+}
+
+bytecode_t *bytecode_load(const char *path, uint64_t key, chunk_t *chunk, func_table_t *funcs)
+{
+    int fd = open(path, O_RDONLY | O_NOFOLLOW);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+
+    /* The file is run as the script, so one someone else could have written is ignored */
+    if (!is_private(fd, 0) || fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(bytecode_header_t))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    /* Private, so filling in the pointers copies only the pages they are on and never touches the file */
+    bytecode_t b = { .size = (size_t)st.st_size };
+    b.base = mmap(NULL, b.size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (b.base == MAP_FAILED) return NULL;
+
+    bytecode_header_t *header = b.base;
+    bytecode_chunk_t *recs = NULL;
+
+    if (header->magic == BYTECODE_MAGIC && header->version == BYTECODE_VERSION && header->key == key &&
+        header->size == b.size && header->object_size == sizeof(object_t) &&
+        header->table_size == sizeof(chunk_table_t) && header->pointer_size == sizeof(void *) &&
+        header->chunk_count > 0 && header->chunk_count - 1 <= CHUNK_FUNC_MAX)
+    {
+        recs = array_at(&b, sizeof(bytecode_header_t), header->chunk_count, sizeof(bytecode_chunk_t), sizeof(uint64_t));
+    }
+
+    /* Every chunk is checked before any of them is handed over */
+    uint32_t chunk_count = recs ? header->chunk_count : 0;
+    chunk_t *chunks = calloc(chunk_count + 1, sizeof(chunk_t));
+    int ok = recs != NULL;
+
+    for (uint32_t i = 0; ok && i < chunk_count; i++)
+    {
+        ok = map_chunk(&b, &recs[i], &chunks[i]);
+        if (ok && i > 0) ok = string_at(&b, recs[i].name) != NULL;
+    }
+
+    if (!ok)
+    {
+        free(chunks);
+        munmap(b.base, b.size);
+        return NULL;
+    }
+
+    *chunk = chunks[0];
+
+    for (uint32_t i = 1; i < chunk_count; i++)
+    {
+        char *name = string_at(&b, recs[i].name);
+        uint32_t index = func_table_add(funcs, name, (uint32_t)strlen(name));
+        function_t *fn = &funcs->funcs[index];
+
+        fn->arity = recs[i].arity;
+        *fn->chunk = chunks[i];
+    }
+
+    free(chunks);
+
+    bytecode_t *bytecode = malloc(sizeof(bytecode_t));
+    *bytecode = b;
+
+    return bytecode;
+}
+
+void bytecode_close(bytecode_t *bytecode)
+{
+    if (!bytecode) return;
+
+    munmap(bytecode->base, bytecode->size);
+    free(bytecode);
+}
+
+#else
+
+/* Nothing is kept without mmap */
+char *bytecode_path(const char *script, const char *dir, uint64_t key)
+{
+    return NULL;
+}
+
+bytecode_t *bytecode_load(const char *path, uint64_t key, chunk_t *chunk, func_table_t *funcs)
+{
+    return NULL;
+}
+
+void bytecode_close(bytecode_t *bytecode)
+{
+}
+
+int bytecode_save(const char *path, uint64_t key, chunk_t *chunk, func_table_t *funcs)
+{
+    return 0;
+}
+
+#endif
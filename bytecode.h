@@ -0,0 +1,48 @@
+#ifndef __PHANTOM_BYTECODE_H_
+#define __PHANTOM_BYTECODE_H_
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "chunk.h"
+#include "function.h"
+
+#define BYTECODE_VERSION 1  /* Bumped whenever the format or the meaning of the op codes changes */
+
+/*
+ * A compiled script kept in a .ptnc file, so a script that hasn't changed
+ * since it was last run doesn't have to be compiled again. The file holds
+ * the code, line table, constants and match tables of the top level and of
+ * each function, with every string once in a pool. It is mapped rather than
+ * read, and the chunks point straight into it, so only the pages with
+ * pointers to fill in are ever copied. The file is tied to a key, a hash of
+ * the source and the options it was compiled with, and one with another key
+ * is ignored. So is a file, or a directory of them, that isn't this user's,
+ * that others can write to or that is a link.
+ */
+typedef struct {
+    void *base;
+    size_t size;
+} bytecode_t;
+
+uint64_t bytecode_key(const char *source, size_t len, const int *options, uint32_t option_count);
+
+/*
+ * Where the file for script goes: next to it with the extension .ptnc, or in
+ * dir named after its key if dir is set. NULL if dir isn't private to this user
+ */
+char *bytecode_path(const char *script, const char *dir, uint64_t key);
+
+/*
+ * Maps the file at path into chunk, which is empty, and funcs, which has no
+ * functions yet. Returns NULL, leaving both as they were, if there is no file
+ * or it isn't for key. The chunks borrow from what is returned, so it is
+ * closed only after they are freed.
+ */
+bytecode_t *bytecode_load(const char *path, uint64_t key, chunk_t *chunk, func_table_t *funcs);
+void bytecode_close(bytecode_t *bytecode);
+
+/* Writes the compiled script out to path. Returns 0 if it couldn't be */
+int bytecode_save(const char *path, uint64_t key, chunk_t *chunk, func_table_t *funcs);
+
+#endif // __PHANTOM_BYTECODE_H_
@@ -0,0 +1,270 @@
+#include <string.h>
+
+#include "chunk.h"
+#include "vm.h"
+
+#define CHUNK_MIN_CAPACITY 64
+
+chunk_t *chunk_init()
+{
+    chunk_t *chunk = malloc(sizeof(chunk_t));
+    chunk->code = NULL;
+    chunk->count = 0;
+    chunk->capacity = 0;
+
+    chunk->lines = NULL;
+    chunk->line = 0;
+
+    chunk->constants = NULL;
+    chunk->const_count = 0;
+    chunk->const_capacity = 0;
+
+    chunk->tables = NULL;
+    chunk->table_count = 0;
+    chunk->table_capacity = 0;
+
+    chunk->local_count = 0;
+    chunk->borrowed = 0;
+
+    return chunk;
+}
+
+void chunk_free(chunk_t *chunk)
+{
+    chunk_clear(chunk);
+
+    free(chunk->code);
+    free(chunk->lines);
+    free(chunk->constants);
+    free(chunk->tables);
+    free(chunk);
+}
+
+/* Empties the chunk but keeps its memory around to be reused */
+void chunk_clear(chunk_t *chunk)
+{
+    /* Borrowed arrays are left to the file, and the chunk starts again with its own */
+    if (chunk->borrowed)
+    {
+        chunk->code = NULL;
+        chunk->capacity = 0;
+        chunk->lines = NULL;
+        chunk->constants = NULL;
+        chunk->const_capacity = 0;
+        chunk->tables = NULL;
+        chunk->table_capacity = 0;
+        chunk->table_count = 0;
+        chunk->const_count = 0;
+        chunk->borrowed = 0;
+    }
+
+    /* The chunk owns the strings in its constants. The vm copies any it keeps */
+    for (uint32_t i = 0; i < chunk->const_count; i++)
+    {
+        if (chunk->constants[i].type == OBJ_VAL_STR)
+            free(chunk->constants[i].as.str);
+    }
+
+    for (uint32_t i = 0; i < chunk->table_count; i++)
+    {
+        chunk_table_t *table = &chunk->tables[i];
+
+        if (table->strings)
+        {
+            for (uint32_t j = 0; j < table->count; j++)
+                free(table->strings[j]);
+        }
+
+        free(table->keys);
+        free(table->strings);
+        free(table->hashes);
+        free(table->offsets);
+    }
+
+    chunk->count = 0;
+    chunk->const_count = 0;
+    chunk->table_count = 0;
+    chunk->local_count = 0;
+}
+
+static uint32_t grow_capacity(uint32_t capacity, uint32_t needed)
+{
+    if (capacity < CHUNK_MIN_CAPACITY) capacity = CHUNK_MIN_CAPACITY;
+
+    while (capacity < needed) capacity *= 2;
+
+    return capacity;
+}
+
+void chunk_write(chunk_t *chunk, uint8_t byte)
+{
+    if (chunk->count + 1 > chunk->capacity)
+    {
+        chunk->capacity = grow_capacity(chunk->capacity, chunk->count + 1);
+        chunk->code = realloc(chunk->code, chunk->capacity);
+        chunk->lines = realloc(chunk->lines, sizeof(uint32_t) * chunk->capacity);
+    }
+
+    chunk->lines[chunk->count] = chunk->line;
+    chunk->code[chunk->count++] = byte;
+}
+
+void chunk_write_operand(chunk_t *chunk, uint32_t val, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+        chunk_write(chunk, (val >> (8 * i)) & 0xff);
+}
+
+/* Overwrites an operand that was written before its value was known, such as a jump */
+void chunk_patch_operand(chunk_t *chunk, uint32_t at, uint32_t val, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+        chunk->code[at + i] = (val >> (8 * i)) & 0xff;
+}
+
+uint32_t chunk_add_const(chunk_t *chunk, object_t obj)
+{
+    if (chunk->const_count + 1 > chunk->const_capacity)
+    {
+        chunk->const_capacity = grow_capacity(chunk->const_capacity, chunk->const_count + 1);
+        chunk->constants = realloc(chunk->constants, sizeof(object_t) * chunk->const_capacity);
+    }
+
+    chunk->constants[chunk->const_count] = obj;
+
+    return chunk->const_count++;
+}
+
+/* The chunk takes the arrays of the table, which can be indexed by a match instruction */
+uint32_t chunk_add_table(chunk_t *chunk, chunk_table_t table)
+{
+    if (chunk->table_count + 1 > chunk->table_capacity)
+    {
+        chunk->table_capacity = chunk->table_capacity ? chunk->table_capacity * 2 : 8;
+        chunk->tables = realloc(chunk->tables, sizeof(chunk_table_t) * chunk->table_capacity);
+    }
+
+    chunk->tables[chunk->table_count] = table;
+
+    return chunk->table_count++;
+}
+
+static void *copy_array(const void *src, size_t size)
+{
+    if (!src) return NULL;
+
+    void *copy = malloc(size);
+    memcpy(copy, src, size);
+
+    return copy;
+}
+
+/*
+ * Adds a copy of a table for a copy of the instruction that uses it. Each
+ * table belongs to one instruction so its offsets can be moved with it.
+ */
+uint32_t chunk_copy_table(chunk_t *chunk, uint32_t index)
+{
+    chunk_table_t table = chunk->tables[index];
+    uint32_t count = table.count;
+
+    table.keys = copy_array(table.keys, sizeof(long) * count);
+    table.hashes = copy_array(table.hashes, sizeof(uint32_t) * count);
+    table.offsets = copy_array(table.offsets, sizeof(uint32_t) * count);
+
+    if (table.strings)
+    {
+        char **strings = calloc(count, sizeof(char *));
+
+        for (uint32_t i = 0; i < count; i++)
+        {
+            if (table.strings[i]) strings[i] = copy_array(table.strings[i], strlen(table.strings[i]) + 1);
+        }
+
+        table.strings = strings;
+    }
+
+    return chunk_add_table(chunk, table);
+}
+
+/* FNV-1a, the same as the globals but over the whole 32 bits */
+uint32_t chunk_hash_str(const char *str)
+{
+    uint32_t hash = 2166136261u;
+
+    for (; *str; str++)
+    {
+        hash ^= (uint8_t)*str;
+        hash *= 16777619;
+    }
+
+    return hash;
+}
+
+/*
+ * Moves the first count bytes of code and all of the constants and tables from
+ * src to the end of dst. The constants and tables go after the ones already in
+ * dst so the indices in the moved code are shifted along to match. Jumps are relative so
+ * they stay as they are. The code in each chunk is done with its local slots
+ * by the time the code after it runs, so the slots are shared. src is left empty.
+ * Returns CHUNK_APPEND_OK, or which limit the indices would go past, in which
+ * case neither chunk is changed.
+ */
+chunk_append_t chunk_append(chunk_t *dst, chunk_t *src, uint32_t count)
+{
+    /* Each chunk can be under the limits and still go over them together */
+    if ((uint64_t)dst->const_count + src->const_count > CHUNK_CONST_MAX) return CHUNK_APPEND_CONSTS;
+    if ((uint64_t)dst->table_count + src->table_count > (uint64_t)CHUNK_TABLE_MAX + 1) return CHUNK_APPEND_TABLES;
+
+    if (dst->count + count > dst->capacity)
+    {
+        dst->capacity = grow_capacity(dst->capacity, dst->count + count);
+        dst->code = realloc(dst->code, dst->capacity);
+        dst->lines = realloc(dst->lines, sizeof(uint32_t) * dst->capacity);
+    }
+
+    if (dst->const_count + src->const_count > dst->const_capacity)
+    {
+        dst->const_capacity = grow_capacity(dst->const_capacity, dst->const_count + src->const_count);
+        dst->constants = realloc(dst->constants, sizeof(object_t) * dst->const_capacity);
+    }
+
+    uint8_t *code = dst->code + dst->count;
+    memcpy(code, src->code, count);
+    memcpy(dst->lines + dst->count, src->lines, sizeof(uint32_t) * count);
+
+    if (dst->const_count > 0 || dst->table_count > 0)
+    {
+        for (uint32_t i = 0; i < count; i += vm_op_length(code[i]))
+        {
+            if (vm_op_has_const(code[i]))
+            {
+                uint32_t index = CHUNK_READ_U24(code + i + 1) + dst->const_count;
+                chunk_patch_operand(dst, dst->count + i + 1, index, CHUNK_CONST_BYTES);
+            }
+            else if (vm_op_has_table(code[i]))
+            {
+                uint32_t index = CHUNK_READ_U16(code + i + 1) + dst->table_count;
+                chunk_patch_operand(dst, dst->count + i + 1, index, CHUNK_TABLE_BYTES);
+            }
+        }
+    }
+
+    dst->count += count;
+
+    memcpy(dst->constants + dst->const_count, src->constants, sizeof(object_t) * src->const_count);
+    dst->const_count += src->const_count;
+
+    for (uint32_t i = 0; i < src->table_count; i++)
+        chunk_add_table(dst, src->tables[i]);
+
+    if (src->local_count > dst->local_count) dst->local_count = src->local_count;
+
+    /* The strings and tables now belong to dst */
+    src->count = 0;
+    src->const_count = 0;
+    src->table_count = 0;
+    src->local_count = 0;
+
+    return CHUNK_APPEND_OK;
+}
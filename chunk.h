@@ -0,0 +1,86 @@
+#ifndef __PHANTOM_CHUNK_H_
+#define __PHANTOM_CHUNK_H_
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "object.h"
+
+/* Operands follow their op code and are stored little endian */
+#define CHUNK_CONST_BYTES 3
+#define CHUNK_JUMP_BYTES  2
+#define CHUNK_LOCAL_BYTES 2
+#define CHUNK_TABLE_BYTES 2
+#define CHUNK_FUNC_BYTES  2
+
+#define CHUNK_CONST_MAX   (1u << 24)    /* Constants a chunk can index */
+#define CHUNK_JUMP_MAX    UINT16_MAX    /* Furthest a jump can go in bytes */
+#define CHUNK_TABLE_MAX   UINT16_MAX    /* Match tables a chunk can index */
+#define CHUNK_FUNC_MAX    UINT16_MAX    /* Functions a call can index */
+#define CHUNK_LOCAL_MAX   UINT16_MAX    /* Local slots an instruction can index */
+
+#define CHUNK_READ_U16(code) ((uint32_t)(code)[0] | (uint32_t)(code)[1] << 8)
+#define CHUNK_READ_U24(code) (CHUNK_READ_U16(code) | (uint32_t)(code)[2] << 16)
+
+/*
+ * The cases of one match instruction. Each slot has a forward offset from the
+ * end of the instruction, the same as its default jump. How a value finds its
+ * slot depends on the op code:
+ *  - OP_MATCH_TABLE indexes the slots by the value less min. Gaps in the
+ *    cases have the default offset
+ *  - OP_MATCH_SEARCH binary searches keys, which are sorted
+ *  - OP_MATCH_HASH probes from the hash of the string. count is a power of
+ *    two and empty slots have no string
+ */
+typedef struct {
+    uint32_t count;
+    long min;
+    long *keys;
+    char **strings;
+    uint32_t *hashes;
+    uint32_t *offsets;
+} chunk_table_t;
+
+/* Bytecode and the constants and tables it uses. The arrays grow as code is emitted */
+typedef struct {
+    uint8_t *code;
+    uint32_t count;
+    uint32_t capacity;
+
+    uint32_t *lines;    /* Source line each byte of code was compiled from, 0 where it isn't known */
+    uint32_t line;      /* Line the code being written comes from */
+
+    object_t *constants;
+    uint32_t const_count;
+    uint32_t const_capacity;
+
+    chunk_table_t *tables;
+    uint32_t table_count;
+    uint32_t table_capacity;
+
+    uint32_t local_count;   /* Slots the vm keeps at the bottom of the stack while it runs */
+
+    int borrowed;       /* Set while the arrays point into a mapped bytecode file, which owns them. Nothing is written then */
+} chunk_t;
+
+/* Whether chunk_append could move the code, or the limit its indices would have gone past */
+typedef enum {
+    CHUNK_APPEND_OK,
+    CHUNK_APPEND_CONSTS,
+    CHUNK_APPEND_TABLES,
+} chunk_append_t;
+
+chunk_t *chunk_init();
+void chunk_free(chunk_t *chunk);
+void chunk_clear(chunk_t *chunk);
+
+void chunk_write(chunk_t *chunk, uint8_t byte);
+void chunk_write_operand(chunk_t *chunk, uint32_t val, int bytes);
+void chunk_patch_operand(chunk_t *chunk, uint32_t at, uint32_t val, int bytes);
+uint32_t chunk_add_const(chunk_t *chunk, object_t obj);
+uint32_t chunk_add_table(chunk_t *chunk, chunk_table_t table);
+uint32_t chunk_copy_table(chunk_t *chunk, uint32_t index);
+uint32_t chunk_hash_str(const char *str);
+chunk_append_t chunk_append(chunk_t *dst, chunk_t *src, uint32_t count);
+
+#endif // __PHANTOM_CHUNK_H_
@@ -1,42 +1,124 @@
 #include "compiler.h"
+#include "fold.h"
 
-static void emit_byte(vm_t *vm, op_code code)
+static void compiler_err(compiler_t *c, char *err_msg)
 {
-    vm->instructions[vm->ip] = code;
-    vm->ip++;
+    c->had_error = 1;
+    fprintf(stderr, "Error: %s\n", err_msg);
+}
+
+static void emit_byte(compiler_t *c, op_code code)
+{
+    /* Remember where the recent instructions start for compiler_emit_binary */
+    if (c->recent_count == COMPILER_RECENT_OPS)
+    {
+        memmove(c->recent_ops, c->recent_ops + 1, sizeof(uint32_t) * (COMPILER_RECENT_OPS - 1));
+        c->recent_count--;
+    }
+
+    c->recent_ops[c->recent_count++] = c->chunk->count;
+
+    chunk_write(c->chunk, code);
 }
 
 /* TODO: Fix this */
-static void emit_bytes(vm_t *vm, int num_codes, op_code code, ...)
+static void emit_bytes(compiler_t *c, int num_codes, op_code code, ...)
 {
     va_list list;
 
     va_start(list, code);
 
     for (int i = 0; i < num_codes; i++)
-        emit_byte(vm, va_arg(list, op_code));
+        emit_byte(c, va_arg(list, op_code));
 
     va_end(list);
 }
 
-static void add_obj(vm_t *vm, object_t obj)
+static uint32_t add_const(compiler_t *c, object_t obj)
+{
+    uint32_t index = chunk_add_const(c->chunk, obj);
+
+    if (index >= CHUNK_CONST_MAX)
+    {
+        compiler_err(c, "Too many constants in one chunk");
+        index = 0;
+    }
+
+    return index;
+}
+
+/* Emits an instruction followed by however many operand bytes its op code takes */
+static void emit_op(compiler_t *c, op_code code, uint32_t operand)
+{
+    emit_byte(c, code);
+    chunk_write_operand(c->chunk, operand, vm_op_length(code) - 1);
+}
+
+static void emit_const(compiler_t *c, object_t obj)
+{
+    emit_op(c, OP_CONST, add_const(c, obj));
+}
+
+/* Emits a forward jump and returns where its offset goes so it can be patched later */
+static uint32_t emit_jump(compiler_t *c, op_code code)
+{
+    emit_byte(c, code);
+    chunk_write_operand(c->chunk, 0, CHUNK_JUMP_BYTES);
+
+    return c->chunk->count - CHUNK_JUMP_BYTES;
+}
+
+/* Points a forward jump at the next instruction to be emitted */
+static void patch_jump(compiler_t *c, uint32_t at)
 {
-    vm->constants[vm->cp] = obj;
-    vm->cp++;
+    uint32_t offset = c->chunk->count - (at + CHUNK_JUMP_BYTES);
+
+    if (offset > CHUNK_JUMP_MAX)
+    {
+        compiler_err(c, "Too much code to jump over");
+        offset = 0;
+    }
+
+    chunk_patch_operand(c->chunk, at, offset, CHUNK_JUMP_BYTES);
+}
+
+/* Jumps back to the OP_LOOP at loop_start */
+static void emit_loop_end(compiler_t *c, uint32_t loop_start)
+{
+    emit_byte(c, OP_LOOP_END);
+
+    uint32_t offset = c->chunk->count + CHUNK_JUMP_BYTES - loop_start;
+
+    if (offset > CHUNK_JUMP_MAX)
+    {
+        compiler_err(c, "Loop body is too large");
+        offset = 0;
+    }
+
+    chunk_write_operand(c->chunk, offset, CHUNK_JUMP_BYTES);
 }
 
 static void compile_num(compiler_t *c, expr_t *expr)
 {
     object_t num = { .type = OBJ_VAL_LONG, .as.long_num = strtol(expr->tok.start, NULL, 10) };
-    add_obj(c->vm, num);
-    emit_byte(c->vm, OP_CONST);
+    if (expr->has_value) num = expr->value;
+
+    emit_const(c, num);
 }
 
 static void compile_double(compiler_t *c, expr_t *expr)
 {
     object_t num = { .type = OBJ_VAL_DOUBLE, .as.double_num = strtod(expr->tok.start, NULL)};
-    add_obj(c->vm, num);
-    emit_byte(c->vm, OP_CONST);
+    if (expr->has_value) num = expr->value;
+
+    emit_const(c, num);
+}
+
+/* Bools only come from comparisons that were folded at compile time */
+static void compile_bool(compiler_t *c, expr_t *expr)
+{
+    object_t val = { .type = OBJ_VAL_BOOL, .as.str = expr->tok.type == TOK_TRUE ? "true" : "false" };
+    emit_const(c, val);
 }
 
 static void compile_string(compiler_t *c, expr_t *expr)
@@ -47,25 +129,127 @@ static void compile_string(compiler_t *c, expr_t *expr)
 
     object_t str = { .type = OBJ_VAL_STR, .as.str = str_val };
 
-    add_obj(c->vm, str);
-    emit_byte(c->vm, OP_CONST);
+    emit_const(c, str);
 }
 
-static void compile_ident(compiler_t *c, expr_t *expr)
+/* Reports an error about a name, which isn't terminated in the source */
+static void name_err(compiler_t *c, const char *fmt, token_t name)
 {
-    char *str_val = malloc(sizeof(char) * expr->tok.len + 1);
-    memcpy(str_val, expr->tok.start, expr->tok.len);
-    str_val[expr->tok.len] = '\0';
+    char msg[256];
+    snprintf(msg, sizeof(msg), fmt, (int)name.len, name.start);
 
-    object_t str = { .type = OBJ_VAL_STR, .as.str = str_val };
-    add_obj(c->vm, str);
-    emit_byte(c->vm, OP_CONST);
-    emit_byte(c->vm, OP_VAR_GET);
+    compiler_err(c, msg);
+}
+
+static int same_name(token_t a, token_t b)
+{
+    return a.len == b.len && memcmp(a.start, b.start, a.len) == 0;
+}
+
+/* Slot of a variable of the function being compiled, or -1 if it is a global */
+static int find_local(compiler_t *c, token_t name)
+{
+    if (!c->func) return -1;
+
+    for (uint32_t i = 0; i < c->func->local_count; i++)
+    {
+        if (same_name(c->func->locals[i], name)) return (int)i;
+    }
+
+    return -1;
+}
+
+static uint32_t add_local(compiler_t *c, token_t name)
+{
+    compiler_func_t *func = c->func;
+
+    if (func->local_count > CHUNK_LOCAL_MAX)
+    {
+        compiler_err(c, "Too many variables in one function");
+        return 0;
+    }
+
+    if (func->local_count == func->local_capacity)
+    {
+        func->local_capacity = func->local_capacity ? func->local_capacity * 2 : 8;
+        func->locals = realloc(func->locals, sizeof(token_t) * func->local_capacity);
+    }
+
+    func->locals[func->local_count] = name;
+
+    return func->local_count++;
+}
+
+/* Pushes the value of a variable, which globals look up by name when the code runs */
+static void emit_get(compiler_t *c, token_t name)
+{
+    int slot = find_local(c, name);
+
+    if (slot >= 0)
+    {
+        emit_op(c, OP_GET_LOCAL, slot);
+        return;
+    }
+
+    expr_t ident = { .tok = name };
+
+    compile_string(c, &ident);
+    emit_byte(c, OP_VAR_GET);
+}
+
+/* Increments or decrements a variable and pushes the new value */
+static void emit_step(compiler_t *c, token_t name, int inc)
+{
+    int slot = find_local(c, name);
+
+    if (slot >= 0)
+    {
+        emit_op(c, inc ? OP_INC_LOCAL : OP_DEC_LOCAL, slot);
+        return;
+    }
+
+    expr_t ident = { .tok = name };
+
+    compile_string(c, &ident);
+    emit_byte(c, inc ? OP_INC : OP_DEC);
+}
+
+/* The name of a global goes under its value */
+static void begin_var(compiler_t *c, token_t name)
+{
+    if (c->func) return;
+
+    expr_t ident = { .tok = name };
+    compile_string(c, &ident);
+}
+
+/*
+ * Declares a variable with the value on top of the stack. Inside a function
+ * it gets a slot the first time it is declared, after its value has been
+ * worked out so the value can still read a global with the same name.
+ */
+static void end_var(compiler_t *c, token_t name)
+{
+    if (!c->func)
+    {
+        emit_byte(c, OP_VAR_DECL);
+        return;
+    }
+
+    int slot = find_local(c, name);
+    if (slot < 0) slot = (int)add_local(c, name);
+
+    emit_op(c, OP_SET_LOCAL, (uint32_t)slot);
+}
+
+static void compile_ident(compiler_t *c, expr_t *expr)
+{
+    emit_get(c, expr->tok);
 }
 
 static void compile_stdin(compiler_t *c, expr_t *expr)
 {
-    emit_byte(c->vm, OP_STDIN);
+    emit_byte(c, OP_STDIN);
 }
 
 static void compile_rand(compiler_t *c, expr_t *expr)
@@ -73,11 +257,529 @@ static void compile_rand(compiler_t *c, expr_t *expr)
     /* Compile the rand number range */
     compile_num(c, expr->right);
 
-    emit_byte(c->vm, OP_RAND);
+    emit_byte(c, OP_RAND);
+}
+
+static void add_jump(jump_list_t *list, uint32_t at)
+{
+    if (list->count == list->capacity)
+    {
+        list->capacity = list->capacity ? list->capacity * 2 : 8;
+        list->at = realloc(list->at, sizeof(uint32_t) * list->capacity);
+    }
+
+    list->at[list->count++] = at;
+}
+
+/* Points the jumps at the next instruction to be emitted and empties the list */
+static void patch_jumps(compiler_t *c, jump_list_t *list)
+{
+    for (uint32_t i = 0; i < list->count; i++)
+        patch_jump(c, list->at[i]);
+
+    free(list->at);
+    list->at = NULL;
+    list->count = 0;
+    list->capacity = 0;
+}
+
+static void compile_bin_expr(compiler_t *c, expr_t *expr);
+
+/*
+ * Starts compiling a function into its own chunk. It is added to the table
+ * before its body is compiled so the body can call it.
+ */
+static void begin_func(compiler_t *c, compiler_func_t *func, token_t name)
+{
+    func->index = UINT32_MAX;
+    func->locals = NULL;
+    func->local_count = 0;
+    func->local_capacity = 0;
+    func->enclosing = c->chunk;
+
+    if (c->funcs)
+    {
+        func->index = func_table_add(c->funcs, name.start, name.len);
+        if (func->index > CHUNK_FUNC_MAX) compiler_err(c, "Too many functions");
+
+        c->chunk = c->funcs->funcs[func->index].chunk;
+    }
+    else
+    {
+        /* The body is still compiled to report its errors, but into a chunk that is thrown away */
+        compiler_err(c, "Functions can't be defined here");
+        c->chunk = chunk_init();
+    }
+
+    c->func = func;
+    c->recent_count = 0;
+    c->inline_count = 0;
+}
+
+/* Parameters are the first slots of the frame, where the call leaves its arguments */
+static void add_param(compiler_t *c, token_t name)
+{
+    compiler_func_t *func = c->func;
+
+    if (find_local(c, name) >= 0)
+    {
+        name_err(c, "Duplicate parameter '%.*s'", name);
+        return;
+    }
+
+    /* A call gives its argument count in a byte */
+    if (func->local_count == UINT8_MAX)
+    {
+        compiler_err(c, "Too many parameters");
+        return;
+    }
+
+    add_local(c, name);
+
+    if (func->index != UINT32_MAX) c->funcs->funcs[func->index].arity = func->local_count;
+}
+
+/*
+ * Whether the last instruction emitted is a call. An expression with jumps in
+ * it ends with something else, so a call there gives the value on every path.
+ */
+static int ends_with_call(compiler_t *c)
+{
+    if (c->recent_count == 0) return 0;
+
+    uint32_t last = c->recent_ops[c->recent_count - 1];
+
+    return c->chunk->code[last] == OP_CALL && last + vm_op_length(OP_CALL) == c->chunk->count;
+}
+
+static void emit_return(compiler_t *c, int has_value)
+{
+    object_t zero = { .type = OBJ_VAL_LONG, .as.long_num = 0 };
+
+    if (!c->func) compiler_err(c, "Can't return from outside a function");
+
+    /* Returning the result of a call reuses the frame, so recursion this way runs in constant stack */
+    if (has_value && c->func && ends_with_call(c))
+    {
+        c->chunk->code[c->recent_ops[c->recent_count - 1]] = OP_TAIL_CALL;
+        return;
+    }
+
+    if (!has_value) emit_const(c, zero);
+
+    emit_byte(c, OP_RETURN);
+}
+
+/* A function that finishes without returning gives 0 */
+static void end_func(compiler_t *c)
+{
+    compiler_func_t *func = c->func;
+
+    emit_return(c, 0);
+    c->chunk->local_count = func->local_count;
+
+    if (func->index == UINT32_MAX) chunk_free(c->chunk);
+
+    free(func->locals);
+
+    c->chunk = func->enclosing;
+    c->func = NULL;
+    c->recent_count = 0;
+    c->inline_count = 0;
+}
+
+/*
+ * Slots for the locals of an inlined call. An inlined call is done with them
+ * before the next one starts, so they are shared by every call in the chunk.
+ */
+static uint32_t inline_slots(compiler_t *c, uint32_t count)
+{
+    token_t unnamed = { 0 };
+    uint32_t used = c->func ? c->func->local_count : c->chunk->local_count;
+
+    if (c->inline_count >= count) return c->inline_base;
+
+    /* Slots taken after the shared ones can't be added to them */
+    if (c->inline_base + c->inline_count != used)
+    {
+        c->inline_base = used;
+        c->inline_count = 0;
+    }
+
+    for (; c->inline_count < count; c->inline_count++)
+    {
+        if (c->func) add_local(c, unnamed);
+        else c->chunk->local_count++;
+    }
+
+    return c->inline_base;
+}
+
+static int ends_path(uint8_t code)
+{
+    return code == OP_RETURN || code == OP_TAIL_CALL || code == OP_EXIT || code == OP_JUMP;
+}
+
+/* Bytes an instruction takes in an inlined copy. A return jumps to the end of the copy unless it is already there */
+static uint32_t inline_length(uint8_t code, int last)
+{
+    uint32_t jump = last ? 0 : 1 + CHUNK_JUMP_BYTES;
+
+    if (code == OP_RETURN) return jump;
+    if (code == OP_TAIL_CALL) return vm_op_length(OP_CALL) + jump;
+
+    return vm_op_length(code);
+}
+
+/*
+ * Works out where each instruction of a function goes in an inlined copy.
+ * Code that can't be reached is left out and has no place. Returns the size
+ * of the copy, or UINT32_MAX if the function calls itself or has a loop or a
+ * match. Those leave values on the stack that a return drops but a jump out
+ * of the copy wouldn't.
+ */
+static uint32_t plan_inline(compiler_t *c, uint32_t index, uint32_t *pos)
+{
+    chunk_t *body = c->funcs->funcs[index].chunk;
+    uint8_t *code = body->code;
+    uint32_t last = 0;
+    uint32_t size = 0;
+
+    if (c->func && c->func->index == index) return UINT32_MAX;
+
+    /* Jumps only go forward without loops, so one pass finds everything that can be reached */
+    uint8_t *live = calloc(body->count + 1, 1);
+    live[0] = 1;
+
+    for (uint32_t i = 0; i < body->count; i += vm_op_length(code[i]))
+    {
+        uint8_t op = code[i];
+        uint32_t length = vm_op_length(op);
+
+        if (length > body->count - i || op == OP_LOOP || op == OP_LOOP_END || vm_op_has_table(op) ||
+            ((op == OP_CALL || op == OP_TAIL_CALL) && CHUNK_READ_U16(code + i + 1) == index))
+        {
+            free(live);
+            return UINT32_MAX;
+        }
+
+        if (!live[i]) continue;
+
+        last = i;
+
+        if (vm_op_is_jump(op))
+        {
+            uint32_t target = i + length + CHUNK_READ_U16(code + i + length - CHUNK_JUMP_BYTES);
+
+            /* Left for the verifier to report */
+            if (target > body->count)
+            {
+                free(live);
+                return UINT32_MAX;
+            }
+
+            live[target] = 1;
+        }
+
+        if (!ends_path(op)) live[i + length] = 1;
+    }
+
+    for (uint32_t i = 0; i <= body->count; i++)
+        pos[i] = UINT32_MAX;
+
+    for (uint32_t i = 0; i < body->count; i += vm_op_length(code[i]))
+    {
+        if (!live[i]) continue;
+
+        pos[i] = size;
+        size += inline_length(code[i], i == last);
+    }
+
+    pos[body->count] = size;
+
+    /* Every jump has to land on an instruction that is kept */
+    for (uint32_t i = 0; i < body->count; i += vm_op_length(code[i]))
+    {
+        uint32_t end = i + vm_op_length(code[i]);
+
+        if (live[i] && vm_op_is_jump(code[i]) && pos[end + CHUNK_READ_U16(code + end - CHUNK_JUMP_BYTES)] == UINT32_MAX)
+            size = UINT32_MAX;
+    }
+
+    free(live);
+
+    return size > CHUNK_JUMP_MAX ? UINT32_MAX : size;
+}
+
+/* The chunk of a function owns the strings in its constants, so the copy needs its own */
+static object_t copy_const(object_t obj)
+{
+    if (obj.type == OBJ_VAL_STR)
+    {
+        size_t len = strlen(obj.as.str);
+        char *str = malloc(len + 1);
+        memcpy(str, obj.as.str, len + 1);
+
+        obj.as.str = str;
+    }
+
+    return obj;
+}
+
+/*
+ * Locals of an inlined function start at zero, the same as in a frame. Slots
+ * set before anything reads them are left alone. Only the code before the
+ * first branch is looked at, so any slot set after it is zeroed.
+ */
+static void zero_locals(compiler_t *c, function_t *fn, uint32_t base)
+{
+    object_t zero = { .type = OBJ_VAL_LONG, .as.long_num = 0 };
+    chunk_t *body = fn->chunk;
+    uint8_t *set = calloc(body->local_count + 1, 1);
+    uint32_t i = 0;
+
+    while (i < body->count && !vm_op_is_jump(body->code[i]) && !ends_path(body->code[i]))
+    {
+        uint8_t op = body->code[i];
+        uint32_t slot = vm_op_has_local(op) ? CHUNK_READ_U16(body->code + i + 1) : body->local_count;
+
+        /* The first use of the slot decides, a read marks it to be zeroed */
+        if (slot < body->local_count && !set[slot]) set[slot] = op == OP_SET_LOCAL ? 1 : 2;
+
+        i += vm_op_length(op);
+    }
+
+    for (uint32_t slot = fn->arity; slot < body->local_count; slot++)
+    {
+        if (set[slot] == 1) continue;
+
+        emit_const(c, zero);
+        emit_op(c, OP_SET_LOCAL, base + slot);
+    }
+
+    free(set);
+}
+
+/*
+ * Replaces a call with a copy of the code of the function. The arguments on
+ * the stack are moved into slots of the caller, which the copy uses in place
+ * of a frame. Returns become jumps to the end of the copy, which leaves the
+ * result on the stack the same as the call would have.
+ */
+static void emit_inline(compiler_t *c, uint32_t index, uint32_t *pos, uint32_t size)
+{
+    function_t *fn = &c->funcs->funcs[index];
+    chunk_t *body = fn->chunk;
+    uint8_t *code = body->code;
+    uint32_t base = inline_slots(c, body->local_count);
+
+    /* The last argument is on top */
+    for (uint32_t slot = fn->arity; slot > 0; slot--)
+        emit_op(c, OP_SET_LOCAL, base + slot - 1);
+
+    zero_locals(c, fn, base);
+
+    uint32_t start = c->chunk->count;
+
+    for (uint32_t i = 0; i < body->count; i += vm_op_length(code[i]))
+    {
+        if (pos[i] == UINT32_MAX) continue;
+
+        uint8_t op = code[i];
+        uint32_t length = vm_op_length(op);
+        uint32_t at = start + pos[i];
+
+        if (op == OP_RETURN || op == OP_TAIL_CALL)
+        {
+            if (op == OP_TAIL_CALL)
+            {
+                chunk_write(c->chunk, OP_CALL);
+                for (uint32_t b = 1; b < length; b++) chunk_write(c->chunk, code[i + b]);
+            }
+
+            /* The last instruction of the copy has nothing to jump over */
+            if (pos[i] + inline_length(op, 1) < size)
+            {
+                chunk_write(c->chunk, OP_JUMP);
+                chunk_write_operand(c->chunk, start + size - (c->chunk->count + CHUNK_JUMP_BYTES), CHUNK_JUMP_BYTES);
+            }
+
+            continue;
+        }
+
+        for (uint32_t b = 0; b < length; b++) chunk_write(c->chunk, code[i + b]);
+
+        if (vm_op_has_const(op))
+        {
+            uint32_t k = add_const(c, copy_const(body->constants[CHUNK_READ_U24(code + i + 1)]));
+            chunk_patch_operand(c->chunk, at + 1, k, CHUNK_CONST_BYTES);
+        }
+
+        if (vm_op_has_local(op))
+            chunk_patch_operand(c->chunk, at + 1, base + CHUNK_READ_U16(code + i + 1), CHUNK_LOCAL_BYTES);
+
+        if (vm_op_is_jump(op))
+        {
+            uint32_t target = i + length + CHUNK_READ_U16(code + i + length - CHUNK_JUMP_BYTES);
+            chunk_patch_operand(c->chunk, at + length - CHUNK_JUMP_BYTES, pos[target] - (pos[i] + length), CHUNK_JUMP_BYTES);
+        }
+    }
+
+    /* Nothing after the copy can be folded into the code in it */
+    c->recent_count = 0;
+}
+
+/* Inlines a call to a small function that doesn't call itself. Returns 0 if the call has to be made */
+static int try_inline(compiler_t *c, uint32_t index)
+{
+    chunk_t *body = c->funcs->funcs[index].chunk;
+    uint32_t used = c->func ? c->func->local_count : c->chunk->local_count;
+
+    if (body->count > c->inline_budget || used + body->local_count > CHUNK_LOCAL_MAX) return 0;
+
+    uint32_t *pos = malloc(sizeof(uint32_t) * (body->count + 1));
+    uint32_t size = plan_inline(c, index, pos);
+
+    if (size != UINT32_MAX) emit_inline(c, index, pos, size);
+
+    free(pos);
+
+    return size != UINT32_MAX;
+}
+
+static void emit_call_to(compiler_t *c, uint32_t index, uint32_t argc)
+{
+    if (try_inline(c, index)) return;
+
+    emit_byte(c, OP_CALL);
+    chunk_write_operand(c->chunk, index, CHUNK_FUNC_BYTES);
+    chunk_write_operand(c->chunk, argc, 1);
+}
+
+/*
+ * Calls are resolved when they are compiled, so running one needs no lookup
+ * by name. Only functions defined before the call can be found, though a
+ * function can call itself. Calls to small functions are inlined instead.
+ */
+static void emit_call(compiler_t *c, token_t name, uint32_t argc)
+{
+    int index = c->funcs ? func_table_find(c->funcs, name.start, name.len, c->func_limit) : -1;
+
+    if (index < 0)
+    {
+        name_err(c, "Function '%.*s' is not defined", name);
+        index = 0;
+    }
+    else if (c->funcs->funcs[index].arity != argc)
+    {
+        name_err(c, "Wrong number of arguments in call to '%.*s'", name);
+    }
+    else
+    {
+        emit_call_to(c, (uint32_t)index, argc);
+        return;
+    }
+
+    emit_byte(c, OP_CALL);
+    chunk_write_operand(c->chunk, (uint32_t)index, CHUNK_FUNC_BYTES);
+    chunk_write_operand(c->chunk, argc, 1);
+}
+
+/* The arguments are pushed in order so they land in the first slots of the frame */
+static void compile_call(compiler_t *c, expr_t *expr)
+{
+    uint32_t argc = 0;
+
+    for (expr_t **arg = &expr->right; *arg; arg = &(*arg)->next)
+    {
+        *arg = fold_expr(*arg);
+        compile_bin_expr(c, *arg);
+        argc++;
+    }
+
+    if (!expr->left || expr->left->tok.type != TOK_IDENT)
+    {
+        compiler_err(c, "Only functions can be called");
+        return;
+    }
+
+    emit_call(c, expr->left->tok, argc);
+}
+
+static int is_logical(expr_t *expr)
+{
+    return expr->tok.type == TOK_AND || expr->tok.type == TOK_OR;
+}
+
+/*
+ * Emits a condition as a chain of jumps that are taken when its truthiness is
+ * the same as when, and falls through otherwise. The jumps are added to list.
+ * The right operand of && and || is jumped over once the left one decides the
+ * result, so it is only run when it is needed.
+ */
+static void compile_branch(compiler_t *c, expr_t *expr, int when, jump_list_t *list)
+{
+    if (!is_logical(expr))
+    {
+        compile_bin_expr(c, expr);
+        add_jump(list, emit_jump(c, when ? OP_JUMP_IF_TRUE : OP_JUMP_IF_FALSE));
+        return;
+    }
+
+    /* The parser has already reported the missing operand */
+    if (!expr->left || !expr->right) return;
+
+    /* The left operand decides the result when it is false for && and true for || */
+    int decides = expr->tok.type == TOK_OR;
+
+    if (decides == when)
+    {
+        compile_branch(c, expr->left, when, list);
+        compile_branch(c, expr->right, when, list);
+        return;
+    }
+
+    jump_list_t decided = { 0 };
+
+    compile_branch(c, expr->left, decides, &decided);
+    compile_branch(c, expr->right, when, list);
+
+    patch_jumps(c, &decided);
+}
+
+/* && and || give true or false rather than one of their operands */
+static void compile_logical(compiler_t *c, expr_t *expr)
+{
+    object_t obj_true = { .type = OBJ_VAL_BOOL, .as.str = "true" };
+    object_t obj_false = { .type = OBJ_VAL_BOOL, .as.str = "false" };
+    jump_list_t false_jumps = { 0 };
+
+    compile_branch(c, expr, 0, &false_jumps);
+
+    emit_const(c, obj_true);
+    uint32_t end_jump = emit_jump(c, OP_JUMP);
+
+    patch_jumps(c, &false_jumps);
+    emit_const(c, obj_false);
+
+    patch_jump(c, end_jump);
 }
 
 static void compile_bin_expr(compiler_t *c, expr_t *expr)
 {
+    if (is_logical(expr))
+    {
+        compile_logical(c, expr);
+        return;
+    }
+
+    /* The arguments are chained through next rather than being operands */
+    if (expr->tok.type == TOK_LPAREN)
+    {
+        compile_call(c, expr);
+        return;
+    }
+
     if (expr->left) compile_bin_expr(c, expr->left);
     if (expr->right) compile_bin_expr(c, expr->right);
 
@@ -87,19 +789,25 @@ static void compile_bin_expr(compiler_t *c, expr_t *expr)
         case TOK_FLOAT: compile_double(c, expr); break;
         case TOK_STRING: compile_string(c, expr); break;
         case TOK_IDENT: compile_ident(c, expr); break;
-
-        case TOK_PLUS: emit_byte(c->vm, OP_ADD); break;
-        case TOK_MINUS: emit_byte(c->vm, OP_SUB); break;
-        case TOK_MULTIPLY: emit_byte(c->vm, OP_MUL); break;
-        case TOK_DIVIDE: emit_byte(c->vm, OP_DIV); break;
-        case TOK_MODULO: emit_byte(c->vm, OP_MOD); break;
-
-        case TOK_LT: emit_byte(c->vm, OP_LT); break;
-        case TOK_LT_EQ: emit_byte(c->vm, OP_LT_EQ); break;
-        case TOK_GT: emit_byte(c->vm, OP_GT); break;
-        case TOK_GT_EQ: emit_byte(c->vm, OP_GT_EQ); break;
-        case TOK_EQ: emit_byte(c->vm, OP_EQ); break;
-        case TOK_NE: emit_byte(c->vm, OP_NE); break;
+        case TOK_TRUE:
+        case TOK_FALSE: compile_bool(c, expr); break;
+
+        /* The range is the right node so it has already been compiled */
+        case TOK_RAND: emit_byte(c, OP_RAND); break;
+        case TOK_STDIN: emit_byte(c, OP_STDIN); break;
+
+        case TOK_PLUS: emit_byte(c, OP_ADD); break;
+        case TOK_MINUS: emit_byte(c, OP_SUB); break;
+        case TOK_MULTIPLY: emit_byte(c, OP_MUL); break;
+        case TOK_DIVIDE: emit_byte(c, OP_DIV); break;
+        case TOK_MODULO: emit_byte(c, OP_MOD); break;
+
+        case TOK_LT: emit_byte(c, OP_LT); break;
+        case TOK_LT_EQ: emit_byte(c, OP_LT_EQ); break;
+        case TOK_GT: emit_byte(c, OP_GT); break;
+        case TOK_GT_EQ: emit_byte(c, OP_GT_EQ); break;
+        case TOK_EQ: emit_byte(c, OP_EQ); break;
+        case TOK_NE: emit_byte(c, OP_NE); break;
         default:
             /* TODO: Error here */
             break;
@@ -108,8 +816,10 @@ static void compile_bin_expr(compiler_t *c, expr_t *expr)
 
 static void compile_var(compiler_t *c, expr_t *expr)
 {
-    /* Left token is identifier so this is always a string object */
-    compile_string(c, expr->left);
+    /* Left token is the identifier, which globals push as a string */
+    begin_var(c, expr->left->tok);
+
+    expr->right = fold_expr(expr->right);
 
 
     /* TODO: Update the tokens to reflect long and double instead of float and int */
@@ -120,9 +830,24 @@ static void compile_var(compiler_t *c, expr_t *expr)
         case TOK_MULTIPLY:
         case TOK_DIVIDE:
         case TOK_MODULO:
+        case TOK_GT:
+        case TOK_GT_EQ:
+        case TOK_LT:
+        case TOK_LT_EQ:
+        case TOK_EQ:
+        case TOK_NE:
+        case TOK_AND:
+        case TOK_OR:
+        case TOK_LPAREN:
             compile_bin_expr(c, expr->right);
             break;
 
+        case TOK_TRUE:
+        case TOK_FALSE:
+        {
+            compile_bool(c, expr->right);
+            break;
+        }
         case TOK_FLOAT:
         {
             compile_double(c, expr->right);
@@ -140,7 +865,7 @@ static void compile_var(compiler_t *c, expr_t *expr)
         }
         case TOK_IDENT:
             compile_ident(c, expr->right);
-            //emit_byte(c->vm, OP_VAR_GET);
+            //emit_byte(c, OP_VAR_GET);
             break;
         case TOK_STDIN:
         {
@@ -157,49 +882,63 @@ static void compile_var(compiler_t *c, expr_t *expr)
            break;
     }
 
-    emit_byte(c->vm, OP_VAR_DECL);
+    end_var(c, expr->left->tok);
 }
 
 static void compile_var_get(compiler_t *c, expr_t *expr)
 {
-    char *ident = malloc(sizeof(char) * expr->tok.len + 1);
-    memcpy(ident, expr->tok.start, expr->tok.len);
-    ident[expr->tok.len] = '\0';
-
-    object_t ident_obj = { .type = OBJ_VAL_STR, .as.str = ident };
+    emit_get(c, expr->tok);
+}
 
-    add_obj(c->vm, ident_obj);
+static void compile_return(compiler_t *c, expr_t *expr)
+{
+    if (expr->left)
+    {
+        expr->left = fold_expr(expr->left);
+        compile_bin_expr(c, expr->left);
+    }
 
-    emit_byte(c->vm, OP_CONST);
-    emit_byte(c->vm, OP_VAR_GET);
+    emit_return(c, expr->left != NULL);
 }
 
-/* Forward declaration as compile_expr and compile_if_stmt have a circular dependency */
+/* Forward declarations as compile_expr and the statements have a circular dependency */
 static void compile_if_stmt(compiler_t* c, expr_t* expr);
+static void compile_loop_stmt(compiler_t* c, expr_t* expr);
+static void compile_match_stmt(compiler_t* c, expr_t* expr);
+static void compile_func(compiler_t* c, expr_t* expr);
 
 static int compile_expr(compiler_t *c, expr_t *expr)
 {
     /* Empty expression */
     if (!expr) return 0;
 
+    c->chunk->line = expr->tok.line;
+
     switch (expr->tok.type)
     {
         case TOK_INT:
         {
             compile_num(c, expr);
-            emit_byte(c->vm, OP_POP);
+            emit_byte(c, OP_POP);
             break;
         }
         case TOK_FLOAT:
         {
             compile_double(c, expr);
-            emit_byte(c->vm, OP_POP);
+            emit_byte(c, OP_POP);
             break;
         }
         case TOK_STRING:
         {
             compile_string(c, expr);
-            emit_byte(c->vm, OP_POP);
+            emit_byte(c, OP_POP);
+            break;
+        }
+        case TOK_TRUE:
+        case TOK_FALSE:
+        {
+            compile_bool(c, expr);
+            emit_byte(c, OP_POP);
             break;
         }
         case TOK_ASSIGN:
@@ -211,7 +950,7 @@ static int compile_expr(compiler_t *c, expr_t *expr)
         {
             /* TODO: Look into making this one call from the compile var function */
             compile_var_get(c, expr);
-            emit_byte(c->vm, OP_POP);
+            emit_byte(c, OP_POP);
             break;
         }
         case TOK_PLUS:
@@ -225,9 +964,11 @@ static int compile_expr(compiler_t *c, expr_t *expr)
         case TOK_LT_EQ:
         case TOK_EQ:
         case TOK_NE:
+        case TOK_AND:
+        case TOK_OR:
         {
             compile_bin_expr(c, expr);
-            emit_byte(c->vm, OP_POP);
+            emit_byte(c, OP_POP);
             break;
         }
         case TOK_IF:
@@ -235,99 +976,212 @@ static int compile_expr(compiler_t *c, expr_t *expr)
             compile_if_stmt(c, expr);
             break;
         }
+        case TOK_LOOP:
+        {
+            compile_loop_stmt(c, expr);
+            break;
+        }
+        case TOK_MATCH:
+        {
+            compile_match_stmt(c, expr);
+            break;
+        }
         case TOK_INCREMENT:
+        case TOK_DECREMENT:
+        {
+            emit_step(c, expr->left->tok, expr->tok.type == TOK_INCREMENT);
+            emit_byte(c, OP_POP);
+            break;
+        }
+        case TOK_LPAREN:
+        {
+            /* A lone call runs the function for what it does and drops the result */
+            compile_call(c, expr);
+            emit_byte(c, OP_DROP);
+            break;
+        }
+        case TOK_RETURN:
+        {
+            compile_return(c, expr);
+            break;
+        }
+        case TOK_RAND:
+        {
+            compile_rand(c, expr);
+            emit_byte(c, OP_POP);
+            break;
+        }
+        case TOK_STDIN:
         {
-            char *ident = malloc(sizeof(char) * expr->left->tok.len + 1);
-            memcpy(ident, expr->left->tok.start, expr->left->tok.len);
-            ident[expr->left->tok.len] = '\0';
+            /* A lone stdin reads input without printing it */
+            compile_stdin(c, expr);
+            emit_byte(c, OP_DROP);
+            break;
+        }
+        case TOK_EXIT:
+        {
+            emit_byte(c, OP_EXIT);
+        }
+        default: break;
+    }
 
-            object_t ident_obj = { .type = OBJ_VAL_STR, .as.str = ident };
+    return 1;
+}
 
-            add_obj(c->vm, ident_obj);
+/* Statements in a block are chained through their next nodes */
+static void compile_block(compiler_t *c, expr_t **block)
+{
+    for (expr_t **stmt = block; *stmt; stmt = &(*stmt)->next)
+    {
+        *stmt = fold_expr(*stmt);
+        compile_expr(c, *stmt);
+    }
+}
 
-            emit_byte(c->vm, OP_CONST);
+static void compile_if_stmt(compiler_t *c, expr_t *expr)
+{
+    /* The left node contains the condition, which jumps over the true branch when it fails */
+    expr->left = fold_expr(expr->left);
 
-            emit_byte(c->vm, OP_INC);
-            emit_byte(c->vm, OP_POP);
-            break;
-        }
-        case TOK_DECREMENT:
-        {
-            char *ident = malloc(sizeof(char) * expr->left->tok.len + 1);
-            memcpy(ident, expr->left->tok.start, expr->left->tok.len);
-            ident[expr->left->tok.len] = '\0';
+    jump_list_t false_jumps = { 0 };
+    compile_branch(c, expr->left, 0, &false_jumps);
+
+    /* Check if the current if statement is an if else */
+    if (expr->right && expr->right->tok.type == TOK_ELSE)
+    {
+        /* Left is true and right is false */
+        compile_block(c, &expr->right->left);
+
+        uint32_t end_jump = emit_jump(c, OP_JUMP);
+        patch_jumps(c, &false_jumps);
 
-            object_t ident_obj = { .type = OBJ_VAL_STR, .as.str = ident };
+        compile_block(c, &expr->right->right);
+
+        patch_jump(c, end_jump);
+    }
+    else
+    {
+        compile_block(c, &expr->right);
+        patch_jumps(c, &false_jumps);
+    }
+}
 
-            add_obj(c->vm, ident_obj);
+/*
+ * Writes copies of a body that was compiled earlier, along with the lines it
+ * came from. Its jumps are relative so the copies run the same wherever they
+ * land. Nothing before the copies can be folded into what comes after them.
+ */
+static void emit_body(compiler_t *c, uint8_t *body, uint32_t *lines, uint32_t size, long copies)
+{
+    uint32_t line = c->chunk->line;
 
-            emit_byte(c->vm, OP_CONST);
+    for (long i = 0; i < copies; i++)
+    {
+        uint32_t start = c->chunk->count;
 
-            emit_byte(c->vm, OP_DEC);
-            emit_byte(c->vm, OP_POP);
-            break;
-        }
-        case TOK_STDIN:
+        for (uint32_t j = 0; j < size; j++)
         {
-            compile_stdin(c, expr);
-            break;
+            c->chunk->line = lines[j];
+            chunk_write(c->chunk, body[j]);
         }
-        case TOK_EXIT:
+
+        /* Each match gets its own table so the peephole optimiser can move its cases */
+        for (uint32_t j = start; j < c->chunk->count; j += vm_op_length(c->chunk->code[j]))
         {
-            emit_byte(c->vm, OP_EXIT);
+            if (!vm_op_has_table(c->chunk->code[j])) continue;
+
+            uint32_t table = chunk_copy_table(c->chunk, CHUNK_READ_U16(c->chunk->code + j + 1));
+            chunk_patch_operand(c->chunk, j + 1, table, CHUNK_TABLE_BYTES);
         }
-        default: break;
     }
 
-    return 1;
+    c->chunk->line = line;
+    c->recent_count = 0;
 }
 
-static void compile_if_stmt(compiler_t *c, expr_t *expr)
+/* Emits a loop that runs copies of the body count times */
+static void emit_counted_loop(compiler_t *c, long count, uint8_t *body, uint32_t *lines, uint32_t size, long copies)
 {
-    /* The left node contains the expression */
-    compile_expr(c, expr->left);
+    object_t num = { .type = OBJ_VAL_LONG, .as.long_num = count };
+    emit_const(c, num);
 
-    /* Remove the pop operation. We don't want that printing with if statement expressions */
-    c->vm->ip--;
+    uint32_t loop_start = c->chunk->count;
+    uint32_t exit_jump = emit_jump(c, OP_LOOP);
 
-    emit_byte(c->vm, OP_IF);
+    emit_body(c, body, lines, size, copies);
 
-    /* Check if the current if statement is an if else */
-    if (expr->right->tok.type == TOK_ELSE)
-    {
-        expr_t *next_expr = expr->right->left;
-        while (next_expr)
-        {
-            /* Left is true and right is false */
-            compile_expr(c, next_expr);
-            next_expr = next_expr->left;
-        }
+    emit_loop_end(c, loop_start);
+    patch_jump(c, exit_jump);
+}
+
+/*
+ * Unrolls a loop with a literal count. The body is compiled once and copied out
+ * so it can be emitted as many times as needed. Loops that fit in the budget
+ * are unrolled fully, leaving no OP_LOOP at all. Larger ones run unroll_factor
+ * copies per iteration, followed by a loop for the iterations left over.
+ */
+static void compile_unrolled_loop(compiler_t *c, expr_t *expr, long count)
+{
+    uint32_t start = c->chunk->count;
 
-        emit_byte(c->vm, OP_ELSE);
+    compile_block(c, &expr->right);
 
-        next_expr = expr->right->right;
-        while (next_expr)
-        {
-            compile_expr(c, next_expr);
-            next_expr = next_expr->left;
-        }
+    uint32_t size = c->chunk->count - start;
+    uint8_t *body = malloc(size + 1);
+    memcpy(body, c->chunk->code + start, size);
+    uint32_t *lines = malloc(sizeof(uint32_t) * (size + 1));
+    memcpy(lines, c->chunk->lines + start, sizeof(uint32_t) * size);
+
+    c->chunk->count = start;
+    c->chunk->line = expr->tok.line;
+    while (c->recent_count && c->recent_ops[c->recent_count - 1] >= start)
+        c->recent_count--;
+
+    uint32_t budget = c->unroll_budget;
+
+    if (size == 0 || (unsigned long)count <= budget / size)
+    {
+        emit_body(c, body, lines, size, count);
+        free(body);
+        free(lines);
+        return;
     }
-    else
+
+    /* Leave room for the copy in the remainder loop */
+    long factor = c->unroll_factor < (unsigned long)count ? (long)c->unroll_factor : count;
+    while (factor > 1 && (unsigned long)(factor + 1) * size > budget)
+        factor--;
+
+    if (factor < 2)
     {
-        expr_t *next_expr = expr->right;
-        while (next_expr)
-        {
-            /* Just compile the right node if no else statement was found */
-            compile_expr(c, next_expr);
-            next_expr = next_expr->left;
-        }
+        emit_counted_loop(c, count, body, lines, size, 1);
+        free(body);
+        free(lines);
+        return;
     }
 
-    emit_byte(c->vm, OP_JUMP_END);
+    emit_counted_loop(c, count / factor, body, lines, size, factor);
+
+    long remainder = count % factor;
+
+    if (remainder == 1) emit_body(c, body, lines, size, 1);
+    else if (remainder > 1) emit_counted_loop(c, remainder, body, lines, size, 1);
+
+    free(body);
+    free(lines);
 }
 
 static void compile_loop_stmt(compiler_t *c, expr_t *expr)
 {
+    expr->left = fold_expr(expr->left);
+
+    /* Negative counts are left to the vm as they count away from zero */
+    if (c->unroll_factor && expr->left->tok.type == TOK_INT && expr->left->has_value &&
+        expr->left->value.as.long_num >= 0)
+    {
+        compile_unrolled_loop(c, expr, expr->left->value.as.long_num);
+        return;
+    }
 
     switch (expr->left->tok.type)
     {
@@ -341,12 +1195,24 @@ static void compile_loop_stmt(compiler_t *c, expr_t *expr)
             compile_ident(c, expr->left);
             break;
         }
+        case TOK_FLOAT:
+        case TOK_TRUE:
+        case TOK_FALSE:
+        case TOK_RAND:
+        case TOK_PLUS:
+        case TOK_MINUS:
+        case TOK_MULTIPLY:
+        case TOK_DIVIDE:
+        case TOK_MODULO:
         case TOK_EQ:
         case TOK_NE:
         case TOK_LT:
         case TOK_LT_EQ:
         case TOK_GT:
         case TOK_GT_EQ:
+        case TOK_AND:
+        case TOK_OR:
+        case TOK_LPAREN:
         {
             compile_bin_expr(c, expr->left);
             break;
@@ -354,44 +1220,304 @@ static void compile_loop_stmt(compiler_t *c, expr_t *expr)
         default: break;
     }
 
-    /* Ignore the pop operation after compiling the expression */
-    //c->vm->cp--;
+    /* The loop counts down the value on top of the stack */
+    uint32_t loop_start = c->chunk->count;
+    uint32_t exit_jump = emit_jump(c, OP_LOOP);
+
+    compile_block(c, &expr->right);
 
-    //compile_expr(c, expr->left);
-    emit_byte(c->vm, OP_LOOP);
+    emit_loop_end(c, loop_start);
+    patch_jump(c, exit_jump);
+}
 
-    compile_expr(c, expr->right);
+static void begin_match(compiler_t *c, compiler_match_t *m)
+{
+    m->op = c->chunk->count;
+    m->cases = NULL;
+    m->count = 0;
+    m->capacity = 0;
+    m->exits = (jump_list_t){ 0 };
+    m->has_default = 0;
+
+    /* The kind of table and where it is are filled in once all of the cases are known */
+    emit_byte(c, OP_MATCH_SEARCH);
+    chunk_write_operand(c->chunk, 0, CHUNK_TABLE_BYTES);
+    chunk_write_operand(c->chunk, 0, CHUNK_JUMP_BYTES);
+}
 
-    /* Compile any other expressions that are in the statement */
-    expr_t *next_expr = NULL;
+/* Adds a case that goes to the next instruction to be emitted */
+static void match_case(compiler_t *c, compiler_match_t *m, token_t label)
+{
+    compiler_case_t arm = { .target = c->chunk->count };
 
-    if (expr->right->tok.type == TOK_ASSIGN )
+    if (label.type == TOK_INT)
+    {
+        arm.value.type = OBJ_VAL_LONG;
+        arm.value.as.long_num = strtol(label.start, NULL, 10);
+    }
+    else if (label.type == TOK_STRING)
     {
-        next_expr = expr->right->left;
+        arm.value.type = OBJ_VAL_STR;
+        arm.value.as.str = malloc(label.len + 1);
+        memcpy(arm.value.as.str, label.start, label.len);
+        arm.value.as.str[label.len] = '\0';
     }
     else
     {
-        next_expr = expr->right;
+        compiler_err(c, "Match cases must be integers or strings");
+        return;
+    }
+
+    if (m->count == m->capacity)
+    {
+        m->capacity = m->capacity ? m->capacity * 2 : 8;
+        m->cases = realloc(m->cases, sizeof(compiler_case_t) * m->capacity);
+    }
+
+    m->cases[m->count++] = arm;
+
+    /* Arms are jumped to so nothing before one can be folded into it */
+    c->recent_count = 0;
+}
+
+static void end_arm(compiler_t *c, compiler_match_t *m)
+{
+    add_jump(&m->exits, emit_jump(c, OP_JUMP));
+}
+
+static void match_default(compiler_t *c, compiler_match_t *m)
+{
+    m->has_default = 1;
+    patch_jump(c, m->op + vm_op_length(OP_MATCH_SEARCH) - CHUNK_JUMP_BYTES);
+
+    c->recent_count = 0;
+}
+
+/* Offset from the end of the match instruction to the arm of a case */
+static uint32_t case_offset(compiler_t *c, compiler_match_t *m, uint32_t target)
+{
+    uint32_t offset = target - (m->op + vm_op_length(OP_MATCH_SEARCH));
+
+    if (offset > CHUNK_JUMP_MAX)
+    {
+        compiler_err(c, "Too much code to jump over");
+        offset = 0;
+    }
+
+    return offset;
+}
+
+static int compare_cases(const void *a, const void *b)
+{
+    long x = ((const compiler_case_t *)a)->value.as.long_num;
+    long y = ((const compiler_case_t *)b)->value.as.long_num;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * Integer cases that are close together are indexed directly, with the gaps
+ * between them going to the default. Otherwise they are sorted to be binary
+ * searched.
+ */
+static op_code int_table(compiler_t *c, compiler_match_t *m, uint32_t fallback, chunk_table_t *table)
+{
+    compiler_case_t *cases = m->cases;
+    uint32_t count = m->count;
+
+    qsort(cases, count, sizeof(compiler_case_t), compare_cases);
+
+    for (uint32_t i = 1; i < count; i++)
+    {
+        if (cases[i].value.as.long_num == cases[i - 1].value.as.long_num)
+        {
+            compiler_err(c, "Duplicate case in match");
+            return OP_MATCH_SEARCH;
+        }
+    }
+
+    long min = cases[0].value.as.long_num;
+    unsigned long span = (unsigned long)cases[count - 1].value.as.long_num - (unsigned long)min;
+
+    if (span < (unsigned long)count * COMPILER_MATCH_DENSITY)
+    {
+        table->count = span + 1;
+        table->min = min;
+        table->offsets = malloc(sizeof(uint32_t) * table->count);
+
+        for (uint32_t i = 0; i < table->count; i++)
+            table->offsets[i] = fallback;
+
+        for (uint32_t i = 0; i < count; i++)
+            table->offsets[(unsigned long)cases[i].value.as.long_num - (unsigned long)min] = case_offset(c, m, cases[i].target);
+
+        return OP_MATCH_TABLE;
+    }
+
+    table->count = count;
+    table->keys = malloc(sizeof(long) * count);
+    table->offsets = malloc(sizeof(uint32_t) * count);
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        table->keys[i] = cases[i].value.as.long_num;
+        table->offsets[i] = case_offset(c, m, cases[i].target);
+    }
+
+    return OP_MATCH_SEARCH;
+}
+
+/*
+ * String cases go in an open addressed table keyed by their hash. It is kept
+ * at most half full so probes are short and always reach an empty slot. The
+ * table takes the strings of the cases.
+ */
+static op_code string_table(compiler_t *c, compiler_match_t *m, chunk_table_t *table)
+{
+    uint32_t capacity = 2;
+    while (capacity < m->count * 2) capacity *= 2;
+
+    uint32_t mask = capacity - 1;
+
+    table->count = capacity;
+    table->strings = calloc(capacity, sizeof(char *));
+    table->hashes = calloc(capacity, sizeof(uint32_t));
+    table->offsets = calloc(capacity, sizeof(uint32_t));
+
+    for (uint32_t i = 0; i < m->count; i++)
+    {
+        char *str = m->cases[i].value.as.str;
+        uint32_t hash = chunk_hash_str(str);
+        uint32_t slot = hash & mask;
+
+        while (table->strings[slot] && strcmp(table->strings[slot], str) != 0)
+            slot = (slot + 1) & mask;
+
+        if (table->strings[slot])
+        {
+            compiler_err(c, "Duplicate case in match");
+            free(str);
+            continue;
+        }
+
+        table->strings[slot] = str;
+        table->hashes[slot] = hash;
+        table->offsets[slot] = case_offset(c, m, m->cases[i].target);
+    }
+
+    return OP_MATCH_HASH;
+}
+
+/* Points the default and the ends of the arms here, then writes the table for the cases */
+static void end_match(compiler_t *c, compiler_match_t *m)
+{
+    uint32_t end = m->op + vm_op_length(OP_MATCH_SEARCH);
+
+    if (!m->has_default) patch_jump(c, end - CHUNK_JUMP_BYTES);
+    patch_jumps(c, &m->exits);
+
+    chunk_table_t table = { 0 };
+    op_code code = OP_MATCH_SEARCH;
+    uint32_t strings = 0;
+
+    for (uint32_t i = 0; i < m->count; i++)
+    {
+        if (m->cases[i].value.type == OBJ_VAL_STR) strings++;
+    }
+
+    if (strings && strings != m->count)
+    {
+        compiler_err(c, "Match cases must all be integers or all strings");
+
+        for (uint32_t i = 0; i < m->count; i++)
+        {
+            if (m->cases[i].value.type == OBJ_VAL_STR) free(m->cases[i].value.as.str);
+        }
+    }
+    else if (strings)
+    {
+        code = string_table(c, m, &table);
+    }
+    else if (m->count)
+    {
+        code = int_table(c, m, CHUNK_READ_U16(c->chunk->code + end - CHUNK_JUMP_BYTES), &table);
+    }
+
+    uint32_t index = chunk_add_table(c->chunk, table);
+
+    if (index > CHUNK_TABLE_MAX)
+    {
+        compiler_err(c, "Too many match statements in one chunk");
+        index = 0;
     }
 
-    while (next_expr->left)
+    c->chunk->code[m->op] = code;
+    chunk_patch_operand(c->chunk, m->op + 1, index, CHUNK_TABLE_BYTES);
+
+    free(m->cases);
+    m->cases = NULL;
+}
+
+/*
+ * The value is popped by a single match instruction that jumps straight to
+ * the arm for it, so finding the arm doesn't depend on how many there are.
+ * Each arm jumps past the rest when it finishes.
+ */
+static void compile_match_stmt(compiler_t *c, expr_t *expr)
+{
+    expr->left = fold_expr(expr->left);
+    compile_bin_expr(c, expr->left);
+
+    compiler_match_t m;
+    begin_match(c, &m);
+
+    /* Each arm holds its first case and its body, with any more cases chained through right */
+    for (expr_t *arm = expr->right; arm; arm = arm->next)
     {
-        /* This skips an issue when if statement expressions are compiled twice */
-        if (next_expr->tok.type == TOK_IF)
+        if (arm->tok.type == TOK_ELSE)
         {
-            next_expr = next_expr->left->left;
+            match_default(c, &m);
+            compile_block(c, &arm->left);
             continue;
         }
 
-        compile_expr(c, next_expr->left);
-        next_expr = next_expr->left;
+        for (expr_t *label = arm; label; label = label->right)
+            match_case(c, &m, label->tok);
+
+        compile_block(c, &arm->left);
+        end_arm(c, &m);
+    }
+
+    end_match(c, &m);
+}
+
+/* The name holds the parameters, chained through next, on its right. The body is on the right */
+static void compile_func(compiler_t *c, expr_t *expr)
+{
+    /* The parser has already reported the missing name */
+    if (!expr->left) return;
+
+    if (c->defined_ahead)
+    {
+        c->func_limit++;
+        return;
     }
-    
-    emit_byte(c->vm, OP_LOOP_END);
+
+    compiler_func_t func;
+    begin_func(c, &func, expr->left->tok);
+
+    for (expr_t *param = expr->left->right; param; param = param->next)
+        add_param(c, param->tok);
+
+    compile_block(c, &expr->right);
+
+    end_func(c);
 }
 
 static int compile_stmt(compiler_t *c, expr_t *expr)
 {
+    c->chunk->line = expr->tok.line;
+
     switch (expr->tok.type)
     {
         case TOK_IF:
@@ -400,16 +1526,36 @@ static int compile_stmt(compiler_t *c, expr_t *expr)
         case TOK_LOOP:
             compile_loop_stmt(c, expr);
             break;
+        case TOK_MATCH:
+            compile_match_stmt(c, expr);
+            break;
+        case TOK_FUNC:
+            compile_func(c, expr);
+            break;
+        case TOK_RETURN:
+            compile_return(c, expr);
+            break;
         default: break;
     }
 
     return 1;
 }
 
-compiler_t *compiler_init(vm_t *vm)
+compiler_t *compiler_init(chunk_t *chunk)
 {
     compiler_t *c = malloc(sizeof(compiler_t));
-    c->vm = vm;
+    c->chunk = chunk;
+    c->funcs = NULL;
+    c->func = NULL;
+    c->func_limit = UINT32_MAX;
+    c->defined_ahead = 0;
+    c->recent_count = 0;
+    c->unroll_factor = COMPILER_UNROLL_FACTOR;
+    c->unroll_budget = COMPILER_UNROLL_BUDGET;
+    c->inline_budget = COMPILER_INLINE_BUDGET;
+    c->inline_base = 0;
+    c->inline_count = 0;
+    c->had_error = 0;
 
     return c;
 }
@@ -419,6 +1565,197 @@ void compiler_free(compiler_t *c)
     free(c);
 }
 
+/* Code emitted from here on is from this line of the source */
+void compiler_set_line(compiler_t *c, uint32_t line)
+{
+    c->chunk->line = line;
+}
+
+void compiler_emit_byte(compiler_t *c, op_code code)
+{
+    emit_byte(c, code);
+}
+
+/*
+ * Emits a binary operator. If the last two instructions pushed its operands as
+ * constants they are replaced with a single constant holding the result.
+ */
+void compiler_emit_binary(compiler_t *c, op_code code)
+{
+    chunk_t *chunk = c->chunk;
+    object_t result;
+
+    if (c->recent_count < 2)
+    {
+        emit_byte(c, code);
+        return;
+    }
+
+    uint32_t last_op = c->recent_ops[c->recent_count - 1];
+    uint32_t prev_op = c->recent_ops[c->recent_count - 2];
+
+    if (chunk->code[last_op] != OP_CONST || chunk->code[prev_op] != OP_CONST)
+    {
+        emit_byte(c, code);
+        return;
+    }
+
+    uint32_t a = CHUNK_READ_U24(chunk->code + prev_op + 1);
+    uint32_t b = CHUNK_READ_U24(chunk->code + last_op + 1);
+
+    /* Only fold constants that nothing else uses so the pool can shrink too */
+    if (a + 1 != b || b + 1 != chunk->const_count ||
+        !fold_binary(code, chunk->constants[a], chunk->constants[b], &result))
+    {
+        emit_byte(c, code);
+        return;
+    }
+
+    chunk->constants[a] = result;
+    chunk->const_count--;
+    chunk->count = last_op;
+
+    /* The folded constant can be folded again by the next operator */
+    c->recent_count--;
+}
+
+/* Jumps used by the single pass compiler in the parser */
+void compiler_emit_op(compiler_t *c, op_code code, uint32_t operand)
+{
+    emit_op(c, code, operand);
+}
+
+uint32_t compiler_add_const(compiler_t *c, object_t obj)
+{
+    return add_const(c, obj);
+}
+
+uint32_t compiler_emit_jump(compiler_t *c, op_code code)
+{
+    return emit_jump(c, code);
+}
+
+void compiler_patch_jump(compiler_t *c, uint32_t at)
+{
+    patch_jump(c, at);
+}
+
+void compiler_emit_loop_end(compiler_t *c, uint32_t loop_start)
+{
+    emit_loop_end(c, loop_start);
+}
+
+void compiler_begin_match(compiler_t *c, compiler_match_t *m)
+{
+    begin_match(c, m);
+}
+
+void compiler_match_case(compiler_t *c, compiler_match_t *m, token_t label)
+{
+    match_case(c, m, label);
+}
+
+void compiler_end_arm(compiler_t *c, compiler_match_t *m)
+{
+    end_arm(c, m);
+}
+
+void compiler_match_default(compiler_t *c, compiler_match_t *m)
+{
+    match_default(c, m);
+}
+
+void compiler_end_match(compiler_t *c, compiler_match_t *m)
+{
+    end_match(c, m);
+}
+
+void compiler_begin_func(compiler_t *c, compiler_func_t *func, token_t name)
+{
+    begin_func(c, func, name);
+}
+
+void compiler_add_param(compiler_t *c, token_t name)
+{
+    add_param(c, name);
+}
+
+void compiler_end_func(compiler_t *c)
+{
+    end_func(c);
+}
+
+void compiler_compile_func(compiler_t *c, expr_t *expr)
+{
+    compile_func(c, expr);
+}
+
+void compiler_emit_call(compiler_t *c, token_t name, uint32_t argc)
+{
+    emit_call(c, name, argc);
+}
+
+/* Calls a function that has already been looked up, inlining it if it is small enough */
+void compiler_emit_call_to(compiler_t *c, uint32_t index, uint32_t argc)
+{
+    emit_call_to(c, index, argc);
+}
+
+/* Takes the first count slots of the frame for code that hands out its own slots, such as the ir */
+void compiler_reserve_slots(compiler_t *c, uint32_t count)
+{
+    token_t unnamed = { 0 };
+
+    if (!c->func)
+    {
+        if (count > c->chunk->local_count) c->chunk->local_count = count;
+        return;
+    }
+
+    while (c->func->local_count < count) add_local(c, unnamed);
+}
+
+void compiler_emit_return(compiler_t *c, int has_value)
+{
+    emit_return(c, has_value);
+}
+
+void compiler_begin_var(compiler_t *c, token_t name)
+{
+    begin_var(c, name);
+}
+
+void compiler_end_var(compiler_t *c, token_t name)
+{
+    end_var(c, name);
+}
+
+void compiler_emit_get(compiler_t *c, token_t name)
+{
+    emit_get(c, name);
+}
+
+void compiler_emit_step(compiler_t *c, token_t name, int inc)
+{
+    emit_step(c, name, inc);
+}
+
+void compiler_emit_literal(compiler_t *c, token_t tok)
+{
+    expr_t literal = { .left = NULL, .right = NULL, .tok = tok };
+
+    switch (tok.type)
+    {
+        case TOK_INT: compile_num(c, &literal); break;
+        case TOK_FLOAT: compile_double(c, &literal); break;
+        case TOK_TRUE:
+        case TOK_FALSE: compile_bool(c, &literal); break;
+
+        /* Identifiers are pushed as strings for the variable operations */
+        default: compile_string(c, &literal); break;
+    }
+}
+
 compiler_code_t compiler_compile_program(compiler_t *c, ast_node_t *ast)
 {
     ast_node_t *curr = ast;
@@ -433,6 +1770,10 @@ compiler_code_t compiler_compile_program(compiler_t *c, ast_node_t *ast)
             case AST_STMT:
                 compile_stmt(c, curr->expr);
                 break;
+            case AST_EXPR:
+                curr->expr = fold_expr(curr->expr);
+                compile_expr(c, curr->expr);
+                break;
             default:
                 compile_expr(c, curr->expr);
         }
@@ -441,7 +1782,7 @@ compiler_code_t compiler_compile_program(compiler_t *c, ast_node_t *ast)
         curr = curr->next;
     }
 
-    emit_byte(c->vm, OP_EXIT);
+    emit_byte(c, OP_EXIT);
 
-    return COMPILER_OK;
+    return c->had_error ? COMPILER_PARSE_ERROR : COMPILER_OK;
 }
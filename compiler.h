@@ -8,7 +8,21 @@
 
 #include "object.h"
 #include "ast.h"
+#include "chunk.h"
 #include "vm.h"
+#include "function.h"
+
+#define COMPILER_RECENT_OPS 16
+
+/* Loops with a literal count are unrolled into at most this many bytes of body */
+#define COMPILER_UNROLL_BUDGET 256
+#define COMPILER_UNROLL_FACTOR 4
+
+/* Calls to functions with at most this many bytes of code are replaced with a copy of the code */
+#define COMPILER_INLINE_BUDGET 64
+
+/* Integer cases go in a directly indexed table when it needs at most this many slots per case */
+#define COMPILER_MATCH_DENSITY 2
 
 typedef enum {
     COMPILER_PARSE_ERROR,
@@ -16,13 +30,90 @@ typedef enum {
     COMPILER_OK,
 } compiler_code_t;
 
+/* Forward jumps that all go to the same place once it is known */
+typedef struct {
+    uint32_t *at;
+    uint32_t count;
+    uint32_t capacity;
+} jump_list_t;
+
+typedef struct {
+    object_t value;
+    uint32_t target;        /* Where the arm of the case starts */
+} compiler_case_t;
+
+/* The cases of a match statement while its arms are emitted */
+typedef struct {
+    uint32_t op;            /* Where the match instruction starts */
+    compiler_case_t *cases;
+    uint32_t count;
+    uint32_t capacity;
+    jump_list_t exits;      /* The jumps from the end of each arm to the end of the match */
+    int has_default;
+} compiler_match_t;
+
+/* A function while its body is compiled. Its parameters and variables are slots in its frame */
+typedef struct {
+    uint32_t index;         /* Where it is in the function table */
+    token_t *locals;        /* Name of each slot, parameters first */
+    uint32_t local_count;
+    uint32_t local_capacity;
+    chunk_t *enclosing;     /* The chunk to go back to once the body is done */
+} compiler_func_t;
+
 typedef struct {
-    vm_t *vm; /* Reference to the vm to push objects and instructions to */
+    chunk_t *chunk; /* The chunk to write instructions and constants to */
     uint32_t scope;
+
+    func_table_t *funcs;    /* Where functions are defined and calls are looked up. NULL allows neither */
+    compiler_func_t *func;  /* The function being compiled, or NULL at the top level */
+    uint32_t func_limit;    /* Calls only see the functions before this in the table */
+    int defined_ahead;      /* Definitions were compiled before the code around them, so they only move func_limit on */
+
+    uint32_t recent_ops[COMPILER_RECENT_OPS];  /* Where the last few instructions start */
+    uint32_t recent_count;
+    uint32_t unroll_factor;     /* Copies of the body in a partly unrolled loop. Zero never unrolls */
+    uint32_t unroll_budget;
+    uint32_t inline_budget;     /* Zero never inlines */
+    uint32_t inline_base;       /* Local slots that inlined calls share */
+    uint32_t inline_count;
+    int had_error;
 } compiler_t;
 
-compiler_t *compiler_init(vm_t *vm);
+compiler_t *compiler_init(chunk_t *chunk);
 void compiler_free(compiler_t *c);
 compiler_code_t compiler_compile_program(compiler_t *c, ast_node_t *ast);
 
+/* Used by the single pass compiler in the parser and by the ir to emit code without an ast */
+void compiler_set_line(compiler_t *c, uint32_t line);
+void compiler_emit_byte(compiler_t *c, op_code code);
+void compiler_emit_op(compiler_t *c, op_code code, uint32_t operand);
+uint32_t compiler_add_const(compiler_t *c, object_t obj);
+void compiler_emit_binary(compiler_t *c, op_code code);
+void compiler_emit_literal(compiler_t *c, token_t tok);
+uint32_t compiler_emit_jump(compiler_t *c, op_code code);
+void compiler_patch_jump(compiler_t *c, uint32_t at);
+void compiler_emit_loop_end(compiler_t *c, uint32_t loop_start);
+
+void compiler_begin_match(compiler_t *c, compiler_match_t *m);
+void compiler_match_case(compiler_t *c, compiler_match_t *m, token_t label);
+void compiler_end_arm(compiler_t *c, compiler_match_t *m);
+void compiler_match_default(compiler_t *c, compiler_match_t *m);
+void compiler_end_match(compiler_t *c, compiler_match_t *m);
+
+void compiler_begin_func(compiler_t *c, compiler_func_t *func, token_t name);
+void compiler_add_param(compiler_t *c, token_t name);
+void compiler_end_func(compiler_t *c);
+void compiler_compile_func(compiler_t *c, expr_t *expr);
+void compiler_emit_call(compiler_t *c, token_t name, uint32_t argc);
+void compiler_emit_call_to(compiler_t *c, uint32_t index, uint32_t argc);
+void compiler_reserve_slots(compiler_t *c, uint32_t count);
+void compiler_emit_return(compiler_t *c, int has_value);
+
+/* Variables are slots in the frame inside a function and globals outside of one */
+void compiler_begin_var(compiler_t *c, token_t name);
+void compiler_end_var(compiler_t *c, token_t name);
+void compiler_emit_get(compiler_t *c, token_t name);
+void compiler_emit_step(compiler_t *c, token_t name, int inc);
+
 #endif // __COMPILER_H_
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include "debug.h"
+#include "vm.h"
 
 void debug_print_token_header(void)
 {
@@ -12,3 +13,192 @@ void debug_print_token(token_t tok)
     printf(" %4d | %4d | %20s | %4d | %.*s\n",
         tok.line, tok.col, token_get_type_literal(tok.type), tok.len, tok.len, tok.start);
 }
+
+static const char *op_name(uint8_t code)
+{
+    switch (code)
+    {
+        case OP_CONST: return "CONST";
+        case OP_ADD: return "ADD";
+        case OP_SUB: return "SUB";
+        case OP_MUL: return "MUL";
+        case OP_DIV: return "DIV";
+        case OP_MOD: return "MOD";
+        case OP_POP: return "POP";
+        case OP_VAR_DECL: return "VAR_DECL";
+        case OP_VAR_GET: return "VAR_GET";
+        case OP_GT: return "GT";
+        case OP_GT_EQ: return "GT_EQ";
+        case OP_LT: return "LT";
+        case OP_LT_EQ: return "LT_EQ";
+        case OP_EQ: return "EQ";
+        case OP_NE: return "NE";
+        case OP_JUMP_IF_FALSE: return "JUMP_IF_FALSE";
+        case OP_JUMP: return "JUMP";
+        case OP_DROP: return "DROP";
+        case OP_INC: return "INC";
+        case OP_DEC: return "DEC";
+        case OP_LOOP: return "LOOP";
+        case OP_LOOP_END: return "LOOP_END";
+        case OP_STDIN: return "STDIN";
+        case OP_RAND: return "RAND";
+        case OP_GT_K: return "GT_K";
+        case OP_GT_EQ_K: return "GT_EQ_K";
+        case OP_LT_K: return "LT_K";
+        case OP_LT_EQ_K: return "LT_EQ_K";
+        case OP_EQ_K: return "EQ_K";
+        case OP_NE_K: return "NE_K";
+        case OP_GET_LOCAL: return "GET_LOCAL";
+        case OP_SET_LOCAL: return "SET_LOCAL";
+        case OP_VAR_DECL_K: return "VAR_DECL_K";
+        case OP_ADD_LL: return "ADD_LL";
+        case OP_SUB_LL: return "SUB_LL";
+        case OP_MUL_LL: return "MUL_LL";
+        case OP_DIV_LL: return "DIV_LL";
+        case OP_MOD_LL: return "MOD_LL";
+        case OP_GT_LL: return "GT_LL";
+        case OP_GT_EQ_LL: return "GT_EQ_LL";
+        case OP_LT_LL: return "LT_LL";
+        case OP_LT_EQ_LL: return "LT_EQ_LL";
+        case OP_EQ_LL: return "EQ_LL";
+        case OP_NE_LL: return "NE_LL";
+        case OP_ADD_DD: return "ADD_DD";
+        case OP_SUB_DD: return "SUB_DD";
+        case OP_MUL_DD: return "MUL_DD";
+        case OP_DIV_DD: return "DIV_DD";
+        case OP_GT_DD: return "GT_DD";
+        case OP_GT_EQ_DD: return "GT_EQ_DD";
+        case OP_LT_DD: return "LT_DD";
+        case OP_LT_EQ_DD: return "LT_EQ_DD";
+        case OP_EQ_DD: return "EQ_DD";
+        case OP_NE_DD: return "NE_DD";
+        case OP_JUMP_IF_TRUE: return "JUMP_IF_TRUE";
+        case OP_JGT: return "JGT";
+        case OP_JGT_EQ: return "JGT_EQ";
+        case OP_JLT: return "JLT";
+        case OP_JLT_EQ: return "JLT_EQ";
+        case OP_JEQ: return "JEQ";
+        case OP_JNE: return "JNE";
+        case OP_JGT_K: return "JGT_K";
+        case OP_JGT_EQ_K: return "JGT_EQ_K";
+        case OP_JLT_K: return "JLT_K";
+        case OP_JLT_EQ_K: return "JLT_EQ_K";
+        case OP_JEQ_K: return "JEQ_K";
+        case OP_JNE_K: return "JNE_K";
+        case OP_MATCH_TABLE: return "MATCH_TABLE";
+        case OP_MATCH_SEARCH: return "MATCH_SEARCH";
+        case OP_MATCH_HASH: return "MATCH_HASH";
+        case OP_CALL: return "CALL";
+        case OP_RETURN: return "RETURN";
+        case OP_INC_LOCAL: return "INC_LOCAL";
+        case OP_DEC_LOCAL: return "DEC_LOCAL";
+        case OP_TAIL_CALL: return "TAIL_CALL";
+        case OP_JGT_LL: return "JGT_LL";
+        case OP_JGT_EQ_LL: return "JGT_EQ_LL";
+        case OP_JLT_LL: return "JLT_LL";
+        case OP_JLT_EQ_LL: return "JLT_EQ_LL";
+        case OP_JEQ_LL: return "JEQ_LL";
+        case OP_JNE_LL: return "JNE_LL";
+        case OP_JGT_DD: return "JGT_DD";
+        case OP_JGT_EQ_DD: return "JGT_EQ_DD";
+        case OP_JLT_DD: return "JLT_DD";
+        case OP_JLT_EQ_DD: return "JLT_EQ_DD";
+        case OP_JEQ_DD: return "JEQ_DD";
+        case OP_JNE_DD: return "JNE_DD";
+        case OP_JGT_LL_K: return "JGT_LL_K";
+        case OP_JGT_EQ_LL_K: return "JGT_EQ_LL_K";
+        case OP_JLT_LL_K: return "JLT_LL_K";
+        case OP_JLT_EQ_LL_K: return "JLT_EQ_LL_K";
+        case OP_JEQ_LL_K: return "JEQ_LL_K";
+        case OP_JNE_LL_K: return "JNE_LL_K";
+        case OP_JGT_DD_K: return "JGT_DD_K";
+        case OP_JGT_EQ_DD_K: return "JGT_EQ_DD_K";
+        case OP_JLT_DD_K: return "JLT_DD_K";
+        case OP_JLT_EQ_DD_K: return "JLT_EQ_DD_K";
+        case OP_JEQ_DD_K: return "JEQ_DD_K";
+        case OP_JNE_DD_K: return "JNE_DD_K";
+        case OP_EXIT: return "EXIT";
+        default: return "UNKNOWN";
+    }
+}
+
+static void print_const(object_t obj)
+{
+    switch (obj.type)
+    {
+        case OBJ_VAL_LONG: printf("%ld", obj.as.long_num); break;
+        case OBJ_VAL_DOUBLE: printf("%f", obj.as.double_num); break;
+        default: printf("%s", obj.as.str); break;
+    }
+}
+
+/* Lists where each case of a match instruction goes, other than gaps in a dense table */
+static void print_cases(chunk_t *chunk, uint32_t offset)
+{
+    uint8_t code = chunk->code[offset];
+    uint32_t end = offset + vm_op_length(code);
+    uint32_t fallback = CHUNK_READ_U16(chunk->code + end - CHUNK_JUMP_BYTES);
+    chunk_table_t *table = &chunk->tables[CHUNK_READ_U16(chunk->code + offset + 1)];
+
+    for (uint32_t i = 0; i < table->count; i++)
+    {
+        if (code == OP_MATCH_HASH && !table->strings[i]) continue;
+        if (code == OP_MATCH_TABLE && table->offsets[i] == fallback) continue;
+
+        printf(" %6s | %14s | case ", "", "");
+
+        if (code == OP_MATCH_TABLE) printf("%ld", table->min + (long)i);
+        else if (code == OP_MATCH_SEARCH) printf("%ld", table->keys[i]);
+        else printf("%s", table->strings[i]);
+
+        printf(" -> %u\n", end + table->offsets[i]);
+    }
+}
+
+void debug_print_chunk(chunk_t *chunk)
+{
+    printf(" %6s | %14s | %s\n", "offset", "op code", "operand");
+    printf("-----------------------------------------------------\n");
+
+    for (uint32_t i = 0; i < chunk->count; i += vm_op_length(chunk->code[i]))
+    {
+        uint8_t code = chunk->code[i];
+        printf(" %6u | %14s | ", i, op_name(code));
+
+        if (vm_op_has_const(code))
+        {
+            uint32_t index = CHUNK_READ_U24(chunk->code + i + 1);
+            printf("%u (", index);
+            print_const(chunk->constants[index]);
+            printf(")");
+        }
+
+        if (vm_op_is_jump(code))
+        {
+            uint32_t end = i + vm_op_length(code);
+            uint32_t offset = CHUNK_READ_U16(chunk->code + end - CHUNK_JUMP_BYTES);
+
+            if (vm_op_has_const(code)) printf(" ");
+            if (vm_op_has_table(code)) printf("table %u ", CHUNK_READ_U16(chunk->code + i + 1));
+            printf("-> %u", code == OP_LOOP_END ? end - offset : end + offset);
+        }
+        else if (vm_op_has_local(code))
+        {
+            printf("slot %u", CHUNK_READ_U16(chunk->code + i + 1));
+        }
+        else if (code == OP_CALL || code == OP_TAIL_CALL)
+        {
+            printf("func %u args %u", CHUNK_READ_U16(chunk->code + i + 1), chunk->code[i + 1 + CHUNK_FUNC_BYTES]);
+        }
+
+        printf("\n");
+
+        if (vm_op_has_table(code)) print_cases(chunk, i);
+    }
+}
+
+void debug_print_function(function_t *fn, uint32_t index)
+{
+    printf("\nfunc %u %s\n", index, fn->name);
+    debug_print_chunk(fn->chunk);
+}
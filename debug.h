@@ -6,8 +6,12 @@
 #define COMPILER_DEBUG_OUTPUT
 
 #include "lexer.h"
+#include "chunk.h"
+#include "function.h"
 
 void debug_print_token_header(void);
 void debug_print_token(token_t tok);
+void debug_print_chunk(chunk_t *chunk);
+void debug_print_function(function_t *fn, uint32_t index);
 
 #endif // __PHANTOM_DEBUG_H_
@@ -0,0 +1,338 @@
+#include <string.h>
+
+#include "document.h"
+#include "lexer.h"
+#include "parser.h"
+
+doc_t *doc_init(const char *src, size_t len)
+{
+    doc_t *d = malloc(sizeof(doc_t));
+    d->root = NULL;
+    d->count = 0;
+    d->len = 0;
+    d->err = stderr;
+    d->seed = 2463534242u;
+
+    if (len) doc_edit(d, 0, 0, src, len);
+
+    return d;
+}
+
+static void free_nodes(doc_node_t *node)
+{
+    if (!node) return;
+
+    free_nodes(node->left);
+    free_nodes(node->right);
+
+    ast_node_free(node->stmt.ast);
+    free(node->stmt.src);
+    free(node);
+}
+
+void doc_free(doc_t *d)
+{
+    free_nodes(d->root);
+    free(d);
+}
+
+static size_t node_count(doc_node_t *node) { return node ? node->count : 0; }
+static size_t node_len(doc_node_t *node) { return node ? node->len : 0; }
+static size_t node_newlines(doc_node_t *node) { return node ? node->newlines : 0; }
+
+/* Works out the totals of a node from its children */
+static doc_node_t *update(doc_node_t *node)
+{
+    node->count = node_count(node->left) + 1 + node_count(node->right);
+    node->len = node_len(node->left) + node->stmt.len + node_len(node->right);
+    node->newlines = node_newlines(node->left) + node->stmt.newlines + node_newlines(node->right);
+
+    return node;
+}
+
+/* Joins two trees, with every statement of a before every statement of b */
+static doc_node_t *merge(doc_node_t *a, doc_node_t *b)
+{
+    if (!a) return b;
+    if (!b) return a;
+
+    if (a->priority > b->priority)
+    {
+        a->right = merge(a->right, b);
+        return update(a);
+    }
+
+    b->left = merge(a, b->left);
+    return update(b);
+}
+
+/* Splits a tree into its first count statements and the rest */
+static void split(doc_node_t *node, size_t count, doc_node_t **left, doc_node_t **right)
+{
+    if (!node)
+    {
+        *left = *right = NULL;
+        return;
+    }
+
+    if (count <= node_count(node->left))
+    {
+        split(node->left, count, left, &node->left);
+        *right = update(node);
+    }
+    else
+    {
+        split(node->right, count - node_count(node->left) - 1, &node->right, right);
+        *left = update(node);
+    }
+}
+
+/* Finds the statement holding pos and the offset it starts at. Past the end is the last statement */
+static size_t stmt_at(doc_node_t *node, size_t pos, size_t *start)
+{
+    size_t index = 0;
+    size_t at = 0;
+
+    for (;;)
+    {
+        if (node->left && pos < at + node->left->len)
+        {
+            node = node->left;
+            continue;
+        }
+
+        at += node_len(node->left);
+        index += node_count(node->left);
+
+        if (pos < at + node->stmt.len || !node->right)
+        {
+            *start = at;
+            return index;
+        }
+
+        at += node->stmt.len;
+        index++;
+        node = node->right;
+    }
+}
+
+doc_stmt_t *doc_stmt(doc_t *d, size_t index, unsigned *line)
+{
+    doc_node_t *node = d->root;
+    size_t newlines = 0;
+
+    if (index >= d->count) return NULL;
+
+    for (;;)
+    {
+        size_t left = node_count(node->left);
+
+        if (index < left)
+        {
+            node = node->left;
+            continue;
+        }
+
+        newlines += node_newlines(node->left);
+
+        if (index == left)
+        {
+            if (line) *line = 1 + (unsigned)newlines;
+            return &node->stmt;
+        }
+
+        newlines += node->stmt.newlines;
+        index -= left + 1;
+        node = node->right;
+    }
+}
+
+static void parse_stmt(doc_t *d, doc_stmt_t *st, unsigned line)
+{
+    lexer_t *l = lexer_init(st->src);
+    l->line = line;
+
+    parser_t *p = parser_init(l);
+    p->err = d->err;
+
+    st->ast = parser_parse_program(p);
+    st->had_error = p->had_error;
+    st->parse_line = line;
+
+    parser_free(p);
+}
+
+/* Copies the source of the statements in the tree to out in order. Returns the bytes copied */
+static size_t copy_src(doc_node_t *node, char *out)
+{
+    if (!node) return 0;
+
+    size_t at = copy_src(node->left, out);
+    memcpy(out + at, node->stmt.src, node->stmt.len);
+    at += node->stmt.len;
+
+    return at + copy_src(node->right, out + at);
+}
+
+/* Copies the damaged statements into buf with the edit applied */
+static size_t apply_edit(doc_node_t *damaged, size_t rel, size_t deleted, const char *text, size_t inserted,
+                         char **buf)
+{
+    size_t old_len = node_len(damaged);
+    size_t len = old_len - deleted + inserted;
+    char *old = malloc(old_len + 1);
+    *buf = realloc(*buf, len + 1);
+
+    copy_src(damaged, old);
+
+    memcpy(*buf, old, rel);
+    memcpy(*buf + rel, text, inserted);
+    memcpy(*buf + rel + inserted, old + rel + deleted, old_len - rel - deleted);
+    (*buf)[len] = '\0';
+
+    free(old);
+
+    return len;
+}
+
+static doc_node_t *new_node(doc_t *d)
+{
+    doc_node_t *node = calloc(1, sizeof(doc_node_t));
+
+    /* xorshift32, so the tree is shaped the same from one run to the next */
+    d->seed ^= d->seed << 13;
+    d->seed ^= d->seed >> 17;
+    d->seed ^= d->seed << 5;
+    node->priority = d->seed;
+
+    return node;
+}
+
+/*
+ * Replaces deleted bytes at offset with the inserted text. Only the statements
+ * the edit touches are reparsed, along with any statements after them that
+ * the edit joins on to, such as when an opening brace is typed. Every other
+ * statement keeps its ast, and as lines are worked out from the tree rather
+ * than kept in each statement, the ones after the edit aren't visited. Apart
+ * from the reparse an edit costs O(log n) in the number of statements on
+ * average. Returns the number of statements that were parsed.
+ */
+size_t doc_edit(doc_t *d, size_t offset, size_t deleted, const char *text, size_t inserted)
+{
+    if (offset > d->len) offset = d->len;
+    if (deleted > d->len - offset) deleted = d->len - offset;
+
+    doc_node_t *before = NULL;
+    doc_node_t *damaged = NULL;
+    doc_node_t *after = NULL;
+    size_t start = 0;
+
+    if (d->root)
+    {
+        size_t last_start = 0;
+
+        /* Text added to the end of a statement can extend it so start one byte early */
+        size_t first = stmt_at(d->root, offset ? offset - 1 : 0, &start);
+        size_t last = stmt_at(d->root, offset + deleted < d->len ? offset + deleted : d->len - 1, &last_start);
+
+        /* A closing brace can be joined by an else branch from the edit */
+        doc_stmt_t *prev = first > 0 ? doc_stmt(d, first - 1, NULL) : NULL;
+
+        if (prev && prev->src[prev->len - 1] == '}')
+        {
+            first--;
+            start -= prev->len;
+        }
+
+        doc_node_t *rest = NULL;
+        split(d->root, first, &before, &rest);
+        split(rest, last - first + 1, &damaged, &after);
+    }
+
+    char *buf = NULL;
+    size_t len = 0;
+    size_t *ends = NULL;
+    size_t new_count = 0;
+
+    for (;;)
+    {
+        len = apply_edit(damaged, offset - start, deleted, text, inserted, &buf);
+
+        int at_end = after == NULL;
+
+        stmt_scanner_t s;
+        lexer_scanner_reset(&s, 0);
+
+        size_t cap = 8;
+        size_t end = 0;
+        ends = realloc(ends, sizeof(size_t) * cap);
+        new_count = 0;
+
+        while ( (end = lexer_scan_stmt(&s, buf, len, at_end)) )
+        {
+            if (new_count == cap)
+            {
+                cap *= 2;
+                ends = realloc(ends, sizeof(size_t) * cap);
+            }
+
+            ends[new_count++] = end;
+        }
+
+        size_t tail = new_count ? ends[new_count - 1] : 0;
+
+        if (tail < len)
+        {
+            /* The edit left a statement open so it runs into the next one */
+            if (!at_end)
+            {
+                doc_node_t *next = NULL;
+                split(after, 1, &next, &after);
+                damaged = merge(damaged, next);
+                continue;
+            }
+
+            /* Unfinished text at the end of the document is kept for the parser to report */
+            if (new_count == cap) ends = realloc(ends, sizeof(size_t) * (cap + 1));
+            ends[new_count++] = len;
+        }
+
+        break;
+    }
+
+    free_nodes(damaged);
+
+    unsigned line = 1 + (unsigned)node_newlines(before);
+    doc_node_t *added = NULL;
+    size_t prev = 0;
+
+    for (size_t i = 0; i < new_count; i++)
+    {
+        doc_node_t *node = new_node(d);
+        doc_stmt_t *st = &node->stmt;
+
+        st->len = ends[i] - prev;
+        st->src = malloc(st->len + 1);
+        memcpy(st->src, buf + prev, st->len);
+        st->src[st->len] = '\0';
+
+        st->newlines = 0;
+        for (size_t j = 0; j < st->len; j++)
+            if (st->src[j] == '\n') st->newlines++;
+
+        parse_stmt(d, st, line);
+        line += st->newlines;
+
+        added = merge(added, update(node));
+        prev = ends[i];
+    }
+
+    d->root = merge(merge(before, added), after);
+    d->count = node_count(d->root);
+    d->len = d->len - deleted + inserted;
+
+    free(ends);
+    free(buf);
+
+    return new_count;
+}
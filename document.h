@@ -0,0 +1,67 @@
+#ifndef __PHANTOM_DOCUMENT_H_
+#define __PHANTOM_DOCUMENT_H_
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "ast.h"
+
+/*
+ * A top level statement along with any whitespace and comments before it. Each
+ * one keeps its own copy of its source so the tokens in its ast stay valid when
+ * the rest of the document is edited.
+ */
+typedef struct {
+    char *src;
+    size_t len;
+
+    unsigned parse_line;    /* Line it started on when parsed. Token lines are relative to this */
+    unsigned newlines;
+
+    ast_node_t *ast;
+    int had_error;
+} doc_stmt_t;
+
+/*
+ * The statements are kept in a treap ordered by where they are in the text.
+ * Each node has the totals of its subtree, so a statement can be found by its
+ * offset or index, and its line worked out, without going through the ones
+ * before it.
+ */
+typedef struct doc_node {
+    doc_stmt_t stmt;
+
+    struct doc_node *left;
+    struct doc_node *right;
+    uint32_t priority;      /* Higher than any under it, which keeps the tree balanced on average */
+
+    size_t count;           /* Statements in the subtree */
+    size_t len;             /* Bytes of source in the subtree */
+    size_t newlines;
+} doc_node_t;
+
+/*
+ * Source that is edited over time, such as a file open in an editor or a REPL
+ * session. Edits only reparse the statements they touch and reuse the rest.
+ */
+typedef struct {
+    doc_node_t *root;
+    size_t count;
+
+    size_t len;             /* Length of the whole text */
+    FILE *err;              /* Where parse errors are reported */
+    uint32_t seed;          /* For the priorities of new nodes */
+} doc_t;
+
+doc_t *doc_init(const char *src, size_t len);
+void doc_free(doc_t *d);
+size_t doc_edit(doc_t *d, size_t offset, size_t deleted, const char *text, size_t inserted);
+
+/*
+ * The statement at index, or NULL past the last one. line is set to the line
+ * the statement starts on now, which its tokens are moved by from parse_line.
+ */
+doc_stmt_t *doc_stmt(doc_t *d, size_t index, unsigned *line);
+
+#endif // __PHANTOM_DOCUMENT_H_
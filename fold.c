@@ -0,0 +1,311 @@
+#include <limits.h>
+
+#include "fold.h"
+
+#define TYPE_UNKNOWN -1
+
+/* Same as the vm so folded comparisons print and test the same way */
+static object_t obj_true = {
+    .type = OBJ_VAL_BOOL,
+    .as.str = "true"
+};
+
+static object_t obj_false = {
+    .type = OBJ_VAL_BOOL,
+    .as.str = "false"
+};
+
+/* Mirrors COMPARE_OBJS which compares longs and doubles with each other */
+#define COMPARE(a, b, op)                                                      \
+    ((a).type == OBJ_VAL_LONG                                                  \
+        ? ((b).type == OBJ_VAL_LONG ? (a).as.long_num op (b).as.long_num       \
+                                    : (a).as.long_num op (b).as.double_num)    \
+        : ((b).type == OBJ_VAL_LONG ? (a).as.double_num op (b).as.long_num     \
+                                    : (a).as.double_num op (b).as.double_num))
+
+static int is_num(object_t obj)
+{
+    return obj.type == OBJ_VAL_LONG || obj.type == OBJ_VAL_DOUBLE;
+}
+
+/* Division that would trap is left for the vm to do when the code runs */
+static int can_divide(long a, long b)
+{
+    return b != 0 && !(a == LONG_MIN && b == -1);
+}
+
+/*
+ * Works out what the vm would push for a binary operator on two constants. Only
+ * operands that the vm handles without printing an error are folded. Long
+ * arithmetic wraps on overflow the same way it does when the vm runs it.
+ * Returns 0 if the operator has to be left for the vm.
+ */
+int fold_binary(op_code code, object_t a, object_t b, object_t *out)
+{
+    switch (code)
+    {
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+        {
+            if (a.type == OBJ_VAL_DOUBLE && b.type == OBJ_VAL_DOUBLE)
+            {
+                out->type = OBJ_VAL_DOUBLE;
+
+                switch (code)
+                {
+                    case OP_ADD: out->as.double_num = a.as.double_num + b.as.double_num; break;
+                    case OP_SUB: out->as.double_num = a.as.double_num - b.as.double_num; break;
+                    case OP_MUL: out->as.double_num = a.as.double_num * b.as.double_num; break;
+                    default:     out->as.double_num = a.as.double_num / b.as.double_num; break;
+                }
+
+                return 1;
+            }
+
+            if (a.type == OBJ_VAL_LONG && b.type == OBJ_VAL_LONG)
+            {
+                unsigned long x = (unsigned long)a.as.long_num;
+                unsigned long y = (unsigned long)b.as.long_num;
+
+                out->type = OBJ_VAL_LONG;
+
+                switch (code)
+                {
+                    case OP_ADD: out->as.long_num = (long)(x + y); break;
+                    case OP_SUB: out->as.long_num = (long)(x - y); break;
+                    case OP_MUL: out->as.long_num = (long)(x * y); break;
+                    default:
+                    {
+                        if (!can_divide(a.as.long_num, b.as.long_num)) return 0;
+                        out->as.long_num = a.as.long_num / b.as.long_num;
+                        break;
+                    }
+                }
+
+                return 1;
+            }
+
+            return 0;
+        }
+        case OP_MOD:
+        {
+            if (a.type != OBJ_VAL_LONG || b.type != OBJ_VAL_LONG) return 0;
+            if (!can_divide(a.as.long_num, b.as.long_num)) return 0;
+
+            out->type = OBJ_VAL_LONG;
+            out->as.long_num = a.as.long_num % b.as.long_num;
+
+            return 1;
+        }
+        case OP_GT:
+        case OP_GT_EQ:
+        case OP_LT:
+        case OP_LT_EQ:
+        case OP_EQ:
+        case OP_NE:
+        {
+            if (!is_num(a) || !is_num(b)) return 0;
+
+            int result = 0;
+
+            switch (code)
+            {
+                case OP_GT:    result = COMPARE(a, b, >);  break;
+                case OP_GT_EQ: result = COMPARE(a, b, >=); break;
+                case OP_LT:    result = COMPARE(a, b, <);  break;
+                case OP_LT_EQ: result = COMPARE(a, b, <=); break;
+                case OP_EQ:    result = COMPARE(a, b, ==); break;
+                default:       result = COMPARE(a, b, !=); break;
+            }
+
+            *out = result ? obj_true : obj_false;
+
+            return 1;
+        }
+        default: return 0;
+    }
+}
+
+static int binary_code(token_type type)
+{
+    switch (type)
+    {
+        case TOK_PLUS: return OP_ADD;
+        case TOK_MINUS: return OP_SUB;
+        case TOK_MULTIPLY: return OP_MUL;
+        case TOK_DIVIDE: return OP_DIV;
+        case TOK_MODULO: return OP_MOD;
+
+        case TOK_LT: return OP_LT;
+        case TOK_LT_EQ: return OP_LT_EQ;
+        case TOK_GT: return OP_GT;
+        case TOK_GT_EQ: return OP_GT_EQ;
+        case TOK_EQ: return OP_EQ;
+        case TOK_NE: return OP_NE;
+        default: return -1;
+    }
+}
+
+/* Type the expression is known to produce without running it */
+static int expr_type(expr_t *expr)
+{
+    if (expr->has_value) return expr->value.type;
+    if (expr->tok.type == TOK_RAND) return OBJ_VAL_LONG;
+
+    int code = binary_code(expr->tok.type);
+    if (code < 0 || !expr->left || !expr->right) return TYPE_UNKNOWN;
+    if (code >= OP_GT) return OBJ_VAL_BOOL;
+
+    int left = expr_type(expr->left);
+    int right = expr_type(expr->right);
+
+    /* Anything else is an error the vm reports when it runs */
+    if (left != right || (left != OBJ_VAL_LONG && left != OBJ_VAL_DOUBLE))
+        return TYPE_UNKNOWN;
+
+    if (code == OP_MOD && left != OBJ_VAL_LONG) return TYPE_UNKNOWN;
+
+    return left;
+}
+
+static int is_const(expr_t *expr, int type, long long_num, double double_num)
+{
+    if (!expr->has_value || expr->value.type != type) return 0;
+
+    if (type == OBJ_VAL_LONG) return expr->value.as.long_num == long_num;
+
+    return expr->value.as.double_num == double_num;
+}
+
+/*
+ * Finds an operand the operator can be replaced with, such as x for x * 1. The
+ * other operand has to be known to have the same type as the constant, as the
+ * vm reports an error for mixed types instead of doing the operation. x + 0.0
+ * is left alone as it turns -0.0 into 0.0.
+ */
+static expr_t *identity(int code, expr_t *left, expr_t *right)
+{
+    int type = left->has_value ? expr_type(right) : expr_type(left);
+    if (type != OBJ_VAL_LONG && type != OBJ_VAL_DOUBLE) return NULL;
+
+    switch (code)
+    {
+        case OP_ADD:
+        {
+            if (is_const(right, OBJ_VAL_LONG, 0, 0) && expr_type(left) == OBJ_VAL_LONG) return left;
+            if (is_const(left, OBJ_VAL_LONG, 0, 0) && expr_type(right) == OBJ_VAL_LONG) return right;
+            break;
+        }
+        case OP_SUB:
+        {
+            if (is_const(right, type, 0, 0.0) && expr_type(left) == type) return left;
+            break;
+        }
+        case OP_MUL:
+        {
+            if (is_const(right, type, 1, 1.0) && expr_type(left) == type) return left;
+            if (is_const(left, type, 1, 1.0) && expr_type(right) == type) return right;
+            break;
+        }
+        case OP_DIV:
+        {
+            if (is_const(right, type, 1, 1.0) && expr_type(left) == type) return left;
+            break;
+        }
+        default: break;
+    }
+
+    return NULL;
+}
+
+static void set_value(expr_t *expr, object_t value)
+{
+    expr->value = value;
+    expr->has_value = 1;
+
+    switch (value.type)
+    {
+        case OBJ_VAL_LONG: expr->tok.type = TOK_INT; break;
+        case OBJ_VAL_DOUBLE: expr->tok.type = TOK_FLOAT; break;
+        default:
+            expr->tok.type = value.as.str == obj_true.as.str ? TOK_TRUE : TOK_FALSE;
+            break;
+    }
+}
+
+/*
+ * Evaluates the constant parts of an expression tree at compile time. Returns
+ * the folded tree, which may be a different node to the one passed in when an
+ * operator was removed. The folded tree takes the place of expr in its block.
+ */
+expr_t *fold_expr(expr_t *expr)
+{
+    if (!expr) return NULL;
+
+    switch (expr->tok.type)
+    {
+        case TOK_INT:
+        {
+            if (expr->has_value) return expr;
+
+            object_t num = { .type = OBJ_VAL_LONG, .as.long_num = strtol(expr->tok.start, NULL, 10) };
+            set_value(expr, num);
+            return expr;
+        }
+        case TOK_FLOAT:
+        {
+            if (expr->has_value) return expr;
+
+            object_t num = { .type = OBJ_VAL_DOUBLE, .as.double_num = strtod(expr->tok.start, NULL) };
+            set_value(expr, num);
+            return expr;
+        }
+        default: break;
+    }
+
+    /* && and || are left for the compiler to turn into jumps but their operands can still be folded */
+    if (expr->tok.type == TOK_AND || expr->tok.type == TOK_OR)
+    {
+        expr->left = fold_expr(expr->left);
+        expr->right = fold_expr(expr->right);
+        return expr;
+    }
+
+    int code = binary_code(expr->tok.type);
+    if (code < 0) return expr;
+
+    expr->left = fold_expr(expr->left);
+    expr->right = fold_expr(expr->right);
+
+    if (!expr->left || !expr->right) return expr;
+
+    object_t result;
+
+    if (expr->left->has_value && expr->right->has_value &&
+        fold_binary(code, expr->left->value, expr->right->value, &result))
+    {
+        expr_free(expr->left);
+        expr_free(expr->right);
+        expr->left = NULL;
+        expr->right = NULL;
+
+        set_value(expr, result);
+        return expr;
+    }
+
+    expr_t *operand = identity(code, expr->left, expr->right);
+    if (!operand) return expr;
+
+    /* Free the operator and the constant but keep the operand */
+    if (operand == expr->left) expr->left = NULL;
+    else expr->right = NULL;
+
+    operand->next = expr->next;
+    expr->next = NULL;
+
+    expr_free(expr);
+
+    return operand;
+}
@@ -0,0 +1,14 @@
+#ifndef __PHANTOM_FOLD_H_
+#define __PHANTOM_FOLD_H_
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "object.h"
+#include "ast.h"
+#include "vm.h"
+
+int fold_binary(op_code code, object_t a, object_t b, object_t *out);
+expr_t *fold_expr(expr_t *expr);
+
+#endif // __PHANTOM_FOLD_H_
@@ -0,0 +1,76 @@
+#include <string.h>
+
+#include "function.h"
+
+func_table_t *func_table_init()
+{
+    func_table_t *table = malloc(sizeof(func_table_t));
+    table->funcs = NULL;
+    table->count = 0;
+    table->capacity = 0;
+
+    return table;
+}
+
+void func_table_free(func_table_t *table)
+{
+    func_table_truncate(table, 0);
+
+    free(table->funcs);
+    free(table);
+}
+
+/* Adds a function with no parameters and an empty chunk for its body */
+uint32_t func_table_add(func_table_t *table, const char *name, uint32_t len)
+{
+    if (table->count == table->capacity)
+    {
+        table->capacity = table->capacity ? table->capacity * 2 : 8;
+        table->funcs = realloc(table->funcs, sizeof(function_t) * table->capacity);
+    }
+
+    function_t *fn = &table->funcs[table->count];
+    fn->name = malloc(len + 1);
+    memcpy(fn->name, name, len);
+    fn->name[len] = '\0';
+
+    fn->arity = 0;
+    fn->chunk = chunk_init();
+    fn->max_depth = 0;
+    fn->verified = 0;
+    tier_init(&fn->tier);
+
+    return table->count++;
+}
+
+/*
+ * Index of the function with the name among the first count, or -1. A later
+ * definition hides an earlier one
+ */
+int func_table_find(func_table_t *table, const char *name, uint32_t len, uint32_t count)
+{
+    if (count > table->count) count = table->count;
+
+    for (uint32_t i = count; i > 0; i--)
+    {
+        function_t *fn = &table->funcs[i - 1];
+
+        if (strncmp(fn->name, name, len) == 0 && fn->name[len] == '\0')
+            return (int)(i - 1);
+    }
+
+    return -1;
+}
+
+/* Throws away the functions from count on, such as those from code that didn't compile */
+void func_table_truncate(func_table_t *table, uint32_t count)
+{
+    while (table->count > count)
+    {
+        function_t *fn = &table->funcs[--table->count];
+
+        free(fn->name);
+        chunk_free(fn->chunk);
+        tier_free(&fn->tier);
+    }
+}
@@ -0,0 +1,38 @@
+#ifndef __PHANTOM_FUNCTION_H_
+#define __PHANTOM_FUNCTION_H_
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "chunk.h"
+#include "tier.h"
+
+/*
+ * A function compiled into its own chunk. Its arguments are the first local
+ * slots of the chunk and the rest hold the variables its body declares.
+ */
+typedef struct {
+    char *name;
+    uint32_t arity;
+    chunk_t *chunk;
+
+    uint32_t max_depth;     /* Set once the chunk has been verified */
+    int verified;
+    tier_t tier;            /* How hot it is, and its machine code once it is hot */
+} function_t;
+
+/* Every function the vm knows about. Calls refer to them by index */
+typedef struct {
+    function_t *funcs;
+    uint32_t count;
+    uint32_t capacity;
+} func_table_t;
+
+func_table_t *func_table_init();
+void func_table_free(func_table_t *table);
+
+uint32_t func_table_add(func_table_t *table, const char *name, uint32_t len);
+int func_table_find(func_table_t *table, const char *name, uint32_t len, uint32_t count);
+void func_table_truncate(func_table_t *table, uint32_t count);
+
+#endif // __PHANTOM_FUNCTION_H_
@@ -17,7 +17,9 @@ static uint32_t hash(const char *key, int len)
 struct hash_table *ht_init()
 {
     struct hash_table *ht = malloc(sizeof(struct hash_table));
-    ht->items = calloc(TABLE_SIZE, sizeof(struct ht_item*));
+
+    /* The buckets are allocated with the first item, so a table that is never used costs next to nothing */
+    ht->items = NULL;
     ht->count = 0;
 
     return ht;
@@ -34,7 +36,7 @@ static void free_chain(struct ht_item *item)
 
 void ht_free(struct hash_table *ht)
 {
-    for (int i = 0; i < TABLE_SIZE; i++)
+    for (int i = 0; ht->items && i < TABLE_SIZE; i++)
     {
         if (!ht->items[i]) continue;
 
@@ -55,6 +57,8 @@ void ht_free(struct hash_table *ht)
 
 int ht_contains_key(struct hash_table *ht, char *key)
 {
+    if (!ht->items) return 0;
+
     unsigned index = hash(key, strlen(key));
 
     /* Quick and dirty fix. If there is no entry at the table then return 0 */
@@ -85,6 +89,8 @@ static struct ht_item *new_item(struct hash_table *ht, char *key, object_t *valu
 
 int ht_insert(struct hash_table *ht, char *key, object_t *value)
 {
+    if (!ht->items) ht->items = calloc(TABLE_SIZE, sizeof(struct ht_item*));
+
     unsigned index = hash(key, strlen(key));
 
     /* If the index is empty then add a new item at that index */
@@ -106,24 +112,39 @@ int ht_insert(struct hash_table *ht, char *key, object_t *value)
     return 0;
 }
 
-int ht_update_key(struct hash_table *ht, char *key, object_t *value)
+static struct ht_item *find_item(struct hash_table *ht, char *key)
 {
+    if (!ht->items) return NULL;
+
     unsigned index = hash(key, strlen(key));
 
+    struct ht_item *curr = ht->items[index];
+    while (curr)
+    {
+        if (strcmp(curr->key, key) == 0) return curr;
+
+        curr = curr->next;
+    }
+
+    return NULL;
+}
+
+int ht_update_key(struct hash_table *ht, char *key, object_t *value)
+{
+    struct ht_item *item = find_item(ht, key);
+
     /* Ideally this should never happen but just in case */
-    /* return 0 if the index is NULL */
-    if (!ht->items[index]) return 0;
+    /* return 0 if the key is not in the table */
+    if (!item) return 0;
 
-    ht->items[index]->value = value;
+    item->value = value;
 
     return 1;
 }
 
 object_t *ht_get_value(struct hash_table *ht, char *key)
 {
-    if (!ht_contains_key(ht, key)) return NULL;
-
-    unsigned index = hash(key, strlen(key));
+    struct ht_item *item = find_item(ht, key);
 
-    return ht->items[index]->value;
+    return item ? item->value : NULL;
 }
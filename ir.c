@@ -0,0 +1,1519 @@
+#include <string.h>
+
+#include "ir.h"
+#include "fold.h"
+#include "iropt.h"
+#include "irlower.h"
+
+#define IR_MIN_CAPACITY 16
+
+/* Gives up on scripts that would build more instructions than this */
+#define IR_MAX_INSNS    (1u << 22)
+
+/* What is assumed about a variable a loop changes. Weakened when the body disagrees */
+#define VAR_TYPE_UNKNOWN 1
+#define VAR_ALIAS        2
+#define VAR_UNTRACKED    4
+
+/*
+ * The value a variable holds at the point being built. A value that may be a
+ * string owned by a global is only used until the next declaration, as the vm
+ * frees the old string when a global is declared again.
+ */
+typedef struct {
+    uint32_t value;
+    uint32_t epoch;
+} binding_t;
+
+typedef struct {
+    uint32_t name;
+    binding_t old;
+} undo_t;
+
+/* A variable a branch changed and its value at the end of the branch */
+typedef struct {
+    uint32_t name;
+    uint32_t value;
+} change_t;
+
+typedef struct {
+    ir_t *ir;
+    uint32_t block;         /* Block instructions are added to */
+    uint32_t loop;          /* Innermost loop being built */
+    uint32_t line;          /* Line of the statement being built */
+
+    binding_t *vars;        /* Indexed by name */
+    uint32_t *marks;
+    uint32_t *slots;
+    uint8_t *locals;        /* Names a function has declared, which live in its frame from then on */
+    uint32_t var_capacity;
+    uint32_t stamp;
+
+    undo_t *undo;           /* Bindings to put back when leaving a branch or loop body */
+    uint32_t undo_count;
+    uint32_t undo_capacity;
+
+    uint32_t epoch;         /* Bumped by every declaration */
+
+    compiler_t *c;          /* Calls are looked up in its function table */
+    uint32_t func_limit;
+    expr_t **defined;       /* Functions the code defines, which go in the table after the ones there */
+    uint32_t defined_count;
+    uint32_t defined_capacity;
+
+    int failed;
+    uint32_t fail_line;
+} builder_t;
+
+static void build_block(builder_t *b, expr_t *first);
+
+static void *grow(void *ptr, uint32_t *capacity, uint32_t needed, size_t size)
+{
+    if (needed <= *capacity) return ptr;
+
+    uint32_t cap = *capacity < IR_MIN_CAPACITY ? IR_MIN_CAPACITY : *capacity;
+    while (cap < needed) cap *= 2;
+
+    *capacity = cap;
+
+    return realloc(ptr, cap * size);
+}
+
+static uint32_t fail(builder_t *b)
+{
+    if (!b->failed) b->fail_line = b->line;
+
+    b->failed = 1;
+    return IR_NONE;
+}
+
+static uint32_t hash_name(const char *str, uint32_t len)
+{
+    uint32_t hash = 2166136261u;
+
+    for (uint32_t i = 0; i < len; i++)
+    {
+        hash ^= (uint8_t)str[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static void grow_names(ir_t *ir)
+{
+    uint32_t size = ir->name_table_size ? ir->name_table_size * 2 : 64;
+    uint32_t *table = malloc(sizeof(uint32_t) * size);
+
+    for (uint32_t i = 0; i < size; i++) table[i] = IR_NONE;
+
+    for (uint32_t n = 0; n < ir->name_count; n++)
+    {
+        uint32_t at = hash_name(ir->names[n].str, ir->names[n].len) & (size - 1);
+        while (table[at] != IR_NONE) at = (at + 1) & (size - 1);
+        table[at] = n;
+    }
+
+    free(ir->name_table);
+    ir->name_table = table;
+    ir->name_table_size = size;
+}
+
+/* Variables are numbered by name so their values can be kept in arrays */
+static uint32_t intern(builder_t *b, token_t tok)
+{
+    ir_t *ir = b->ir;
+
+    if ((ir->name_count + 1) * 2 > ir->name_table_size) grow_names(ir);
+
+    uint32_t mask = ir->name_table_size - 1;
+    uint32_t at = hash_name(tok.start, tok.len) & mask;
+
+    for (; ir->name_table[at] != IR_NONE; at = (at + 1) & mask)
+    {
+        ir_name_t *name = &ir->names[ir->name_table[at]];
+        if (name->len == (uint32_t)tok.len && memcmp(name->str, tok.start, tok.len) == 0)
+            return ir->name_table[at];
+    }
+
+    ir->names = grow(ir->names, &ir->name_capacity, ir->name_count + 1, sizeof(ir_name_t));
+
+    ir_name_t *name = &ir->names[ir->name_count];
+    name->len = tok.len;
+    name->str = malloc(tok.len + 1);
+    memcpy(name->str, tok.start, tok.len);
+    name->str[tok.len] = '\0';
+
+    ir->name_table[at] = ir->name_count;
+
+    if (ir->name_count >= b->var_capacity)
+    {
+        uint32_t old = b->var_capacity;
+        uint32_t cap = old;
+
+        b->vars = grow(b->vars, &cap, ir->name_count + 1, sizeof(binding_t));
+        b->marks = realloc(b->marks, sizeof(uint32_t) * cap);
+        b->slots = realloc(b->slots, sizeof(uint32_t) * cap);
+        b->locals = realloc(b->locals, cap);
+        b->var_capacity = cap;
+
+        for (uint32_t i = old; i < cap; i++)
+        {
+            b->vars[i].value = IR_NONE;
+            b->vars[i].epoch = 0;
+            b->marks[i] = 0;
+            b->locals[i] = 0;
+        }
+    }
+
+    return ir->name_count++;
+}
+
+static uint32_t new_block(builder_t *b, int reachable)
+{
+    ir_t *ir = b->ir;
+    ir->blocks = grow(ir->blocks, &ir->block_capacity, ir->block_count + 1, sizeof(ir_block_t));
+
+    ir_block_t *block = &ir->blocks[ir->block_count];
+    block->insns = NULL;
+    block->count = 0;
+    block->capacity = 0;
+    block->term = IR_END;
+    block->arg = IR_NONE;
+    block->succ[0] = IR_NONE;
+    block->succ[1] = IR_NONE;
+    block->pred_count = 0;
+    block->idom = IR_NONE;
+    block->loop = b->loop;
+    block->reachable = reachable;
+
+    return ir->block_count++;
+}
+
+static int is_reachable(builder_t *b, uint32_t block)
+{
+    return b->ir->blocks[block].reachable;
+}
+
+/* Ends from with a jump to to. Blocks that can't be reached don't count as predecessors */
+static void jump_to(builder_t *b, uint32_t from, uint32_t to)
+{
+    ir_block_t *block = &b->ir->blocks[from];
+    block->term = IR_JUMP;
+    block->succ[0] = to;
+
+    if (block->reachable)
+    {
+        ir_block_t *target = &b->ir->blocks[to];
+        target->preds[target->pred_count++] = from;
+    }
+}
+
+static uint32_t add_insn(builder_t *b, ir_op_t op, int type)
+{
+    ir_t *ir = b->ir;
+
+    if (ir->insn_count >= IR_MAX_INSNS) return fail(b);
+
+    ir->insns = grow(ir->insns, &ir->insn_capacity, ir->insn_count + 1, sizeof(ir_insn_t));
+
+    ir_insn_t *insn = &ir->insns[ir->insn_count];
+    insn->op = op;
+    insn->type = type;
+    insn->block = b->block;
+    insn->args[0] = IR_NONE;
+    insn->args[1] = IR_NONE;
+    insn->name = IR_NONE;
+    insn->value.type = OBJ_VAL_LONG;
+    insn->value.as.long_num = 0;
+    insn->func = IR_NONE;
+    insn->call_args = NULL;
+    insn->argc = 0;
+    insn->line = b->line;
+    insn->uses = 0;
+    insn->dead = 0;
+    insn->alias = 0;
+
+    ir_block_t *block = &ir->blocks[b->block];
+    block->insns = grow(block->insns, &block->capacity, block->count + 1, sizeof(uint32_t));
+    block->insns[block->count++] = ir->insn_count;
+
+    return ir->insn_count++;
+}
+
+static uint32_t add_const(builder_t *b, object_t value)
+{
+    uint32_t v = add_insn(b, IR_CONST, value.type);
+
+    if (v != IR_NONE) b->ir->insns[v].value = value;
+    else if (value.type == OBJ_VAL_STR) free(value.as.str);
+
+    return v;
+}
+
+static uint32_t add_unary(builder_t *b, ir_op_t op, int type, uint32_t arg)
+{
+    uint32_t v = add_insn(b, op, type);
+    if (v != IR_NONE) b->ir->insns[v].args[0] = arg;
+
+    return v;
+}
+
+static uint32_t add_named(builder_t *b, ir_op_t op, uint32_t name, uint32_t arg)
+{
+    uint32_t v = add_insn(b, op, IR_TYPE_UNKNOWN);
+    if (v == IR_NONE) return v;
+
+    ir_insn_t *insn = &b->ir->insns[v];
+    insn->name = name;
+    insn->args[0] = arg;
+
+    /* Reads and increments push the global itself, which may be a string it owns */
+    insn->alias = op != IR_SET;
+
+    return v;
+}
+
+static void bind(builder_t *b, uint32_t name, uint32_t value)
+{
+    b->undo = grow(b->undo, &b->undo_capacity, b->undo_count + 1, sizeof(undo_t));
+    b->undo[b->undo_count].name = name;
+    b->undo[b->undo_count].old = b->vars[name];
+    b->undo_count++;
+
+    b->vars[name].value = value;
+    b->vars[name].epoch = b->epoch;
+}
+
+static void undo_to(builder_t *b, uint32_t count)
+{
+    while (b->undo_count > count)
+    {
+        undo_t *u = &b->undo[--b->undo_count];
+        b->vars[u->name] = u->old;
+    }
+}
+
+/* The value of a variable, or IR_NONE if it has to be read from the global */
+static uint32_t lookup(builder_t *b, uint32_t name)
+{
+    binding_t *var = &b->vars[name];
+
+    if (var->value == IR_NONE) return IR_NONE;
+    if (b->ir->insns[var->value].alias && var->epoch != b->epoch) return IR_NONE;
+
+    return var->value;
+}
+
+ir_op_t ir_binary_op(token_type type)
+{
+    switch (type)
+    {
+        case TOK_PLUS: return IR_ADD;
+        case TOK_MINUS: return IR_SUB;
+        case TOK_MULTIPLY: return IR_MUL;
+        case TOK_DIVIDE: return IR_DIV;
+        case TOK_MODULO: return IR_MOD;
+        case TOK_GT: return IR_GT;
+        case TOK_GT_EQ: return IR_GT_EQ;
+        case TOK_LT: return IR_LT;
+        case TOK_LT_EQ: return IR_LT_EQ;
+        case TOK_EQ: return IR_EQ;
+        case TOK_NE: return IR_NE;
+        default: return IR_PHI;
+    }
+}
+
+op_code ir_op_code(ir_op_t op)
+{
+    if (op <= IR_MOD) return OP_ADD + (op - IR_ADD);
+
+    return OP_GT + (op - IR_GT);
+}
+
+int ir_is_compare(ir_op_t op)
+{
+    return op >= IR_GT && op <= IR_NE;
+}
+
+static int is_num_type(int type)
+{
+    return type == OBJ_VAL_LONG || type == OBJ_VAL_DOUBLE;
+}
+
+/* Type of an operator's result. Unknown when the vm would report an error instead */
+int ir_binary_type(ir_op_t op, int left, int right)
+{
+    if (ir_is_compare(op)) return OBJ_VAL_BOOL;
+    if (left != right || !is_num_type(left)) return IR_TYPE_UNKNOWN;
+    if (op == IR_MOD && left != OBJ_VAL_LONG) return IR_TYPE_UNKNOWN;
+
+    return left;
+}
+
+static int is_const(ir_insn_t *insn, int type, long long_num, double double_num)
+{
+    if (insn->op != IR_CONST || insn->value.type != type) return 0;
+    if (type == OBJ_VAL_LONG) return insn->value.as.long_num == long_num;
+
+    return insn->value.as.double_num == double_num;
+}
+
+/* The same identities fold_expr removes, for values of a known type */
+static uint32_t identity(ir_t *ir, ir_op_t op, uint32_t l, uint32_t r)
+{
+    ir_insn_t *a = &ir->insns[l];
+    ir_insn_t *b = &ir->insns[r];
+
+    switch (op)
+    {
+        case IR_ADD:
+        {
+            if (is_const(b, OBJ_VAL_LONG, 0, 0) && a->type == OBJ_VAL_LONG) return l;
+            if (is_const(a, OBJ_VAL_LONG, 0, 0) && b->type == OBJ_VAL_LONG) return r;
+            break;
+        }
+        case IR_SUB:
+        {
+            if (is_num_type(a->type) && is_const(b, a->type, 0, 0.0)) return l;
+            break;
+        }
+        case IR_MUL:
+        {
+            if (is_num_type(a->type) && is_const(b, a->type, 1, 1.0)) return l;
+            if (is_num_type(b->type) && is_const(a, b->type, 1, 1.0)) return r;
+            break;
+        }
+        case IR_DIV:
+        {
+            if (is_num_type(a->type) && is_const(b, a->type, 1, 1.0)) return l;
+            break;
+        }
+        default: break;
+    }
+
+    return IR_NONE;
+}
+
+static uint32_t build_binary(builder_t *b, ir_op_t op, uint32_t l, uint32_t r)
+{
+    ir_t *ir = b->ir;
+    object_t result;
+
+    if (ir->insns[l].op == IR_CONST && ir->insns[r].op == IR_CONST &&
+        fold_binary(ir_op_code(op), ir->insns[l].value, ir->insns[r].value, &result))
+    {
+        return add_const(b, result);
+    }
+
+    uint32_t same = identity(ir, op, l, r);
+    if (same != IR_NONE) return same;
+
+    uint32_t v = add_insn(b, op, ir_binary_type(op, ir->insns[l].type, ir->insns[r].type));
+    if (v == IR_NONE) return v;
+
+    ir_insn_t *insn = &ir->insns[v];
+    insn->args[0] = l;
+    insn->args[1] = r;
+
+    /* Operands the vm rejects leave the left one as the result */
+    insn->alias = insn->type == IR_TYPE_UNKNOWN && ir->insns[l].alias;
+
+    return v;
+}
+
+static uint32_t read_var(builder_t *b, token_t tok)
+{
+    uint32_t name = intern(b, tok);
+    uint32_t value = lookup(b, name);
+
+    if (value != IR_NONE) return value;
+
+    /* A local that may not have been set on the way here holds whatever its slot was left with */
+    if (b->locals[name]) return fail(b);
+
+    /* Later reads use the same value until the next declaration */
+    value = add_named(b, IR_GET, name, IR_NONE);
+    if (value != IR_NONE) bind(b, name, value);
+
+    return value;
+}
+
+static uint32_t build_literal(builder_t *b, expr_t *expr)
+{
+    if (expr->has_value) return add_const(b, expr->value);
+
+    object_t value;
+
+    switch (expr->tok.type)
+    {
+        case TOK_INT:
+        {
+            value.type = OBJ_VAL_LONG;
+            value.as.long_num = strtol(expr->tok.start, NULL, 10);
+            break;
+        }
+        case TOK_FLOAT:
+        {
+            value.type = OBJ_VAL_DOUBLE;
+            value.as.double_num = strtod(expr->tok.start, NULL);
+            break;
+        }
+        case TOK_TRUE:
+        case TOK_FALSE:
+        {
+            value.type = OBJ_VAL_BOOL;
+            value.as.str = expr->tok.type == TOK_TRUE ? "true" : "false";
+            break;
+        }
+        default:
+        {
+            value.type = OBJ_VAL_STR;
+            value.as.str = malloc(expr->tok.len + 1);
+            memcpy(value.as.str, expr->tok.start, expr->tok.len);
+            value.as.str[expr->tok.len] = '\0';
+            break;
+        }
+    }
+
+    return add_const(b, value);
+}
+
+/* The range of rand is read as a number, the same as the compiler does */
+static uint32_t build_rand(builder_t *b, expr_t *expr)
+{
+    if (!expr->right || expr->right->tok.type != TOK_INT) return fail(b);
+
+    uint32_t range = build_literal(b, expr->right);
+    if (range == IR_NONE) return range;
+
+    return add_unary(b, IR_RAND, OBJ_VAL_LONG, range);
+}
+
+static uint32_t build_value(builder_t *b, expr_t *expr);
+
+static int same_name(token_t a, token_t b)
+{
+    return a.len == b.len && memcmp(a.start, b.start, a.len) == 0;
+}
+
+static uint32_t count_params(expr_t *func)
+{
+    uint32_t count = 0;
+
+    for (expr_t *param = func->left->right; param; param = param->next)
+        count++;
+
+    return count;
+}
+
+/*
+ * Where a call goes, found the same way the compiler finds it. Functions the
+ * code defines go in the table after the ones already there, in the order
+ * they are defined. Returns IR_NONE for a call the compiler would report.
+ */
+static uint32_t find_func(builder_t *b, token_t name, uint32_t argc)
+{
+    func_table_t *funcs = b->c->funcs;
+    if (!funcs) return IR_NONE;
+
+    for (uint32_t k = b->defined_count; k > 0; k--)
+    {
+        expr_t *func = b->defined[k - 1];
+        if (!same_name(func->left->tok, name)) continue;
+
+        return count_params(func) == argc ? funcs->count + k - 1 : IR_NONE;
+    }
+
+    int index = func_table_find(funcs, name.start, name.len, b->func_limit);
+    if (index < 0 || funcs->funcs[index].arity != argc) return IR_NONE;
+
+    return (uint32_t)index;
+}
+
+/* A function can step any global by name, so the values known for them don't last past a call */
+static void forget_globals(builder_t *b)
+{
+    for (uint32_t name = 0; name < b->ir->name_count; name++)
+        if (!b->locals[name] && b->vars[name].value != IR_NONE) bind(b, name, IR_NONE);
+}
+
+static uint32_t build_call(builder_t *b, expr_t *expr)
+{
+    if (!expr->left || expr->left->tok.type != TOK_IDENT) return fail(b);
+
+    uint32_t argc = 0;
+    for (expr_t *arg = expr->right; arg; arg = arg->next) argc++;
+
+    uint32_t func = find_func(b, expr->left->tok, argc);
+    if (func == IR_NONE) return fail(b);
+
+    uint32_t *args = malloc(sizeof(uint32_t) * (argc + 1));
+    uint32_t n = 0;
+
+    for (expr_t *arg = expr->right; arg && !b->failed; arg = arg->next)
+        args[n++] = build_value(b, arg);
+
+    uint32_t v = b->failed ? IR_NONE : add_insn(b, IR_CALL, IR_TYPE_UNKNOWN);
+
+    if (v == IR_NONE)
+    {
+        free(args);
+        return v;
+    }
+
+    ir_insn_t *insn = &b->ir->insns[v];
+    insn->func = func;
+    insn->call_args = args;
+    insn->argc = argc;
+
+    /* The function may return a string owned by a global, and can read any global by name */
+    insn->alias = 1;
+    b->ir->closed = 0;
+
+    forget_globals(b);
+
+    return v;
+}
+
+/* Builds an expression tree. Anything the compiler wouldn't emit a value for fails */
+static uint32_t build_value(builder_t *b, expr_t *expr)
+{
+    if (!expr || b->failed) return fail(b);
+
+    switch (expr->tok.type)
+    {
+        case TOK_INT:
+        case TOK_FLOAT:
+        case TOK_STRING:
+        case TOK_TRUE:
+        case TOK_FALSE:
+            return build_literal(b, expr);
+
+        case TOK_IDENT: return read_var(b, expr->tok);
+        case TOK_STDIN: return add_insn(b, IR_STDIN, IR_TYPE_UNKNOWN);
+        case TOK_RAND: return build_rand(b, expr);
+        case TOK_LPAREN: return build_call(b, expr);
+        default: break;
+    }
+
+    ir_op_t op = ir_binary_op(expr->tok.type);
+    if (op == IR_PHI || !expr->left || !expr->right) return fail(b);
+
+    uint32_t l = build_value(b, expr->left);
+    uint32_t r = build_value(b, expr->right);
+
+    if (b->failed) return IR_NONE;
+
+    return build_binary(b, op, l, r);
+}
+
+static void declare(builder_t *b, uint32_t name, uint32_t value)
+{
+    add_named(b, IR_SET, name, value);
+
+    /*
+     * The old string of the global is freed so values that may point at it are
+     * stale, including the one just declared. Those are read back from the global.
+     */
+    b->epoch++;
+    bind(b, name, b->ir->insns[value].alias ? IR_NONE : value);
+}
+
+/*
+ * Inside a function a declaration gives the variable a slot in the frame from
+ * then on. Nothing else can see the slot so the value is only kept in the ir.
+ */
+static void assign(builder_t *b, uint32_t name, uint32_t value)
+{
+    if (!b->ir->is_func)
+    {
+        declare(b, name, value);
+        return;
+    }
+
+    b->locals[name] = 1;
+    bind(b, name, value);
+}
+
+static void build_var(builder_t *b, expr_t *expr)
+{
+    if (!expr->left || !expr->right) return (void)fail(b);
+
+    uint32_t name = intern(b, expr->left->tok);
+    uint32_t value = build_value(b, expr->right);
+
+    if (!b->failed) assign(b, name, value);
+}
+
+/*
+ * Increments of a variable whose value is known to be a number become an add
+ * and a declaration so the value can stay in the ir. Anything else is done on
+ * the global by name as the vm would. A function only ever steps a global by
+ * name, and a local it can't step in the ir is left to the compiler.
+ */
+static uint32_t build_inc_dec(builder_t *b, expr_t *expr)
+{
+    if (!expr->left || expr->left->tok.type != TOK_IDENT) return fail(b);
+
+    int inc = expr->tok.type == TOK_INCREMENT;
+    uint32_t name = intern(b, expr->left->tok);
+    int local = b->locals[name];
+    uint32_t value = lookup(b, name);
+
+    if (value == IR_NONE && local) return fail(b);
+    if (value == IR_NONE && !b->ir->is_func) return add_named(b, inc ? IR_INC : IR_DEC, name, IR_NONE);
+
+    int type = b->ir->is_func && !local ? IR_TYPE_UNKNOWN : b->ir->insns[value].type;
+
+    if (is_num_type(type))
+    {
+        object_t one = { .type = type };
+        if (type == OBJ_VAL_LONG) one.as.long_num = 1;
+        else one.as.double_num = 1.0;
+
+        uint32_t k = add_const(b, one);
+        uint32_t result = k == IR_NONE ? k : build_binary(b, inc ? IR_ADD : IR_SUB, value, k);
+
+        if (!b->failed) assign(b, name, result);
+        return result;
+    }
+
+    /* Strings and bools are left as they are */
+    if (type != IR_TYPE_UNKNOWN) return value;
+    if (local) return fail(b);
+
+    uint32_t result = add_named(b, inc ? IR_INC : IR_DEC, name, IR_NONE);
+    if (result != IR_NONE) bind(b, name, result);
+
+    return result;
+}
+
+/* Records the value at the end of a branch of each variable the branch changed */
+static change_t *collect_changes(builder_t *b, uint32_t since, uint32_t *count)
+{
+    change_t *changes = malloc(sizeof(change_t) * (b->undo_count - since + 1));
+    uint32_t stamp = ++b->stamp;
+
+    *count = 0;
+
+    for (uint32_t i = since; i < b->undo_count; i++)
+    {
+        uint32_t name = b->undo[i].name;
+        if (b->marks[name] == stamp) continue;
+
+        b->marks[name] = stamp;
+        changes[*count].name = name;
+        changes[*count].value = lookup(b, name);
+        (*count)++;
+    }
+
+    return changes;
+}
+
+/* The value a variable has after an if, given its values at the ends of the two branches */
+static uint32_t join_value(builder_t *b, uint32_t then_value, uint32_t else_value,
+                           int then_reachable, int else_reachable)
+{
+    ir_t *ir = b->ir;
+
+    if (!then_reachable) return else_value;
+    if (!else_reachable) return then_value;
+    if (then_value == else_value) return then_value;
+    if (then_value == IR_NONE || else_value == IR_NONE) return IR_NONE;
+
+    ir_insn_t *a = &ir->insns[then_value];
+    ir_insn_t *c = &ir->insns[else_value];
+
+    int type = a->type == c->type ? a->type : IR_TYPE_UNKNOWN;
+    uint8_t alias = a->alias || c->alias;
+
+    uint32_t phi = add_insn(b, IR_PHI, type);
+    if (phi == IR_NONE) return phi;
+
+    ir_insn_t *insn = &ir->insns[phi];
+    insn->args[0] = then_value;
+    insn->args[1] = else_value;
+    insn->alias = alias;
+
+    return phi;
+}
+
+static void build_if(builder_t *b, expr_t *expr)
+{
+    ir_t *ir = b->ir;
+
+    uint32_t cond = build_value(b, expr->left);
+    if (b->failed) return;
+
+    expr_t *true_block = expr->right;
+    expr_t *false_block = NULL;
+
+    if (expr->right && expr->right->tok.type == TOK_ELSE)
+    {
+        true_block = expr->right->left;
+        false_block = expr->right->right;
+    }
+
+    uint32_t branch = b->block;
+    int reachable = is_reachable(b, branch);
+    uint32_t entry = b->undo_count;
+
+    ir->blocks[branch].term = IR_BRANCH;
+    ir->blocks[branch].arg = cond;
+
+    uint32_t then_block = new_block(b, reachable);
+    ir->blocks[branch].succ[0] = then_block;
+    if (reachable) ir->blocks[then_block].preds[ir->blocks[then_block].pred_count++] = branch;
+
+    b->block = then_block;
+    build_block(b, true_block);
+
+    uint32_t then_end = b->block;
+    uint32_t then_count = 0;
+    change_t *then_changes = collect_changes(b, entry, &then_count);
+
+    undo_to(b, entry);
+
+    uint32_t else_block = new_block(b, reachable);
+    ir->blocks[branch].succ[1] = else_block;
+    if (reachable) ir->blocks[else_block].preds[ir->blocks[else_block].pred_count++] = branch;
+
+    b->block = else_block;
+    build_block(b, false_block);
+
+    uint32_t else_end = b->block;
+    uint32_t else_count = 0;
+    change_t *else_changes = collect_changes(b, entry, &else_count);
+
+    undo_to(b, entry);
+
+    int then_reachable = is_reachable(b, then_end);
+    int else_reachable = is_reachable(b, else_end);
+
+    uint32_t join = new_block(b, then_reachable || else_reachable);
+    jump_to(b, then_end, join);
+    jump_to(b, else_end, join);
+    b->block = join;
+
+    /* Variables the true branch changed, which the false branch may have changed too */
+    uint32_t stamp = ++b->stamp;
+    for (uint32_t i = 0; i < else_count; i++)
+    {
+        b->marks[else_changes[i].name] = stamp;
+        b->slots[else_changes[i].name] = i;
+    }
+
+    for (uint32_t i = 0; i < then_count && !b->failed; i++)
+    {
+        uint32_t name = then_changes[i].name;
+        uint32_t else_value = b->marks[name] == stamp ? else_changes[b->slots[name]].value : lookup(b, name);
+
+        bind(b, name, join_value(b, then_changes[i].value, else_value, then_reachable, else_reachable));
+    }
+
+    /* Then the ones only the false branch changed */
+    stamp = ++b->stamp;
+    for (uint32_t i = 0; i < then_count; i++)
+        b->marks[then_changes[i].name] = stamp;
+
+    for (uint32_t i = 0; i < else_count && !b->failed; i++)
+    {
+        uint32_t name = else_changes[i].name;
+        if (b->marks[name] == stamp) continue;
+
+        bind(b, name, join_value(b, lookup(b, name), else_changes[i].value, then_reachable, else_reachable));
+    }
+
+    free(then_changes);
+    free(else_changes);
+}
+
+/* Finds the variables a block declares or increments, including in nested statements */
+static void assigned_names(builder_t *b, expr_t *first, uint32_t **names, uint32_t *count, uint32_t *capacity)
+{
+    for (expr_t *stmt = first; stmt; stmt = stmt->next)
+    {
+        switch (stmt->tok.type)
+        {
+            case TOK_ASSIGN:
+            case TOK_INCREMENT:
+            case TOK_DECREMENT:
+            {
+                if (!stmt->left) break;
+
+                uint32_t name = intern(b, stmt->left->tok);
+                if (b->marks[name] == b->stamp) break;
+
+                b->marks[name] = b->stamp;
+                *names = grow(*names, capacity, *count + 1, sizeof(uint32_t));
+                (*names)[(*count)++] = name;
+                break;
+            }
+            case TOK_IF:
+            {
+                if (stmt->right && stmt->right->tok.type == TOK_ELSE)
+                {
+                    assigned_names(b, stmt->right->left, names, count, capacity);
+                    assigned_names(b, stmt->right->right, names, count, capacity);
+                }
+                else
+                {
+                    assigned_names(b, stmt->right, names, count, capacity);
+                }
+
+                break;
+            }
+            case TOK_LOOP:
+            {
+                assigned_names(b, stmt->right, names, count, capacity);
+                break;
+            }
+            default: break;
+        }
+    }
+}
+
+/* Throws away everything built since a loop body was started so it can be built again */
+static void truncate_to(builder_t *b, uint32_t insns, uint32_t blocks, uint32_t loops, uint32_t undo)
+{
+    ir_t *ir = b->ir;
+
+    for (uint32_t i = insns; i < ir->insn_count; i++)
+    {
+        if (ir->insns[i].op == IR_CONST && ir->insns[i].value.type == OBJ_VAL_STR)
+            free(ir->insns[i].value.as.str);
+
+        free(ir->insns[i].call_args);
+    }
+
+    for (uint32_t i = blocks; i < ir->block_count; i++)
+        free(ir->blocks[i].insns);
+
+    ir->insn_count = insns;
+    ir->block_count = blocks;
+    ir->loop_count = loops;
+
+    undo_to(b, undo);
+}
+
+/* Whether anything in the statements from first on, or in the expressions in them, is a call */
+static int has_call(expr_t *first)
+{
+    for (expr_t *expr = first; expr; expr = expr->next)
+        if (expr->tok.type == TOK_LPAREN || has_call(expr->left) || has_call(expr->right)) return 1;
+
+    return 0;
+}
+
+/* Counters the compiler pushes a value for */
+static int is_counter(expr_t *expr)
+{
+    if (!expr) return 0;
+
+    switch (expr->tok.type)
+    {
+        case TOK_INT:
+        case TOK_IDENT:
+        case TOK_FLOAT:
+        case TOK_TRUE:
+        case TOK_FALSE:
+        case TOK_RAND:
+            return 1;
+        default:
+            return ir_binary_op(expr->tok.type) != IR_PHI;
+    }
+}
+
+/*
+ * Variables the body changes get a phi in the loop header. What each phi is
+ * assumed to hold is checked against the value at the end of the body, and
+ * if the body disagrees the assumption is weakened and the body built again.
+ */
+static void build_loop(builder_t *b, expr_t *expr)
+{
+    ir_t *ir = b->ir;
+
+    if (!is_counter(expr->left)) return (void)fail(b);
+
+    int reachable = is_reachable(b, b->block);
+    uint32_t preheader = new_block(b, reachable);
+
+    jump_to(b, b->block, preheader);
+    b->block = preheader;
+
+    uint32_t counter = build_value(b, expr->left);
+    if (b->failed) return;
+
+    uint32_t *names = NULL;
+    uint32_t count = 0;
+    uint32_t capacity = 0;
+    int calls = has_call(expr->right);
+
+    b->stamp++;
+    assigned_names(b, expr->right, &names, &count, &capacity);
+
+    uint8_t *state = calloc(count + 1, 1);
+    uint32_t *entries = malloc(sizeof(uint32_t) * (count + 1));
+    uint32_t *phis = malloc(sizeof(uint32_t) * (count + 1));
+    uint32_t *latch_values = malloc(sizeof(uint32_t) * (count + 1));
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        entries[i] = lookup(b, names[i]);
+
+        if (entries[i] == IR_NONE) state[i] = VAR_UNTRACKED;
+        else if (ir->insns[entries[i]].alias) state[i] = VAR_ALIAS;
+    }
+
+    uint32_t parent = b->loop;
+    uint32_t insn_save = ir->insn_count;
+    uint32_t block_save = ir->block_count;
+    uint32_t loop_save = ir->loop_count;
+    uint32_t undo_save = b->undo_count;
+
+    for (;;)
+    {
+        ir->loops = grow(ir->loops, &ir->loop_capacity, ir->loop_count + 1, sizeof(ir_loop_t));
+
+        uint32_t loop = ir->loop_count++;
+        ir->loops[loop].preheader = preheader;
+        ir->loops[loop].latch = IR_NONE;
+        ir->loops[loop].exit = IR_NONE;
+        ir->loops[loop].parent = parent;
+
+        b->loop = loop;
+
+        uint32_t header = new_block(b, reachable);
+        ir->loops[loop].header = header;
+        jump_to(b, preheader, header);
+        b->block = header;
+
+        /*
+         * A declaration late in one iteration runs before anything early in the
+         * next, so values that may be strings owned by a global aren't used
+         * across the loop unless they come through a phi. Only the top level
+         * declares globals. A call late in one iteration can step a global too.
+         */
+        if (!ir->is_func) b->epoch++;
+        if (calls) forget_globals(b);
+
+        for (uint32_t i = 0; i < count; i++)
+        {
+            phis[i] = IR_NONE;
+
+            if (state[i] & VAR_UNTRACKED)
+            {
+                bind(b, names[i], IR_NONE);
+                continue;
+            }
+
+            int type = state[i] & VAR_TYPE_UNKNOWN ? IR_TYPE_UNKNOWN : ir->insns[entries[i]].type;
+
+            phis[i] = add_insn(b, IR_PHI, type);
+            if (phis[i] == IR_NONE) break;
+
+            ir->insns[phis[i]].args[0] = entries[i];
+            ir->insns[phis[i]].alias = (state[i] & VAR_ALIAS) != 0;
+            bind(b, names[i], phis[i]);
+        }
+
+        uint32_t header_undo = b->undo_count;
+        uint32_t body = new_block(b, reachable);
+
+        ir->blocks[header].term = IR_LOOP;
+        ir->blocks[header].arg = counter;
+        ir->blocks[header].succ[0] = body;
+        if (reachable) ir->blocks[body].preds[ir->blocks[body].pred_count++] = header;
+
+        b->block = body;
+        build_block(b, expr->right);
+
+        if (b->failed) break;
+
+        uint32_t latch = b->block;
+        int retry = 0;
+
+        for (uint32_t i = 0; i < count && is_reachable(b, latch); i++)
+        {
+            if (phis[i] == IR_NONE) continue;
+
+            uint32_t value = lookup(b, names[i]);
+            latch_values[i] = value;
+
+            if (value == IR_NONE)
+            {
+                state[i] |= VAR_UNTRACKED;
+                retry = 1;
+                continue;
+            }
+
+            ir_insn_t *phi = &ir->insns[phis[i]];
+
+            if (ir->insns[value].alias && !phi->alias)
+            {
+                state[i] |= VAR_ALIAS;
+                retry = 1;
+            }
+
+            if (phi->type != IR_TYPE_UNKNOWN && ir->insns[value].type != phi->type)
+            {
+                state[i] |= VAR_TYPE_UNKNOWN;
+                retry = 1;
+            }
+        }
+
+        if (retry)
+        {
+            truncate_to(b, insn_save, block_save, loop_save, undo_save);
+            ir->blocks[preheader].term = IR_END;
+            continue;
+        }
+
+        if (is_reachable(b, latch))
+        {
+            jump_to(b, latch, header);
+            ir->loops[loop].latch = latch;
+
+            for (uint32_t i = 0; i < count; i++)
+                if (phis[i] != IR_NONE) ir->insns[phis[i]].args[1] = latch_values[i];
+        }
+
+        /* After the loop the variables have the values they had in the header */
+        undo_to(b, header_undo);
+        b->loop = parent;
+
+        uint32_t exit = new_block(b, reachable);
+        ir->blocks[header].succ[1] = exit;
+        if (reachable) ir->blocks[exit].preds[ir->blocks[exit].pred_count++] = header;
+
+        ir->loops[loop].exit = exit;
+        b->block = exit;
+        break;
+    }
+
+    b->loop = parent;
+
+    free(names);
+    free(state);
+    free(entries);
+    free(phis);
+    free(latch_values);
+}
+
+static void build_return(builder_t *b, expr_t *expr)
+{
+    object_t zero = { .type = OBJ_VAL_LONG, .as.long_num = 0 };
+
+    if (!b->ir->is_func) return (void)fail(b);
+
+    uint32_t value = expr->left ? build_value(b, expr->left) : add_const(b, zero);
+    if (b->failed) return;
+
+    /* Anything after a return is built into a block nothing jumps to */
+    b->ir->blocks[b->block].term = IR_RETURN;
+    b->ir->blocks[b->block].arg = value;
+    b->block = new_block(b, 0);
+}
+
+static void build_stmt(builder_t *b, expr_t *expr)
+{
+    b->line = expr->tok.line;
+
+    switch (expr->tok.type)
+    {
+        case TOK_ASSIGN: build_var(b, expr); break;
+        case TOK_IF: build_if(b, expr); break;
+        case TOK_LOOP: build_loop(b, expr); break;
+        case TOK_STDIN: add_insn(b, IR_STDIN, IR_TYPE_UNKNOWN); break;
+        case TOK_RETURN: build_return(b, expr); break;
+
+        /* A lone call is made for what it does, without printing what it gives */
+        case TOK_LPAREN: build_call(b, expr); break;
+
+        /* Matches are left to the ast compiler, which emits their tables. Functions are only defined at the top level */
+        case TOK_MATCH:
+        case TOK_FUNC:
+            fail(b);
+            break;
+        case TOK_EXIT:
+        {
+            /* Anything after an exit is built into a block nothing jumps to */
+            b->ir->blocks[b->block].term = IR_EXIT;
+            b->block = new_block(b, 0);
+            break;
+        }
+        case TOK_INCREMENT:
+        case TOK_DECREMENT:
+        {
+            uint32_t value = build_inc_dec(b, expr);
+            if (!b->failed) add_unary(b, IR_PRINT, IR_TYPE_UNKNOWN, value);
+            break;
+        }
+        default:
+        {
+            uint32_t value = build_value(b, expr);
+            if (!b->failed) add_unary(b, IR_PRINT, IR_TYPE_UNKNOWN, value);
+            break;
+        }
+    }
+}
+
+static void build_block(builder_t *b, expr_t *first)
+{
+    for (expr_t *stmt = first; stmt && !b->failed; stmt = stmt->next)
+        build_stmt(b, stmt);
+}
+
+static void init_builder(builder_t *b, ir_t *ir, compiler_t *c)
+{
+    memset(b, 0, sizeof(builder_t));
+    b->ir = ir;
+    b->loop = IR_NONE;
+    b->c = c;
+    b->func_limit = c->func_limit;
+    b->block = new_block(b, 1);
+}
+
+/* Returns the ir, or NULL with the line that stopped it if it couldn't be built */
+static ir_t *finish(builder_t *b, uint32_t *fail_line)
+{
+    free(b->vars);
+    free(b->marks);
+    free(b->slots);
+    free(b->locals);
+    free(b->undo);
+    free(b->defined);
+
+    if (!b->failed) return b->ir;
+
+    if (fail_line) *fail_line = b->fail_line;
+    ir_free(b->ir);
+
+    return NULL;
+}
+
+/* The compiler adds a function to the table at its definition, unless that was done ahead of the code */
+static void define_func(builder_t *b, expr_t *expr)
+{
+    if (!expr->left || !b->c->funcs) return (void)fail(b);
+
+    if (b->c->defined_ahead)
+    {
+        b->func_limit++;
+        return;
+    }
+
+    b->defined = grow(b->defined, &b->defined_capacity, b->defined_count + 1, sizeof(expr_t *));
+    b->defined[b->defined_count++] = expr;
+}
+
+/*
+ * Builds the ssa form of a program. The globals a script declares become
+ * values in the ir wherever the declaration is known to reach, and are only
+ * read by name when it isn't. Returns NULL for anything the ir can't express
+ * the same way the compiler would, such as code with parse errors. Functions
+ * the program defines are only looked up, as each is built on its own.
+ */
+ir_t *ir_build(ast_node_t *ast, int closed, compiler_t *c, uint32_t *fail_line)
+{
+    ir_t *ir = calloc(1, sizeof(ir_t));
+    ir->closed = closed;
+
+    builder_t b;
+    init_builder(&b, ir, c);
+
+    for (ast_node_t *node = ast; node && !b.failed; node = node->next)
+    {
+        if (!node->expr) continue;
+
+        b.line = node->expr->tok.line;
+
+        if (node->expr->tok.type == TOK_FUNC)
+        {
+            define_func(&b, node->expr);
+            continue;
+        }
+
+        /* The compiler only handles if, loop, match and return statements at the top level */
+        if (node->type == AST_STMT && node->expr->tok.type != TOK_IF && node->expr->tok.type != TOK_LOOP &&
+            node->expr->tok.type != TOK_MATCH && node->expr->tok.type != TOK_RETURN)
+            continue;
+
+        build_stmt(&b, node->expr);
+    }
+
+    return finish(&b, fail_line);
+}
+
+/*
+ * Builds the body of a function. Its variables become values the same way the
+ * globals of a script do, but as nothing else can see them they are never
+ * written back. Calls in it see the functions before it and the function itself.
+ */
+static ir_t *build_func(expr_t *func, compiler_t *c, uint32_t *fail_line)
+{
+    ir_t *ir = calloc(1, sizeof(ir_t));
+    ir->is_func = 1;
+
+    builder_t b;
+    init_builder(&b, ir, c);
+    b.line = func->tok.line;
+
+    b.defined = grow(b.defined, &b.defined_capacity, 1, sizeof(expr_t *));
+    b.defined[b.defined_count++] = func;
+
+    for (expr_t *param = func->left->right; param && !b.failed; param = param->next)
+    {
+        uint32_t name = intern(&b, param->tok);
+
+        /* The compiler reports duplicates, and a call gives its argument count in a byte */
+        if (b.locals[name] || ir->param_count == UINT8_MAX)
+        {
+            fail(&b);
+            break;
+        }
+
+        uint32_t v = add_insn(&b, IR_PARAM, IR_TYPE_UNKNOWN);
+        if (v == IR_NONE) break;
+
+        ir->insns[v].name = name;
+        ir->param_count++;
+        b.locals[name] = 1;
+        bind(&b, name, v);
+    }
+
+    build_block(&b, func->right);
+
+    return finish(&b, fail_line);
+}
+
+void ir_free(ir_t *ir)
+{
+    for (uint32_t i = 0; i < ir->insn_count; i++)
+    {
+        if (ir->insns[i].op == IR_CONST && ir->insns[i].value.type == OBJ_VAL_STR)
+            free(ir->insns[i].value.as.str);
+
+        free(ir->insns[i].call_args);
+    }
+
+    for (uint32_t i = 0; i < ir->block_count; i++)
+        free(ir->blocks[i].insns);
+
+    for (uint32_t i = 0; i < ir->name_count; i++)
+        free(ir->names[i].str);
+
+    free(ir->insns);
+    free(ir->blocks);
+    free(ir->loops);
+    free(ir->names);
+    free(ir->name_table);
+    free(ir);
+}
+
+/*
+ * Instructions that can be removed, merged or moved without changing what the
+ * script does. The arithmetic operators only count when the vm can't report an
+ * error for them or trap on a division.
+ */
+int ir_is_pure(ir_t *ir, ir_insn_t *insn)
+{
+    switch (insn->op)
+    {
+        case IR_CONST:
+        case IR_PHI:
+            return 1;
+
+        case IR_ADD:
+        case IR_SUB:
+        case IR_MUL:
+            return insn->type != IR_TYPE_UNKNOWN;
+
+        case IR_DIV:
+        case IR_MOD:
+        {
+            if (insn->type == OBJ_VAL_DOUBLE) return 1;
+            if (insn->type != OBJ_VAL_LONG) return 0;
+
+            ir_insn_t *divisor = &ir->insns[insn->args[1]];
+
+            return divisor->op == IR_CONST && divisor->value.as.long_num != 0 &&
+                   divisor->value.as.long_num != -1;
+        }
+
+        default:
+            return ir_is_compare(insn->op);
+    }
+}
+
+/* Needs the dominator tree from ir_optimise */
+int ir_dominates(ir_t *ir, uint32_t a, uint32_t b)
+{
+    return ir->blocks[a].dom_pre <= ir->blocks[b].dom_pre &&
+           ir->blocks[b].dom_post <= ir->blocks[a].dom_post;
+}
+
+int ir_in_loop(ir_t *ir, uint32_t loop, uint32_t block)
+{
+    return block >= ir->loops[loop].header && block < ir->loops[loop].exit;
+}
+
+static const char *op_name(ir_op_t op)
+{
+    switch (op)
+    {
+        case IR_CONST: return "const";
+        case IR_GET: return "get";
+        case IR_SET: return "set";
+        case IR_INC: return "inc";
+        case IR_DEC: return "dec";
+        case IR_ADD: return "add";
+        case IR_SUB: return "sub";
+        case IR_MUL: return "mul";
+        case IR_DIV: return "div";
+        case IR_MOD: return "mod";
+        case IR_GT: return "gt";
+        case IR_GT_EQ: return "gt_eq";
+        case IR_LT: return "lt";
+        case IR_LT_EQ: return "lt_eq";
+        case IR_EQ: return "eq";
+        case IR_NE: return "ne";
+        case IR_PRINT: return "print";
+        case IR_STDIN: return "stdin";
+        case IR_RAND: return "rand";
+        case IR_PHI: return "phi";
+        case IR_PARAM: return "param";
+        case IR_CALL: return "call";
+        default: return "?";
+    }
+}
+
+void ir_print(ir_t *ir)
+{
+    for (uint32_t i = 0; i < ir->block_count; i++)
+    {
+        ir_block_t *block = &ir->blocks[i];
+        if (!block->reachable) continue;
+
+        printf("b%u:", i);
+        for (uint32_t p = 0; p < block->pred_count; p++)
+            printf(" <- b%u", block->preds[p]);
+        printf("\n");
+
+        for (uint32_t k = 0; k < block->count; k++)
+        {
+            ir_insn_t *insn = &ir->insns[block->insns[k]];
+            if (insn->dead) continue;
+
+            printf("  v%u = %s", block->insns[k], op_name(insn->op));
+
+            if (insn->name != IR_NONE) printf(" %s", ir->names[insn->name].str);
+
+            if (insn->op == IR_CONST)
+            {
+                switch (insn->value.type)
+                {
+                    case OBJ_VAL_LONG: printf(" %ld", insn->value.as.long_num); break;
+                    case OBJ_VAL_DOUBLE: printf(" %f", insn->value.as.double_num); break;
+                    default: printf(" %s", insn->value.as.str); break;
+                }
+            }
+
+            if (insn->op == IR_CALL) printf(" f%u", insn->func);
+
+            for (int a = 0; a < IR_MAX_PREDS; a++)
+                if (insn->args[a] != IR_NONE) printf(" v%u", insn->args[a]);
+
+            for (uint32_t a = 0; a < insn->argc; a++)
+                printf(" v%u", insn->call_args[a]);
+
+            printf("\n");
+        }
+
+        switch (block->term)
+        {
+            case IR_JUMP: printf("  jump b%u\n", block->succ[0]); break;
+            case IR_BRANCH: printf("  branch v%u b%u b%u\n", block->arg, block->succ[0], block->succ[1]); break;
+            case IR_LOOP: printf("  loop v%u b%u b%u\n", block->arg, block->succ[0], block->succ[1]); break;
+            case IR_EXIT: printf("  exit\n"); break;
+            case IR_RETURN: printf("  return v%u\n", block->arg); break;
+            case IR_END: printf("  end\n"); break;
+        }
+    }
+}
+
+/*
+ * Compiles a function through its own ir into its own chunk, or with the ast
+ * compiler if the ir can't be built for it.
+ */
+static void compile_func(compiler_t *c, expr_t *func)
+{
+    uint32_t line = func->tok.line;
+    ir_t *ir = build_func(func, c, &line);
+
+    if (ir)
+    {
+        ir_optimise(ir);
+
+        compiler_func_t f;
+        compiler_begin_func(c, &f, func->left->tok);
+
+        for (expr_t *param = func->left->right; param; param = param->next)
+            compiler_add_param(c, param->tok);
+
+        int lowered = ir_lower(ir, c);
+
+        compiler_end_func(c);
+        ir_free(ir);
+
+        if (lowered) return;
+
+        /* Nothing was emitted for the body so it is compiled again from the start */
+        func_table_truncate(c->funcs, c->funcs->count - 1);
+    }
+
+    compiler_compile_func(c, func);
+
+    if (!c->had_error)
+    {
+        fprintf(stderr, "Warning: line %u can't be optimised, so function '%.*s' is compiled without -O\n", line,
+                func->left->tok.len, func->left->tok.start);
+    }
+}
+
+/*
+ * Compiles a program through the ir. Programs the ir can't be built for are
+ * compiled by the ast compiler instead, which is pointed out as -O was asked
+ * for. closed is set when nothing else runs against the globals once the
+ * program has finished, such as a whole script.
+ */
+compiler_code_t ir_compile_program(compiler_t *c, ast_node_t *ast, int closed)
+{
+    uint32_t funcs = c->funcs ? c->funcs->count : 0;
+    uint32_t line = ast && ast->expr ? ast->expr->tok.line : 1;
+    ir_t *ir = ir_build(ast, closed, c, &line);
+
+    if (ir)
+    {
+        ir_optimise(ir);
+
+        /* The functions go in the table before the code that calls them is emitted, as it may inline them */
+        for (ast_node_t *node = ast; node && !c->defined_ahead; node = node->next)
+            if (node->expr && node->expr->tok.type == TOK_FUNC) compile_func(c, node->expr);
+
+        int lowered = ir_lower(ir, c);
+        ir_free(ir);
+
+        if (lowered) return c->had_error ? COMPILER_PARSE_ERROR : COMPILER_OK;
+
+        if (c->funcs) func_table_truncate(c->funcs, funcs);
+    }
+
+    compiler_code_t code = compiler_compile_program(c, ast);
+
+    if (code == COMPILER_OK)
+        fprintf(stderr, "Warning: line %u can't be optimised, so the code is compiled without -O\n", line);
+
+    return code;
+}
@@ -0,0 +1,147 @@
+#ifndef __PHANTOM_IR_H_
+#define __PHANTOM_IR_H_
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "object.h"
+#include "ast.h"
+#include "compiler.h"
+
+#define IR_NONE         UINT32_MAX
+#define IR_TYPE_UNKNOWN -1
+
+/* Blocks come from structured statements so none has more than two predecessors */
+#define IR_MAX_PREDS    2
+
+typedef enum {
+    IR_CONST,
+    IR_GET,         /* Reads the global called name */
+    IR_SET,         /* Declares the global called name with args[0] */
+    IR_INC,         /* Increments the global called name and gives its new value */
+    IR_DEC,
+
+    /* Binary operators in the same order as their op codes */
+    IR_ADD,
+    IR_SUB,
+    IR_MUL,
+    IR_DIV,
+    IR_MOD,
+    IR_GT,
+    IR_GT_EQ,
+    IR_LT,
+    IR_LT_EQ,
+    IR_EQ,
+    IR_NE,
+
+    IR_PRINT,
+    IR_STDIN,
+    IR_RAND,        /* args[0] is the range */
+    IR_PHI,         /* One argument for each predecessor, in the same order */
+    IR_PARAM,       /* A parameter called name, in the slot the call left it in */
+    IR_CALL,        /* Calls function func with call_args */
+} ir_op_t;
+
+typedef enum {
+    IR_JUMP,        /* Goes to succ[0] */
+    IR_BRANCH,      /* Goes to succ[0] if arg is truthy and succ[1] if not */
+    IR_LOOP,        /* Counts down arg, set in the preheader, running succ[0] then leaving for succ[1] */
+    IR_EXIT,        /* An exit statement */
+    IR_RETURN,      /* Returns arg from a function */
+    IR_END,         /* The end of the code */
+} ir_term_t;
+
+/* An instruction and the value it defines. Values are named by their index */
+typedef struct {
+    ir_op_t op;
+    int type;           /* The object type the value always has, or IR_TYPE_UNKNOWN */
+    uint32_t block;
+    uint32_t args[IR_MAX_PREDS];
+    uint32_t name;      /* Variable for the global operations and parameters */
+    object_t value;     /* Set for constants */
+    uint32_t func;      /* Index of the function a call goes to */
+    uint32_t *call_args;    /* Arguments of a call in the order they are pushed */
+    uint32_t argc;
+    uint32_t line;      /* Source line of the statement it came from */
+
+    uint32_t uses;
+    uint8_t dead;
+    uint8_t alias;      /* The value may be a string owned by a global */
+} ir_insn_t;
+
+typedef struct {
+    uint32_t *insns;    /* Phis come first */
+    uint32_t count;
+    uint32_t capacity;
+
+    ir_term_t term;
+    uint32_t arg;
+    uint32_t succ[2];
+
+    uint32_t preds[IR_MAX_PREDS];
+    uint32_t pred_count;
+
+    uint32_t idom;      /* Immediate dominator */
+    uint32_t dom_pre;   /* Order the dominator tree is walked in, to test dominance quickly */
+    uint32_t dom_post;
+    uint32_t loop;      /* Innermost loop the block is in */
+    uint8_t reachable;
+} ir_block_t;
+
+/*
+ * A counted loop. Blocks are numbered in source order so the blocks of a loop
+ * are the ones from its header up to but not including its exit.
+ */
+typedef struct {
+    uint32_t preheader;
+    uint32_t header;
+    uint32_t latch;
+    uint32_t exit;
+    uint32_t parent;
+} ir_loop_t;
+
+typedef struct {
+    char *str;
+    uint32_t len;
+} ir_name_t;
+
+typedef struct {
+    ir_insn_t *insns;
+    uint32_t insn_count;
+    uint32_t insn_capacity;
+
+    ir_block_t *blocks;
+    uint32_t block_count;
+    uint32_t block_capacity;
+
+    ir_loop_t *loops;
+    uint32_t loop_count;
+    uint32_t loop_capacity;
+
+    ir_name_t *names;
+    uint32_t name_count;
+    uint32_t name_capacity;
+    uint32_t *name_table;   /* Open addressing table of indices into names */
+    uint32_t name_table_size;
+
+    int closed;             /* Nothing reads the globals once the code has finished */
+    int is_func;            /* The body of a function, which returns rather than exits at its end */
+    uint32_t param_count;   /* Parameters of a function are its first values, one for each slot */
+} ir_t;
+
+ir_t *ir_build(ast_node_t *ast, int closed, compiler_t *c, uint32_t *fail_line);
+void ir_free(ir_t *ir);
+void ir_print(ir_t *ir);
+
+ir_op_t ir_binary_op(token_type type);
+op_code ir_op_code(ir_op_t op);
+int ir_is_compare(ir_op_t op);
+int ir_binary_type(ir_op_t op, int left, int right);
+int ir_is_pure(ir_t *ir, ir_insn_t *insn);
+int ir_dominates(ir_t *ir, uint32_t a, uint32_t b);
+int ir_in_loop(ir_t *ir, uint32_t loop, uint32_t block);
+
+compiler_code_t ir_compile_program(compiler_t *c, ast_node_t *ast, int closed);
+
+#endif // __PHANTOM_IR_H_
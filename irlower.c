@@ -0,0 +1,769 @@
+#include <string.h>
+
+#include "irlower.h"
+
+/* Where a value lives between being worked out and being used */
+typedef enum {
+    KIND_NONE,      /* Nothing uses it so it is dropped straight away */
+    KIND_CONST,     /* Pushed again wherever it is used */
+    KIND_STACK,     /* Left on the stack for its one use */
+    KIND_LOCAL,     /* Kept in a local slot */
+} kind_t;
+
+/* A forward jump waiting for the block it goes to */
+typedef struct {
+    uint32_t at;
+    uint32_t next;
+} patch_t;
+
+typedef struct {
+    ir_t *ir;
+    compiler_t *c;
+
+    uint8_t *kind;
+    uint32_t *uses;
+    uint32_t *use_block;    /* Block of the last use, which is all that matters for one use */
+    uint32_t *slot;
+
+    uint32_t *pos;          /* Position of each instruction, for live ranges */
+    uint32_t *start;
+    uint32_t *end;
+    uint32_t *block_end;    /* Position of the end of each block */
+    uint32_t *loop_end;
+
+    uint32_t *stack;        /* Values on the stack while a block is simulated */
+    uint32_t sp;
+
+    uint32_t *consts;       /* Constant index of each value and name once it has been added */
+    uint32_t *names;
+
+    patch_t *patches;
+    uint32_t patch_count;
+    uint32_t patch_capacity;
+    uint32_t *pending;      /* Patches waiting for each block */
+    uint32_t *loop_start;   /* Where the OP_LOOP of each loop is */
+
+    uint32_t slot_count;
+} lower_t;
+
+static int is_live(ir_t *ir, ir_insn_t *insn)
+{
+    return !insn->dead && ir->blocks[insn->block].reachable;
+}
+
+/* The values an instruction pops, in the order they are pushed */
+static uint32_t operands(ir_insn_t *insn, uint32_t *ops)
+{
+    switch (insn->op)
+    {
+        case IR_SET:
+        case IR_PRINT:
+        case IR_RAND:
+            ops[0] = insn->args[0];
+            return 1;
+
+        case IR_CONST:
+        case IR_GET:
+        case IR_INC:
+        case IR_DEC:
+        case IR_STDIN:
+        case IR_PHI:
+        case IR_PARAM:
+            return 0;
+
+        case IR_CALL:
+            memcpy(ops, insn->call_args, sizeof(uint32_t) * insn->argc);
+            return insn->argc;
+
+        default:
+            ops[0] = insn->args[0];
+            ops[1] = insn->args[1];
+            return 2;
+    }
+}
+
+static int has_result(ir_op_t op)
+{
+    return op != IR_SET && op != IR_PRINT;
+}
+
+static int is_preheader(ir_t *ir, uint32_t block)
+{
+    ir_block_t *b = &ir->blocks[block];
+    if (b->term != IR_JUMP) return 0;
+
+    ir_block_t *target = &ir->blocks[b->succ[0]];
+
+    return target->term == IR_LOOP && ir->loops[target->loop].preheader == block;
+}
+
+static uint32_t pred_index(ir_block_t *block, uint32_t pred)
+{
+    for (uint32_t p = 0; p < block->pred_count; p++)
+        if (block->preds[p] == pred) return p;
+
+    return IR_NONE;
+}
+
+/*
+ * The values pushed at the end of a block. A preheader pushes the loop counter,
+ * which stays on the stack for the whole loop, and a block that jumps to a
+ * block with phis pushes the value each phi gets from it. ops needs room for
+ * the counter and every phi of the successor. Returns how many of the values
+ * are phi copies through *copies.
+ */
+static uint32_t end_operands(lower_t *l, uint32_t block, uint32_t *ops, uint32_t *copies)
+{
+    ir_t *ir = l->ir;
+    ir_block_t *b = &ir->blocks[block];
+    uint32_t count = 0;
+
+    *copies = 0;
+
+    if (b->term == IR_BRANCH || b->term == IR_RETURN)
+    {
+        ops[count++] = b->arg;
+        return count;
+    }
+
+    if (b->term != IR_JUMP) return count;
+
+    ir_block_t *target = &ir->blocks[b->succ[0]];
+    uint32_t p = pred_index(target, block);
+
+    if (is_preheader(ir, block)) ops[count++] = target->arg;
+
+    for (uint32_t k = 0; k < target->count; k++)
+    {
+        ir_insn_t *phi = &ir->insns[target->insns[k]];
+        if (phi->op != IR_PHI) break;
+        if (phi->dead) continue;
+
+        ops[count++] = phi->args[p];
+        (*copies)++;
+    }
+
+    return count;
+}
+
+static uint32_t max_operands(ir_t *ir)
+{
+    uint32_t most = 2;
+
+    for (uint32_t b = 0; b < ir->block_count; b++)
+        if (ir->blocks[b].count + 1 > most) most = ir->blocks[b].count + 1;
+
+    for (uint32_t v = 0; v < ir->insn_count; v++)
+        if (ir->insns[v].argc > most) most = ir->insns[v].argc;
+
+    return most;
+}
+
+static void add_use(lower_t *l, uint32_t v, uint32_t block)
+{
+    l->uses[v]++;
+    l->use_block[v] = block;
+}
+
+static void count_uses(lower_t *l, uint32_t *ops)
+{
+    ir_t *ir = l->ir;
+
+    for (uint32_t b = 0; b < ir->block_count; b++)
+    {
+        ir_block_t *block = &ir->blocks[b];
+        if (!block->reachable) continue;
+
+        for (uint32_t k = 0; k < block->count; k++)
+        {
+            ir_insn_t *insn = &ir->insns[block->insns[k]];
+            if (insn->dead) continue;
+
+            uint32_t n = operands(insn, ops);
+            for (uint32_t i = 0; i < n; i++) add_use(l, ops[i], b);
+        }
+
+        uint32_t copies;
+        uint32_t n = end_operands(l, b, ops, &copies);
+        for (uint32_t i = 0; i < n; i++) add_use(l, ops[i], b);
+    }
+}
+
+static void choose_kinds(lower_t *l)
+{
+    ir_t *ir = l->ir;
+
+    for (uint32_t v = 0; v < ir->insn_count; v++)
+    {
+        ir_insn_t *insn = &ir->insns[v];
+
+        if (!is_live(ir, insn)) l->kind[v] = KIND_NONE;
+        else if (insn->op == IR_CONST) l->kind[v] = KIND_CONST;
+        else if (insn->op == IR_PHI || insn->op == IR_PARAM) l->kind[v] = KIND_LOCAL;
+        else if (l->uses[v] == 0) l->kind[v] = KIND_NONE;
+        else if (l->uses[v] == 1 && l->use_block[v] == insn->block) l->kind[v] = KIND_STACK;
+        else l->kind[v] = KIND_LOCAL;
+    }
+}
+
+/*
+ * Checks the operands left on the stack are the ones on top, in order, and
+ * pops them. They have to come before any operand that is pushed when it is
+ * used. Anything out of place is moved to a local slot instead.
+ */
+static int take_operands(lower_t *l, uint32_t *ops, uint32_t n)
+{
+    uint32_t k = 0;
+    while (k < n && l->kind[ops[k]] == KIND_STACK) k++;
+
+    int ok = 1;
+
+    for (uint32_t i = k; i < n; i++)
+    {
+        if (l->kind[ops[i]] == KIND_STACK)
+        {
+            l->kind[ops[i]] = KIND_LOCAL;
+            ok = 0;
+        }
+    }
+
+    for (uint32_t i = 0; i < k && ok; i++)
+        if (l->sp < k || l->stack[l->sp - k + i] != ops[i]) ok = 0;
+
+    if (!ok)
+    {
+        for (uint32_t i = 0; i < k; i++) l->kind[ops[i]] = KIND_LOCAL;
+        return 0;
+    }
+
+    l->sp -= k;
+
+    return 1;
+}
+
+/* Returns 0 if any value had to be moved off the stack, in which case it is run again */
+static int simulate_block(lower_t *l, uint32_t b, uint32_t *ops)
+{
+    ir_t *ir = l->ir;
+    ir_block_t *block = &ir->blocks[b];
+
+    l->sp = 0;
+
+    for (uint32_t k = 0; k < block->count; k++)
+    {
+        uint32_t v = block->insns[k];
+        ir_insn_t *insn = &ir->insns[v];
+
+        if (insn->dead || insn->op == IR_CONST || insn->op == IR_PHI || insn->op == IR_PARAM) continue;
+
+        uint32_t n = operands(insn, ops);
+        if (!take_operands(l, ops, n)) return 0;
+
+        if (l->kind[v] == KIND_STACK) l->stack[l->sp++] = v;
+    }
+
+    uint32_t copies;
+    uint32_t n = end_operands(l, b, ops, &copies);
+    if (!take_operands(l, ops, n)) return 0;
+
+    if (l->sp == 0) return 1;
+
+    while (l->sp > 0) l->kind[l->stack[--l->sp]] = KIND_LOCAL;
+
+    return 0;
+}
+
+/* Which loop of the ones around block to extend a use to, given where the value is defined */
+static void extend_to_loops(lower_t *l, uint32_t v, uint32_t use_block)
+{
+    ir_t *ir = l->ir;
+    uint32_t def_block = ir->insns[v].block;
+
+    for (uint32_t loop = ir->blocks[use_block].loop; loop != IR_NONE; loop = ir->loops[loop].parent)
+    {
+        if (ir_in_loop(ir, loop, def_block)) break;
+        if (l->loop_end[loop] > l->end[v]) l->end[v] = l->loop_end[loop];
+    }
+}
+
+static void use_at(lower_t *l, uint32_t v, uint32_t pos, uint32_t block)
+{
+    if (l->kind[v] != KIND_LOCAL) return;
+
+    if (pos > l->end[v]) l->end[v] = pos;
+    extend_to_loops(l, v, block);
+}
+
+/*
+ * Works out where each value in a local slot is live. Positions count the
+ * instructions and block ends in the order they are emitted. A value used in a
+ * loop that it isn't defined in has to live until the end of the loop, as the
+ * loop goes back to before the use.
+ */
+static void find_live_ranges(lower_t *l, uint32_t *ops)
+{
+    ir_t *ir = l->ir;
+    uint32_t pos = 0;
+
+    for (uint32_t b = 0; b < ir->block_count; b++)
+    {
+        ir_block_t *block = &ir->blocks[b];
+        if (!block->reachable) continue;
+
+        for (uint32_t k = 0; k < block->count; k++)
+        {
+            uint32_t v = block->insns[k];
+            if (!ir->insns[v].dead && ir->insns[v].op != IR_PHI) l->pos[v] = pos++;
+        }
+
+        l->block_end[b] = pos++;
+    }
+
+    for (uint32_t i = 0; i < ir->loop_count; i++)
+    {
+        l->loop_end[i] = 0;
+
+        for (uint32_t b = ir->loops[i].header; b < ir->loops[i].exit; b++)
+            if (ir->blocks[b].reachable && l->block_end[b] > l->loop_end[i]) l->loop_end[i] = l->block_end[b];
+    }
+
+    /* Phis are set at the end of each predecessor */
+    for (uint32_t v = 0; v < ir->insn_count; v++)
+    {
+        ir_insn_t *insn = &ir->insns[v];
+        if (l->kind[v] != KIND_LOCAL) continue;
+
+        if (insn->op != IR_PHI)
+        {
+            l->start[v] = l->end[v] = l->pos[v];
+            continue;
+        }
+
+        ir_block_t *block = &ir->blocks[insn->block];
+        l->start[v] = UINT32_MAX;
+        l->end[v] = 0;
+
+        for (uint32_t p = 0; p < block->pred_count; p++)
+        {
+            uint32_t at = l->block_end[block->preds[p]];
+            if (at < l->start[v]) l->start[v] = at;
+            if (at > l->end[v]) l->end[v] = at;
+        }
+    }
+
+    for (uint32_t b = 0; b < ir->block_count; b++)
+    {
+        ir_block_t *block = &ir->blocks[b];
+        if (!block->reachable) continue;
+
+        for (uint32_t k = 0; k < block->count; k++)
+        {
+            ir_insn_t *insn = &ir->insns[block->insns[k]];
+            if (insn->dead) continue;
+
+            uint32_t n = operands(insn, ops);
+            for (uint32_t i = 0; i < n; i++) use_at(l, ops[i], l->pos[block->insns[k]], b);
+        }
+
+        uint32_t copies;
+        uint32_t n = end_operands(l, b, ops, &copies);
+        for (uint32_t i = 0; i < n; i++) use_at(l, ops[i], l->block_end[b], b);
+    }
+}
+
+/* Min heap of values in slots, ordered by where they stop being live */
+static void heap_push(lower_t *l, uint32_t *heap, uint32_t *count, uint32_t v)
+{
+    uint32_t i = (*count)++;
+
+    while (i > 0 && l->end[heap[(i - 1) / 2]] > l->end[v])
+    {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+
+    heap[i] = v;
+}
+
+static uint32_t heap_pop(lower_t *l, uint32_t *heap, uint32_t *count)
+{
+    uint32_t top = heap[0];
+    uint32_t last = heap[--(*count)];
+    uint32_t i = 0;
+
+    for (;;)
+    {
+        uint32_t child = i * 2 + 1;
+        if (child >= *count) break;
+        if (child + 1 < *count && l->end[heap[child + 1]] < l->end[heap[child]]) child++;
+        if (l->end[heap[child]] >= l->end[last]) break;
+
+        heap[i] = heap[child];
+        i = child;
+    }
+
+    if (*count > 0) heap[i] = last;
+
+    return top;
+}
+
+static lower_t *sort_owner;
+
+static int by_start(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+
+    if (sort_owner->start[x] != sort_owner->start[y])
+        return sort_owner->start[x] < sort_owner->start[y] ? -1 : 1;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Gives each value a slot with a linear scan over the live ranges. A slot is
+ * handed on once the value in it is last used, which may be by the instruction
+ * that defines the next value as the operands are read before the result is set.
+ * Parameters keep the slots the call leaves them in, which nothing else is given.
+ * Returns 0 if the slots wouldn't leave enough of the stack for the code itself.
+ */
+static int assign_slots(lower_t *l)
+{
+    ir_t *ir = l->ir;
+    uint32_t count = 0;
+    uint32_t *order = malloc(sizeof(uint32_t) * (ir->insn_count + 1));
+
+    for (uint32_t v = 0; v < ir->insn_count; v++)
+    {
+        if (ir->insns[v].op == IR_PARAM) l->slot[v] = v;
+        else if (l->kind[v] == KIND_LOCAL) order[count++] = v;
+    }
+
+    sort_owner = l;
+    qsort(order, count, sizeof(uint32_t), by_start);
+
+    uint32_t *active = malloc(sizeof(uint32_t) * (count + 1));
+    uint32_t *free_slots = malloc(sizeof(uint32_t) * (count + 1));
+    uint32_t active_count = 0;
+    uint32_t free_count = 0;
+
+    l->slot_count = ir->param_count;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint32_t v = order[i];
+
+        while (active_count > 0 && l->end[active[0]] <= l->start[v])
+            free_slots[free_count++] = l->slot[heap_pop(l, active, &active_count)];
+
+        l->slot[v] = free_count > 0 ? free_slots[--free_count] : l->slot_count++;
+        heap_push(l, active, &active_count, v);
+    }
+
+    free(order);
+    free(active);
+    free(free_slots);
+
+    return l->slot_count <= STACK_MAX / 2;
+}
+
+static uint32_t const_index(lower_t *l, uint32_t v)
+{
+    if (l->consts[v] != IR_NONE) return l->consts[v];
+
+    object_t value = l->ir->insns[v].value;
+
+    /* The chunk frees its own strings */
+    if (value.type == OBJ_VAL_STR)
+    {
+        char *copy = malloc(strlen(value.as.str) + 1);
+        strcpy(copy, value.as.str);
+        value.as.str = copy;
+    }
+
+    return l->consts[v] = compiler_add_const(l->c, value);
+}
+
+static uint32_t name_index(lower_t *l, uint32_t name)
+{
+    if (l->names[name] != IR_NONE) return l->names[name];
+
+    ir_name_t *n = &l->ir->names[name];
+    object_t value = { .type = OBJ_VAL_STR, .as.str = malloc(n->len + 1) };
+    memcpy(value.as.str, n->str, n->len + 1);
+
+    return l->names[name] = compiler_add_const(l->c, value);
+}
+
+static void push_value(lower_t *l, uint32_t v)
+{
+    switch (l->kind[v])
+    {
+        case KIND_CONST: compiler_emit_op(l->c, OP_CONST, const_index(l, v)); break;
+        case KIND_LOCAL: compiler_emit_op(l->c, OP_GET_LOCAL, l->slot[v]); break;
+        default: break;
+    }
+}
+
+static void push_operands(lower_t *l, uint32_t *ops, uint32_t n)
+{
+    for (uint32_t i = 0; i < n; i++) push_value(l, ops[i]);
+}
+
+/* Operators on two longs or two doubles skip the checks of the generic op codes */
+static op_code typed_op(ir_t *ir, ir_insn_t *insn)
+{
+    int left = ir->insns[insn->args[0]].type;
+    int right = ir->insns[insn->args[1]].type;
+
+    if (left == OBJ_VAL_LONG && right == OBJ_VAL_LONG)
+        return OP_ADD_LL + (insn->op - IR_ADD);
+
+    if (left == OBJ_VAL_DOUBLE && right == OBJ_VAL_DOUBLE && insn->op != IR_MOD)
+    {
+        if (ir_is_compare(insn->op)) return OP_GT_DD + (insn->op - IR_GT);
+
+        return OP_ADD_DD + (insn->op - IR_ADD);
+    }
+
+    return ir_op_code(insn->op);
+}
+
+static void emit_insn(lower_t *l, uint32_t v, uint32_t *ops)
+{
+    ir_insn_t *insn = &l->ir->insns[v];
+    compiler_t *c = l->c;
+
+    compiler_set_line(c, insn->line);
+    push_operands(l, ops, operands(insn, ops));
+
+    switch (insn->op)
+    {
+        case IR_GET:
+        {
+            compiler_emit_op(c, OP_CONST, name_index(l, insn->name));
+            compiler_emit_byte(c, OP_VAR_GET);
+            break;
+        }
+        case IR_SET: compiler_emit_op(c, OP_VAR_DECL_K, name_index(l, insn->name)); break;
+        case IR_INC:
+        case IR_DEC:
+        {
+            compiler_emit_op(c, OP_CONST, name_index(l, insn->name));
+            compiler_emit_byte(c, insn->op == IR_INC ? OP_INC : OP_DEC);
+            break;
+        }
+        case IR_PRINT: compiler_emit_byte(c, OP_POP); break;
+        case IR_STDIN: compiler_emit_byte(c, OP_STDIN); break;
+        case IR_RAND: compiler_emit_byte(c, OP_RAND); break;
+        case IR_CALL: compiler_emit_call_to(c, insn->func, insn->argc); break;
+        default: compiler_emit_byte(c, typed_op(l->ir, insn)); break;
+    }
+
+    if (!has_result(insn->op)) return;
+
+    switch (l->kind[v])
+    {
+        case KIND_LOCAL: compiler_emit_op(c, OP_SET_LOCAL, l->slot[v]); break;
+        case KIND_NONE: compiler_emit_byte(c, OP_DROP); break;
+        default: break;
+    }
+}
+
+static void add_patch(lower_t *l, uint32_t at, uint32_t block)
+{
+    if (l->patch_count + 1 > l->patch_capacity)
+    {
+        l->patch_capacity = l->patch_capacity ? l->patch_capacity * 2 : 16;
+        l->patches = realloc(l->patches, sizeof(patch_t) * l->patch_capacity);
+    }
+
+    l->patches[l->patch_count].at = at;
+    l->patches[l->patch_count].next = l->pending[block];
+    l->pending[block] = l->patch_count++;
+}
+
+/* Sets the phis of the block jumped to, pushing every value before any is set */
+static void emit_copies(lower_t *l, uint32_t b, uint32_t *ops)
+{
+    ir_t *ir = l->ir;
+    ir_block_t *target = &ir->blocks[ir->blocks[b].succ[0]];
+
+    uint32_t copies;
+    uint32_t n = end_operands(l, b, ops, &copies);
+    uint32_t first = n - copies;
+
+    /* A phi in the same slot as the value it gets already has it */
+    uint32_t *phis = ops + n;
+    uint32_t kept = 0;
+
+    for (uint32_t k = 0, i = first; k < target->count && i < n; k++)
+    {
+        uint32_t phi = target->insns[k];
+        if (ir->insns[phi].dead) continue;
+
+        uint32_t value = ops[i++];
+        if (l->kind[value] == KIND_LOCAL && l->slot[value] == l->slot[phi]) continue;
+
+        ops[first + kept] = value;
+        phis[kept++] = phi;
+    }
+
+    push_operands(l, ops, first + kept);
+
+    while (kept > 0) compiler_emit_op(l->c, OP_SET_LOCAL, l->slot[phis[--kept]]);
+}
+
+static uint32_t next_block(ir_t *ir, uint32_t b)
+{
+    for (b++; b < ir->block_count && !ir->blocks[b].reachable; b++) ;
+
+    return b;
+}
+
+static void emit_block(lower_t *l, uint32_t b, uint32_t *ops)
+{
+    ir_t *ir = l->ir;
+    ir_block_t *block = &ir->blocks[b];
+    compiler_t *c = l->c;
+
+    for (uint32_t p = l->pending[b]; p != IR_NONE; p = l->patches[p].next)
+        compiler_patch_jump(c, l->patches[p].at);
+
+    for (uint32_t k = 0; k < block->count; k++)
+    {
+        uint32_t v = block->insns[k];
+        ir_op_t op = ir->insns[v].op;
+
+        if (!ir->insns[v].dead && op != IR_CONST && op != IR_PHI && op != IR_PARAM)
+            emit_insn(l, v, ops);
+    }
+
+    switch (block->term)
+    {
+        case IR_BRANCH:
+        {
+            push_value(l, block->arg);
+            add_patch(l, compiler_emit_jump(c, OP_JUMP_IF_FALSE), block->succ[1]);
+
+            if (block->succ[0] != next_block(ir, b))
+                add_patch(l, compiler_emit_jump(c, OP_JUMP), block->succ[0]);
+
+            break;
+        }
+        case IR_LOOP:
+        {
+            uint32_t at = compiler_emit_jump(c, OP_LOOP);
+            l->loop_start[block->loop] = at - 1;
+            add_patch(l, at, block->succ[1]);
+            break;
+        }
+        case IR_JUMP:
+        {
+            emit_copies(l, b, ops);
+
+            ir_block_t *target = &ir->blocks[block->succ[0]];
+
+            if (target->term == IR_LOOP && ir->loops[target->loop].latch == b)
+                compiler_emit_loop_end(c, l->loop_start[target->loop]);
+            else if (block->succ[0] != next_block(ir, b))
+                add_patch(l, compiler_emit_jump(c, OP_JUMP), block->succ[0]);
+
+            break;
+        }
+        case IR_RETURN:
+        {
+            /* A call left on the stack for the return becomes a tail call */
+            push_value(l, block->arg);
+            compiler_emit_return(c, 1);
+            break;
+        }
+        case IR_EXIT: compiler_emit_byte(c, OP_EXIT); break;
+        case IR_END: break;
+    }
+}
+
+static void lower_free(lower_t *l)
+{
+    free(l->kind);
+    free(l->uses);
+    free(l->use_block);
+    free(l->slot);
+    free(l->pos);
+    free(l->start);
+    free(l->end);
+    free(l->block_end);
+    free(l->loop_end);
+    free(l->stack);
+    free(l->consts);
+    free(l->names);
+    free(l->patches);
+    free(l->pending);
+    free(l->loop_start);
+}
+
+/*
+ * Emits bytecode for optimised ir. Values used once in the same block as they
+ * are worked out are left on the stack for their use, the same as the ast
+ * compiler does, and the rest are kept in local slots at the bottom of the
+ * stack, or of the frame for the body of a function, which the compiler
+ * finishes. Returns 0 without emitting anything if the ir needs more slots
+ * than the stack has room for.
+ */
+int ir_lower(ir_t *ir, compiler_t *c)
+{
+    lower_t l;
+    memset(&l, 0, sizeof(lower_t));
+    l.ir = ir;
+    l.c = c;
+
+    uint32_t n = ir->insn_count + 1;
+    uint32_t *ops = malloc(sizeof(uint32_t) * max_operands(ir) * 2);
+
+    l.kind = calloc(n, 1);
+    l.uses = calloc(n, sizeof(uint32_t));
+    l.use_block = calloc(n, sizeof(uint32_t));
+    l.slot = calloc(n, sizeof(uint32_t));
+    l.pos = calloc(n, sizeof(uint32_t));
+    l.start = calloc(n, sizeof(uint32_t));
+    l.end = calloc(n, sizeof(uint32_t));
+    l.stack = malloc(sizeof(uint32_t) * n);
+    l.consts = malloc(sizeof(uint32_t) * n);
+    l.block_end = calloc(ir->block_count + 1, sizeof(uint32_t));
+    l.pending = malloc(sizeof(uint32_t) * (ir->block_count + 1));
+    l.loop_end = calloc(ir->loop_count + 1, sizeof(uint32_t));
+    l.loop_start = calloc(ir->loop_count + 1, sizeof(uint32_t));
+    l.names = malloc(sizeof(uint32_t) * (ir->name_count + 1));
+
+    for (uint32_t i = 0; i < n; i++) l.consts[i] = IR_NONE;
+    for (uint32_t i = 0; i <= ir->block_count; i++) l.pending[i] = IR_NONE;
+    for (uint32_t i = 0; i <= ir->name_count; i++) l.names[i] = IR_NONE;
+
+    count_uses(&l, ops);
+    choose_kinds(&l);
+
+    for (uint32_t b = 0; b < ir->block_count; b++)
+        if (ir->blocks[b].reachable) while (!simulate_block(&l, b, ops)) ;
+
+    find_live_ranges(&l, ops);
+
+    if (!assign_slots(&l))
+    {
+        free(ops);
+        lower_free(&l);
+        return 0;
+    }
+
+    /* Calls that are inlined take their slots after these */
+    compiler_reserve_slots(c, l.slot_count);
+
+    for (uint32_t b = 0; b < ir->block_count; b++)
+        if (ir->blocks[b].reachable) emit_block(&l, b, ops);
+
+    if (!ir->is_func) compiler_emit_byte(c, OP_EXIT);
+
+    free(ops);
+    lower_free(&l);
+
+    return 1;
+}
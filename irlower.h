@@ -0,0 +1,12 @@
+#ifndef __PHANTOM_IRLOWER_H_
+#define __PHANTOM_IRLOWER_H_
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "ir.h"
+#include "compiler.h"
+
+int ir_lower(ir_t *ir, compiler_t *c);
+
+#endif // __PHANTOM_IRLOWER_H_
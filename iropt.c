@@ -0,0 +1,518 @@
+#include <string.h>
+
+#include "iropt.h"
+
+/* Values that have been replaced point at the value that replaced them */
+typedef struct {
+    ir_t *ir;
+    uint32_t *forward;
+} opt_t;
+
+static uint32_t resolve(opt_t *o, uint32_t v)
+{
+    if (v == IR_NONE) return v;
+
+    uint32_t root = v;
+    while (o->forward[root] != root) root = o->forward[root];
+
+    /* Point everything on the way straight at the end */
+    while (o->forward[v] != root)
+    {
+        uint32_t next = o->forward[v];
+        o->forward[v] = root;
+        v = next;
+    }
+
+    return root;
+}
+
+static void replace(opt_t *o, uint32_t v, uint32_t with)
+{
+    o->forward[v] = with;
+    o->ir->insns[v].dead = 1;
+}
+
+/* Rewrites every argument to the value that replaced it */
+static void apply(opt_t *o)
+{
+    ir_t *ir = o->ir;
+
+    for (uint32_t i = 0; i < ir->insn_count; i++)
+    {
+        ir_insn_t *insn = &ir->insns[i];
+
+        for (int a = 0; a < IR_MAX_PREDS; a++)
+            insn->args[a] = resolve(o, insn->args[a]);
+
+        for (uint32_t a = 0; a < insn->argc; a++)
+            insn->call_args[a] = resolve(o, insn->call_args[a]);
+    }
+
+    for (uint32_t i = 0; i < ir->block_count; i++)
+        ir->blocks[i].arg = resolve(o, ir->blocks[i].arg);
+}
+
+static uint32_t intersect(ir_t *ir, uint32_t a, uint32_t b)
+{
+    while (a != b)
+    {
+        while (a > b) a = ir->blocks[a].idom;
+        while (b > a) b = ir->blocks[b].idom;
+    }
+
+    return a;
+}
+
+/*
+ * Blocks are numbered so that every block comes after its predecessors other
+ * than through the back edge of a loop, which makes the block numbers a
+ * reverse postorder for the usual iterative dominator algorithm. The tree is
+ * then numbered so ir_dominates only has to compare two ranges.
+ */
+static void find_dominators(ir_t *ir)
+{
+    ir_block_t *blocks = ir->blocks;
+
+    for (uint32_t i = 0; i < ir->block_count; i++)
+        blocks[i].idom = IR_NONE;
+
+    blocks[0].idom = 0;
+
+    int changed = 1;
+
+    while (changed)
+    {
+        changed = 0;
+
+        for (uint32_t i = 1; i < ir->block_count; i++)
+        {
+            if (!blocks[i].reachable) continue;
+
+            uint32_t idom = IR_NONE;
+
+            for (uint32_t p = 0; p < blocks[i].pred_count; p++)
+            {
+                uint32_t pred = blocks[i].preds[p];
+                if (blocks[pred].idom == IR_NONE) continue;
+
+                idom = idom == IR_NONE ? pred : intersect(ir, pred, idom);
+            }
+
+            if (idom != blocks[i].idom)
+            {
+                blocks[i].idom = idom;
+                changed = 1;
+            }
+        }
+    }
+
+    /* Every block comes after its immediate dominator so sizes can be summed backwards */
+    uint32_t *size = calloc(ir->block_count, sizeof(uint32_t));
+
+    for (uint32_t i = ir->block_count; i-- > 0; )
+    {
+        if (blocks[i].idom == IR_NONE) continue;
+
+        size[i]++;
+        if (i > 0) size[blocks[i].idom] += size[i];
+    }
+
+    /* The next free number in each block's part of the preorder */
+    uint32_t *next = calloc(ir->block_count, sizeof(uint32_t));
+
+    for (uint32_t i = 0; i < ir->block_count; i++)
+    {
+        if (blocks[i].idom == IR_NONE)
+        {
+            blocks[i].dom_pre = UINT32_MAX;
+            blocks[i].dom_post = 0;
+            continue;
+        }
+
+        uint32_t pre = 0;
+
+        if (i > 0)
+        {
+            pre = next[blocks[i].idom];
+            next[blocks[i].idom] += size[i];
+        }
+
+        blocks[i].dom_pre = pre;
+        blocks[i].dom_post = pre + size[i] - 1;
+        next[i] = pre + 1;
+    }
+
+    free(size);
+    free(next);
+}
+
+static int is_live(ir_t *ir, ir_insn_t *insn)
+{
+    return !insn->dead && ir->blocks[insn->block].reachable;
+}
+
+/* Phis whose arguments are all the same value, other than the phi itself */
+static void remove_trivial_phis(opt_t *o)
+{
+    ir_t *ir = o->ir;
+    int changed = 1;
+
+    while (changed)
+    {
+        changed = 0;
+
+        for (uint32_t i = 0; i < ir->insn_count; i++)
+        {
+            ir_insn_t *insn = &ir->insns[i];
+            if (insn->op != IR_PHI || !is_live(ir, insn)) continue;
+
+            uint32_t same = IR_NONE;
+            int trivial = 1;
+
+            for (uint32_t p = 0; p < ir->blocks[insn->block].pred_count; p++)
+            {
+                uint32_t arg = resolve(o, insn->args[p]);
+                if (arg == i || arg == same) continue;
+
+                if (same != IR_NONE)
+                {
+                    trivial = 0;
+                    break;
+                }
+
+                same = arg;
+            }
+
+            if (trivial && same != IR_NONE)
+            {
+                replace(o, i, same);
+                changed = 1;
+            }
+        }
+    }
+
+    apply(o);
+}
+
+/* Not worked out yet. Only used while types are being inferred */
+#define TYPE_PENDING -2
+
+static int is_binary(ir_op_t op)
+{
+    return op >= IR_ADD && op <= IR_NE;
+}
+
+static int meet(int a, int b)
+{
+    if (a == TYPE_PENDING) return b;
+    if (b == TYPE_PENDING) return a;
+
+    return a == b ? a : IR_TYPE_UNKNOWN;
+}
+
+/*
+ * Works out the type of every phi and operator from the values that reach it.
+ * Everything starts out pending and only moves towards unknown, so the types a
+ * loop carries around are found even when the builder had to be cautious
+ * about them, for example after trivial phis were removed.
+ */
+static void infer_types(ir_t *ir)
+{
+    for (uint32_t i = 0; i < ir->insn_count; i++)
+    {
+        ir_insn_t *insn = &ir->insns[i];
+        if (is_live(ir, insn) && (insn->op == IR_PHI || is_binary(insn->op))) insn->type = TYPE_PENDING;
+    }
+
+    int changed = 1;
+
+    while (changed)
+    {
+        changed = 0;
+
+        for (uint32_t b = 0; b < ir->block_count; b++)
+        {
+            ir_block_t *block = &ir->blocks[b];
+            if (!block->reachable) continue;
+
+            for (uint32_t k = 0; k < block->count; k++)
+            {
+                ir_insn_t *insn = &ir->insns[block->insns[k]];
+                if (insn->dead) continue;
+
+                int type;
+
+                if (insn->op == IR_PHI)
+                {
+                    type = TYPE_PENDING;
+
+                    for (uint32_t p = 0; p < block->pred_count; p++)
+                        type = meet(type, ir->insns[insn->args[p]].type);
+                }
+                else if (is_binary(insn->op))
+                {
+                    int left = ir->insns[insn->args[0]].type;
+                    int right = ir->insns[insn->args[1]].type;
+
+                    if (left == TYPE_PENDING || right == TYPE_PENDING) continue;
+
+                    type = ir_binary_type(insn->op, left, right);
+                }
+                else
+                {
+                    continue;
+                }
+
+                if (type != insn->type)
+                {
+                    insn->type = type;
+                    changed = 1;
+                }
+            }
+        }
+    }
+
+    /* Phis that only see each other never get a value at all */
+    for (uint32_t i = 0; i < ir->insn_count; i++)
+        if (ir->insns[i].type == TYPE_PENDING) ir->insns[i].type = IR_TYPE_UNKNOWN;
+}
+
+static int is_commutative(ir_op_t op)
+{
+    return op == IR_ADD || op == IR_MUL || op == IR_EQ || op == IR_NE;
+}
+
+static uint32_t hash_insn(ir_op_t op, uint32_t a, uint32_t b)
+{
+    uint32_t hash = (uint32_t)op * 2654435761u;
+    hash ^= a + 0x9e3779b9u + (hash << 6) + (hash >> 2);
+    hash ^= b + 0x9e3779b9u + (hash << 6) + (hash >> 2);
+
+    return hash;
+}
+
+/*
+ * Replaces a pure operator with an earlier one that works out the same thing
+ * from the same values, as long as the earlier one always runs first.
+ */
+static void eliminate_common(opt_t *o)
+{
+    ir_t *ir = o->ir;
+
+    uint32_t size = 64;
+    while (size < ir->insn_count * 2) size *= 2;
+
+    uint32_t *table = malloc(sizeof(uint32_t) * size);
+    for (uint32_t i = 0; i < size; i++) table[i] = IR_NONE;
+
+    for (uint32_t b = 0; b < ir->block_count; b++)
+    {
+        ir_block_t *block = &ir->blocks[b];
+        if (!block->reachable) continue;
+
+        for (uint32_t k = 0; k < block->count; k++)
+        {
+            uint32_t v = block->insns[k];
+            ir_insn_t *insn = &ir->insns[v];
+
+            if (insn->dead || insn->op == IR_CONST || insn->op == IR_PHI || !ir_is_pure(ir, insn))
+                continue;
+
+            uint32_t a = resolve(o, insn->args[0]);
+            uint32_t c = resolve(o, insn->args[1]);
+
+            if (is_commutative(insn->op) && c < a)
+            {
+                uint32_t t = a;
+                a = c;
+                c = t;
+            }
+
+            insn->args[0] = a;
+            insn->args[1] = c;
+
+            uint32_t at = hash_insn(insn->op, a, c) & (size - 1);
+
+            for (; table[at] != IR_NONE; at = (at + 1) & (size - 1))
+            {
+                ir_insn_t *other = &ir->insns[table[at]];
+                if (other->op == insn->op && other->args[0] == a && other->args[1] == c) break;
+            }
+
+            if (table[at] != IR_NONE && ir_dominates(ir, ir->insns[table[at]].block, b))
+                replace(o, v, table[at]);
+            else
+                table[at] = v;
+        }
+    }
+
+    free(table);
+    apply(o);
+}
+
+static int is_invariant(ir_t *ir, uint32_t loop, ir_insn_t *insn)
+{
+    for (int a = 0; a < IR_MAX_PREDS; a++)
+    {
+        uint32_t arg = insn->args[a];
+        if (arg != IR_NONE && ir_in_loop(ir, loop, ir->insns[arg].block)) return 0;
+    }
+
+    return 1;
+}
+
+static void append_insn(ir_block_t *block, uint32_t v)
+{
+    if (block->count + 1 > block->capacity)
+    {
+        block->capacity = block->capacity ? block->capacity * 2 : 16;
+        block->insns = realloc(block->insns, sizeof(uint32_t) * block->capacity);
+    }
+
+    block->insns[block->count++] = v;
+}
+
+/*
+ * Moves pure operators whose operands don't change in a loop out to the end of
+ * its preheader, so they are worked out once however many times the loop runs.
+ * Inner loops go first so anything hoisted out of them can carry on out of the
+ * loops around them.
+ */
+static void hoist_invariants(ir_t *ir)
+{
+    for (uint32_t l = ir->loop_count; l-- > 0; )
+    {
+        ir_loop_t *loop = &ir->loops[l];
+        ir_block_t *preheader = &ir->blocks[loop->preheader];
+
+        if (!preheader->reachable || loop->exit == IR_NONE) continue;
+
+        for (uint32_t b = loop->header; b < loop->exit; b++)
+        {
+            ir_block_t *block = &ir->blocks[b];
+            uint32_t kept = 0;
+
+            for (uint32_t k = 0; k < block->count; k++)
+            {
+                uint32_t v = block->insns[k];
+                ir_insn_t *insn = &ir->insns[v];
+
+                if (!insn->dead && block->reachable && insn->op != IR_CONST && insn->op != IR_PHI &&
+                    ir_is_pure(ir, insn) && is_invariant(ir, l, insn))
+                {
+                    insn->block = loop->preheader;
+                    append_insn(&ir->blocks[loop->preheader], v);
+                    continue;
+                }
+
+                block->insns[kept++] = v;
+            }
+
+            block->count = kept;
+        }
+    }
+}
+
+/* Globals that something reads back by name */
+static uint8_t *read_names(ir_t *ir)
+{
+    uint8_t *read = calloc(ir->name_count + 1, 1);
+
+    for (uint32_t i = 0; i < ir->insn_count; i++)
+    {
+        ir_insn_t *insn = &ir->insns[i];
+        if (!is_live(ir, insn)) continue;
+
+        if (insn->op == IR_GET || insn->op == IR_INC || insn->op == IR_DEC)
+            read[insn->name] = 1;
+    }
+
+    return read;
+}
+
+/*
+ * Keeps what the script does and the values that go into it. Declarations of
+ * globals that are never read back by name only matter when something else can
+ * look at the globals afterwards, which it can't for a closed program.
+ */
+static void eliminate_dead(ir_t *ir)
+{
+    uint8_t *read = ir->closed ? read_names(ir) : NULL;
+    uint8_t *live = calloc(ir->insn_count + 1, 1);
+    uint32_t *work = malloc(sizeof(uint32_t) * (ir->insn_count + 1));
+    uint32_t count = 0;
+
+    for (uint32_t i = 0; i < ir->insn_count; i++)
+    {
+        ir_insn_t *insn = &ir->insns[i];
+        if (!is_live(ir, insn) || ir_is_pure(ir, insn)) continue;
+        if (insn->op == IR_SET && read && !read[insn->name]) continue;
+
+        live[i] = 1;
+        work[count++] = i;
+    }
+
+    for (uint32_t b = 0; b < ir->block_count; b++)
+    {
+        ir_block_t *block = &ir->blocks[b];
+        if (!block->reachable || block->arg == IR_NONE) continue;
+
+        if (!live[block->arg])
+        {
+            live[block->arg] = 1;
+            work[count++] = block->arg;
+        }
+    }
+
+    while (count > 0)
+    {
+        ir_insn_t *insn = &ir->insns[work[--count]];
+
+        for (uint32_t a = 0; a < IR_MAX_PREDS + insn->argc; a++)
+        {
+            uint32_t arg = a < IR_MAX_PREDS ? insn->args[a] : insn->call_args[a - IR_MAX_PREDS];
+
+            if (arg != IR_NONE && !live[arg])
+            {
+                live[arg] = 1;
+                work[count++] = arg;
+            }
+        }
+    }
+
+    for (uint32_t i = 0; i < ir->insn_count; i++)
+        if (!live[i] || !ir->blocks[ir->insns[i].block].reachable) ir->insns[i].dead = 1;
+
+    free(read);
+    free(live);
+    free(work);
+}
+
+/*
+ * Runs the passes over the ir in order:
+ *  - phis that only ever see one value are replaced with it
+ *  - the types of values are inferred, which the later passes and the
+ *    lowering use to tell which operators can't fail
+ *  - common subexpressions are worked out once
+ *  - loop invariant operators are hoisted out of loops, after which common
+ *    subexpressions are looked for again as hoisting can line more of them up
+ *  - anything whose value isn't used and that has no effect is removed
+ */
+void ir_optimise(ir_t *ir)
+{
+    opt_t o;
+    o.ir = ir;
+    o.forward = malloc(sizeof(uint32_t) * (ir->insn_count + 1));
+
+    for (uint32_t i = 0; i < ir->insn_count; i++) o.forward[i] = i;
+
+    find_dominators(ir);
+    remove_trivial_phis(&o);
+    infer_types(ir);
+    eliminate_common(&o);
+    hoist_invariants(ir);
+    eliminate_common(&o);
+    eliminate_dead(ir);
+
+    free(o.forward);
+}
@@ -0,0 +1,11 @@
+#ifndef __PHANTOM_IROPT_H_
+#define __PHANTOM_IROPT_H_
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "ir.h"
+
+void ir_optimise(ir_t *ir);
+
+#endif // __PHANTOM_IROPT_H_
@@ -0,0 +1,2058 @@
+#include <string.h>
+#include <stddef.h>
+
+#include "jit.h"
+#include "verify.h"
+#include "vm.h"
+
+#if defined(__x86_64__) && !defined(_WIN32)
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define TYPE_AT offsetof(object_t, type)
+#define VALUE_AT offsetof(object_t, as)
+
+/* Registers by their number in an instruction encoding */
+enum { RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSI = 6, RDI = 7, R8 = 8, R9, R10, R11, R12, R13, R14, R15 };
+enum { XMM0 = 0, XMM1 = 1, XMM2 = 2 };
+
+#define REG_NONE (-1)
+
+/* Condition codes, added to the base op code of jcc, setcc and cmovcc */
+enum {
+    CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_A = 0x7,
+    CC_P = 0xa, CC_NP = 0xb, CC_L = 0xc, CC_GE = 0xd, CC_LE = 0xe, CC_G = 0xf,
+};
+
+typedef enum { CMP_GT, CMP_GT_EQ, CMP_LT, CMP_LT_EQ, CMP_EQ, CMP_NE } compare_t;
+
+/* A 32 bit offset in the code that is filled in once where it goes is known */
+typedef struct {
+    uint32_t at;
+    uint32_t target;    /* Bytecode offset of the instruction, or of the stop, it goes to */
+    int to_stop;
+} jit_fixup_t;
+
+/* An operand of a comparison, which is either a stack slot or a constant */
+typedef struct {
+    int32_t disp;
+    int reg;            /* Register a trace keeps the slot in, or REG_NONE */
+    int is_const;
+    object_t value;
+} jit_operand_t;
+
+typedef struct {
+    uint8_t *code;
+    uint32_t count;
+    uint32_t capacity;
+
+    chunk_t *chunk;
+    uint32_t *depth;
+    uint32_t *labels;   /* Where the code for each bytecode offset starts */
+    uint32_t *stops;    /* Where the stop that hands each offset to the interpreter is, if it has one */
+
+    jit_fixup_t *fixups;
+    uint32_t fixup_count;
+    uint32_t fixup_capacity;
+
+    jit_reloc_t *relocs;
+    uint32_t reloc_count;
+    uint32_t reloc_capacity;
+
+    uint32_t epilogue;
+    jit_code_t **traces;    /* Traces of loops the chunk has, by the offset of their OP_LOOP */
+} jit_asm_t;
+
+/* Comparisons that give a bool point it at one of these, which is all the vm looks at */
+static char jit_true[] = "true";
+static char jit_false[] = "false";
+
+static void emit8(jit_asm_t *a, uint8_t byte)
+{
+    if (a->count == a->capacity)
+    {
+        a->capacity = a->capacity ? a->capacity * 2 : 1024;
+        a->code = realloc(a->code, a->capacity);
+    }
+
+    a->code[a->count++] = byte;
+}
+
+static void emit32(jit_asm_t *a, uint32_t val)
+{
+    for (int i = 0; i < 4; i++)
+        emit8(a, (val >> (8 * i)) & 0xff);
+}
+
+static void emit64(jit_asm_t *a, uint64_t val)
+{
+    emit32(a, (uint32_t)val);
+    emit32(a, (uint32_t)(val >> 32));
+}
+
+/* Points the rel32 at at to target, counting from the end of the rel32 */
+static void patch32(jit_asm_t *a, uint32_t at, uint32_t target)
+{
+    uint32_t rel = target - (at + 4);
+    memcpy(a->code + at, &rel, sizeof(rel));
+}
+
+static void add_fixup(jit_asm_t *a, uint32_t target, int to_stop)
+{
+    if (a->fixup_count == a->fixup_capacity)
+    {
+        a->fixup_capacity = a->fixup_capacity ? a->fixup_capacity * 2 : 64;
+        a->fixups = realloc(a->fixups, sizeof(jit_fixup_t) * a->fixup_capacity);
+    }
+
+    a->fixups[a->fixup_count++] = (jit_fixup_t){ .at = a->count, .target = target, .to_stop = to_stop };
+    emit32(a, 0);
+}
+
+/* Where a local slot and a stack slot are from the locals pointer, which is kept in rbx */
+static int32_t local_at(uint32_t slot)
+{
+    return (int32_t)(slot * sizeof(object_t));
+}
+
+static int32_t stack_at(jit_asm_t *a, uint32_t depth)
+{
+    return local_at(a->chunk->local_count + depth);
+}
+
+/* The rex prefix of a 64 bit instruction with reg in the reg field of its mod r/m byte and rm in the r/m field */
+static void rex_w(jit_asm_t *a, int reg, int rm)
+{
+    emit8(a, 0x48 | (reg & 8) >> 1 | (rm & 8) >> 3);
+}
+
+/* The same without the 64 bit operand size, which is only needed for r8 and up */
+static void rex(jit_asm_t *a, int reg, int rm)
+{
+    if ((reg | rm) & 8) emit8(a, 0x40 | (reg & 8) >> 1 | (rm & 8) >> 3);
+}
+
+/* The mod r/m byte for two registers */
+static void modrm(jit_asm_t *a, int reg, int rm)
+{
+    emit8(a, 0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+/* The mod r/m byte and displacement for [rbx + disp] */
+static void mem(jit_asm_t *a, int reg, int32_t disp)
+{
+    emit8(a, 0x80 | (reg & 7) << 3 | RBX);
+    emit32(a, (uint32_t)disp);
+}
+
+static void load(jit_asm_t *a, int reg, int32_t disp)
+{
+    rex_w(a, reg, RBX); emit8(a, 0x8b); mem(a, reg, disp);
+}
+
+static void store(jit_asm_t *a, int reg, int32_t disp)
+{
+    rex_w(a, reg, RBX); emit8(a, 0x89); mem(a, reg, disp);
+}
+
+static void store_type(jit_asm_t *a, int32_t disp, object_val_t type)
+{
+    emit8(a, 0xc7); mem(a, 0, disp + TYPE_AT); emit32(a, type);
+}
+
+static void cmp_type(jit_asm_t *a, int32_t disp, object_val_t type)
+{
+    emit8(a, 0x83); mem(a, 7, disp + TYPE_AT); emit8(a, type);
+}
+
+static void mov_imm(jit_asm_t *a, int reg, uint64_t imm)
+{
+    rex_w(a, 0, reg); emit8(a, 0xb8 + (reg & 7)); emit64(a, imm);
+}
+
+/* Leaves room for an address at the end of the code that is filled in when the code is mapped */
+static void add_reloc(jit_asm_t *a, jit_reloc_kind_t kind, uint32_t index)
+{
+    if (a->reloc_count == a->reloc_capacity)
+    {
+        a->reloc_capacity = a->reloc_capacity ? a->reloc_capacity * 2 : 64;
+        a->relocs = realloc(a->relocs, sizeof(jit_reloc_t) * a->reloc_capacity);
+    }
+
+    a->relocs[a->reloc_count++] = (jit_reloc_t){ .at = a->count, .kind = kind, .index = index };
+    emit64(a, 0);
+}
+
+/* mov reg, imm64 with an address that changes from one process to the next */
+static void mov_reloc(jit_asm_t *a, int reg, jit_reloc_kind_t kind, uint32_t index)
+{
+    rex_w(a, 0, reg); emit8(a, 0xb8 + (reg & 7)); add_reloc(a, kind, index);
+}
+
+/* An instruction on two 64 bit registers, with dst in the r/m field */
+static void alu(jit_asm_t *a, uint8_t op, int dst, int src)
+{
+    rex_w(a, src, dst); emit8(a, op); modrm(a, src, dst);
+}
+
+/* dst *= src */
+static void imul(jit_asm_t *a, int dst, int src)
+{
+    rex_w(a, dst, src); emit8(a, 0x0f); emit8(a, 0xaf); modrm(a, dst, src);
+}
+
+/* A scalar double instruction on an xmm register and [rbx + disp] */
+static void sd_mem(jit_asm_t *a, uint8_t op, int xmm, int32_t disp)
+{
+    emit8(a, 0xf2); rex(a, xmm, RBX); emit8(a, 0x0f); emit8(a, op); mem(a, xmm, disp);
+}
+
+/* The same on two xmm registers */
+static void sd_reg(jit_asm_t *a, uint8_t op, int dst, int src)
+{
+    emit8(a, 0xf2); rex(a, dst, src); emit8(a, 0x0f); emit8(a, op); modrm(a, dst, src);
+}
+
+/* movq xmm, reg, which moves the bits of a double from a general register */
+static void movq_xmm(jit_asm_t *a, int xmm, int reg)
+{
+    emit8(a, 0x66); rex_w(a, xmm, reg); emit8(a, 0x0f); emit8(a, 0x6e); modrm(a, xmm, reg);
+}
+
+static void setcc(jit_asm_t *a, int cc, int reg)
+{
+    emit8(a, 0x0f); emit8(a, 0x90 + cc); emit8(a, 0xc0 | reg);
+}
+
+/* Copies a whole object, tag and value */
+static void copy_obj(jit_asm_t *a, int32_t dst, int32_t src)
+{
+    if (dst == src) return;
+
+    load(a, RAX, src);
+    load(a, RCX, src + 8);
+    store(a, RAX, dst);
+    store(a, RCX, dst + 8);
+}
+
+static void jmp_to(jit_asm_t *a, uint32_t target)
+{
+    emit8(a, 0xe9);
+    add_fixup(a, target, 0);
+}
+
+static void jcc_to(jit_asm_t *a, int cc, uint32_t target)
+{
+    emit8(a, 0x0f); emit8(a, 0x80 + cc);
+    add_fixup(a, target, 0);
+}
+
+/* Hands the instruction at offset to the interpreter when the condition holds, before it has changed anything */
+static void stop_if(jit_asm_t *a, int cc, uint32_t offset)
+{
+    emit8(a, 0x0f); emit8(a, 0x80 + cc);
+    add_fixup(a, offset, 1);
+}
+
+/* A forward jump within the code of one instruction. Returns where its rel32 is to be patched by land */
+static uint32_t jcc_fwd(jit_asm_t *a, int cc)
+{
+    emit8(a, 0x0f); emit8(a, 0x80 + cc); emit32(a, 0);
+
+    return a->count - 4;
+}
+
+static uint32_t jmp_fwd(jit_asm_t *a)
+{
+    emit8(a, 0xe9); emit32(a, 0);
+
+    return a->count - 4;
+}
+
+static void land(jit_asm_t *a, uint32_t at)
+{
+    patch32(a, at, a->count);
+}
+
+/* Stops with the offset in eax for the interpreter to carry on from */
+static void emit_stop(jit_asm_t *a, uint32_t offset)
+{
+    emit8(a, 0xb8); emit32(a, offset);
+    emit8(a, 0xe9); emit32(a, 0);
+    patch32(a, a->count - 4, a->epilogue);
+}
+
+/* Stops at the instruction at offset unless the object at disp has the type */
+static void guard_type(jit_asm_t *a, int32_t disp, object_val_t type, uint32_t offset)
+{
+    cmp_type(a, disp, type);
+    stop_if(a, CC_NE, offset);
+}
+
+/* Returns the register holding the long, which is reg unless the operand already lives in one */
+static int load_long(jit_asm_t *a, int reg, jit_operand_t *o)
+{
+    if (o->reg != REG_NONE) return o->reg;
+
+    if (o->is_const) mov_imm(a, reg, (uint64_t)o->value.as.long_num);
+    else load(a, reg, o->disp + VALUE_AT);
+
+    return reg;
+}
+
+static int load_double(jit_asm_t *a, int xmm, jit_operand_t *o)
+{
+    if (o->reg != REG_NONE) return o->reg;
+
+    if (!o->is_const)
+    {
+        sd_mem(a, 0x10, xmm, o->disp + VALUE_AT);
+        return xmm;
+    }
+
+    uint64_t bits;
+    memcpy(&bits, &o->value.as.double_num, sizeof(bits));
+
+    mov_imm(a, RAX, bits);
+    movq_xmm(a, xmm, RAX);
+
+    return xmm;
+}
+
+/* Sets al to whether the comparison of two longs holds */
+static void compare_longs(jit_asm_t *a, compare_t cmp, jit_operand_t *left, jit_operand_t *right)
+{
+    static const int cc[] = { CC_G, CC_GE, CC_L, CC_LE, CC_E, CC_NE };
+
+    int left_reg = load_long(a, RAX, left);
+    int right_reg = load_long(a, RCX, right);
+    alu(a, 0x39, left_reg, right_reg);
+    setcc(a, cc[cmp], RAX);
+}
+
+/* The same for doubles, where nothing holds for a NaN other than != */
+static void compare_doubles(jit_asm_t *a, compare_t cmp, jit_operand_t *left, jit_operand_t *right)
+{
+    int left_reg = load_double(a, XMM0, left);
+    int right_reg = load_double(a, XMM1, right);
+
+    /* ucomisd with the operands swapped for < and <= so above means the comparison holds */
+    int swap = cmp == CMP_LT || cmp == CMP_LT_EQ;
+    emit8(a, 0x66);
+    rex(a, swap ? right_reg : left_reg, swap ? left_reg : right_reg);
+    emit8(a, 0x0f); emit8(a, 0x2e);
+    modrm(a, swap ? right_reg : left_reg, swap ? left_reg : right_reg);
+
+    switch (cmp)
+    {
+        case CMP_GT: case CMP_LT: setcc(a, CC_A, RAX); break;
+        case CMP_GT_EQ: case CMP_LT_EQ: setcc(a, CC_AE, RAX); break;
+        case CMP_EQ:
+        {
+            setcc(a, CC_E, RAX);
+            setcc(a, CC_NP, RCX);
+            emit8(a, 0x20); emit8(a, 0xc8);     /* and al, cl */
+            break;
+        }
+        case CMP_NE:
+        {
+            setcc(a, CC_NE, RAX);
+            setcc(a, CC_P, RCX);
+            emit8(a, 0x08); emit8(a, 0xc8);     /* or al, cl */
+            break;
+        }
+    }
+}
+
+/*
+ * Sets al to whether a comparison holds. An operand that could be either
+ * type is checked, and anything but two longs or two doubles goes to the
+ * interpreter, which also compares a long with a double.
+ */
+static void emit_compare(jit_asm_t *a, uint32_t offset, compare_t cmp, jit_operand_t *left, jit_operand_t *right,
+                         int typed, object_val_t type)
+{
+    if (typed)
+    {
+        if (type == OBJ_VAL_LONG) compare_longs(a, cmp, left, right);
+        else compare_doubles(a, cmp, left, right);
+        return;
+    }
+
+    if (right->is_const)
+    {
+        guard_type(a, left->disp, right->value.type, offset);
+
+        if (right->value.type == OBJ_VAL_LONG) compare_longs(a, cmp, left, right);
+        else compare_doubles(a, cmp, left, right);
+        return;
+    }
+
+    cmp_type(a, left->disp, OBJ_VAL_LONG);
+    uint32_t not_long = jcc_fwd(a, CC_NE);
+
+    guard_type(a, right->disp, OBJ_VAL_LONG, offset);
+    compare_longs(a, cmp, left, right);
+    uint32_t done = jmp_fwd(a);
+
+    land(a, not_long);
+    guard_type(a, left->disp, OBJ_VAL_DOUBLE, offset);
+    guard_type(a, right->disp, OBJ_VAL_DOUBLE, offset);
+    compare_doubles(a, cmp, left, right);
+
+    land(a, done);
+}
+
+/* Stores true or false from al */
+static void store_bool(jit_asm_t *a, int32_t disp)
+{
+    emit8(a, 0x84); emit8(a, 0xc0);                         /* test al, al */
+    mov_reloc(a, RCX, JIT_RELOC_TRUE, 0);
+    mov_reloc(a, RDX, JIT_RELOC_FALSE, 0);
+    emit8(a, 0x48); emit8(a, 0x0f); emit8(a, 0x45); emit8(a, 0xd1);     /* cmovne rdx, rcx */
+
+    store_type(a, disp, OBJ_VAL_BOOL);
+    store(a, RDX, disp + VALUE_AT);
+}
+
+/* Jumps to target when al is the same as when */
+static void branch_on(jit_asm_t *a, int when, uint32_t target)
+{
+    emit8(a, 0x84); emit8(a, 0xc0);
+    jcc_to(a, when ? CC_NE : CC_E, target);
+}
+
+/* Sets al to whether the long at disp is truthy */
+static void truthy_long(jit_asm_t *a, int32_t disp)
+{
+    /* cmp qword [rbx + disp], 0 */
+    emit8(a, 0x48); emit8(a, 0x83); mem(a, 7, disp + VALUE_AT); emit8(a, 0);
+    setcc(a, CC_NE, RAX);
+}
+
+/* The same for a bool, which is true if its string is "true" */
+static void truthy_bool(jit_asm_t *a, int32_t disp)
+{
+    load(a, RAX, disp + VALUE_AT);
+    emit8(a, 0x81); emit8(a, 0x38); emit32(a, 0x65757274);  /* cmp dword [rax], "true" */
+    setcc(a, CC_E, RCX);
+    uint32_t not_true = jcc_fwd(a, CC_NE);
+    emit8(a, 0x80); emit8(a, 0x78); emit8(a, 4); emit8(a, 0); /* cmp byte [rax + 4], 0 */
+    setcc(a, CC_E, RCX);
+    land(a, not_true);
+    emit8(a, 0x88); emit8(a, 0xc8);                         /* mov al, cl */
+}
+
+/*
+ * Sets al to whether the object at disp is truthy. Longs and bools are
+ * checked here and anything else goes to the interpreter.
+ */
+static void emit_truthy(jit_asm_t *a, int32_t disp, uint32_t offset)
+{
+    cmp_type(a, disp, OBJ_VAL_LONG);
+    uint32_t not_long = jcc_fwd(a, CC_NE);
+
+    truthy_long(a, disp);
+    uint32_t done = jmp_fwd(a);
+
+    land(a, not_long);
+    guard_type(a, disp, OBJ_VAL_BOOL, offset);
+    truthy_bool(a, disp);
+
+    land(a, done);
+}
+
+/* dst = dst op src on longs in place. Division by zero is left to the interpreter */
+static void long_arith(jit_asm_t *a, uint8_t code, int32_t dst, int32_t src, uint32_t offset)
+{
+    load(a, RAX, dst + VALUE_AT);
+    load(a, RCX, src + VALUE_AT);
+
+    switch (code)
+    {
+        case OP_ADD: alu(a, 0x01, RAX, RCX); break;
+        case OP_SUB: alu(a, 0x29, RAX, RCX); break;
+        case OP_MUL: imul(a, RAX, RCX); break;
+        default:
+        {
+            alu(a, 0x85, RCX, RCX);
+            stop_if(a, CC_E, offset);
+
+            emit8(a, 0x48); emit8(a, 0x99);                 /* cqo */
+            emit8(a, 0x48); emit8(a, 0xf7); emit8(a, 0xf9); /* idiv rcx */
+
+            if (code == OP_MOD) alu(a, 0x89, RAX, RDX);
+            break;
+        }
+    }
+
+    store(a, RAX, dst + VALUE_AT);
+}
+
+static void double_arith(jit_asm_t *a, uint8_t code, int32_t dst, int32_t src)
+{
+    static const uint8_t ops[] = { [OP_ADD] = 0x58, [OP_SUB] = 0x5c, [OP_MUL] = 0x59, [OP_DIV] = 0x5e };
+
+    sd_mem(a, 0x10, XMM0, dst + VALUE_AT);
+    sd_mem(a, ops[code], XMM0, src + VALUE_AT);
+    sd_mem(a, 0x11, XMM0, dst + VALUE_AT);
+}
+
+/* An operator on two longs or two doubles. Anything else, such as a modulo of doubles, goes to the interpreter */
+static void emit_arith(jit_asm_t *a, uint8_t code, int32_t dst, int32_t src, uint32_t offset)
+{
+    cmp_type(a, dst, OBJ_VAL_LONG);
+    uint32_t not_long = jcc_fwd(a, CC_NE);
+
+    guard_type(a, src, OBJ_VAL_LONG, offset);
+    long_arith(a, code, dst, src, offset);
+    uint32_t done = jmp_fwd(a);
+
+    land(a, not_long);
+
+    if (code == OP_MOD)
+    {
+        stop_if(a, CC_NE, offset);
+    }
+    else
+    {
+        guard_type(a, dst, OBJ_VAL_DOUBLE, offset);
+        guard_type(a, src, OBJ_VAL_DOUBLE, offset);
+        double_arith(a, code, dst, src);
+    }
+
+    land(a, done);
+}
+
+/* The generic operator a typed one does the same as, given operands of its type */
+static uint8_t untyped(uint8_t code)
+{
+    switch (code)
+    {
+        case OP_ADD_LL: case OP_ADD_DD: return OP_ADD;
+        case OP_SUB_LL: case OP_SUB_DD: return OP_SUB;
+        case OP_MUL_LL: case OP_MUL_DD: return OP_MUL;
+        case OP_DIV_LL: case OP_DIV_DD: return OP_DIV;
+        default: return OP_MOD;
+    }
+}
+
+static int compare_kind(uint8_t code, compare_t *cmp)
+{
+    /* The typed compare and branch op codes come in runs of six in the order of compare_t */
+    if (code >= OP_JGT_LL && code <= OP_JNE_DD_K)
+    {
+        *cmp = (compare_t)((code - OP_JGT_LL) % 6);
+        return 1;
+    }
+
+    switch (code)
+    {
+        case OP_GT: case OP_GT_K: case OP_GT_LL: case OP_GT_DD: case OP_JGT: case OP_JGT_K: *cmp = CMP_GT; return 1;
+        case OP_GT_EQ: case OP_GT_EQ_K: case OP_GT_EQ_LL: case OP_GT_EQ_DD: case OP_JGT_EQ: case OP_JGT_EQ_K: *cmp = CMP_GT_EQ; return 1;
+        case OP_LT: case OP_LT_K: case OP_LT_LL: case OP_LT_DD: case OP_JLT: case OP_JLT_K: *cmp = CMP_LT; return 1;
+        case OP_LT_EQ: case OP_LT_EQ_K: case OP_LT_EQ_LL: case OP_LT_EQ_DD: case OP_JLT_EQ: case OP_JLT_EQ_K: *cmp = CMP_LT_EQ; return 1;
+        case OP_EQ: case OP_EQ_K: case OP_EQ_LL: case OP_EQ_DD: case OP_JEQ: case OP_JEQ_K: *cmp = CMP_EQ; return 1;
+        case OP_NE: case OP_NE_K: case OP_NE_LL: case OP_NE_DD: case OP_JNE: case OP_JNE_K: *cmp = CMP_NE; return 1;
+        default: return 0;
+    }
+}
+
+static uint32_t jump_target(chunk_t *chunk, uint32_t offset)
+{
+    uint8_t code = chunk->code[offset];
+    uint32_t end = offset + vm_op_length(code);
+    uint32_t jump = CHUNK_READ_U16(chunk->code + end - CHUNK_JUMP_BYTES);
+
+    return code == OP_LOOP_END ? end - jump : end + jump;
+}
+
+/* Comparisons, which push a bool or branch on it */
+static int emit_comparison(jit_asm_t *a, uint32_t i, compare_t cmp)
+{
+    chunk_t *chunk = a->chunk;
+    uint8_t code = chunk->code[i];
+    uint32_t depth = a->depth[i];
+    int typed = vm_op_operand_type(code) >= 0;
+    object_val_t type = typed ? (object_val_t)vm_op_operand_type(code) : OBJ_VAL_LONG;
+
+    jit_operand_t left = { .reg = REG_NONE }, right = { .reg = REG_NONE };
+
+    if (vm_op_has_const(code))
+    {
+        right.is_const = 1;
+        right.value = chunk->constants[CHUNK_READ_U24(chunk->code + i + 1)];
+
+        /* Other constants never compare as anything but false, which the interpreter can work out */
+        if (right.value.type != OBJ_VAL_LONG && right.value.type != OBJ_VAL_DOUBLE) return 0;
+
+        left.disp = stack_at(a, depth - 1);
+    }
+    else
+    {
+        left.disp = stack_at(a, depth - 2);
+        right.disp = stack_at(a, depth - 1);
+    }
+
+    emit_compare(a, i, cmp, &left, &right, typed, type);
+
+    if (vm_op_is_jump(code)) branch_on(a, 0, jump_target(chunk, i));
+    else store_bool(a, left.disp);
+
+    return 1;
+}
+
+/* Emits the code for one instruction. Returns 0 if it is left to the interpreter */
+static int emit_insn(jit_asm_t *a, uint32_t i)
+{
+    chunk_t *chunk = a->chunk;
+    uint8_t code = chunk->code[i];
+    uint32_t depth = a->depth[i];
+    compare_t cmp;
+
+    if (compare_kind(code, &cmp)) return emit_comparison(a, i, cmp);
+
+    switch (code)
+    {
+        case OP_CONST:
+        {
+            uint32_t index = CHUNK_READ_U24(chunk->code + i + 1);
+            object_t obj = chunk->constants[index];
+            uint64_t bits;
+            memcpy(&bits, &obj.as, sizeof(bits));
+
+            store_type(a, stack_at(a, depth), obj.type);
+
+            /* Strings are where this process put them */
+            if (obj.type == OBJ_VAL_STR || obj.type == OBJ_VAL_BOOL) mov_reloc(a, RAX, JIT_RELOC_CONST, index);
+            else mov_imm(a, RAX, bits);
+
+            store(a, RAX, stack_at(a, depth) + VALUE_AT);
+            return 1;
+        }
+        case OP_GET_LOCAL:
+        {
+            copy_obj(a, stack_at(a, depth), local_at(CHUNK_READ_U16(chunk->code + i + 1)));
+            return 1;
+        }
+        case OP_SET_LOCAL:
+        {
+            copy_obj(a, local_at(CHUNK_READ_U16(chunk->code + i + 1)), stack_at(a, depth - 1));
+            return 1;
+        }
+        case OP_INC_LOCAL:
+        case OP_DEC_LOCAL:
+        {
+            int32_t slot = local_at(CHUNK_READ_U16(chunk->code + i + 1));
+
+            /* Doubles are stepped by the interpreter */
+            guard_type(a, slot, OBJ_VAL_LONG, i);
+
+            /* inc or dec qword [rbx + slot] */
+            emit8(a, 0x48); emit8(a, 0xff); mem(a, code == OP_INC_LOCAL ? 0 : 1, slot + VALUE_AT);
+            copy_obj(a, stack_at(a, depth), slot);
+            return 1;
+        }
+        case OP_DROP:
+            return 1;
+
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_MOD:
+        {
+            emit_arith(a, code, stack_at(a, depth - 2), stack_at(a, depth - 1), i);
+            return 1;
+        }
+        case OP_ADD_LL: case OP_SUB_LL: case OP_MUL_LL: case OP_DIV_LL: case OP_MOD_LL:
+        {
+            long_arith(a, untyped(code), stack_at(a, depth - 2), stack_at(a, depth - 1), i);
+            return 1;
+        }
+        case OP_ADD_DD: case OP_SUB_DD: case OP_MUL_DD: case OP_DIV_DD:
+        {
+            double_arith(a, untyped(code), stack_at(a, depth - 2), stack_at(a, depth - 1));
+            return 1;
+        }
+        case OP_JUMP:
+        {
+            jmp_to(a, jump_target(chunk, i));
+            return 1;
+        }
+        case OP_LOOP_END:
+        {
+            uint32_t target = jump_target(chunk, i);
+
+            /* A loop with a trace goes back through the interpreter, which runs the trace */
+            emit8(a, 0xe9);
+            add_fixup(a, target, a->traces && a->traces[target]);
+            return 1;
+        }
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+        {
+            emit_truthy(a, stack_at(a, depth - 1), i);
+            branch_on(a, code == OP_JUMP_IF_TRUE, jump_target(chunk, i));
+            return 1;
+        }
+        case OP_LOOP:
+        {
+            int32_t counter = stack_at(a, depth - 1) + VALUE_AT;
+
+            /* The loop is done once the counter is all zero bits, and is counted down otherwise */
+            emit8(a, 0x48); emit8(a, 0x83); mem(a, 7, counter); emit8(a, 0);
+            jcc_to(a, CC_E, jump_target(chunk, i));
+            emit8(a, 0x48); emit8(a, 0xff); mem(a, 1, counter);
+            return 1;
+        }
+        default:
+            return 0;
+    }
+}
+
+/*
+ * The code starts with an entry that jumps to the instruction it is asked to
+ * start at through a table of every offset, which comes after the code:
+ *     push rbx; mov rbx, rdi; mov esi, esi; lea rax, [table]; jmp [rax + rsi * 8]
+ * and the epilogue that every stop goes through:
+ *     pop rbx; ret
+ */
+static uint32_t emit_entry(jit_asm_t *a)
+{
+    emit8(a, 0x53);
+    emit8(a, 0x48); emit8(a, 0x89); emit8(a, 0xfb);
+    emit8(a, 0x89); emit8(a, 0xf6);
+    emit8(a, 0x48); emit8(a, 0x8d); emit8(a, 0x05); emit32(a, 0);
+
+    uint32_t table_at = a->count - 4;
+
+    emit8(a, 0xff); emit8(a, 0x24); emit8(a, 0xf0);
+
+    a->epilogue = a->count;
+    emit8(a, 0x5b);
+    emit8(a, 0xc3);
+
+    return table_at;
+}
+
+/* The address a relocation is filled in with for the code at base */
+static uint64_t reloc_value(jit_reloc_t *reloc, chunk_t *chunk, uint8_t *base)
+{
+    switch (reloc->kind)
+    {
+        case JIT_RELOC_CODE: return (uint64_t)(uintptr_t)(base + reloc->index);
+        case JIT_RELOC_TRUE: return (uint64_t)(uintptr_t)jit_true;
+        case JIT_RELOC_FALSE: return (uint64_t)(uintptr_t)jit_false;
+        default: return (uint64_t)(uintptr_t)chunk->constants[reloc->index].as.str;
+    }
+}
+
+/* Copies the code into pages that are made executable once they are no longer writable, filling in its addresses */
+static int map_code(jit_code_t *jit, chunk_t *chunk, uint8_t *code, size_t size, jit_reloc_t *relocs, uint32_t reloc_count)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+    jit->size = (size + page - 1) / page * page;
+    jit->mem = mmap(NULL, jit->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (jit->mem == MAP_FAILED)
+    {
+        jit->mem = NULL;
+        return 0;
+    }
+
+    uint8_t *base = jit->mem;
+    memcpy(base, code, size);
+
+    for (uint32_t r = 0; r < reloc_count; r++)
+    {
+        uint64_t addr = reloc_value(&relocs[r], chunk, base);
+        memcpy(base + relocs[r].at, &addr, sizeof(addr));
+    }
+
+    if (mprotect(jit->mem, jit->size, PROT_READ | PROT_EXEC) != 0) return 0;
+
+    jit->entry = (jit_entry_t)(uintptr_t)base;
+
+    return 1;
+}
+
+/* Code for the chunk that owns the depths, which is mapped once it has been laid down */
+static jit_code_t *new_code(chunk_t *chunk, uint32_t *depth)
+{
+    jit_code_t *jit = malloc(sizeof(jit_code_t));
+    jit->entry = NULL;
+    jit->mem = NULL;
+    jit->size = 0;
+    jit->code_size = 0;
+    jit->map = NULL;
+    jit->map_count = 0;
+    jit->relocs = NULL;
+    jit->reloc_count = 0;
+    jit->image_size = 0;
+    jit->depth = depth;
+    jit->native = calloc(chunk->count + 1, 1);
+    jit->local_count = chunk->local_count;
+    jit->iterations = 0;
+    jit->exits = 0;
+    jit->deopts = NULL;
+    jit->deopt_count = 0;
+    jit->deopt_slots = NULL;
+    jit->globals = NULL;
+    jit->global_count = 0;
+    jit->global_slot = 0;
+
+    return jit;
+}
+
+/* Points the jumps at what they go to. Stops for operands the code doesn't handle go after it, out of the way */
+static void resolve_fixups(jit_asm_t *a)
+{
+    for (uint32_t f = 0; f < a->fixup_count; f++)
+    {
+        jit_fixup_t *fixup = &a->fixups[f];
+
+        if (fixup->to_stop && a->stops[fixup->target] == UINT32_MAX)
+        {
+            a->stops[fixup->target] = a->count;
+            emit_stop(a, fixup->target);
+        }
+
+        patch32(a, fixup->at, fixup->to_stop ? a->stops[fixup->target] : a->labels[fixup->target]);
+    }
+}
+
+static void free_asm(jit_asm_t *a)
+{
+    free(a->code);
+    free(a->labels);
+    free(a->stops);
+    free(a->fixups);
+    free(a->relocs);
+}
+
+/*
+ * Translates a verified chunk to x86-64 by laying down a template for each
+ * instruction. The verifier gives the depth of the stack at every
+ * instruction, so each stack slot is at a fixed place from the locals and
+ * the native code never keeps a stack pointer. Instructions with no template,
+ * and operands of a type a template doesn't handle, stop the native code and
+ * leave the instruction to the interpreter, which enters the native code
+ * again after it. Returns NULL if the chunk can't be translated.
+ */
+jit_code_t *jit_compile(chunk_t *chunk, func_table_t *funcs, int in_function, jit_code_t **traces)
+{
+    uint32_t *depth = malloc(sizeof(uint32_t) * (chunk->count + 1));
+
+    if (verify_depths(chunk, funcs, in_function, depth).code != VERIFY_OK)
+    {
+        free(depth);
+        return NULL;
+    }
+
+    jit_asm_t a = { 0 };
+    a.chunk = chunk;
+    a.depth = depth;
+    a.traces = traces;
+    a.labels = malloc(sizeof(uint32_t) * (chunk->count + 1));
+    a.stops = malloc(sizeof(uint32_t) * (chunk->count + 1));
+
+    jit_code_t *jit = new_code(chunk, depth);
+
+    uint32_t table_at = emit_entry(&a);
+
+    for (uint32_t i = 0; i <= chunk->count; i++)
+        a.stops[i] = UINT32_MAX;
+
+    for (uint32_t i = 0; i < chunk->count; i += vm_op_length(chunk->code[i]))
+    {
+        uint32_t relocs = a.reloc_count;
+        a.labels[i] = a.count;
+
+        if (depth[i] != VERIFY_UNREACHED && emit_insn(&a, i))
+        {
+            jit->native[i] = 1;
+            continue;
+        }
+
+        /* The instruction is left to the interpreter */
+        a.count = a.labels[i];
+        a.reloc_count = relocs;
+        a.stops[i] = a.count;
+        emit_stop(&a, i);
+    }
+
+    a.labels[chunk->count] = a.stops[chunk->count] = a.count;
+    emit_stop(&a, chunk->count);
+
+    /* Offsets inside an instruction are never entered at */
+    for (uint32_t i = 0, next = 0; i < chunk->count; i++)
+    {
+        if (i == next) next += vm_op_length(chunk->code[i]);
+        else a.labels[i] = a.labels[chunk->count];
+    }
+
+    resolve_fixups(&a);
+
+    jit->map = malloc(sizeof(jit_map_t) * chunk->count);
+
+    for (uint32_t i = 0; i < chunk->count; i += vm_op_length(chunk->code[i]))
+        jit->map[jit->map_count++] = (jit_map_t){ .code = a.labels[i], .offset = i };
+
+    while (a.count % sizeof(uint64_t)) emit8(&a, 0xcc);
+
+    jit->code_size = a.count;
+    patch32(&a, table_at, a.count);
+
+    for (uint32_t i = 0; i <= chunk->count; i++)
+        add_reloc(&a, JIT_RELOC_CODE, a.labels[i]);
+
+    if (!map_code(jit, chunk, a.code, a.count, a.relocs, a.reloc_count))
+    {
+        free_asm(&a);
+        jit_free(jit);
+        return NULL;
+    }
+
+    /* The relocations are kept with the code so it can be written out */
+    jit->relocs = a.relocs;
+    jit->reloc_count = a.reloc_count;
+    jit->image_size = a.count;
+    a.relocs = NULL;
+
+    free_asm(&a);
+
+    return jit;
+}
+
+#define TYPE_UNKNOWN (-1)
+#define TYPE_MIXED (-2)
+
+/* Registers a trace can keep slots in. Nothing is called from a trace, so the ones a call would clobber are used first */
+static const int trace_gprs[] = { RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+static const int trace_xmms[] = { XMM2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 };
+
+/*
+ * A value a slot holds along the trace and the register it is kept in. A
+ * stack slot the trace pushes holds a new value from each write, up to its
+ * last read. Locals, globals, and slots that come round from the last
+ * iteration, hold one value for the whole trace, since the interpreter can
+ * read them once it leaves. A value that every use sees as the same long or
+ * double can live in a register, and is only written back when the trace
+ * leaves. Nothing a trace runs can reach a global by its name, so none of
+ * them escape while it runs and they go in registers the same as locals.
+ */
+typedef struct {
+    uint32_t slot;
+    uint32_t start;     /* Index in the path of the first and last instructions to use the value */
+    uint32_t end;
+    uint32_t uses;
+    int type;           /* Type every use sees, or TYPE_MIXED */
+    int wraps;          /* Kept for the whole trace, and loaded before the first iteration */
+    int reg;            /* REG_NONE if it stays in memory */
+    uint32_t next;      /* The next value of the same slot, or UINT32_MAX */
+} jit_range_t;
+
+/* An exit that leaves values in registers for the interpreter to put back in their slots */
+typedef struct {
+    uint32_t at;        /* The rel32 of the jump to it */
+    uint32_t offset;    /* Where the interpreter carries on */
+    uint32_t k;         /* Index in the path of the instruction it leaves from */
+} jit_exit_t;
+
+/*
+ * A trace being compiled. The type of each slot is worked out along the
+ * path rather than checked at each instruction, so slots are only checked
+ * once, on entry, and slots holding the same long or double all the way
+ * are given registers by a linear scan over where they are used.
+ */
+typedef struct {
+    jit_asm_t a;
+    trace_t *trace;
+
+    int *types;         /* Type in memory of each slot at this point in the trace, or TYPE_UNKNOWN */
+    int *guards;        /* Type each slot is checked for on entry, or TYPE_UNKNOWN if it isn't */
+    int *tags;          /* Type stack slots above the loop are tagged with on entry, so iterations needn't */
+    uint32_t slot_count;
+    uint32_t global_slot;   /* The first of the slots globals are kept in, above the deepest the stack gets */
+    int discover;       /* Set while finding the slots read before they are written */
+    uint32_t loop_top;  /* Where an iteration starts, once the entry checks are done */
+
+    jit_range_t *ranges;
+    uint32_t range_count;
+    uint32_t range_capacity;
+    uint32_t *first;    /* The first value of each slot, once the trace has been scanned */
+    uint32_t *current;  /* The value each slot holds at this point in the trace, or UINT32_MAX */
+    uint8_t *reg_only;  /* Set for stack slots whose every value is in a register, which are only tagged on the way out */
+    int scan;           /* Set while finding where each slot is used */
+    uint32_t k;         /* Index in the path of the instruction being laid down */
+    jit_map_t *map;     /* Where the code for each instruction in the path starts, as of the last pass */
+
+    jit_exit_t *exits;
+    uint32_t exit_count;
+    uint32_t exit_capacity;
+} jit_trace_t;
+
+/* Starts a new value for the slot, while finding live ranges */
+static void new_range(jit_trace_t *t, uint32_t slot, int type, int wraps)
+{
+    if (t->range_count == t->range_capacity)
+    {
+        t->range_capacity = t->range_capacity ? t->range_capacity * 2 : 64;
+        t->ranges = realloc(t->ranges, sizeof(jit_range_t) * t->range_capacity);
+    }
+
+    uint32_t at = t->range_count++;
+
+    if (t->current[slot] == UINT32_MAX) t->first[slot] = at;
+    else t->ranges[t->current[slot]].next = at;
+
+    t->ranges[at] = (jit_range_t){ .slot = slot, .start = t->k, .end = t->k, .uses = 1, .type = type,
+                                   .wraps = wraps, .reg = REG_NONE, .next = UINT32_MAX };
+    t->current[slot] = at;
+}
+
+/*
+ * Notes a read or write of the slot by the instruction being laid down,
+ * which is called before a write is laid down so it goes to the register
+ * of the new value. While scanning this finds the live ranges, and after
+ * it follows them in the same order.
+ */
+static void use_slot(jit_trace_t *t, uint32_t slot, int type, int writes)
+{
+    uint32_t cur = t->current[slot];
+
+    if (t->scan)
+    {
+        if (cur == UINT32_MAX || (writes && !t->ranges[cur].wraps))
+        {
+            new_range(t, slot, type, !writes || slot < t->a.chunk->local_count || slot >= t->global_slot);
+            return;
+        }
+
+        if (t->ranges[cur].type != type) t->ranges[cur].type = TYPE_MIXED;
+
+        t->ranges[cur].uses++;
+        t->ranges[cur].end = t->k;
+        return;
+    }
+
+    if (cur == UINT32_MAX) t->current[slot] = t->first[slot];
+    else if (writes && !t->ranges[cur].wraps) t->current[slot] = t->ranges[cur].next;
+}
+
+/* The register the slot's value is in at this point, or REG_NONE */
+static int slot_reg(jit_trace_t *t, uint32_t slot)
+{
+    uint32_t cur = t->current[slot];
+
+    return cur == UINT32_MAX ? REG_NONE : t->ranges[cur].reg;
+}
+
+/* The type the slot had when the iteration was recorded, or TYPE_UNKNOWN for stack it hadn't pushed yet */
+static int recorded_type(jit_trace_t *t, uint32_t slot)
+{
+    if (slot >= t->global_slot) return t->trace->global_types[slot - t->global_slot];
+
+    return slot < t->trace->slot_count ? (int)t->trace->types[slot] : TYPE_UNKNOWN;
+}
+
+/* The type of the slot, or TYPE_UNKNOWN if the trace can't know it there */
+static int slot_type(jit_trace_t *t, uint32_t slot)
+{
+    /* Read before the trace writes it, so it is checked on entry to be what it was when recorded */
+    if (t->types[slot] == TYPE_UNKNOWN && t->discover && recorded_type(t, slot) != TYPE_UNKNOWN)
+        t->guards[slot] = t->types[slot] = recorded_type(t, slot);
+
+    use_slot(t, slot, t->types[slot], 0);
+
+    return t->types[slot];
+}
+
+/* Tags the slot with type, which only takes a store if it could have been something else */
+static void set_type(jit_trace_t *t, uint32_t slot, int type)
+{
+    if (t->types[slot] != type && !t->reg_only[slot]) store_type(&t->a, local_at(slot), type);
+
+    t->types[slot] = type;
+}
+
+/* Whether the value is in its register, rather than its slot, at the k'th instruction of the path */
+static int live_at(jit_range_t *r, uint32_t k)
+{
+    return r->reg != REG_NONE && (r->wraps || (r->start < k && k <= r->end));
+}
+
+/*
+ * Leaves the trace for the interpreter at offset when the condition holds.
+ * An exit with values in registers deoptimises, so it gets a stub of its
+ * own after the trace, and the rest share the stop for their offset.
+ */
+static void trace_exit(jit_trace_t *t, int cc, uint32_t offset)
+{
+    uint32_t i = 0;
+
+    while (i < t->range_count && !live_at(&t->ranges[i], t->k)) i++;
+
+    if (i == t->range_count)
+    {
+        stop_if(&t->a, cc, offset);
+        return;
+    }
+
+    if (t->exit_count == t->exit_capacity)
+    {
+        t->exit_capacity = t->exit_capacity ? t->exit_capacity * 2 : 16;
+        t->exits = realloc(t->exits, sizeof(jit_exit_t) * t->exit_capacity);
+    }
+
+    emit8(&t->a, 0x0f); emit8(&t->a, 0x80 + cc); emit32(&t->a, 0);
+    t->exits[t->exit_count++] = (jit_exit_t){ .at = t->a.count - 4, .offset = offset, .k = t->k };
+}
+
+/* Returns a register holding the bits of the slot's value, which is scratch if it lives in memory */
+static int value_in(jit_trace_t *t, uint32_t slot, int scratch)
+{
+    if (slot_reg(t, slot) != REG_NONE) return slot_reg(t, slot);
+
+    load(&t->a, scratch, local_at(slot) + VALUE_AT);
+    return scratch;
+}
+
+/* Gives the slot the value in reg */
+static void value_out(jit_trace_t *t, uint32_t slot, int reg)
+{
+    int home = slot_reg(t, slot);
+
+    if (home == REG_NONE) store(&t->a, reg, local_at(slot) + VALUE_AT);
+    else if (home != reg) alu(&t->a, 0x89, home, reg);
+}
+
+/* The same for doubles, in xmm registers */
+static int double_in(jit_trace_t *t, uint32_t slot, int scratch)
+{
+    if (slot_reg(t, slot) != REG_NONE) return slot_reg(t, slot);
+
+    sd_mem(&t->a, 0x10, scratch, local_at(slot) + VALUE_AT);
+    return scratch;
+}
+
+static void double_out(jit_trace_t *t, uint32_t slot, int xmm)
+{
+    int home = slot_reg(t, slot);
+
+    if (home == REG_NONE) sd_mem(&t->a, 0x11, xmm, local_at(slot) + VALUE_AT);
+    else if (home != xmm) sd_reg(&t->a, 0x10, home, xmm);
+}
+
+/* A comparison operand for the slot, from wherever it lives */
+static void slot_operand(jit_trace_t *t, jit_operand_t *o, uint32_t slot)
+{
+    o->disp = local_at(slot);
+    o->reg = slot_reg(t, slot);
+}
+
+/* Copies the value in src to dst, which are of a type the trace knows */
+static int copy_slot(jit_trace_t *t, uint32_t dst, uint32_t src)
+{
+    int type = slot_type(t, src);
+
+    if (type == TYPE_UNKNOWN) return 0;
+
+    int src_reg = slot_reg(t, src);
+    use_slot(t, dst, type, 1);
+
+    if (type == OBJ_VAL_DOUBLE && (src_reg != REG_NONE || slot_reg(t, dst) != REG_NONE))
+        double_out(t, dst, double_in(t, src, XMM0));
+    else
+        value_out(t, dst, value_in(t, src, RAX));
+
+    set_type(t, dst, type);
+
+    return 1;
+}
+
+/* dst = dst op src on longs, in the register dst lives in where it has one */
+static void trace_long_arith(jit_trace_t *t, uint8_t op, uint32_t dst, uint32_t src, uint32_t offset)
+{
+    jit_asm_t *a = &t->a;
+    int home = slot_reg(t, dst);
+
+    if (home != REG_NONE && op != OP_DIV && op != OP_MOD)
+    {
+        int reg = value_in(t, src, RCX);
+
+        if (op == OP_ADD) alu(a, 0x01, home, reg);
+        else if (op == OP_SUB) alu(a, 0x29, home, reg);
+        else imul(a, home, reg);
+        return;
+    }
+
+    int left = value_in(t, dst, RAX);
+    if (left != RAX) alu(a, 0x89, RAX, left);
+
+    int right = value_in(t, src, RCX);
+
+    switch (op)
+    {
+        case OP_ADD: alu(a, 0x01, RAX, right); break;
+        case OP_SUB: alu(a, 0x29, RAX, right); break;
+        case OP_MUL: imul(a, RAX, right); break;
+        default:
+        {
+            /* Division by zero is left to the interpreter */
+            alu(a, 0x85, right, right);
+            trace_exit(t, CC_E, offset);
+
+            emit8(a, 0x48); emit8(a, 0x99);                 /* cqo */
+            rex_w(a, 0, right); emit8(a, 0xf7); modrm(a, 7, right);
+            if (op == OP_MOD) alu(a, 0x89, RAX, RDX);
+            break;
+        }
+    }
+
+    value_out(t, dst, RAX);
+}
+
+static void trace_double_arith(jit_trace_t *t, uint8_t op, uint32_t dst, uint32_t src)
+{
+    static const uint8_t ops[] = { [OP_ADD] = 0x58, [OP_SUB] = 0x5c, [OP_MUL] = 0x59, [OP_DIV] = 0x5e };
+
+    int home = slot_reg(t, dst);
+    int acc = home != REG_NONE ? home : XMM0;
+
+    if (home == REG_NONE) sd_mem(&t->a, 0x10, XMM0, local_at(dst) + VALUE_AT);
+
+    if (slot_reg(t, src) != REG_NONE) sd_reg(&t->a, ops[op], acc, slot_reg(t, src));
+    else sd_mem(&t->a, ops[op], acc, local_at(src) + VALUE_AT);
+
+    if (home == REG_NONE) sd_mem(&t->a, 0x11, XMM0, local_at(dst) + VALUE_AT);
+}
+
+/*
+ * The type of the slot the global used by the instruction being laid down is
+ * kept in, or TYPE_UNKNOWN if the trace can't keep it. Only longs, doubles
+ * and bools are kept, as the interpreter frees a string it writes over.
+ */
+static int global_type(jit_trace_t *t, uint32_t *slot)
+{
+    *slot = t->global_slot + t->trace->global_at[t->k];
+    int type = slot_type(t, *slot);
+
+    return type == OBJ_VAL_LONG || type == OBJ_VAL_DOUBLE || type == OBJ_VAL_BOOL ? type : TYPE_UNKNOWN;
+}
+
+/* Leaves the trace for the interpreter at the side of the branch it wasn't recorded taking */
+static void exit_branch(jit_trace_t *t, uint32_t offset, int jumps_when, uint32_t next)
+{
+    chunk_t *chunk = t->a.chunk;
+    uint32_t target = jump_target(chunk, offset);
+    int taken = next == target;
+
+    /* al holds the condition, which jumps when it is jumps_when */
+    emit8(&t->a, 0x84); emit8(&t->a, 0xc0);
+
+    if (taken) trace_exit(t, jumps_when ? CC_E : CC_NE, offset + vm_op_length(chunk->code[offset]));
+    else trace_exit(t, jumps_when ? CC_NE : CC_E, target);
+}
+
+static int trace_compare(jit_trace_t *t, uint32_t offset, uint32_t next, compare_t cmp)
+{
+    chunk_t *chunk = t->a.chunk;
+    uint8_t code = chunk->code[offset];
+    uint32_t base = chunk->local_count + t->a.depth[offset];
+    uint32_t left_slot;
+    int left_type, right_type;
+
+    jit_operand_t left = { .reg = REG_NONE }, right = { .reg = REG_NONE };
+
+    if (vm_op_has_const(code))
+    {
+        right.is_const = 1;
+        right.value = chunk->constants[CHUNK_READ_U24(chunk->code + offset + 1)];
+        right_type = right.value.type;
+        left_slot = base - 1;
+    }
+    else
+    {
+        left_slot = base - 2;
+        right_type = slot_type(t, base - 1);
+        slot_operand(t, &right, base - 1);
+    }
+
+    left_type = slot_type(t, left_slot);
+    slot_operand(t, &left, left_slot);
+
+    /* Comparisons of a long with a double, and of anything else, are left to the interpreter */
+    if (left_type != right_type || (left_type != OBJ_VAL_LONG && left_type != OBJ_VAL_DOUBLE)) return 0;
+
+    if (left_type == OBJ_VAL_LONG) compare_longs(&t->a, cmp, &left, &right);
+    else compare_doubles(&t->a, cmp, &left, &right);
+
+    if (vm_op_is_jump(code))
+    {
+        exit_branch(t, offset, 0, next);
+        return 1;
+    }
+
+    /* Stores true or false from al */
+    emit8(&t->a, 0x84); emit8(&t->a, 0xc0);
+    mov_imm(&t->a, RCX, (uint64_t)(uintptr_t)jit_true);
+    mov_imm(&t->a, RDX, (uint64_t)(uintptr_t)jit_false);
+    emit8(&t->a, 0x48); emit8(&t->a, 0x0f); emit8(&t->a, 0x45); emit8(&t->a, 0xd1);
+
+    /* A bool is never kept in a register */
+    use_slot(t, left_slot, OBJ_VAL_BOOL, 1);
+    store(&t->a, RDX, left.disp + VALUE_AT);
+    set_type(t, left_slot, OBJ_VAL_BOOL);
+
+    return 1;
+}
+
+/* Lays down the instruction at offset, which went on to next when it was recorded */
+static int trace_insn(jit_trace_t *t, uint32_t offset, uint32_t next)
+{
+    jit_asm_t *a = &t->a;
+    chunk_t *chunk = a->chunk;
+    uint8_t code = chunk->code[offset];
+    uint32_t base = chunk->local_count + a->depth[offset];
+    compare_t cmp;
+
+    if (compare_kind(code, &cmp)) return trace_compare(t, offset, next, cmp);
+
+    switch (code)
+    {
+        case OP_LOOP:
+        {
+            /* The counter isn't an object, so it is never given a register */
+            use_slot(t, base - 1, TYPE_MIXED, 0);
+
+            /* The interpreter runs the OP_LOOP that finishes the loop */
+            emit8(a, 0x48); emit8(a, 0x83); mem(a, 7, local_at(base - 1) + VALUE_AT); emit8(a, 0);
+            trace_exit(t, CC_E, offset);
+            emit8(a, 0x48); emit8(a, 0xff); mem(a, 1, local_at(base - 1) + VALUE_AT);
+            return 1;
+        }
+        case OP_LOOP_END:
+        {
+            /* Only the end of the loop being traced, as the last instruction, goes back to the top */
+            if (jump_target(chunk, offset) != t->trace->header || offset != t->trace->path[t->trace->count - 1])
+                return 0;
+
+            emit8(a, 0xe9); emit32(a, 0);
+            patch32(a, a->count - 4, t->loop_top);
+            return 1;
+        }
+        case OP_JUMP:
+        case OP_DROP:
+            return 1;
+
+        case OP_CONST:
+        {
+            object_t obj = chunk->constants[CHUNK_READ_U24(chunk->code + offset + 1)];
+            uint64_t bits;
+            memcpy(&bits, &obj.as, sizeof(bits));
+
+            /* The name of a global that is read straight away is only for the interpreter, which never sees it */
+            if (obj.type == OBJ_VAL_STR && chunk->code[next] == OP_VAR_GET) return 1;
+
+            use_slot(t, base, obj.type, 1);
+            int reg = slot_reg(t, base);
+
+            if (reg == REG_NONE)
+            {
+                mov_imm(a, RAX, bits);
+                store(a, RAX, local_at(base) + VALUE_AT);
+            }
+            else if (obj.type == OBJ_VAL_DOUBLE)
+            {
+                mov_imm(a, RAX, bits);
+                movq_xmm(a, reg, RAX);
+            }
+            else
+            {
+                mov_imm(a, reg, bits);
+            }
+
+            set_type(t, base, obj.type);
+            return 1;
+        }
+        case OP_GET_LOCAL:
+            return copy_slot(t, base, CHUNK_READ_U16(chunk->code + offset + 1));
+
+        case OP_SET_LOCAL:
+            return copy_slot(t, CHUNK_READ_U16(chunk->code + offset + 1), base - 1);
+
+        case OP_VAR_GET:
+        {
+            uint32_t slot;
+
+            if (global_type(t, &slot) == TYPE_UNKNOWN) return 0;
+
+            return copy_slot(t, base - 1, slot);
+        }
+        case OP_VAR_DECL:
+        case OP_VAR_DECL_K:
+        {
+            /* A global keeps the type it was checked for on entry, which is what it is written back with */
+            uint32_t slot;
+            int type = global_type(t, &slot);
+
+            if (type == TYPE_UNKNOWN || type != slot_type(t, base - 1)) return 0;
+
+            return copy_slot(t, slot, base - 1);
+        }
+
+        case OP_INC_LOCAL:
+        case OP_DEC_LOCAL:
+        {
+            uint32_t slot = CHUNK_READ_U16(chunk->code + offset + 1);
+
+            if (slot_type(t, slot) != OBJ_VAL_LONG) return 0;
+
+            int reg = slot_reg(t, slot);
+
+            /* inc or dec the register, or qword [rbx + slot] */
+            if (reg != REG_NONE)
+            {
+                rex_w(a, 0, reg); emit8(a, 0xff); modrm(a, code == OP_INC_LOCAL ? 0 : 1, reg);
+            }
+            else
+            {
+                emit8(a, 0x48); emit8(a, 0xff); mem(a, code == OP_INC_LOCAL ? 0 : 1, local_at(slot) + VALUE_AT);
+            }
+
+            return copy_slot(t, base, slot);
+        }
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+        {
+            int type = slot_type(t, base - 1);
+            int reg = slot_reg(t, base - 1);
+
+            if (type == OBJ_VAL_LONG && reg != REG_NONE)
+            {
+                alu(a, 0x85, reg, reg);
+                setcc(a, CC_NE, RAX);
+            }
+            else if (type == OBJ_VAL_LONG) truthy_long(a, local_at(base - 1));
+            else if (type == OBJ_VAL_BOOL) truthy_bool(a, local_at(base - 1));
+            else return 0;
+
+            exit_branch(t, offset, code == OP_JUMP_IF_TRUE, next);
+            return 1;
+        }
+        default:
+        {
+            /* Arithmetic, generic or typed, on two longs or two doubles */
+            uint8_t op = code <= OP_MOD ? code : untyped(code);
+            int type = slot_type(t, base - 2);
+
+            if (type != slot_type(t, base - 1)) return 0;
+
+            if ((code >= OP_ADD_LL && code <= OP_MOD_LL && type != OBJ_VAL_LONG) ||
+                (code >= OP_ADD_DD && code <= OP_DIV_DD && type != OBJ_VAL_DOUBLE))
+                return 0;
+
+            if (type == OBJ_VAL_LONG) trace_long_arith(t, op, base - 2, base - 1, offset);
+            else if (type == OBJ_VAL_DOUBLE && op != OP_MOD) trace_double_arith(t, op, base - 2, base - 1);
+            else return 0;
+
+            return 1;
+        }
+    }
+}
+
+/* Runs through the trace once from the types in t, laying down its code. Returns 0 if it can't be compiled */
+static int trace_pass(jit_trace_t *t)
+{
+    trace_t *trace = t->trace;
+
+    for (uint32_t k = 0; k < trace->count; k++)
+    {
+        uint32_t next = k + 1 < trace->count ? trace->path[k + 1] : trace->header;
+
+        t->k = k;
+        t->map[k] = (jit_map_t){ .code = t->a.count, .offset = trace->path[k] };
+        if (!trace_insn(t, trace->path[k], next)) return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Works out the types at the top of an iteration. They are what the entry
+ * leaves, less any slot that an iteration leaves as something else, until
+ * going round again changes nothing. Returns 0 if a slot the trace reads
+ * can change type between iterations.
+ */
+static int trace_types(jit_trace_t *t, int *top)
+{
+    trace_t *trace = t->trace;
+    uint32_t start = t->a.count, fixups = t->a.fixup_count;
+
+    for (uint32_t s = 0; s < t->slot_count; s++)
+        t->types[s] = t->guards[s] = t->tags[s] = TYPE_UNKNOWN;
+
+    t->discover = 1;
+    int ok = trace_pass(t);
+    t->discover = 0;
+
+    for (uint32_t s = 0; ok && s < t->slot_count; s++)
+    {
+        int end = t->types[s];
+
+        /*
+         * A slot the trace writes before reading is also checked if it is
+         * left the type it started as, and the stack above the loop, which
+         * holds nothing yet, is tagged with what it is left as. Either way an
+         * iteration then only stores a tag where the type changes.
+         */
+        if (t->guards[s] == TYPE_UNKNOWN && end != TYPE_UNKNOWN)
+        {
+            if (s >= trace->slot_count && s < t->global_slot) t->tags[s] = end;
+            else if (recorded_type(t, s) == end) t->guards[s] = end;
+        }
+
+        int entry = t->guards[s] != TYPE_UNKNOWN ? t->guards[s] : t->tags[s];
+        top[s] = entry == end ? entry : TYPE_UNKNOWN;
+    }
+
+    while (ok)
+    {
+        t->a.count = start;
+        t->a.fixup_count = fixups;
+
+        memcpy(t->types, top, sizeof(int) * t->slot_count);
+
+        if (!trace_pass(t)) return 0;
+
+        int changed = 0;
+
+        for (uint32_t s = 0; s < t->slot_count; s++)
+        {
+            if (top[s] != t->types[s] && top[s] != TYPE_UNKNOWN)
+            {
+                top[s] = TYPE_UNKNOWN;
+                changed = 1;
+            }
+        }
+
+        if (!changed) break;
+    }
+
+    t->a.count = start;
+    t->a.fixup_count = fixups;
+
+    return ok;
+}
+
+/*
+ * Gives registers from the pool to the values of the type by a linear scan
+ * over their live ranges in order of where they start. A range frees its
+ * register once it has ended, and when none is free the range with the
+ * fewest uses, which may be the new one, stays in memory.
+ */
+static void linear_scan(jit_trace_t *t, int type, const int *pool, uint32_t pool_size)
+{
+    jit_range_t *ranges = t->ranges;
+    uint32_t *order = malloc(sizeof(uint32_t) * (t->range_count + 1));
+    uint32_t *active = malloc(sizeof(uint32_t) * pool_size);
+    int *free_regs = malloc(sizeof(int) * pool_size);
+    uint32_t count = 0, active_count = 0, free_count = pool_size;
+
+    for (uint32_t r = 0; r < pool_size; r++)
+        free_regs[r] = pool[pool_size - 1 - r];
+
+    for (uint32_t i = 0; i < t->range_count; i++)
+    {
+        if (ranges[i].type != type) continue;
+
+        uint32_t at = count++;
+
+        while (at > 0 && ranges[order[at - 1]].start > ranges[i].start)
+        {
+            order[at] = order[at - 1];
+            at--;
+        }
+
+        order[at] = i;
+    }
+
+    for (uint32_t n = 0; n < count; n++)
+    {
+        uint32_t i = order[n];
+
+        for (uint32_t j = 0; j < active_count;)
+        {
+            if (ranges[active[j]].end < ranges[i].start)
+            {
+                free_regs[free_count++] = ranges[active[j]].reg;
+                active[j] = active[--active_count];
+            }
+            else j++;
+        }
+
+        if (free_count)
+        {
+            ranges[i].reg = free_regs[--free_count];
+            active[active_count++] = i;
+            continue;
+        }
+
+        uint32_t victim = active_count;
+
+        for (uint32_t j = 0; j < active_count; j++)
+        {
+            uint32_t uses = victim < active_count ? ranges[active[victim]].uses : ranges[i].uses;
+            if (ranges[active[j]].uses < uses) victim = j;
+        }
+
+        if (victim < active_count)
+        {
+            ranges[i].reg = ranges[active[victim]].reg;
+            ranges[active[victim]].reg = REG_NONE;
+            active[victim] = i;
+        }
+    }
+
+    free(order);
+    free(active);
+    free(free_regs);
+}
+
+/* Finds the live range of every value from the types at the top of the loop, and gives registers to the longs and doubles */
+static int trace_registers(jit_trace_t *t, int *top)
+{
+    uint32_t start = t->a.count, fixups = t->a.fixup_count;
+
+    memcpy(t->types, top, sizeof(int) * t->slot_count);
+
+    t->scan = 1;
+    int ok = trace_pass(t);
+    t->scan = 0;
+
+    t->a.count = start;
+    t->a.fixup_count = fixups;
+
+    if (!ok) return 0;
+
+    for (uint32_t i = 0; i < t->range_count; i++)
+    {
+        if (!t->ranges[i].wraps) continue;
+
+        t->ranges[i].start = 0;
+        t->ranges[i].end = t->trace->count;
+    }
+
+    linear_scan(t, OBJ_VAL_LONG, trace_gprs, sizeof(trace_gprs) / sizeof(trace_gprs[0]));
+    linear_scan(t, OBJ_VAL_DOUBLE, trace_xmms, sizeof(trace_xmms) / sizeof(trace_xmms[0]));
+
+    for (uint32_t s = 0; s < t->slot_count; s++)
+    {
+        t->current[s] = UINT32_MAX;
+        t->reg_only[s] = t->first[s] != UINT32_MAX;
+
+        for (uint32_t i = t->first[s]; i != UINT32_MAX; i = t->ranges[i].next)
+        {
+            if (t->ranges[i].reg == REG_NONE || t->ranges[i].wraps) t->reg_only[s] = 0;
+        }
+    }
+
+    return 1;
+}
+
+/* Whether the trace keeps a value in the callee saved register, which it then has to save */
+static int uses_reg(jit_trace_t *t, int reg)
+{
+    for (uint32_t i = 0; i < t->range_count; i++)
+    {
+        if (t->ranges[i].reg == reg && t->ranges[i].type == OBJ_VAL_LONG) return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Records the interpreter state at an exit, from the values live in
+ * registers there, and lays down its stub, which returns the index of the
+ * record through the bailout:
+ *     mov eax, JIT_DEOPT | index; jmp bailout
+ */
+static void emit_deopt(jit_trace_t *t, jit_code_t *jit, jit_exit_t *e, uint32_t bailout)
+{
+    uint32_t first = 0;
+
+    if (jit->deopt_count) first = jit->deopts[jit->deopt_count - 1].first + jit->deopts[jit->deopt_count - 1].count;
+
+    jit_deopt_t *d = &jit->deopts[jit->deopt_count];
+    *d = (jit_deopt_t){ .offset = e->offset, .depth = t->a.depth[e->offset], .first = first, .count = 0 };
+
+    for (uint32_t i = 0; i < t->range_count; i++)
+    {
+        jit_range_t *r = &t->ranges[i];
+
+        if (!live_at(r, e->k)) continue;
+
+        jit->deopt_slots = realloc(jit->deopt_slots, sizeof(jit_deopt_slot_t) * (first + d->count + 1));
+        jit->deopt_slots[first + d->count++] = (jit_deopt_slot_t){
+            .slot = r->slot,
+            .reg = (uint8_t)(r->type == OBJ_VAL_DOUBLE ? JIT_XMM + r->reg : r->reg),
+            .type = (uint8_t)r->type,
+            .tag = t->reg_only[r->slot],
+        };
+    }
+
+    land(&t->a, e->at);
+    emit8(&t->a, 0xb8); emit32(&t->a, JIT_DEOPT | jit->deopt_count++);
+    emit8(&t->a, 0xe9); emit32(&t->a, 0);
+    patch32(&t->a, t->a.count - 4, bailout);
+}
+
+/*
+ * The bailout every deoptimising exit goes through, which saves the
+ * registers the trace keeps values in to the register file before leaving
+ * through the epilogue:
+ *     mov rcx, regs; mov [rcx + 8 * reg], reg; movsd [rcx + 8 * (JIT_XMM + xmm)], xmm; ...
+ */
+static uint32_t emit_bailout(jit_trace_t *t, jit_code_t *jit)
+{
+    jit_asm_t *a = &t->a;
+    uint32_t at = a->count;
+    uint8_t saved[JIT_REGS] = { 0 };
+
+    mov_imm(a, RCX, (uint64_t)(uintptr_t)jit->regs);
+
+    for (uint32_t i = 0; i < t->range_count; i++)
+    {
+        jit_range_t *r = &t->ranges[i];
+        int index = r->type == OBJ_VAL_DOUBLE ? JIT_XMM + r->reg : r->reg;
+
+        if (r->reg == REG_NONE || saved[index]) continue;
+
+        saved[index] = 1;
+
+        if (r->type == OBJ_VAL_DOUBLE)
+        {
+            emit8(a, 0xf2); rex(a, r->reg, RCX); emit8(a, 0x0f); emit8(a, 0x11);
+        }
+        else
+        {
+            rex_w(a, r->reg, RCX); emit8(a, 0x89);
+        }
+
+        emit8(a, 0x80 | (r->reg & 7) << 3 | RCX);
+        emit32(a, (uint32_t)(index * sizeof(uint64_t)));
+    }
+
+    emit8(a, 0xe9); emit32(a, 0);
+    patch32(a, a->count - 4, a->epilogue);
+
+    return at;
+}
+
+/*
+ * Compiles a recorded iteration of a loop to a straight line of machine
+ * code that goes round the loop until the counter runs out. A branch that
+ * goes the other way from when it was recorded leaves the trace for the
+ * interpreter at the side it went, and so does an entry check that fails,
+ * at the OP_LOOP, so the interpreter runs that iteration. Longs and doubles
+ * are kept in registers while the trace runs, and an exit that leaves any
+ * there deoptimises, for jit_deopt to put them back in their slots. Globals
+ * are copied to slots above the stack by jit_load_globals, and back once
+ * the trace has left by jit_store_globals.
+ * Returns NULL if the trace can't be compiled.
+ */
+jit_code_t *jit_compile_trace(chunk_t *chunk, func_table_t *funcs, int in_function, trace_t *trace)
+{
+    uint32_t *depth = malloc(sizeof(uint32_t) * (chunk->count + 1));
+
+    if (verify_depths(chunk, funcs, in_function, depth).code != VERIFY_OK)
+    {
+        free(depth);
+        return NULL;
+    }
+
+    jit_trace_t t = { 0 };
+    t.trace = trace;
+    t.a.chunk = chunk;
+    t.a.depth = depth;
+    t.a.stops = malloc(sizeof(uint32_t) * (chunk->count + 1));
+
+    /* Every slot the trace can touch, from the deepest the stack gets in it, and then the globals it uses */
+    t.global_slot = chunk->local_count;
+
+    for (uint32_t k = 0; k < trace->count; k++)
+    {
+        if (chunk->local_count + depth[trace->path[k]] + 1 > t.global_slot)
+            t.global_slot = chunk->local_count + depth[trace->path[k]] + 1;
+    }
+
+    t.slot_count = t.global_slot + trace->global_count;
+
+    t.types = malloc(sizeof(int) * t.slot_count);
+    t.guards = malloc(sizeof(int) * t.slot_count);
+    t.tags = malloc(sizeof(int) * t.slot_count);
+    t.first = malloc(sizeof(uint32_t) * t.slot_count);
+    t.current = malloc(sizeof(uint32_t) * t.slot_count);
+    t.reg_only = calloc(t.slot_count, 1);
+    int *top = malloc(sizeof(int) * t.slot_count);
+
+    for (uint32_t s = 0; s < t.slot_count; s++)
+        t.first[s] = t.current[s] = UINT32_MAX;
+
+    for (uint32_t i = 0; i <= chunk->count; i++)
+        t.a.stops[i] = UINT32_MAX;
+
+    jit_code_t *jit = new_code(chunk, depth);
+    jit->native[trace->header] = 1;
+    jit->map = t.map = malloc(sizeof(jit_map_t) * trace->count);
+    jit->map_count = trace->count;
+    jit->global_slot = t.global_slot;
+    jit->global_count = trace->global_count;
+    jit->globals = malloc(sizeof(object_t *) * (trace->global_count + 1));
+    if (trace->global_count) memcpy(jit->globals, trace->globals, sizeof(object_t *) * trace->global_count);
+
+    int ok = trace_types(&t, top) && trace_registers(&t, top);
+
+    if (ok)
+    {
+        /* push rbx and the callee saved registers the trace uses; mov rbx, rdi */
+        emit8(&t.a, 0x53);
+
+        for (int reg = R12; reg <= R15; reg++)
+        {
+            if (uses_reg(&t, reg)) { emit8(&t.a, 0x41); emit8(&t.a, 0x50 + (reg & 7)); }
+        }
+
+        emit8(&t.a, 0x48); emit8(&t.a, 0x89); emit8(&t.a, 0xfb);
+
+        for (uint32_t s = 0; s < t.slot_count; s++)
+        {
+            if (t.guards[s] != TYPE_UNKNOWN) guard_type(&t.a, local_at(s), t.guards[s], trace->header);
+            if (t.tags[s] != TYPE_UNKNOWN && !t.reg_only[s]) store_type(&t.a, local_at(s), t.tags[s]);
+        }
+
+        /* The values kept for the whole trace are loaded once the checks have passed */
+        for (uint32_t i = 0; i < t.range_count; i++)
+        {
+            jit_range_t *r = &t.ranges[i];
+
+            if (r->reg == REG_NONE || !r->wraps) continue;
+
+            if (r->type == OBJ_VAL_DOUBLE) sd_mem(&t.a, 0x10, r->reg, local_at(r->slot) + VALUE_AT);
+            else load(&t.a, r->reg, local_at(r->slot) + VALUE_AT);
+        }
+
+        /* Each iteration is counted, to tell how often the trace leaves the loop part way */
+        t.loop_top = t.a.count;
+        mov_imm(&t.a, RAX, (uint64_t)(uintptr_t)&jit->iterations);
+        emit8(&t.a, 0x48); emit8(&t.a, 0xff); emit8(&t.a, 0x00);   /* inc qword [rax] */
+
+        memcpy(t.types, top, sizeof(int) * t.slot_count);
+        ok = trace_pass(&t);
+    }
+
+    if (ok)
+    {
+        t.a.epilogue = t.a.count;
+
+        for (int reg = R15; reg >= R12; reg--)
+        {
+            if (uses_reg(&t, reg)) { emit8(&t.a, 0x41); emit8(&t.a, 0x58 + (reg & 7)); }
+        }
+
+        emit8(&t.a, 0x5b);
+        emit8(&t.a, 0xc3);
+
+        if (t.exit_count)
+        {
+            uint32_t bailout = emit_bailout(&t, jit);
+            jit->deopts = malloc(sizeof(jit_deopt_t) * t.exit_count);
+
+            for (uint32_t e = 0; e < t.exit_count; e++)
+                emit_deopt(&t, jit, &t.exits[e], bailout);
+        }
+
+        resolve_fixups(&t.a);
+        jit->code_size = t.a.count;
+        ok = map_code(jit, chunk, t.a.code, t.a.count, NULL, 0);
+    }
+
+    if (!ok)
+    {
+        jit_free(jit);
+        jit = NULL;
+    }
+
+    free(top);
+    free(t.types);
+    free(t.guards);
+    free(t.tags);
+    free(t.ranges);
+    free(t.first);
+    free(t.current);
+    free(t.reg_only);
+    free(t.exits);
+    free_asm(&t.a);
+
+    return jit;
+}
+
+/* Whether the addresses an image leaves to be filled in are all inside it and name things the chunk has */
+static int check_image(chunk_t *chunk, jit_image_t *image)
+{
+    if (image->code_size % sizeof(uint64_t) || image->size != image->code_size + sizeof(uint64_t) * (chunk->count + 1))
+        return 0;
+
+    for (uint32_t r = 0; r < image->reloc_count; r++)
+    {
+        jit_reloc_t *reloc = &image->relocs[r];
+
+        if ((size_t)reloc->at + sizeof(uint64_t) > image->size) return 0;
+
+        switch (reloc->kind)
+        {
+            case JIT_RELOC_CODE:
+                if (reloc->index >= image->code_size) return 0;
+                break;
+
+            case JIT_RELOC_TRUE:
+            case JIT_RELOC_FALSE:
+                break;
+
+            case JIT_RELOC_CONST:
+                if (reloc->index >= chunk->const_count) return 0;
+                if (chunk->constants[reloc->index].type != OBJ_VAL_STR &&
+                    chunk->constants[reloc->index].type != OBJ_VAL_BOOL) return 0;
+                break;
+
+            default:
+                return 0;
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * Maps code jit_compile laid down for the same chunk, in this process or
+ * another, filling in the addresses that change between them. depth is what
+ * verify_depths gave for the chunk, and belongs to the code returned. Returns
+ * NULL, having freed it, if the image doesn't fit the chunk.
+ */
+jit_code_t *jit_load(chunk_t *chunk, uint32_t *depth, jit_image_t *image)
+{
+    if (!check_image(chunk, image))
+    {
+        free(depth);
+        return NULL;
+    }
+
+    jit_code_t *jit = new_code(chunk, depth);
+    memcpy(jit->native, image->native, chunk->count + 1);
+
+    if (!map_code(jit, chunk, image->code, image->size, image->relocs, image->reloc_count))
+    {
+        jit_free(jit);
+        return NULL;
+    }
+
+    jit->code_size = image->code_size;
+    jit->image_size = image->size;
+    jit->reloc_count = image->reloc_count;
+    jit->relocs = malloc(sizeof(jit_reloc_t) * (image->reloc_count + 1));
+    memcpy(jit->relocs, image->relocs, sizeof(jit_reloc_t) * image->reloc_count);
+
+    /* Where each instruction starts is in the jump table */
+    uint8_t *table = (uint8_t *)jit->mem + image->code_size;
+    jit->map = malloc(sizeof(jit_map_t) * chunk->count);
+
+    for (uint32_t i = 0; i < chunk->count; i += vm_op_length(chunk->code[i]))
+    {
+        uint64_t addr;
+        memcpy(&addr, table + sizeof(uint64_t) * i, sizeof(addr));
+        jit->map[jit->map_count++] = (jit_map_t){ .code = (uint32_t)(addr - (uint64_t)(uintptr_t)jit->mem), .offset = i };
+    }
+
+    return jit;
+}
+
+void jit_free(jit_code_t *jit)
+{
+    if (!jit) return;
+
+    if (jit->mem) munmap(jit->mem, jit->size);
+
+    free(jit->map);
+    free(jit->relocs);
+    free(jit->depth);
+    free(jit->native);
+    free(jit->deopts);
+    free(jit->deopt_slots);
+    free(jit->globals);
+    free(jit);
+}
+
+#else
+
+/* Other platforms run everything in the interpreter */
+jit_code_t *jit_compile(chunk_t *chunk, func_table_t *funcs, int in_function, jit_code_t **traces)
+{
+    return NULL;
+}
+
+jit_code_t *jit_compile_trace(chunk_t *chunk, func_table_t *funcs, int in_function, trace_t *trace)
+{
+    return NULL;
+}
+
+jit_code_t *jit_load(chunk_t *chunk, uint32_t *depth, jit_image_t *image)
+{
+    free(depth);
+    return NULL;
+}
+
+void jit_free(jit_code_t *jit)
+{
+}
+
+#endif
+
+/*
+ * Rebuilds the interpreter state at an exit that deoptimised, from its
+ * record and the registers the bailout saved, and returns the offset the
+ * interpreter carries on from. The stack is as deep there as the record
+ * says, which is the depth the verifier gives for that offset.
+ */
+uint32_t jit_deopt(jit_code_t *jit, object_t *locals, uint32_t exit)
+{
+    jit_deopt_t *d = &jit->deopts[exit & ~JIT_DEOPT];
+
+    for (uint32_t n = 0; n < d->count; n++)
+    {
+        jit_deopt_slot_t *s = &jit->deopt_slots[d->first + n];
+        object_t *obj = &locals[s->slot];
+
+        if (s->tag) obj->type = s->type;
+        memcpy(&obj->as, &jit->regs[s->reg], sizeof(jit->regs[s->reg]));
+    }
+
+    return d->offset;
+}
+
+/* Copies the globals a trace uses into its slots for them, before it is entered */
+void jit_load_globals(jit_code_t *jit, object_t *locals)
+{
+    for (uint32_t g = 0; g < jit->global_count; g++)
+        locals[jit->global_slot + g] = *jit->globals[g];
+}
+
+/* Copies them back once it has left, which it only does with the types it was entered with */
+void jit_store_globals(jit_code_t *jit, object_t *locals)
+{
+    for (uint32_t g = 0; g < jit->global_count; g++)
+        *jit->globals[g] = locals[jit->global_slot + g];
+}
@@ -0,0 +1,127 @@
+#ifndef __PHANTOM_JIT_H_
+#define __PHANTOM_JIT_H_
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "object.h"
+#include "chunk.h"
+#include "function.h"
+#include "trace.h"
+
+/*
+ * Runs native code for a chunk from the instruction at offset, with the local
+ * slots and the stack above them starting at locals. Returns the offset of
+ * the first instruction it leaves to the interpreter, or the end of the code.
+ */
+typedef uint32_t (*jit_entry_t)(object_t *locals, uint32_t offset);
+
+/* Set in the offset native code returns when it left through a deoptimisation, with the index of its jit_deopt_t */
+#define JIT_DEOPT 0x80000000u
+
+/* Bumped whenever the code the jit lays down changes, so code cached by an older one isn't used */
+#define JIT_VERSION 1
+
+/* Registers in the register file a bailout saves: the general registers by number, then the xmm registers */
+#define JIT_XMM 16
+#define JIT_REGS 32
+
+/* A value a trace kept in a register, and the slot it goes back to */
+typedef struct {
+    uint32_t slot;
+    uint8_t reg;        /* Index in the register file */
+    uint8_t type;
+    uint8_t tag;        /* Set if the trace never tagged the slot itself */
+} jit_deopt_slot_t;
+
+/*
+ * The interpreter state at an exit from a trace that assumed more than the
+ * interpreter can see: the instruction to carry on from, how deep the stack
+ * is there, and the values in registers that make up the rest of the locals
+ * and stack.
+ */
+typedef struct {
+    uint32_t offset;
+    uint32_t depth;
+    uint32_t first;     /* Index of its first slot in deopt_slots */
+    uint32_t count;
+} jit_deopt_t;
+
+/* What goes in a 64 bit address in the code, which is only known once the code is mapped in a process */
+typedef enum {
+    JIT_RELOC_CODE,     /* The address of index bytes into the code */
+    JIT_RELOC_TRUE,     /* The strings comparisons point a bool at */
+    JIT_RELOC_FALSE,
+    JIT_RELOC_CONST,    /* The string of the constant at index in the chunk */
+} jit_reloc_kind_t;
+
+typedef struct {
+    uint32_t at;        /* Offset of the address in the code */
+    uint32_t kind;
+    uint32_t index;
+} jit_reloc_t;
+
+/* Code for a chunk as it is kept outside a process, to be mapped with its addresses filled in */
+typedef struct {
+    uint8_t *code;
+    size_t size;        /* Bytes of code and the jump table after it */
+    size_t code_size;
+    jit_reloc_t *relocs;
+    uint32_t reloc_count;
+    uint8_t *native;    /* chunk->count + 1 flags, as jit_code_t has them */
+} jit_image_t;
+
+/* Where the machine code for an instruction of the chunk starts */
+typedef struct {
+    uint32_t code;      /* Offset in the machine code */
+    uint32_t offset;    /* Offset of the instruction in the chunk */
+} jit_map_t;
+
+/*
+ * A chunk translated to machine code. Every instruction can be entered at, so
+ * the interpreter can hand back. A trace is entered only at its loop.
+ */
+struct jit_code {
+    jit_entry_t entry;
+    void *mem;
+    size_t size;
+    size_t code_size;   /* Bytes of machine code at the start of mem, before any jump table */
+
+    jit_map_t *map;     /* In order of the machine code, for profilers to tell which instruction code is from */
+    uint32_t map_count;
+
+    /* Addresses in the code, so it can be kept and mapped again in another process. Traces have none and aren't kept */
+    jit_reloc_t *relocs;
+    uint32_t reloc_count;
+    size_t image_size;  /* Bytes of mem that make up the image, 0 if it can't be kept */
+
+    uint32_t *depth;    /* Stack depth above the locals at each offset, to set the sp when native code stops */
+    uint8_t *native;    /* Set for each offset with native code rather than a stop for the interpreter */
+    uint32_t local_count;
+
+    /* Iterations a trace has run, and times it has left the loop part way through one */
+    uint64_t iterations;
+    uint64_t exits;
+
+    jit_deopt_t *deopts;
+    uint32_t deopt_count;
+    jit_deopt_slot_t *deopt_slots;
+    uint64_t regs[JIT_REGS];    /* Where the bailout saves the registers for the exit to be rebuilt from */
+
+    /* The globals a trace uses, which it keeps in the slots from global_slot on while it runs */
+    object_t **globals;
+    uint32_t global_count;
+    uint32_t global_slot;
+};
+
+typedef struct jit_code jit_code_t;
+
+jit_code_t *jit_compile(chunk_t *chunk, func_table_t *funcs, int in_function, jit_code_t **traces);
+jit_code_t *jit_compile_trace(chunk_t *chunk, func_table_t *funcs, int in_function, trace_t *trace);
+jit_code_t *jit_load(chunk_t *chunk, uint32_t *depth, jit_image_t *image);
+uint32_t jit_deopt(jit_code_t *jit, object_t *locals, uint32_t exit);
+void jit_load_globals(jit_code_t *jit, object_t *locals);
+void jit_store_globals(jit_code_t *jit, object_t *locals);
+void jit_free(jit_code_t *jit);
+
+#endif // __PHANTOM_JIT_H_
@@ -0,0 +1,304 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "jitcache.h"
+#include "verify.h"
+
+#if defined(__x86_64__) && !defined(_WIN32)
+
+#include <limits.h>
+#include <cpuid.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CACHE_MAGIC 0x54494A50     /* "PJIT" */
+
+/* Most bytes of code a file can claim to have, past which it is taken to be damaged */
+#define CACHE_MAX_CODE (1u << 30)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t key;
+    uint64_t image_hash;    /* Of everything after the header, so a damaged file is never mapped */
+    uint64_t size;
+    uint64_t code_size;
+    uint32_t reloc_count;
+    uint32_t count;         /* Bytes of bytecode in the chunk, so of native flags less one */
+} cache_header_t;
+
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t size)
+{
+    const uint8_t *bytes = data;
+
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+
+    return hash;
+}
+
+/* The features cpuid reports, which the code is only known to run on a cpu with all of */
+static void cpu_features(uint32_t *features)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    memset(features, 0, sizeof(uint32_t) * 4);
+
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+    {
+        features[0] = ecx;
+        features[1] = edx;
+    }
+
+    if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+    {
+        features[2] = ebx;
+        features[3] = ecx;
+    }
+}
+
+/* Everything the code laid down for a chunk depends on. The strings of constants don't matter as they are relocated */
+static uint64_t cache_key(chunk_t *chunk, uint32_t *depth, jit_code_t **traces)
+{
+    uint32_t version = JIT_VERSION;
+    uint32_t features[4];
+    uint64_t hash = 14695981039346656037ull;
+
+    cpu_features(features);
+
+    hash = hash_bytes(hash, &version, sizeof(version));
+    hash = hash_bytes(hash, features, sizeof(features));
+    hash = hash_bytes(hash, &chunk->count, sizeof(chunk->count));
+    hash = hash_bytes(hash, chunk->code, chunk->count);
+    hash = hash_bytes(hash, depth, sizeof(uint32_t) * (chunk->count + 1));
+    hash = hash_bytes(hash, &chunk->local_count, sizeof(chunk->local_count));
+
+    for (uint32_t i = 0; i < chunk->const_count; i++)
+    {
+        object_t *obj = &chunk->constants[i];
+        hash = hash_bytes(hash, &obj->type, sizeof(obj->type));
+
+        if (obj->type == OBJ_VAL_LONG || obj->type == OBJ_VAL_DOUBLE)
+            hash = hash_bytes(hash, &obj->as, sizeof(obj->as));
+    }
+
+    /* Loops with a trace go back through the interpreter */
+    for (uint32_t i = 0; traces && i < chunk->count; i++)
+    {
+        if (traces[i]) hash = hash_bytes(hash, &i, sizeof(i));
+    }
+
+    return hash;
+}
+
+/* The code with its addresses left out, its relocations and its native flags, as they are kept */
+static uint64_t image_hash(const uint8_t *code, uint64_t size, const jit_reloc_t *relocs, uint32_t reloc_count,
+                           const uint8_t *native, uint32_t count)
+{
+    uint64_t hash = 14695981039346656037ull;
+
+    hash = hash_bytes(hash, code, size);
+    hash = hash_bytes(hash, relocs, sizeof(jit_reloc_t) * reloc_count);
+    hash = hash_bytes(hash, native, count + 1);
+
+    return hash;
+}
+
+static void cache_name(char *name, uint64_t key)
+{
+    snprintf(name, PATH_MAX, "%016llx.jit", (unsigned long long)key);
+}
+
+/* Whether fd is a directory or file this user owns and no one else can write to */
+static int is_private(int fd, int want_dir)
+{
+    struct stat st;
+
+    return fstat(fd, &st) == 0 && (want_dir ? S_ISDIR(st.st_mode) : S_ISREG(st.st_mode)) &&
+           st.st_uid == geteuid() && !(st.st_mode & (S_IWGRP | S_IWOTH));
+}
+
+/*
+ * Opens the directory, which has to be private as the code in it gets run.
+ * Returns -1 if it isn't, or is a link, so the cache isn't used. The files are
+ * opened relative to what is returned, so they are in the directory checked.
+ */
+static int open_dir(const char *dir)
+{
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+
+    if (fd >= 0 && !is_private(fd, 1))
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* Reads the code kept under key. depth belongs to the code returned, and is freed if there is none */
+static jit_code_t *load_code(const char *dir, chunk_t *chunk, uint32_t *depth, uint64_t key)
+{
+    char name[PATH_MAX];
+    cache_name(name, key);
+
+    int dir_fd = open_dir(dir);
+    int fd = dir_fd >= 0 ? openat(dir_fd, name, O_RDONLY | O_NOFOLLOW) : -1;
+    FILE *in = fd >= 0 && is_private(fd, 0) ? fdopen(fd, "rb") : NULL;
+
+    if (dir_fd >= 0) close(dir_fd);
+
+    if (!in)
+    {
+        if (fd >= 0) close(fd);
+        free(depth);
+        return NULL;
+    }
+
+    cache_header_t header;
+    jit_image_t image = { 0 };
+    int ok = fread(&header, sizeof(header), 1, in) == 1 && header.magic == CACHE_MAGIC &&
+             header.version == JIT_VERSION && header.key == key && header.count == chunk->count &&
+             header.size <= CACHE_MAX_CODE && header.reloc_count <= header.size;
+
+    if (ok)
+    {
+        image.size = header.size;
+        image.code_size = header.code_size;
+        image.reloc_count = header.reloc_count;
+        image.code = malloc(image.size + 1);
+        image.relocs = malloc(sizeof(jit_reloc_t) * (image.reloc_count + 1));
+        image.native = malloc(chunk->count + 1);
+
+        ok = fread(image.code, 1, image.size, in) == image.size &&
+             fread(image.relocs, sizeof(jit_reloc_t), image.reloc_count, in) == image.reloc_count &&
+             fread(image.native, 1, chunk->count + 1, in) == chunk->count + 1 &&
+             image_hash(image.code, image.size, image.relocs, image.reloc_count, image.native, chunk->count) ==
+                 header.image_hash;
+    }
+
+    fclose(in);
+
+    jit_code_t *jit = NULL;
+
+    if (ok) jit = jit_load(chunk, depth, &image);
+    else free(depth);
+
+    free(image.code);
+    free(image.relocs);
+    free(image.native);
+
+    return jit;
+}
+
+/* Writes the code out under key. Nothing is kept if it can't all be written */
+static void store_code(const char *dir, chunk_t *chunk, jit_code_t *jit, uint64_t key)
+{
+    if (jit->image_size == 0) return;
+
+    /* Made on first use. If it is already there it has to be private all the same */
+    mkdir(dir, 0700);
+
+    int dir_fd = open_dir(dir);
+    if (dir_fd < 0) return;
+
+    char name[PATH_MAX], temp[PATH_MAX];
+    cache_name(name, key);
+    snprintf(temp, sizeof(temp), "%016llx.%d.tmp", (unsigned long long)key, (int)getpid());
+
+    /* The addresses are left out, so the file is the same whichever process wrote it */
+    uint8_t *code = malloc(jit->image_size);
+    memcpy(code, jit->mem, jit->image_size);
+
+    for (uint32_t r = 0; r < jit->reloc_count; r++)
+        memset(code + jit->relocs[r].at, 0, sizeof(uint64_t));
+
+    int fd = openat(dir_fd, temp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+    FILE *out = fd >= 0 ? fdopen(fd, "wb") : NULL;
+
+    if (!out)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+            unlinkat(dir_fd, temp, 0);
+        }
+
+        close(dir_fd);
+        free(code);
+        return;
+    }
+
+    cache_header_t header = {
+        .magic = CACHE_MAGIC,
+        .version = JIT_VERSION,
+        .key = key,
+        .size = jit->image_size,
+        .code_size = jit->code_size,
+        .reloc_count = jit->reloc_count,
+        .count = chunk->count,
+        .image_hash = image_hash(code, jit->image_size, jit->relocs, jit->reloc_count, jit->native, chunk->count),
+    };
+
+    int ok = fwrite(&header, sizeof(header), 1, out) == 1 &&
+             fwrite(code, 1, jit->image_size, out) == jit->image_size &&
+             fwrite(jit->relocs, sizeof(jit_reloc_t), jit->reloc_count, out) == jit->reloc_count &&
+             fwrite(jit->native, 1, chunk->count + 1, out) == chunk->count + 1;
+
+    ok = fclose(out) == 0 && ok;
+
+    /* Moved into place whole, so another process never maps a file part way through being written */
+    if (!ok || renameat(dir_fd, temp, dir_fd, name) != 0) unlinkat(dir_fd, temp, 0);
+
+    close(dir_fd);
+    free(code);
+}
+
+jit_code_t *jit_cache_load(const char *dir, chunk_t *chunk, func_table_t *funcs, int in_function,
+                           jit_code_t **traces)
+{
+    uint32_t *depth = malloc(sizeof(uint32_t) * (chunk->count + 1));
+
+    if (verify_depths(chunk, funcs, in_function, depth).code != VERIFY_OK)
+    {
+        free(depth);
+        return NULL;
+    }
+
+    return load_code(dir, chunk, depth, cache_key(chunk, depth, traces));
+}
+
+jit_code_t *jit_cache_compile(const char *dir, chunk_t *chunk, func_table_t *funcs, int in_function,
+                              jit_code_t **traces)
+{
+    if (!dir) return jit_compile(chunk, funcs, in_function, traces);
+
+    jit_code_t *jit = jit_cache_load(dir, chunk, funcs, in_function, traces);
+    if (jit) return jit;
+
+    jit = jit_compile(chunk, funcs, in_function, traces);
+    if (jit) store_code(dir, chunk, jit, cache_key(chunk, jit->depth, traces));
+
+    return jit;
+}
+
+#else
+
+/* Without a jit there is no code to keep */
+jit_code_t *jit_cache_load(const char *dir, chunk_t *chunk, func_table_t *funcs, int in_function,
+                           jit_code_t **traces)
+{
+    return NULL;
+}
+
+jit_code_t *jit_cache_compile(const char *dir, chunk_t *chunk, func_table_t *funcs, int in_function,
+                              jit_code_t **traces)
+{
+    return jit_compile(chunk, funcs, in_function, traces);
+}
+
+#endif
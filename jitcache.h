@@ -0,0 +1,32 @@
+#ifndef __PHANTOM_JITCACHE_H_
+#define __PHANTOM_JITCACHE_H_
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "chunk.h"
+#include "function.h"
+#include "jit.h"
+
+/*
+ * Keeps machine code in a directory between runs, so a process that runs the
+ * same code as an earlier one can map what it compiled instead of compiling
+ * it again. Code is kept in a file named after a hash of the bytecode, the
+ * stack depths the verifier gives it, the loops that have traces, the
+ * features of the cpu and JIT_VERSION, so a change to any of them misses.
+ * A hash of the code is kept with it and checked before the code is mapped,
+ * which catches a file that was cut short or damaged. It can't catch one that
+ * was written to be run, so the directory and each file in it have to belong
+ * to the user running phantom and be writable by no one else, and aren't
+ * links. The cache is skipped otherwise.
+ */
+
+/* Maps the code kept for chunk in dir, if there is any. Returns NULL if there isn't */
+jit_code_t *jit_cache_load(const char *dir, chunk_t *chunk, func_table_t *funcs, int in_function,
+                           jit_code_t **traces);
+
+/* Compiles chunk as jit_compile does, taking the code from dir where it can and keeping it there where it can't */
+jit_code_t *jit_cache_compile(const char *dir, chunk_t *chunk, func_table_t *funcs, int in_function,
+                              jit_code_t **traces);
+
+#endif // __PHANTOM_JITCACHE_H_
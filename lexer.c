@@ -89,35 +89,42 @@ static token_t new_token(lexer_t *l, token_type type)
     return tok;
 }
 
-static token_type check_keyword(const char *start)
+/* Whether the identifier of len bytes at start is word. Names that only start with a keyword are identifiers */
+static int is_keyword(const char *start, unsigned len, const char *word)
+{
+    return len == strlen(word) && memcmp(start, word, len) == 0;
+}
+
+static token_type check_keyword(const char *start, unsigned len)
 {
     switch (*start)
     {
-        case 'b': if (memcmp(start, "break", 5) == 0) return TOK_BREAK; break;
-        case 'c': if (memcmp(start, "continue", 8) == 0) return TOK_CONTINUE; break;
+        case 'b': if (is_keyword(start, len, "break")) return TOK_BREAK; break;
+        case 'c': if (is_keyword(start, len, "continue")) return TOK_CONTINUE; break;
         case 'e':
         {
-            if (memcmp(start, "else", 4) == 0) return TOK_ELSE;
-            if (memcmp(start, "exit", 4) == 0) return TOK_EXIT;
+            if (is_keyword(start, len, "else")) return TOK_ELSE;
+            if (is_keyword(start, len, "exit")) return TOK_EXIT;
             break;
         }
         case 'f':
         {
-            if (memcmp(start, "false", 5) == 0) return TOK_FALSE;
-            if (memcmp(start, "func", 4) == 0) return TOK_FUNC;
+            if (is_keyword(start, len, "false")) return TOK_FALSE;
+            if (is_keyword(start, len, "func")) return TOK_FUNC;
             break;
         }
-        case 'i': if (memcmp(start, "if", 2) == 0) return TOK_IF; break;
-        case 'l': if (memcmp(start, "loop", 4) == 0) return TOK_LOOP; break;
+        case 'i': if (is_keyword(start, len, "if")) return TOK_IF; break;
+        case 'l': if (is_keyword(start, len, "loop")) return TOK_LOOP; break;
+        case 'm': if (is_keyword(start, len, "match")) return TOK_MATCH; break;
         case 'r':
         {
-            if (memcmp(start, "return", 6) == 0) return TOK_RETURN;
-            if (memcmp(start, "rand", 4) == 0) return TOK_RAND;
+            if (is_keyword(start, len, "return")) return TOK_RETURN;
+            if (is_keyword(start, len, "rand")) return TOK_RAND;
             break;
         }
-        case 's': if (memcmp(start, "stdin", 5) == 0) return TOK_STDIN; break;
-        case 't': if (memcmp(start, "true", 4) == 0) return TOK_TRUE; break;
-        case 'v': if (memcmp(start, "var", 3) == 0) return TOK_VAR; break;
+        case 's': if (is_keyword(start, len, "stdin")) return TOK_STDIN; break;
+        case 't': if (is_keyword(start, len, "true")) return TOK_TRUE; break;
+        case 'v': if (is_keyword(start, len, "var")) return TOK_VAR; break;
     }
 
     return TOK_IDENT;
@@ -127,7 +134,7 @@ static token_t new_identifer(lexer_t *l)
 {
     while (is_char(peek_char(l)) || is_digit(peek_char(l))) advance(l);
 
-    token_type type = check_keyword(l->start);
+    token_type type = check_keyword(l->start, (unsigned)(l->curr - l->start));
 
     return new_token(l, type);
 }
@@ -281,6 +288,7 @@ const char *token_get_type_literal(token_type type)
         case TOK_CONTINUE: return "CONTINUE";
         case TOK_TRUE: return "TRUE";
         case TOK_FALSE: return "FALSE";
+        case TOK_MATCH: return "MATCH";
 
         case TOK_STDIN: return "STDIN";
         case TOK_EXIT: return "EXIT";
@@ -288,3 +296,117 @@ const char *token_get_type_literal(token_type type)
         default: return "ILLEGAL";
     }
 }
+
+void lexer_scanner_reset(stmt_scanner_t *s, size_t pos)
+{
+    s->pos = pos;
+    s->depth = 0;
+    s->in_string = 0;
+    s->in_comment = 0;
+}
+
+/*
+ * Checks if an else keyword follows a closing brace. Returns 1 if it does, 0 if
+ * it does not, and -1 if there is not enough input yet to tell.
+ */
+static int else_follows(const char *src, size_t pos, size_t len, int at_end)
+{
+    for (;;)
+    {
+        if (pos >= len) return at_end ? 0 : -1;
+
+        char c = src[pos];
+
+        if (c == ' ' || c == '\t' || c == '\r' || c == '\n')
+        {
+            pos++;
+            continue;
+        }
+
+        if (c == '#')
+        {
+            while (pos < len && src[pos] != '\n') pos++;
+            continue;
+        }
+
+        break;
+    }
+
+    /* Need the keyword plus one more character to rule out identifiers like elsewhere */
+    if (len - pos < 5 && !at_end)
+    {
+        if (memcmp(src + pos, "else", len - pos < 4 ? len - pos : 4) == 0) return -1;
+        return 0;
+    }
+
+    if (len - pos < 4 || memcmp(src + pos, "else", 4) != 0) return 0;
+    if (len - pos > 4 && (is_char(src[pos + 4]) || is_digit(src[pos + 4]))) return 0;
+
+    return 1;
+}
+
+/*
+ * Scans src from s->pos for the end of the current top level statement. A
+ * statement ends with a ';' or a closing '}' at brace depth zero, unless the
+ * brace is followed by an else branch. Returns the offset just past the end of
+ * the statement, or 0 if more input is needed. at_end tells the scanner that
+ * no more input will arrive.
+ */
+size_t lexer_scan_stmt(stmt_scanner_t *s, const char *src, size_t len, int at_end)
+{
+    while (s->pos < len)
+    {
+        char c = src[s->pos];
+
+        if (s->in_comment)
+        {
+            if (c == '\n') s->in_comment = 0;
+            s->pos++;
+            continue;
+        }
+
+        if (s->in_string)
+        {
+            if (c == '"') s->in_string = 0;
+            s->pos++;
+            continue;
+        }
+
+        switch (c)
+        {
+            case '"': s->in_string = 1; break;
+            case '#': s->in_comment = 1; break;
+            case '{': s->depth++; break;
+            case ';':
+            {
+                if (s->depth == 0) return ++s->pos;
+                break;
+            }
+            case '}':
+            {
+                /* A stray closing brace is left for the parser to report */
+                if (s->depth == 0) return ++s->pos;
+                if (s->depth > 1)
+                {
+                    s->depth--;
+                    break;
+                }
+
+                int has_else = else_follows(src, s->pos + 1, len, at_end);
+
+                /* Leave the brace unscanned until we know what follows it */
+                if (has_else < 0) return 0;
+
+                s->depth--;
+                if (!has_else) return ++s->pos;
+
+                break;
+            }
+            default: break;
+        }
+
+        s->pos++;
+    }
+
+    return 0;
+}
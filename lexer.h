@@ -1,6 +1,8 @@
 #ifndef __PHANTOM_LEXER_H_
 #define __PHANTOM_LEXER_H_
 
+#include <stddef.h>
+
 typedef enum {
     TOK_ILLEGAL,
     TOK_ERROR,
@@ -57,6 +59,7 @@ typedef enum {
     TOK_CONTINUE,
     TOK_TRUE,
     TOK_FALSE,
+    TOK_MATCH,
 
     TOK_STDIN,
     TOK_EXIT,
@@ -78,9 +81,24 @@ typedef struct {
     unsigned col;
 } lexer_t;
 
+/*
+ * State for finding where top level statements end without lexing them. This
+ * only tracks braces, strings, and comments so it can be resumed when more of
+ * the source becomes available.
+ */
+typedef struct {
+    size_t pos;       /* Offset of the next byte to scan */
+    unsigned depth;   /* Current brace depth */
+    int in_string;
+    int in_comment;
+} stmt_scanner_t;
+
 lexer_t *lexer_init(const char *src);
 void lexer_free(lexer_t *l);
 token_t lexer_next(lexer_t *l);
 const char *token_get_type_literal(token_type type);
 
+void lexer_scanner_reset(stmt_scanner_t *s, size_t pos);
+size_t lexer_scan_stmt(stmt_scanner_t *s, const char *src, size_t len, int at_end);
+
 #endif // __PHANTOM_LEXER_H_
@@ -9,7 +9,65 @@
 #include "parser.h"
 #include "compiler.h"
 #include "vm.h"
+#include "stream.h"
+#include "parallel.h"
+#include "peephole.h"
+#include "ir.h"
 #include "debug.h"
+#include "aot.h"
+#include "perf.h"
+#include "bytecode.h"
+
+/* Compile straight from the tokens instead of building an ast first */
+static int single_pass = 0;
+
+/* Lex on a separate thread while parsing */
+static int pipelined = 0;
+
+/* Threads to compile top level statements on. Zero compiles on the main thread */
+static int jobs = 0;
+
+/* Optimise through the ssa ir before emitting bytecode */
+static int use_ir = 0;
+
+/* Copies of the body in a partly unrolled loop. Zero turns unrolling off */
+static int unroll_factor = COMPILER_UNROLL_FACTOR;
+
+/* Most bytes of code a function can have for calls to it to be inlined. Zero turns inlining off */
+static int inline_budget = COMPILER_INLINE_BUDGET;
+
+/* Run the peephole optimiser. Turned off to see the code as the compiler emitted it */
+static int optimise = 1;
+
+/* Translate chunks to machine code where the platform allows it */
+static int use_jit = 1;
+
+/* Calls of a function, and back edges of a loop, before its chunk is translated */
+static int call_threshold = TIER_CALL_THRESHOLD;
+static int loop_threshold = TIER_LOOP_THRESHOLD;
+
+/* Back edges of a loop before an iteration of it is traced. Zero turns tracing off */
+static int trace_threshold = TIER_TRACE_THRESHOLD;
+
+/* Report each chunk that is translated */
+static int report_tiers = 0;
+
+/* Print the bytecode before running it */
+static int print_code = 0;
+
+/* Write the script out as C to this file instead of running it */
+static const char *aot_path = NULL;
+
+/* Keep machine code in this directory between runs, and start chunks out with what is there */
+static const char *jit_cache = NULL;
+
+/* Name machine code in /tmp/perf-<pid>.map for perf, and with jitdump write the code out for perf inject too */
+static int perf_map = 0;
+static int jitdump = 0;
+
+/* Keep the compiled script in a .ptnc file next to it, or in this directory, and run from that while the script is unchanged */
+static int ptnc = 0;
+static const char *ptnc_dir = NULL;
 
 static char *read_file(const char *path)
 {
@@ -44,11 +102,41 @@ static void print_help()
 {
     printf("\nUsage: phantom [options] [arguments...]\n\n");
     printf("To start phantom in interactive mode(REPL)\n  phantom\n\n");
+    printf("To run a script piped in through stdin\n  phantom -\n\n");
     printf("For help type:\n  phantom -h\n\n");
+    printf("Options:\n");
+    printf("  -s  Compile in a single pass without building an ast\n");
+    printf("  -p  Lex on a separate thread while parsing scripts\n");
+    printf("  -j <threads>  Compile the top level statements of scripts on a pool of threads, after their functions\n");
+    printf("  -O  Optimise through an ssa ir before emitting bytecode, warning about code it has to compile without it\n");
+    printf("  -u <factor>  Unroll loops with a literal count by factor, 0 turns unrolling off\n");
+    printf("  -i <bytes>  Inline calls to functions of at most bytes of code, 0 turns inlining off\n");
+    printf("  -d  Don't run the peephole optimiser\n");
+    printf("  -n  Interpret everything rather than translating it to machine code\n");
+    printf("  -t <calls>  Translate a function to machine code once it has been called this often\n");
+    printf("  -l <iterations>  Translate a chunk once a loop in it has gone round this often, 0 translates scripts up front\n");
+    printf("  -T <iterations>  Trace a loop once it has gone round this often, 0 turns tracing off\n");
+    printf("  --jit-cache <dir>  Keep machine code in dir for later runs of the same code to start with\n");
+    printf("  -r  Report each chunk and trace translated to machine code on stderr\n");
+    printf("  -b  Print the bytecode before running it\n");
+    printf("  --ptnc  Keep the compiled script next to it in a .ptnc file and run that until the script changes\n");
+    printf("  --ptnc-dir <dir>  Keep compiled scripts in dir instead of next to them\n");
+    printf("  --aot <file>  Write the script out as C to build with a C compiler instead of running it\n");
+    printf("  --perf-map  Name the machine code for perf in /tmp/perf-<pid>.map\n");
+    printf("  --jitdump  Write the machine code and the lines it came from to /tmp/jit-<pid>.dump for perf inject\n\n");
+
+    printf("Syntax:\n");
+    printf("  var name = value;  Declares name, or gives it a new value if it has one\n");
+    printf("  if (cond) { ... } else { ... }\n");
+    printf("  loop (count) { ... }\n");
+    printf("  match (value) { 1, 2 { ... } 3 { ... } else { ... } }  Runs the first arm with a case equal to value\n");
+    printf("  func name(a, b) { return a + b; }  Defines a function at the top level, called as name(1, 2)\n");
+    printf("  a && b, a || b  Only work out b when a doesn't already decide the result\n");
+    printf("  value;  Prints value, unless it is a lone call or stdin, which are run for what they do\n");
+    printf("  stdin, rand(n), exit  Read a line, pick a number below n, stop the script\n\n");
 
     /* TODO: Add list of arguments output here */
     /* -v or --version, -h or --help */
-    printf("Help not implemented\n");
 }
 
 static void print_info()
@@ -68,97 +156,329 @@ static void run_inline(lexer_t *l)
 
 static void repl()
 {
-    char input[1024];
+    vm_t *vm = vm_init();
+    vm->jit = use_jit;
+    vm->call_threshold = call_threshold;
+    vm->loop_threshold = loop_threshold;
+    vm->trace_threshold = trace_threshold;
+    vm->report_tiers = report_tiers;
+    vm->jit_cache = jit_cache;
+    stream_t *s = stream_init(stdin);
+    s->prompt = ">> ";
+    s->single_pass = single_pass;
+    s->use_ir = use_ir;
+    s->unroll_factor = unroll_factor;
+    s->inline_budget = inline_budget;
+    s->optimise = optimise;
+    s->print_code = print_code;
+
+    /* Statements can span multiple lines so only run them once they are complete */
+    if (stream_run(s, vm) != VM_EXIT)
+        printf("\n");
+
+    stream_free(s);
+    vm_free(vm);
+}
+
+/* Runs a script piped in through stdin one statement at a time */
+static void run_stream(FILE *in)
+{
+    srand(time(NULL));
 
-    lexer_t *l = NULL;
-    parser_t *p = NULL;
-    ast_node_t *ast = NULL;
-    compiler_t *c = NULL;
     vm_t *vm = vm_init();
+    vm->jit = use_jit;
+    vm->call_threshold = call_threshold;
+    vm->loop_threshold = loop_threshold;
+    vm->trace_threshold = trace_threshold;
+    vm->report_tiers = report_tiers;
+    vm->jit_cache = jit_cache;
+    stream_t *s = stream_init(in);
+    s->single_pass = single_pass;
+    s->use_ir = use_ir;
+    s->unroll_factor = unroll_factor;
+    s->inline_budget = inline_budget;
+    s->optimise = optimise;
+    s->print_code = print_code;
+
+    stream_run(s, vm);
+
+    stream_free(s);
+    vm_free(vm);
+}
 
-    compiler_code_t code;
+/* Writes the compiled script out as C rather than running it */
+static void write_aot(vm_t *vm, const char *path)
+{
+    FILE *out = fopen(path, "w");
 
-    for (;;)
+    if (!out)
     {
-        printf(">> ");
+        fprintf(stderr, "Unable to open file '%s'\n", path);
+        exit(74);
+    }
+
+    int written = aot_compile(vm->chunk, vm->funcs, out);
+    fclose(out);
+
+    /* Don't leave half a program behind for a build to pick up */
+    if (!written) remove(path);
+}
+
+/* Handles the options and returns the path of the script to run */
+static const char *check_args(int argc, char **argv)
+{
+    const char *script = NULL;
 
-        if (!fgets(input, sizeof(input), stdin))
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-h") == 0)
         {
-            printf("\n");
-            break;
+            print_help();
+            exit(0);
         }
 
-        l = lexer_init(input);
-        p = parser_init(l);
-        ast = parser_parse_program(p);
-        c = compiler_init(vm);
+        if (strcmp(argv[i], "-v") == 0)
+        {
+            print_info();
+            exit(0);
+        }
 
-        code = compiler_compile_program(c, ast);
+        if (strcmp(argv[i], "-s") == 0)
+        {
+            single_pass = 1;
+            continue;
+        }
 
-        vm_run(vm);
-        //run_inline(l);
+        if (strcmp(argv[i], "-p") == 0)
+        {
+            pipelined = 1;
+            continue;
+        }
 
+        if (strcmp(argv[i], "-O") == 0)
+        {
+            use_ir = 1;
+            continue;
+        }
 
-        parser_free(p);
-        ast_node_free(ast); // TODO: Use the better named version of the function
-        compiler_free(c);
+        if (strcmp(argv[i], "-d") == 0)
+        {
+            optimise = 0;
+            continue;
+        }
 
-        /* TODO: Maybe look into a clearer way of sorting this out */
-        vm->ip = 0;
-        vm->cp = 0;
-    }
+        if (strcmp(argv[i], "-n") == 0)
+        {
+            use_jit = 0;
+            continue;
+        }
 
-    vm_free(vm);
-}
+        if (strcmp(argv[i], "-r") == 0)
+        {
+            report_tiers = 1;
+            continue;
+        }
 
-static void check_args(int argc, char **argv)
-{
-    if (argc == 1)
-    {
-        repl();
-        exit(0);
-    }
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+        {
+            call_threshold = atoi(argv[++i]);
+            if (call_threshold < 0) call_threshold = 0;
+            continue;
+        }
 
-    if (argc == 2)
-    {
-        if (strcmp(argv[1], "-h") == 0)
+        if (strcmp(argv[i], "-l") == 0 && i + 1 < argc)
         {
-            print_help();
-            exit(0);
+            loop_threshold = atoi(argv[++i]);
+            if (loop_threshold < 0) loop_threshold = 0;
+            continue;
         }
 
-        if (strcmp(argv[1], "-v") == 0)
+        if (strcmp(argv[i], "-T") == 0 && i + 1 < argc)
         {
-            print_info();
-            exit(0);
+            trace_threshold = atoi(argv[++i]);
+            if (trace_threshold < 0) trace_threshold = 0;
+            continue;
         }
+
+        if (strcmp(argv[i], "-b") == 0)
+        {
+            print_code = 1;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--aot") == 0 && i + 1 < argc)
+        {
+            aot_path = argv[++i];
+            continue;
+        }
+
+        if (strcmp(argv[i], "--jit-cache") == 0 && i + 1 < argc)
+        {
+            jit_cache = argv[++i];
+            continue;
+        }
+
+        if (strcmp(argv[i], "--ptnc") == 0)
+        {
+            ptnc = 1;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--ptnc-dir") == 0 && i + 1 < argc)
+        {
+            ptnc = 1;
+            ptnc_dir = argv[++i];
+            continue;
+        }
+
+        if (strcmp(argv[i], "--perf-map") == 0)
+        {
+            perf_map = 1;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--jitdump") == 0)
+        {
+            perf_map = jitdump = 1;
+            continue;
+        }
+
+        if (strcmp(argv[i], "-u") == 0 && i + 1 < argc)
+        {
+            unroll_factor = atoi(argv[++i]);
+            if (unroll_factor < 0) unroll_factor = 0;
+            continue;
+        }
+
+        if (strcmp(argv[i], "-i") == 0 && i + 1 < argc)
+        {
+            inline_budget = atoi(argv[++i]);
+            if (inline_budget < 0) inline_budget = 0;
+            continue;
+        }
+
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+        {
+            jobs = atoi(argv[++i]);
+            if (jobs < 1) jobs = 1;
+            continue;
+        }
+
+        /* A lone dash means the script is piped in through stdin */
+        if (argv[i][0] == '-' && argv[i][1] != '\0')
+        {
+            fprintf(stderr, "Unknown option '%s'\n", argv[i]);
+            print_help();
+            exit(64); /* Usage error */
+        }
+
+        script = argv[i];
     }
+
+    if (!script || strcmp(script, "-") == 0)
+    {
+        if (perf_map) perf_open("<stdin>", jitdump);
+
+        if (script) run_stream(stdin);
+        else repl();
+
+        perf_close();
+        exit(0);
+    }
+
+    return script;
 }
 
 int main(int argc, char **argv)
 {
-    check_args(argc, argv);
+    const char *path = check_args(argc, argv);
 
-    char *input = read_file(argv[1]);
+    if (perf_map) perf_open(path, jitdump);
+
+    char *input = read_file(path);
 
     srand(time(NULL));
 
     lexer_t *l = lexer_init(input);
-    parser_t *p = parser_init(l);
     vm_t *vm = vm_init();
-    compiler_t *c = compiler_init(vm);
 
-    ast_node_t *ast = parser_parse_program(p);
-    if (!ast)
+    /* Everything that changes the code compiled from the source goes in the key */
+    bytecode_t *bytecode = NULL;
+    char *ptnc_path = NULL;
+    uint64_t ptnc_key = 0;
+
+    if (ptnc)
+    {
+        int options[] = { single_pass, use_ir, unroll_factor, inline_budget, optimise };
+
+        ptnc_key = bytecode_key(input, strlen(input), options, sizeof(options) / sizeof(options[0]));
+        ptnc_path = bytecode_path(path, ptnc_dir, ptnc_key);
+        if (ptnc_path) bytecode = bytecode_load(ptnc_path, ptnc_key, vm->chunk, vm->funcs);
+    }
+
+    /* Nothing is parsed when the bytecode is loaded, so there is no lexer thread to start */
+    parser_t *p = pipelined && !bytecode ? parser_init_pipelined(l) : parser_init(l);
+    vm->jit = use_jit;
+    vm->call_threshold = call_threshold;
+    vm->loop_threshold = loop_threshold;
+    vm->trace_threshold = trace_threshold;
+    vm->report_tiers = report_tiers;
+    vm->jit_cache = jit_cache;
+    compiler_t *c = compiler_init(vm->chunk);
+    c->unroll_factor = unroll_factor;
+    c->inline_budget = inline_budget;
+    c->funcs = vm->funcs;
+
+    compiler_code_t code;
+    ast_node_t *ast = NULL;
+
+    if (bytecode)
     {
-        printf("No ast supplied\n");
-        goto cleanup;
+        code = COMPILER_OK;
+    }
+    else if (jobs)
+    {
+        code = parallel_compile(input, strlen(input), vm->chunk, vm->funcs, jobs, single_pass, use_ir,
+                                unroll_factor, inline_budget);
+    }
+    else if (single_pass)
+    {
+        code = parser_compile_program(p, c);
+    }
+    else
+    {
+        ast = parser_parse_program(p);
+        if (!ast)
+        {
+            printf("No ast supplied\n");
+            goto cleanup;
+        }
+
+        /* Nothing runs after the script so it is compiled as a closed program */
+        code = use_ir ? ir_compile_program(c, ast, 1) : compiler_compile_program(c, ast);
     }
-    
-    compiler_code_t code = compiler_compile_program(c, ast);
     //if (code == COMPILER_OK) printf("Successful compilation!\n");
 
-    vm_run(vm);
+    if (code != COMPILER_PARSE_ERROR)
+    {
+        /* Loaded bytecode was optimised before it was saved */
+        if (optimise && !bytecode) peephole_optimise(vm->chunk);
+        if (print_code) debug_print_chunk(vm->chunk);
+
+        for (uint32_t i = 0; i < vm->funcs->count; i++)
+        {
+            if (optimise && !bytecode) peephole_optimise(vm->funcs->funcs[i].chunk);
+            if (print_code) debug_print_function(&vm->funcs->funcs[i], i);
+        }
+
+        /* Saved before it runs, as the vm changes nothing in the chunks */
+        if (ptnc_path && !bytecode && code == COMPILER_OK) bytecode_save(ptnc_path, ptnc_key, vm->chunk, vm->funcs);
+
+        if (aot_path)
+            write_aot(vm, aot_path);
+        else
+            vm_run(vm);
+    }
 
     //ast_node_print_header();
     //ast_node_print_node(ast);
@@ -168,10 +488,13 @@ cleanup:
     ast_node_free(ast);
 
     vm_free(vm);
+    bytecode_close(bytecode);
+    free(ptnc_path);
     compiler_free(c);
     parser_free(p);
 
     free(input);
+    perf_close();
 
     _CrtDumpMemoryLeaks();
 
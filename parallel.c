@@ -0,0 +1,353 @@
+#include <string.h>
+
+#include "parallel.h"
+#include "parser.h"
+#include "lexer.h"
+#include "vm.h"
+#include "ir.h"
+
+#ifndef _WIN32
+#include <pthread.h>
+#include <stdatomic.h>
+#endif
+
+/* A run of top level statements that is compiled on its own */
+typedef struct {
+    const char *src;
+    size_t len;
+    unsigned line;          /* Line in the script the part starts on */
+
+    chunk_t *chunk;
+    compiler_code_t code;
+    FILE *err;              /* Errors are held back so they can be reported in order */
+    uint32_t first_func;    /* Functions defined before the part, which its calls can see to begin with */
+} part_t;
+
+/* A function definition, which is compiled before any of the parts */
+typedef struct {
+    const char *src;
+    size_t len;
+    unsigned line;
+} def_t;
+
+typedef struct {
+    part_t *parts;
+    size_t count;
+    def_t *defs;
+    size_t def_count;
+    func_table_t *funcs;    /* Read by every part once the definitions have been compiled */
+    int single_pass;
+    int use_ir;
+    int unroll_factor;
+    int inline_budget;
+
+#ifdef _WIN32
+    size_t next;
+#else
+    atomic_size_t next;     /* Next part for a worker to pick up */
+#endif
+} work_t;
+
+#ifdef _WIN32
+/* TODO: Threads on Windows. Until then the parts are compiled one after another */
+#define take_part(w) ((w)->next++)
+#else
+#define take_part(w) atomic_fetch_add(&(w)->next, 1)
+#endif
+
+static void add_part(part_t **parts, size_t *count, size_t *cap,
+                     const char *src, size_t len, unsigned line)
+{
+    if (*count == *cap)
+    {
+        *cap *= 2;
+        *parts = realloc(*parts, sizeof(part_t) * *cap);
+    }
+
+    part_t *part = &(*parts)[(*count)++];
+    part->src = src;
+    part->len = len;
+    part->line = line;
+    part->chunk = chunk_init();
+    part->code = COMPILER_OK;
+    part->err = NULL;
+    part->first_func = 0;
+}
+
+/* Whether a top level statement defines a function */
+static int defines_func(const char *stmt)
+{
+    lexer_t *l = lexer_init(stmt);
+    token_type type = lexer_next(l).type;
+
+    lexer_free(l);
+
+    return type == TOK_FUNC;
+}
+
+/*
+ * Statements at brace depth zero don't depend on each other until they run so
+ * the script can be cut at any of their boundaries. Neighbouring statements
+ * are grouped so each part is big enough to be worth handing to a thread.
+ * Calls are resolved against the functions defined before them as they are
+ * compiled, so function definitions are collected to be compiled first, in
+ * order. The single pass compiler emits a function as it parses it, so there
+ * everything from the first definition on is kept in one part instead.
+ */
+static part_t *split_parts(work_t *w, const char *src, size_t len)
+{
+    size_t cap = 16;
+    part_t *parts = malloc(sizeof(part_t) * cap);
+    size_t def_cap = 0;
+
+    w->count = 0;
+    w->defs = NULL;
+    w->def_count = 0;
+
+    stmt_scanner_t s;
+    lexer_scanner_reset(&s, 0);
+
+    size_t start = 0;
+    size_t end = 0;
+    size_t stmt = 0;
+    unsigned line = 1;
+    unsigned part_line = 1;
+    size_t part_defs = 0;
+
+    while ( (end = lexer_scan_stmt(&s, src, len, 1)) )
+    {
+        if (defines_func(src + stmt))
+        {
+            if (w->single_pass) break;
+
+            if (w->def_count == def_cap)
+            {
+                def_cap = def_cap ? def_cap * 2 : 8;
+                w->defs = realloc(w->defs, sizeof(def_t) * def_cap);
+            }
+
+            w->defs[w->def_count].src = src + stmt;
+            w->defs[w->def_count].len = end - stmt;
+            w->defs[w->def_count].line = line;
+            w->def_count++;
+        }
+
+        for (size_t i = stmt; i < end; i++)
+            if (src[i] == '\n') line++;
+
+        stmt = end;
+        if (end - start < PARALLEL_PART_SIZE) continue;
+
+        add_part(&parts, &w->count, &cap, src + start, end - start, part_line);
+        parts[w->count - 1].first_func = (uint32_t)part_defs;
+
+        part_line = line;
+        part_defs = w->def_count;
+        start = end;
+    }
+
+    /* Anything after the last statement is left for the parser to report */
+    if (start < len || w->count == 0)
+    {
+        add_part(&parts, &w->count, &cap, src + start, len - start, part_line);
+        parts[w->count - 1].first_func = (uint32_t)part_defs;
+    }
+
+    return parts;
+}
+
+/*
+ * Compiles the function definitions one after another, so each sees the ones
+ * before it. Their parse errors are left for the parts to report in order.
+ */
+static compiler_code_t compile_defs(work_t *w)
+{
+    compiler_code_t code = COMPILER_OK;
+
+    for (size_t i = 0; i < w->def_count; i++)
+    {
+        def_t *def = &w->defs[i];
+
+        char *src = malloc(def->len + 1);
+        memcpy(src, def->src, def->len);
+        src[def->len] = '\0';
+
+        lexer_t *l = lexer_init(src);
+        l->line = def->line;
+
+        parser_t *p = parser_init(l);
+        FILE *sink = tmpfile();
+        if (sink) p->err = sink;
+
+        /* The definition is the only code, so what is emitted around it is thrown away */
+        chunk_t *chunk = chunk_init();
+        compiler_t *c = compiler_init(chunk);
+        c->unroll_factor = w->unroll_factor;
+        c->inline_budget = w->inline_budget;
+        c->funcs = w->funcs;
+
+        ast_node_t *ast = parser_parse_program(p);
+        compiler_code_t compiled = w->use_ir ? ir_compile_program(c, ast, 0) : compiler_compile_program(c, ast);
+        if (compiled == COMPILER_PARSE_ERROR) code = compiled;
+
+        ast_node_free(ast);
+        compiler_free(c);
+        chunk_free(chunk);
+        parser_free(p);
+        if (sink) fclose(sink);
+        free(src);
+    }
+
+    return code;
+}
+
+static void compile_part(part_t *part, func_table_t *funcs, int single_pass, int use_ir, int unroll_factor,
+                         int inline_budget)
+{
+    /* The lexer stops at a terminator so each part needs its own copy */
+    char *src = malloc(part->len + 1);
+    memcpy(src, part->src, part->len);
+    src[part->len] = '\0';
+
+    lexer_t *l = lexer_init(src);
+    l->line = part->line;
+
+    parser_t *p = parser_init(l);
+    compiler_t *c = compiler_init(part->chunk);
+    c->unroll_factor = unroll_factor;
+    c->inline_budget = inline_budget;
+    c->funcs = funcs;
+
+    /* Definitions were compiled ahead of the parts, and only the single pass compiler leaves them to the part */
+    if (funcs && !single_pass)
+    {
+        c->defined_ahead = 1;
+        c->func_limit = part->first_func;
+    }
+
+    part->err = tmpfile();
+    if (part->err) p->err = part->err;
+
+    if (single_pass)
+    {
+        part->code = parser_compile_program(p, c);
+    }
+    else
+    {
+        ast_node_t *ast = parser_parse_program(p);
+
+        /* The parts after this one read the globals it declares */
+        part->code = use_ir ? ir_compile_program(c, ast, 0) : compiler_compile_program(c, ast);
+        ast_node_free(ast);
+    }
+
+    compiler_free(c);
+    parser_free(p);
+    free(src);
+}
+
+static void *compile_parts(void *arg)
+{
+    work_t *w = arg;
+    size_t i;
+
+    /* The single pass compiler only defines and calls functions in the last part */
+    while ( (i = take_part(w)) < w->count )
+        compile_part(&w->parts[i], !w->single_pass || i == w->count - 1 ? w->funcs : NULL, w->single_pass, w->use_ir,
+                     w->unroll_factor, w->inline_budget);
+
+    return NULL;
+}
+
+static void report_errors(FILE *err)
+{
+    char buf[512];
+    size_t bytes;
+
+    rewind(err);
+
+    while ( (bytes = fread(buf, 1, sizeof(buf), err)) > 0 )
+        fwrite(buf, 1, bytes, stderr);
+
+    fclose(err);
+}
+
+/*
+ * Compiles the script on a pool of threads and appends the result to out. Each
+ * part is compiled into its own chunk and the chunks are joined in source
+ * order, so the code and any errors are the same as compiling it in one go.
+ * Globals are looked up by name when the code runs so no names need resolving
+ * across parts. Functions are all defined before the threads start, after
+ * which the parts only read the table.
+ */
+compiler_code_t parallel_compile(const char *src, size_t len, chunk_t *out, func_table_t *funcs, int threads,
+                                 int single_pass, int use_ir, int unroll_factor, int inline_budget)
+{
+    work_t work;
+    work.funcs = funcs;
+    work.single_pass = single_pass;
+    work.use_ir = use_ir;
+    work.unroll_factor = unroll_factor;
+    work.inline_budget = inline_budget;
+    work.next = 0;
+    work.parts = split_parts(&work, src, len);
+
+    uint32_t defined = funcs ? funcs->count : 0;
+    compiler_code_t code = funcs ? compile_defs(&work) : COMPILER_OK;
+
+    for (size_t i = 0; i < work.count; i++)
+        work.parts[i].first_func += defined;
+
+    if (threads > PARALLEL_MAX_THREADS) threads = PARALLEL_MAX_THREADS;
+    if ((size_t)threads > work.count) threads = (int)work.count;
+
+#ifndef _WIN32
+    pthread_t pool[PARALLEL_MAX_THREADS];
+    int started = 0;
+
+    /* The calling thread works through the parts as well */
+    for (int i = 1; i < threads; i++)
+    {
+        if (pthread_create(&pool[started], NULL, compile_parts, &work) != 0) break;
+        started++;
+    }
+#endif
+
+    compile_parts(&work);
+
+#ifndef _WIN32
+    for (int i = 0; i < started; i++)
+        pthread_join(pool[i], NULL);
+#endif
+
+    for (size_t i = 0; i < work.count; i++)
+    {
+        part_t *part = &work.parts[i];
+
+        if (part->err) report_errors(part->err);
+        if (part->code == COMPILER_PARSE_ERROR) code = COMPILER_PARSE_ERROR;
+
+        /* Each part was compiled as a whole program so leave out its closing exit */
+        uint32_t count = part->chunk->count;
+        if (count > 0 && part->chunk->code[count - 1] == OP_EXIT) count--;
+
+        /* The parts are each under the limits of a chunk but can go over them together */
+        chunk_append_t appended = code == COMPILER_PARSE_ERROR ? CHUNK_APPEND_OK : chunk_append(out, part->chunk, count);
+
+        if (appended != CHUNK_APPEND_OK)
+        {
+            fprintf(stderr, "Error: %s\n", appended == CHUNK_APPEND_CONSTS ? "Too many constants in one chunk" :
+                                                                           "Too many match statements in one chunk");
+            code = COMPILER_PARSE_ERROR;
+        }
+
+        chunk_free(part->chunk);
+    }
+
+    chunk_write(out, OP_EXIT);
+
+    free(work.parts);
+    free(work.defs);
+
+    return code;
+}
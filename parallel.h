@@ -0,0 +1,16 @@
+#ifndef __PHANTOM_PARALLEL_H_
+#define __PHANTOM_PARALLEL_H_
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "chunk.h"
+#include "compiler.h"
+
+#define PARALLEL_PART_SIZE   (64 * 1024) /* Bytes of source compiled by each task */
+#define PARALLEL_MAX_THREADS 64
+
+compiler_code_t parallel_compile(const char *src, size_t len, chunk_t *out, func_table_t *funcs, int threads, int single_pass, int use_ir,
+                                 int unroll_factor, int inline_budget);
+
+#endif // __PHANTOM_PARALLEL_H_
@@ -18,9 +18,18 @@ typedef enum {
 
 typedef expr_t *(*parse_func)(parser_t *p);
 
+/*
+ * Single pass rules emit bytecode straight from the tokens instead of building
+ * an ast. Each returns the type of the token the ast would have at the root of
+ * what it emitted, so statements treat it the same as the ast compiler does.
+ */
+typedef token_type (*emit_func)(parser_t *p, compiler_t *c);
+
 typedef struct {
     parse_func prefix;
     parse_func infix;
+    emit_func emit_prefix;
+    emit_func emit_infix;
     op_prec prec;
 } parse_rule_t;
 
@@ -34,20 +43,44 @@ static expr_t *inc_dec(parser_t *p);
 static expr_t *stdinput(parser_t *p);
 static expr_t *exit_script(parser_t *p);
 static expr_t *rand_num(parser_t *p);
+static expr_t *call(parser_t *p);
 
 /* Functions for statements nested within statements */
 static expr_t *nested_if(parser_t *p);
 static expr_t *nested_var(parser_t *p);
+static expr_t *nested_loop(parser_t *p);
+static expr_t *nested_match(parser_t *p);
+static expr_t *nested_return(parser_t *p);
+
+static token_type emit_variable(parser_t *p, compiler_t *c);
+static token_type emit_literal(parser_t *p, compiler_t *c);
+static token_type emit_binary_op(parser_t *p, compiler_t *c);
+static token_type emit_and(parser_t *p, compiler_t *c);
+static token_type emit_or(parser_t *p, compiler_t *c);
+static token_type emit_group(parser_t *p, compiler_t *c);
+static token_type emit_stdinput(parser_t *p, compiler_t *c);
+static token_type emit_exit_script(parser_t *p, compiler_t *c);
+static token_type emit_rand_num(parser_t *p, compiler_t *c);
+
+static token_t next_token(parser_t *p)
+{
+#ifndef _WIN32
+    if (p->ring) return token_ring_next(p->ring);
+#endif
+
+    return lexer_next(p->l);
+}
 
 static void parser_advance(parser_t *p)
 {
     p->prev = p->curr;
-    p->curr = lexer_next(p->l);
+    p->curr = next_token(p);
 }
 
 static void parser_err(parser_t *p, char *err_msg)
 {
-    fprintf(stderr, "[line %d: col: %d] Error: %s\n", p->curr.line, p->curr.col, err_msg);
+    p->had_error = 1;
+    fprintf(p->err, "[line %d: col: %d] Error: %s\n", p->curr.line, p->curr.col, err_msg);
 }
 
 static void consume_tok(parser_t *p, token_type type, char *err_msg)
@@ -66,63 +99,73 @@ static int peek_tok(parser_t *p, token_type type)
     return (p->curr.type == type ? 1 : 0);
 }
 
+/*
+ * Blocks are read until their closing brace. Half typed source, such as a block
+ * that is still being written in an editor, stops at the first error instead.
+ */
+static int end_of_block(parser_t *p)
+{
+    return peek_tok(p, TOK_RBRACE) || peek_tok(p, TOK_EOF) || p->had_error;
+}
+
 static parse_rule_t parse_rules[] = {
-    /*              prefix  infix  operator precedence */
-
-    [TOK_ILLEGAL] = { NULL, NULL, OP_PREC_NONE },
-    [TOK_ERROR]   = { NULL, NULL, OP_PREC_NONE },
-    [TOK_EOF]     = { NULL, NULL, OP_PREC_NONE },
-
-    [TOK_IDENT]  = { variable,       NULL, OP_PREC_NONE },
-    [TOK_ASSIGN] = { NULL,       NULL, OP_PREC_ASSIGN },
-    [TOK_INT]    = { number_int, NULL, OP_PREC_NONE },
-    [TOK_FLOAT]  = { number_double, NULL, OP_PREC_NONE },
-    [TOK_STRING] = { string,       NULL, OP_PREC_NONE },
-
-    [TOK_PLUS]     = { NULL, binary_op, OP_PREC_TERM },
-    [TOK_MINUS]    = { NULL, binary_op, OP_PREC_TERM },
-    [TOK_DIVIDE]   = { NULL, binary_op, OP_PREC_FACTOR },
-    [TOK_MULTIPLY] = { NULL, binary_op, OP_PREC_FACTOR },
-    [TOK_MODULO]   = { NULL, binary_op, OP_PREC_FACTOR },
-
-    [TOK_BANG]      = { NULL, NULL, OP_PREC_UNARY },
-    [TOK_AND]       = { NULL, NULL, OP_PREC_AND },
-    [TOK_OR]        = { NULL, NULL, OP_PREC_OR },
-    [TOK_INCREMENT] = { NULL, inc_dec, OP_PREC_UNARY },
-    [TOK_DECREMENT] = { NULL, inc_dec, OP_PREC_UNARY },
-
-    [TOK_LT]    = { NULL, binary_op, OP_PREC_EQUALITY },
-    [TOK_GT]    = { NULL, binary_op, OP_PREC_EQUALITY },
-    [TOK_NE]    = { NULL, binary_op, OP_PREC_COMPARISON },
-    [TOK_EQ]    = { NULL, binary_op, OP_PREC_COMPARISON },
-    [TOK_LT_EQ] = { NULL, binary_op, OP_PREC_EQUALITY },
-    [TOK_GT_EQ] = { NULL, binary_op, OP_PREC_EQUALITY },
-
-    [TOK_COMMA]     = { NULL, NULL, OP_PREC_NONE },
-    [TOK_SEMICOLON] = { NULL, NULL, OP_PREC_NONE },
-    [TOK_COMMENT]   = { NULL, NULL, OP_PREC_NONE },
-
-    [TOK_LPAREN]   = { group, NULL, OP_PREC_CALL },
-    [TOK_RPAREN]   = { NULL, NULL, OP_PREC_NONE },
-    [TOK_LBRACE]   = { NULL, NULL, OP_PREC_NONE },
-    [TOK_RBRACE]   = { NULL, NULL, OP_PREC_NONE },
-    [TOK_LBRACKET] = { NULL, NULL, OP_PREC_NONE },
-    [TOK_RBRACKET] = { NULL, NULL, OP_PREC_NONE },
-
-    [TOK_VAR]      = { nested_var, NULL, OP_PREC_NONE },
-    [TOK_IF]       = { nested_if, NULL, OP_PREC_NONE },
-    [TOK_ELSE]     = { NULL, NULL, OP_PREC_NONE },
-    [TOK_LOOP]     = { NULL, NULL, OP_PREC_NONE },
-    [TOK_FUNC]     = { NULL, NULL, OP_PREC_NONE },
-    [TOK_RETURN]   = { NULL, NULL, OP_PREC_NONE },
-    [TOK_BREAK]    = { NULL, NULL, OP_PREC_NONE },
-    [TOK_CONTINUE] = { NULL, NULL, OP_PREC_NONE },
-    [TOK_TRUE]     = { NULL, NULL, OP_PREC_NONE },
-    [TOK_FALSE]    = { NULL, NULL, OP_PREC_NONE },
-
-    [TOK_STDIN]    = { stdinput, NULL, OP_PREC_NONE},
-    [TOK_EXIT]     = { exit_script, NULL, OP_PREC_NONE },
-    [TOK_RAND]     = { rand_num, NULL, OP_PREC_NONE },
+    /*              prefix  infix  emit prefix  emit infix  operator precedence */
+
+    [TOK_ILLEGAL] = { NULL, NULL, NULL, NULL, OP_PREC_NONE },
+    [TOK_ERROR]   = { NULL, NULL, NULL, NULL, OP_PREC_NONE },
+    [TOK_EOF]     = { NULL, NULL, NULL, NULL, OP_PREC_NONE },
+
+    [TOK_IDENT]  = { variable,       NULL, emit_variable, NULL, OP_PREC_NONE },
+    [TOK_ASSIGN] = { NULL,       NULL, NULL, NULL, OP_PREC_ASSIGN },
+    [TOK_INT]    = { number_int, NULL, emit_literal, NULL, OP_PREC_NONE },
+    [TOK_FLOAT]  = { number_double, NULL, emit_literal, NULL, OP_PREC_NONE },
+    [TOK_STRING] = { string,       NULL, emit_literal, NULL, OP_PREC_NONE },
+
+    [TOK_PLUS]     = { NULL, binary_op, NULL, emit_binary_op, OP_PREC_TERM },
+    [TOK_MINUS]    = { NULL, binary_op, NULL, emit_binary_op, OP_PREC_TERM },
+    [TOK_DIVIDE]   = { NULL, binary_op, NULL, emit_binary_op, OP_PREC_FACTOR },
+    [TOK_MULTIPLY] = { NULL, binary_op, NULL, emit_binary_op, OP_PREC_FACTOR },
+    [TOK_MODULO]   = { NULL, binary_op, NULL, emit_binary_op, OP_PREC_FACTOR },
+
+    [TOK_BANG]      = { NULL, NULL, NULL, NULL, OP_PREC_UNARY },
+    [TOK_AND]       = { NULL, binary_op, NULL, emit_and, OP_PREC_AND },
+    [TOK_OR]        = { NULL, binary_op, NULL, emit_or, OP_PREC_OR },
+    [TOK_INCREMENT] = { NULL, inc_dec, NULL, NULL, OP_PREC_UNARY },
+    [TOK_DECREMENT] = { NULL, inc_dec, NULL, NULL, OP_PREC_UNARY },
+
+    [TOK_LT]    = { NULL, binary_op, NULL, emit_binary_op, OP_PREC_EQUALITY },
+    [TOK_GT]    = { NULL, binary_op, NULL, emit_binary_op, OP_PREC_EQUALITY },
+    [TOK_NE]    = { NULL, binary_op, NULL, emit_binary_op, OP_PREC_COMPARISON },
+    [TOK_EQ]    = { NULL, binary_op, NULL, emit_binary_op, OP_PREC_COMPARISON },
+    [TOK_LT_EQ] = { NULL, binary_op, NULL, emit_binary_op, OP_PREC_EQUALITY },
+    [TOK_GT_EQ] = { NULL, binary_op, NULL, emit_binary_op, OP_PREC_EQUALITY },
+
+    [TOK_COMMA]     = { NULL, NULL, NULL, NULL, OP_PREC_NONE },
+    [TOK_SEMICOLON] = { NULL, NULL, NULL, NULL, OP_PREC_NONE },
+    [TOK_COMMENT]   = { NULL, NULL, NULL, NULL, OP_PREC_NONE },
+
+    [TOK_LPAREN]   = { group, call, emit_group, NULL, OP_PREC_CALL },
+    [TOK_RPAREN]   = { NULL, NULL, NULL, NULL, OP_PREC_NONE },
+    [TOK_LBRACE]   = { NULL, NULL, NULL, NULL, OP_PREC_NONE },
+    [TOK_RBRACE]   = { NULL, NULL, NULL, NULL, OP_PREC_NONE },
+    [TOK_LBRACKET] = { NULL, NULL, NULL, NULL, OP_PREC_NONE },
+    [TOK_RBRACKET] = { NULL, NULL, NULL, NULL, OP_PREC_NONE },
+
+    [TOK_VAR]      = { nested_var, NULL, NULL, NULL, OP_PREC_NONE },
+    [TOK_IF]       = { nested_if, NULL, NULL, NULL, OP_PREC_NONE },
+    [TOK_ELSE]     = { NULL, NULL, NULL, NULL, OP_PREC_NONE },
+    [TOK_LOOP]     = { nested_loop, NULL, NULL, NULL, OP_PREC_NONE },
+    [TOK_FUNC]     = { NULL, NULL, NULL, NULL, OP_PREC_NONE },
+    [TOK_RETURN]   = { nested_return, NULL, NULL, NULL, OP_PREC_NONE },
+    [TOK_BREAK]    = { NULL, NULL, NULL, NULL, OP_PREC_NONE },
+    [TOK_CONTINUE] = { NULL, NULL, NULL, NULL, OP_PREC_NONE },
+    [TOK_TRUE]     = { NULL, NULL, NULL, NULL, OP_PREC_NONE },
+    [TOK_FALSE]    = { NULL, NULL, NULL, NULL, OP_PREC_NONE },
+    [TOK_MATCH]    = { nested_match, NULL, NULL, NULL, OP_PREC_NONE },
+
+    [TOK_STDIN]    = { stdinput, NULL, emit_stdinput, NULL, OP_PREC_NONE },
+    [TOK_EXIT]     = { exit_script, NULL, emit_exit_script, NULL, OP_PREC_NONE },
+    [TOK_RAND]     = { rand_num, NULL, emit_rand_num, NULL, OP_PREC_NONE },
 };
 
 static parse_rule_t *get_rule(token_type type)
@@ -150,6 +193,12 @@ static expr_t *parse_precedence(parser_t *p, op_prec prec)
 
         parser_advance(p);
         parse_func infix_rule = get_rule(p->prev.type)->infix;
+        if (!infix_rule)
+        {
+            parser_err(p, "Expected an operator");
+            return prefix;
+        }
+
         infix = infix_rule(p);
 
         if (!infix) return prefix;
@@ -251,60 +300,101 @@ static expr_t *rand_num(parser_t *p)
     return node;
 }
 
+/* The callee is added as the left node once this returns. Arguments are chained through next on the right */
+static expr_t *call(parser_t *p)
+{
+    expr_t *call_expr = init_expr(p->prev);
+    expr_t *last = NULL;
+
+    while (!peek_tok(p, TOK_RPAREN))
+    {
+        expr_t *arg = parse_precedence(p, OP_PREC_ASSIGN);
+        if (!arg) break;
+
+        if (!last) call_expr->right = arg;
+        else last->next = arg;
+
+        last = arg;
+
+        if (!peek_tok(p, TOK_COMMA)) break;
+        parser_advance(p);
+    }
+
+    consume_tok(p, TOK_RPAREN, "Expected ')' after arguments");
+
+    return call_expr;
+}
+
+/*
+ * Statements in a block are chained through their next nodes. Expression
+ * statements end with a semicolon while nested statements read their own end.
+ */
+static expr_t *parse_block(parser_t *p)
+{
+    expr_t *first = NULL;
+    expr_t *last = NULL;
+
+    while (!end_of_block(p))
+    {
+        token_type type = p->curr.type;
+        expr_t *stmt = NULL;
+
+        if (type == TOK_FUNC)
+        {
+            parser_err(p, "Functions can only be defined at the top level");
+            break;
+        }
+
+        if (type == TOK_IF || type == TOK_VAR || type == TOK_LOOP || type == TOK_MATCH || type == TOK_RETURN)
+        {
+            parser_advance(p);
+            stmt = get_rule(type)->prefix(p);
+        }
+        else
+        {
+            stmt = parse_precedence(p, OP_PREC_ASSIGN);
+            consume_tok(p, TOK_SEMICOLON, "Expected ';' at the end of expression");
+        }
+
+        if (!stmt) break;
+
+        if (!first) first = stmt;
+        else last->next = stmt;
+
+        last = stmt;
+    }
+
+    return first;
+}
+
 static expr_t *nested_if(parser_t *p)
 {
     expr_t *if_expr = init_expr(p->prev);
 
     consume_tok(p, TOK_LPAREN, "Expected '(' after if keyword");
 
-
     /* Like parsing the statement, the left node contains the expression */
     if_expr->left = parse_precedence(p, OP_PREC_ASSIGN);
 
     consume_tok(p, TOK_RPAREN, "Expected ')' at the end of expression");
     consume_tok(p, TOK_LBRACE, "Expected '{' at the start of true branch");
 
-    expr_t *true_branch = parse_precedence(p, OP_PREC_ASSIGN);
-    parser_advance(p);
-
-    expr_t *next_expr = true_branch;
-
-     while (!peek_tok(p, TOK_RBRACE))
-    {
-        next_expr->left = parse_precedence(p, OP_PREC_ASSIGN);
-        next_expr = next_expr->left;
-        parser_advance(p);
-    }
+    expr_t *true_branch = parse_block(p);
 
     consume_tok(p, TOK_RBRACE, "Expected '}' at the end of true branch");
 
-
     if (p->curr.type == TOK_ELSE)
     {
+        /* The else node holds the true branch on the left and the false branch on the right */
         expr_t *else_node = init_expr(p->curr);
 
         parser_advance(p);
         consume_tok(p, TOK_LBRACE, "Expected '{' after else statement");
 
-        else_node->right = parse_precedence(p, OP_PREC_ASSIGN);
-        next_expr = else_node->right;
-
-        parser_advance(p);
-
-        /* Append extra expressions if they are contained within the false branch */
-        while (!peek_tok(p, TOK_RBRACE))
-        {
-            next_expr->left = parse_precedence(p, OP_PREC_ASSIGN);
-            next_expr = next_expr->left;
-            parser_advance(p);
-        }
-
-
         else_node->left = true_branch;
+        else_node->right = parse_block(p);
         if_expr->right = else_node;
 
-
-        //parser_advance(p);
         consume_tok(p, TOK_RBRACE, "Expected '}' at the end of false branch");
     }
     else
@@ -315,87 +405,147 @@ static expr_t *nested_if(parser_t *p)
     return if_expr;
 }
 
-static expr_t *nested_var(parser_t *p)
+static expr_t *nested_loop(parser_t *p)
 {
-    consume_tok(p, TOK_IDENT, "Expected variable definition");
+    expr_t *loop_expr = init_expr(p->prev);
 
-    expr_t *var= init_expr(p->curr); /* Assignment token '=' */
-    var->left = init_expr(p->prev); /* The ident token */
+    consume_tok(p, TOK_LPAREN, "Expected '(' after loop keyword");
 
-    parser_advance(p);
+    /* Left node stores the expression and the right node the body */
+    loop_expr->left = parse_precedence(p, OP_PREC_ASSIGN);
 
-    var->right = parse_precedence(p, OP_PREC_ASSIGN);
+    consume_tok(p, TOK_RPAREN, "Expected ')' at the end of expression");
+    consume_tok(p, TOK_LBRACE, "Expected '{' after loop expression");
 
-    consume_tok(p, TOK_SEMICOLON, "Expected ';' at the end of expression");
+    loop_expr->right = parse_block(p);
 
-    return var;
+    consume_tok(p, TOK_RBRACE, "Expected '}' at the end of expression");
+
+    return loop_expr;
 }
 
-static ast_node_t *parse_if_stmt(parser_t *p)
+static int is_case_label(parser_t *p)
 {
-    ast_node_t *ast_node = init_ast_node(AST_STMT);
-    expr_t *if_expr = init_expr(p->curr);
+    return peek_tok(p, TOK_INT) || peek_tok(p, TOK_STRING);
+}
 
-    parser_advance(p);
-    consume_tok(p, TOK_LPAREN, "Expected '(' after if keyword");
+/*
+ * An arm is either else or a comma separated list of integer or string cases,
+ * followed by a block. The first case holds the block on its left and the
+ * rest of the cases are chained through right.
+ */
+static expr_t *parse_arm(parser_t *p)
+{
+    expr_t *arm = NULL;
 
-    /* The left node will contain the expression */
-    if_expr->left = parse_precedence(p, OP_PREC_ASSIGN);
+    if (peek_tok(p, TOK_ELSE))
+    {
+        arm = init_expr(p->curr);
+        parser_advance(p);
+    }
+    else
+    {
+        expr_t *last = NULL;
 
-    consume_tok(p, TOK_RPAREN, "Expected ')' at the end of expression");
-    consume_tok(p, TOK_LBRACE, "Expected '{' at the start of true branch");
+        while (1)
+        {
+            if (!is_case_label(p))
+            {
+                parser_err(p, "Expected an integer or string case");
+                if (arm) expr_free(arm);
+                return NULL;
+            }
 
+            expr_t *label = init_expr(p->curr);
+            parser_advance(p);
 
-    /* Parse the true branch of the if statement */
-    expr_t *true_branch = parse_precedence(p, OP_PREC_ASSIGN);
-    parser_advance(p);
+            if (!arm) arm = label;
+            else last->right = label;
 
-    expr_t *next_expr = true_branch;
+            last = label;
 
-    /* Append extra expressions if they are contained in the branch */
-    while (!peek_tok(p, TOK_RBRACE))
-    {
-        next_expr->left = parse_precedence(p, OP_PREC_ASSIGN);
-        next_expr = next_expr->left;
+            if (!peek_tok(p, TOK_COMMA)) break;
+            parser_advance(p);
+        }
     }
 
-    consume_tok(p, TOK_RBRACE, "Expected '}' at the end of true branch");
-
+    consume_tok(p, TOK_LBRACE, "Expected '{' at the start of match case");
 
-    if (p->curr.type == TOK_ELSE)
-    {
-        expr_t *else_node = init_expr(p->curr);
+    arm->left = parse_block(p);
 
-        parser_advance(p);
-        consume_tok(p, TOK_LBRACE, "Expected '{' after else statement");
+    consume_tok(p, TOK_RBRACE, "Expected '}' at the end of match case");
 
-        else_node->right = parse_precedence(p, OP_PREC_ASSIGN);
-        next_expr = else_node->right;
+    return arm;
+}
 
-        parser_advance(p);
+static expr_t *nested_match(parser_t *p)
+{
+    expr_t *match_expr = init_expr(p->prev);
 
-        /* Append extra expressions if they are contained within the false branch */
-        while (!peek_tok(p, TOK_RBRACE))
-        {
-            next_expr->left = parse_precedence(p, OP_PREC_ASSIGN);
-            next_expr = next_expr->left;
-            parser_advance(p);
-        }
+    consume_tok(p, TOK_LPAREN, "Expected '(' after match keyword");
 
+    /* Left node stores the value being matched and the right node the arms */
+    match_expr->left = parse_precedence(p, OP_PREC_ASSIGN);
 
-        else_node->left = true_branch;
-        if_expr->right = else_node;
+    consume_tok(p, TOK_RPAREN, "Expected ')' at the end of expression");
+    consume_tok(p, TOK_LBRACE, "Expected '{' after match expression");
 
+    expr_t *last = NULL;
 
-        //parser_advance(p);
-        consume_tok(p, TOK_RBRACE, "Expected '}' at the end of false branch");
-    }
-    else
+    while (!end_of_block(p))
     {
-        if_expr->right = true_branch;
+        expr_t *arm = parse_arm(p);
+        if (!arm) break;
+
+        if (!last) match_expr->right = arm;
+        else last->next = arm;
+
+        last = arm;
+
+        /* The default has to come last so the arms before it can fall through to it */
+        if (arm->tok.type == TOK_ELSE) break;
     }
 
-    ast_node->expr = if_expr;
+    consume_tok(p, TOK_RBRACE, "Expected '}' at the end of match");
+
+    return match_expr;
+}
+
+/* The left node holds the value, if there is one */
+static expr_t *nested_return(parser_t *p)
+{
+    expr_t *return_expr = init_expr(p->prev);
+
+    if (!peek_tok(p, TOK_SEMICOLON))
+        return_expr->left = parse_precedence(p, OP_PREC_ASSIGN);
+
+    consume_tok(p, TOK_SEMICOLON, "Expected ';' at the end of return");
+
+    return return_expr;
+}
+
+static expr_t *nested_var(parser_t *p)
+{
+    consume_tok(p, TOK_IDENT, "Expected variable definition");
+
+    expr_t *var= init_expr(p->curr); /* Assignment token '=' */
+    var->left = init_expr(p->prev); /* The ident token */
+
+    parser_advance(p);
+
+    var->right = parse_precedence(p, OP_PREC_ASSIGN);
+
+    consume_tok(p, TOK_SEMICOLON, "Expected ';' at the end of expression");
+
+    return var;
+}
+
+static ast_node_t *parse_if_stmt(parser_t *p)
+{
+    ast_node_t *ast_node = init_ast_node(AST_STMT);
+
+    parser_advance(p);
+    ast_node->expr = nested_if(p);
 
     return ast_node;
 }
@@ -403,47 +553,75 @@ static ast_node_t *parse_if_stmt(parser_t *p)
 static ast_node_t *parse_loop_stmt(parser_t *p)
 {
     ast_node_t *loop_node = init_ast_node(AST_STMT);
-    expr_t *loop_expr = init_expr(p->curr);
 
     parser_advance(p);
-    consume_tok(p, TOK_LPAREN, "Expected '(' after loop keyword");
+    loop_node->expr = nested_loop(p);
 
-    /* Left node stores the expression */
-    loop_expr->left = parse_precedence(p, OP_PREC_ASSIGN);
+    return loop_node;
+}
 
-    consume_tok(p, TOK_RPAREN, "Expected ')' at the end of expression");
-    consume_tok(p, TOK_LBRACE, "Expected '{' after loop expression");
+static ast_node_t *parse_match_stmt(parser_t *p)
+{
+    ast_node_t *match_node = init_ast_node(AST_STMT);
 
-    loop_expr->right = parse_precedence(p, OP_PREC_ASSIGN);
+    parser_advance(p);
+    match_node->expr = nested_match(p);
 
-    expr_t *next_expr = NULL;
+    return match_node;
+}
 
-    /* Check if there is a variable assignement otherwise the tree will break */
-    if (loop_expr->right->tok.type == TOK_ASSIGN)
-    {
-        next_expr = loop_expr->right->left;
-    }
-    else
+static ast_node_t *parse_return_stmt(parser_t *p)
+{
+    ast_node_t *return_node = init_ast_node(AST_STMT);
+
+    parser_advance(p);
+    return_node->expr = nested_return(p);
+
+    return return_node;
+}
+
+/*
+ * The function node holds its name on the left and its body on the right.
+ * The parameters are chained through next on the right of the name.
+ */
+static ast_node_t *func_decl(parser_t *p)
+{
+    ast_node_t *func_node = init_ast_node(AST_STMT);
+
+    parser_advance(p);
+
+    expr_t *func = init_expr(p->prev);
+    func_node->expr = func;
+
+    consume_tok(p, TOK_IDENT, "Expected function name");
+    func->left = init_expr(p->prev);
+
+    consume_tok(p, TOK_LPAREN, "Expected '(' after function name");
+
+    expr_t *last = NULL;
+
+    while (peek_tok(p, TOK_IDENT))
     {
-        next_expr = loop_expr->right;
+        expr_t *param = init_expr(p->curr);
         parser_advance(p);
-    }
 
-    while(!peek_tok(p, TOK_RBRACE))
-    {
-        next_expr->left = parse_precedence(p, OP_PREC_ASSIGN);
-        next_expr = next_expr->left;
+        if (!last) func->left->right = param;
+        else last->next = param;
 
-        if (!peek_tok(p, TOK_RBRACE))
-            parser_advance(p);
+        last = param;
+
+        if (!peek_tok(p, TOK_COMMA)) break;
+        parser_advance(p);
     }
 
-    consume_tok(p, TOK_RBRACE, "Expected '}' at the end of expression");
+    consume_tok(p, TOK_RPAREN, "Expected ')' after parameters");
+    consume_tok(p, TOK_LBRACE, "Expected '{' before function body");
 
+    func->right = parse_block(p);
 
-    loop_node->expr = loop_expr;
+    consume_tok(p, TOK_RBRACE, "Expected '}' at the end of function body");
 
-    return loop_node;
+    return func_node;
 }
 
 static ast_node_t *expression(parser_t *p)
@@ -466,14 +644,22 @@ static ast_node_t *statement(parser_t *p)
         {
             return parse_if_stmt(p);
         }
-        case TOK_RETURN:
         case TOK_LOOP:
         {
             return parse_loop_stmt(p);
         }
+        case TOK_RETURN:
+        {
+            return parse_return_stmt(p);
+        }
+        case TOK_MATCH:
+        {
+            return parse_match_stmt(p);
+        }
         case TOK_LBRACE:
         {
-            printf("Statements not yet implemented\n");
+            parser_err(p, "Statements not yet implemented");
+            parser_advance(p);
             return NULL; /* TODO: Error node here */
         }
         default:
@@ -516,14 +702,48 @@ parser_t *parser_init(lexer_t *l)
 {
     parser_t *p = malloc(sizeof(parser_t));
     p->l = l;
+    p->ring = NULL;
     p->prev = lexer_next(l);
     p->curr = p->prev;
+    p->err = stderr;
+    p->had_error = 0;
 
     return p;
 }
 
+/*
+ * Lexes on a separate thread while the parser runs. Tokens are read in the same
+ * order the lexer produced them so errors are reported exactly as they would be
+ * by parser_init.
+ */
+parser_t *parser_init_pipelined(lexer_t *l)
+{
+#ifdef _WIN32
+    /* TODO: Threads on Windows. Until then lex on demand */
+    return parser_init(l);
+#else
+    struct token_ring *ring = token_ring_init(l);
+    if (!ring) return parser_init(l);
+
+    parser_t *p = malloc(sizeof(parser_t));
+    p->l = l;
+    p->ring = ring;
+    p->prev = token_ring_next(ring);
+    p->curr = p->prev;
+    p->err = stderr;
+    p->had_error = 0;
+
+    return p;
+#endif
+}
+
 void parser_free(parser_t *p)
 {
+#ifndef _WIN32
+    /* Stop the lexer thread before the lexer goes away */
+    if (p->ring) token_ring_free(p->ring);
+#endif
+
     lexer_free(p->l);
     free(p);
 }
@@ -540,7 +760,7 @@ ast_node_t *parser_parse_program(parser_t *p)
             case TOK_FUNC:
             case TOK_VAR:
             {
-                ast_node_t *node = var_decl(p);
+                ast_node_t *node = p->curr.type == TOK_FUNC ? func_decl(p) : var_decl(p);
 
                 if (!ast)
                 {
@@ -557,6 +777,7 @@ ast_node_t *parser_parse_program(parser_t *p)
             default:
             {
                 ast_node_t *expr_node = statement(p);
+                if (!expr_node) break;
 
                 if (!ast)
                 {
@@ -573,3 +794,407 @@ ast_node_t *parser_parse_program(parser_t *p)
 
     return ast;
 }
+
+/*
+ * Single pass compilation. These functions are driven by the same rules table
+ * as the parser but emit bytecode as soon as each token is seen, so no ast is
+ * built for scripts that don't need one.
+ */
+
+/* Returns the type of the token at the root of the expression, as the ast would have it */
+static token_type emit_precedence(parser_t *p, compiler_t *c, op_prec prec)
+{
+    parser_advance(p);
+
+    emit_func prefix_rule = get_rule(p->prev.type)->emit_prefix;
+    if (!prefix_rule)
+    {
+        parser_err(p, "Expected expression");
+        return TOK_ERROR;
+    }
+
+    token_type type = prefix_rule(p, c);
+
+    while (prec <= get_rule(p->curr.type)->prec)
+    {
+        parser_advance(p);
+
+        emit_func infix_rule = get_rule(p->prev.type)->emit_infix;
+        if (!infix_rule)
+        {
+            parser_err(p, "Expected expression");
+            return TOK_ERROR;
+        }
+
+        type = infix_rule(p, c);
+    }
+
+    return type;
+}
+
+static void emit_call(parser_t *p, compiler_t *c, token_t name)
+{
+    uint32_t argc = 0;
+
+    /* Skip the opening bracket */
+    parser_advance(p);
+
+    while (!peek_tok(p, TOK_RPAREN) && !p->had_error)
+    {
+        emit_precedence(p, c, OP_PREC_ASSIGN);
+        argc++;
+
+        if (!peek_tok(p, TOK_COMMA)) break;
+        parser_advance(p);
+    }
+
+    consume_tok(p, TOK_RPAREN, "Expected ')' after arguments");
+    compiler_emit_call(c, name, argc);
+}
+
+static token_type emit_variable(parser_t *p, compiler_t *c)
+{
+    token_t name = p->prev;
+
+    if (peek_tok(p, TOK_LPAREN))
+    {
+        emit_call(p, c, name);
+        return TOK_LPAREN;
+    }
+
+    /* Increments and decrements work on the variable rather than its value */
+    if (peek_tok(p, TOK_INCREMENT) || peek_tok(p, TOK_DECREMENT))
+    {
+        int inc = peek_tok(p, TOK_INCREMENT);
+
+        parser_advance(p);
+        compiler_emit_step(c, name, inc);
+        return inc ? TOK_INCREMENT : TOK_DECREMENT;
+    }
+
+    compiler_emit_get(c, name);
+    return TOK_IDENT;
+}
+
+static token_type emit_literal(parser_t *p, compiler_t *c)
+{
+    compiler_emit_literal(c, p->prev);
+    return p->prev.type;
+}
+
+static token_type emit_binary_op(parser_t *p, compiler_t *c)
+{
+    token_type op_type = p->prev.type;
+
+    /* Emit the right operand before the operator as the left is already on the stack */
+    emit_precedence(p, c, get_rule(op_type)->prec + 1);
+
+    switch (op_type)
+    {
+        case TOK_PLUS: compiler_emit_binary(c, OP_ADD); break;
+        case TOK_MINUS: compiler_emit_binary(c, OP_SUB); break;
+        case TOK_MULTIPLY: compiler_emit_binary(c, OP_MUL); break;
+        case TOK_DIVIDE: compiler_emit_binary(c, OP_DIV); break;
+        case TOK_MODULO: compiler_emit_binary(c, OP_MOD); break;
+
+        case TOK_LT: compiler_emit_binary(c, OP_LT); break;
+        case TOK_LT_EQ: compiler_emit_binary(c, OP_LT_EQ); break;
+        case TOK_GT: compiler_emit_binary(c, OP_GT); break;
+        case TOK_GT_EQ: compiler_emit_binary(c, OP_GT_EQ); break;
+        case TOK_EQ: compiler_emit_binary(c, OP_EQ); break;
+        case TOK_NE: compiler_emit_binary(c, OP_NE); break;
+        default: break;
+    }
+
+    return op_type;
+}
+
+/*
+ * Pushes true or false for a logical operator whose left operand is on the
+ * stack. The right operand is jumped over when the left one is enough to
+ * give the result, which is true for || and false for &&.
+ */
+static token_type emit_logical(parser_t *p, compiler_t *c, op_code jump, token_type result)
+{
+    token_t decided = { .type = result };
+    token_t other = { .type = result == TOK_TRUE ? TOK_FALSE : TOK_TRUE };
+
+    uint32_t left_jump = compiler_emit_jump(c, jump);
+
+    emit_precedence(p, c, get_rule(p->prev.type)->prec + 1);
+    uint32_t right_jump = compiler_emit_jump(c, jump);
+
+    compiler_emit_literal(c, other);
+    uint32_t end_jump = compiler_emit_jump(c, OP_JUMP);
+
+    compiler_patch_jump(c, left_jump);
+    compiler_patch_jump(c, right_jump);
+    compiler_emit_literal(c, decided);
+
+    compiler_patch_jump(c, end_jump);
+
+    return result == TOK_TRUE ? TOK_OR : TOK_AND;
+}
+
+static token_type emit_and(parser_t *p, compiler_t *c)
+{
+    return emit_logical(p, c, OP_JUMP_IF_FALSE, TOK_FALSE);
+}
+
+static token_type emit_or(parser_t *p, compiler_t *c)
+{
+    return emit_logical(p, c, OP_JUMP_IF_TRUE, TOK_TRUE);
+}
+
+static token_type emit_group(parser_t *p, compiler_t *c)
+{
+    /* The ast keeps only what is inside the brackets */
+    token_type type = emit_precedence(p, c, OP_PREC_ASSIGN);
+    consume_tok(p, TOK_RPAREN, "Expected ')' at the end of grouping expression");
+
+    return type;
+}
+
+static token_type emit_stdinput(parser_t *p, compiler_t *c)
+{
+    compiler_emit_byte(c, OP_STDIN);
+    return TOK_STDIN;
+}
+
+static token_type emit_exit_script(parser_t *p, compiler_t *c)
+{
+    compiler_emit_byte(c, OP_EXIT);
+    return TOK_EXIT;
+}
+
+static token_type emit_rand_num(parser_t *p, compiler_t *c)
+{
+    consume_tok(p, TOK_LPAREN, "Expected '(' after rand keyword");
+    emit_precedence(p, c, OP_PREC_ASSIGN);
+    consume_tok(p, TOK_RPAREN, "Expected ')' after rand keyword");
+
+    compiler_emit_byte(c, OP_RAND);
+    return TOK_RAND;
+}
+
+static void emit_statement(parser_t *p, compiler_t *c);
+
+static void emit_block(parser_t *p, compiler_t *c)
+{
+    while (!peek_tok(p, TOK_RBRACE) && !peek_tok(p, TOK_EOF))
+    {
+        if (peek_tok(p, TOK_FUNC))
+        {
+            parser_err(p, "Functions can only be defined at the top level");
+            return;
+        }
+
+        emit_statement(p, c);
+    }
+
+    consume_tok(p, TOK_RBRACE, "Expected '}' at the end of block");
+}
+
+static void emit_var_decl(parser_t *p, compiler_t *c)
+{
+    /* Skip the var token */
+    parser_advance(p);
+
+    consume_tok(p, TOK_IDENT, "Expected variable definition");
+
+    token_t name = p->prev;
+    compiler_begin_var(c, name);
+
+    consume_tok(p, TOK_ASSIGN, "Expected '=' after variable name");
+    emit_precedence(p, c, OP_PREC_ASSIGN);
+
+    consume_tok(p, TOK_SEMICOLON, "Expected ';' at the end of expression");
+
+    compiler_end_var(c, name);
+}
+
+static void emit_func_decl(parser_t *p, compiler_t *c)
+{
+    compiler_func_t func;
+
+    /* Skip the func token */
+    parser_advance(p);
+
+    consume_tok(p, TOK_IDENT, "Expected function name");
+    compiler_begin_func(c, &func, p->prev);
+
+    consume_tok(p, TOK_LPAREN, "Expected '(' after function name");
+
+    while (peek_tok(p, TOK_IDENT))
+    {
+        parser_advance(p);
+        compiler_add_param(c, p->prev);
+
+        if (!peek_tok(p, TOK_COMMA)) break;
+        parser_advance(p);
+    }
+
+    consume_tok(p, TOK_RPAREN, "Expected ')' after parameters");
+    consume_tok(p, TOK_LBRACE, "Expected '{' before function body");
+    emit_block(p, c);
+
+    compiler_end_func(c);
+}
+
+static void emit_return_stmt(parser_t *p, compiler_t *c)
+{
+    parser_advance(p);
+
+    int has_value = !peek_tok(p, TOK_SEMICOLON);
+    if (has_value) emit_precedence(p, c, OP_PREC_ASSIGN);
+
+    consume_tok(p, TOK_SEMICOLON, "Expected ';' at the end of return");
+
+    compiler_emit_return(c, has_value);
+}
+
+static void emit_if_stmt(parser_t *p, compiler_t *c)
+{
+    parser_advance(p);
+
+    consume_tok(p, TOK_LPAREN, "Expected '(' after if keyword");
+    emit_precedence(p, c, OP_PREC_ASSIGN);
+    consume_tok(p, TOK_RPAREN, "Expected ')' at the end of expression");
+
+    uint32_t false_jump = compiler_emit_jump(c, OP_JUMP_IF_FALSE);
+
+    consume_tok(p, TOK_LBRACE, "Expected '{' at the start of true branch");
+    emit_block(p, c);
+
+    if (peek_tok(p, TOK_ELSE))
+    {
+        parser_advance(p);
+
+        uint32_t end_jump = compiler_emit_jump(c, OP_JUMP);
+        compiler_patch_jump(c, false_jump);
+
+        consume_tok(p, TOK_LBRACE, "Expected '{' after else statement");
+        emit_block(p, c);
+
+        compiler_patch_jump(c, end_jump);
+        return;
+    }
+
+    compiler_patch_jump(c, false_jump);
+}
+
+static void emit_loop_stmt(parser_t *p, compiler_t *c)
+{
+    parser_advance(p);
+
+    consume_tok(p, TOK_LPAREN, "Expected '(' after loop keyword");
+    emit_precedence(p, c, OP_PREC_ASSIGN);
+    consume_tok(p, TOK_RPAREN, "Expected ')' at the end of expression");
+
+    uint32_t loop_start = c->chunk->count;
+    uint32_t exit_jump = compiler_emit_jump(c, OP_LOOP);
+
+    consume_tok(p, TOK_LBRACE, "Expected '{' after loop expression");
+    emit_block(p, c);
+
+    compiler_emit_loop_end(c, loop_start);
+    compiler_patch_jump(c, exit_jump);
+}
+
+static void emit_arm_cases(parser_t *p, compiler_t *c, compiler_match_t *m)
+{
+    while (1)
+    {
+        if (!is_case_label(p))
+        {
+            parser_err(p, "Expected an integer or string case");
+            return;
+        }
+
+        parser_advance(p);
+        compiler_match_case(c, m, p->prev);
+
+        if (!peek_tok(p, TOK_COMMA)) break;
+        parser_advance(p);
+    }
+}
+
+static void emit_match_stmt(parser_t *p, compiler_t *c)
+{
+    parser_advance(p);
+
+    consume_tok(p, TOK_LPAREN, "Expected '(' after match keyword");
+    emit_precedence(p, c, OP_PREC_ASSIGN);
+    consume_tok(p, TOK_RPAREN, "Expected ')' at the end of expression");
+    consume_tok(p, TOK_LBRACE, "Expected '{' after match expression");
+
+    compiler_match_t m;
+    compiler_begin_match(c, &m);
+
+    while (!end_of_block(p))
+    {
+        if (peek_tok(p, TOK_ELSE))
+        {
+            parser_advance(p);
+            compiler_match_default(c, &m);
+
+            consume_tok(p, TOK_LBRACE, "Expected '{' at the start of match case");
+            emit_block(p, c);
+            break;
+        }
+
+        emit_arm_cases(p, c, &m);
+
+        consume_tok(p, TOK_LBRACE, "Expected '{' at the start of match case");
+        emit_block(p, c);
+
+        compiler_end_arm(c, &m);
+    }
+
+    compiler_end_match(c, &m);
+
+    consume_tok(p, TOK_RBRACE, "Expected '}' at the end of match");
+}
+
+static void emit_statement(parser_t *p, compiler_t *c)
+{
+    compiler_set_line(c, p->curr.line);
+
+    switch (p->curr.type)
+    {
+        case TOK_VAR: emit_var_decl(p, c); return;
+        case TOK_IF: emit_if_stmt(p, c); return;
+        case TOK_LOOP: emit_loop_stmt(p, c); return;
+        case TOK_MATCH: emit_match_stmt(p, c); return;
+        case TOK_FUNC: emit_func_decl(p, c); return;
+        case TOK_RETURN: emit_return_stmt(p, c); return;
+        case TOK_EXIT:
+        {
+            parser_advance(p);
+            compiler_emit_byte(c, OP_EXIT);
+            consume_tok(p, TOK_SEMICOLON, "Expected ';' at the end of expression");
+            return;
+        }
+        default: break;
+    }
+
+    token_type type = emit_precedence(p, c, OP_PREC_ASSIGN);
+
+    /* Like the ast compiler a lone stdin or call, even in brackets, is run without printing its value */
+    if (type == TOK_STDIN || type == TOK_LPAREN)
+        compiler_emit_byte(c, OP_DROP);
+    else if (type != TOK_EXIT)
+        compiler_emit_byte(c, OP_POP);
+
+    consume_tok(p, TOK_SEMICOLON, "Expected ';' at the end of expression");
+}
+
+compiler_code_t parser_compile_program(parser_t *p, compiler_t *c)
+{
+    while (!match_tok(p->curr, TOK_EOF))
+        emit_statement(p, c);
+
+    compiler_emit_byte(c, OP_EXIT);
+
+    return p->had_error || c->had_error ? COMPILER_PARSE_ERROR : COMPILER_OK;
+}
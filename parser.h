@@ -6,16 +6,23 @@
 
 #include "lexer.h"
 #include "ast.h"
+#include "compiler.h"
+#include "pipeline.h"
 
 typedef struct {
 	token_t curr;
 	token_t prev;
 	lexer_t *l;
+	struct token_ring *ring; /* Tokens from the lexer thread when pipelined */
+	FILE *err;               /* Where errors are reported */
+	int had_error;
 } parser_t;
 
 parser_t *parser_init(lexer_t *l);
+parser_t *parser_init_pipelined(lexer_t *l);
 void parser_free(parser_t *p);
 ast_node_t *parser_parse_program(parser_t *p);
+compiler_code_t parser_compile_program(parser_t *p, compiler_t *c);
 
 #endif //PARSER_H
 
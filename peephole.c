@@ -0,0 +1,534 @@
+#include <string.h>
+
+#include "peephole.h"
+#include "vm.h"
+
+/* An instruction decoded from the chunk so it can be changed or removed */
+typedef struct {
+    uint32_t operand;   /* Constant index or local slot */
+    uint32_t target;    /* Instruction a jump goes to */
+
+    uint32_t offset;    /* Where it started in the code before optimising */
+    uint32_t pos;       /* Where it goes once the code is written back */
+
+    uint8_t code;
+    uint8_t live;
+} insn_t;
+
+typedef struct {
+    insn_t *insns;      /* One extra at the end stands for the end of the code */
+    uint32_t count;
+    uint8_t *labels;    /* Set for instructions that a jump lands on */
+    uint32_t **cases;   /* Instruction each slot of a match table goes to, by table */
+} peephole_t;
+
+static op_code compare_const(uint8_t code)
+{
+    switch (code)
+    {
+        case OP_GT: return OP_GT_K;
+        case OP_GT_EQ: return OP_GT_EQ_K;
+        case OP_LT: return OP_LT_K;
+        case OP_LT_EQ: return OP_LT_EQ_K;
+        case OP_EQ: return OP_EQ_K;
+        case OP_NE: return OP_NE_K;
+        default: return OP_EXIT;
+    }
+}
+
+/* The fused compare and branch for a comparison, which may be against a constant */
+static op_code compare_jump(uint8_t code)
+{
+    switch (code)
+    {
+        case OP_GT: return OP_JGT;
+        case OP_GT_EQ: return OP_JGT_EQ;
+        case OP_LT: return OP_JLT;
+        case OP_LT_EQ: return OP_JLT_EQ;
+        case OP_EQ: return OP_JEQ;
+        case OP_NE: return OP_JNE;
+
+        /* Typed comparisons keep their type, so the branch checks no tags either */
+        case OP_GT_LL: return OP_JGT_LL;
+        case OP_GT_EQ_LL: return OP_JGT_EQ_LL;
+        case OP_LT_LL: return OP_JLT_LL;
+        case OP_LT_EQ_LL: return OP_JLT_EQ_LL;
+        case OP_EQ_LL: return OP_JEQ_LL;
+        case OP_NE_LL: return OP_JNE_LL;
+
+        case OP_GT_DD: return OP_JGT_DD;
+        case OP_GT_EQ_DD: return OP_JGT_EQ_DD;
+        case OP_LT_DD: return OP_JLT_DD;
+        case OP_LT_EQ_DD: return OP_JLT_EQ_DD;
+        case OP_EQ_DD: return OP_JEQ_DD;
+        case OP_NE_DD: return OP_JNE_DD;
+
+        case OP_GT_K: return OP_JGT_K;
+        case OP_GT_EQ_K: return OP_JGT_EQ_K;
+        case OP_LT_K: return OP_JLT_K;
+        case OP_LT_EQ_K: return OP_JLT_EQ_K;
+        case OP_EQ_K: return OP_JEQ_K;
+        case OP_NE_K: return OP_JNE_K;
+        default: return OP_EXIT;
+    }
+}
+
+/*
+ * The fused compare and branch against a constant for one that compares the
+ * top two values. A typed one only takes a constant of its type.
+ */
+static op_code jump_const(uint8_t code, object_t obj)
+{
+    if (vm_op_operand_type(code) >= 0 && obj.type != (object_val_t)vm_op_operand_type(code)) return OP_EXIT;
+
+    switch (code)
+    {
+        case OP_JGT: return OP_JGT_K;
+        case OP_JGT_EQ: return OP_JGT_EQ_K;
+        case OP_JLT: return OP_JLT_K;
+        case OP_JLT_EQ: return OP_JLT_EQ_K;
+        case OP_JEQ: return OP_JEQ_K;
+        case OP_JNE: return OP_JNE_K;
+
+        case OP_JGT_LL: return OP_JGT_LL_K;
+        case OP_JGT_EQ_LL: return OP_JGT_EQ_LL_K;
+        case OP_JLT_LL: return OP_JLT_LL_K;
+        case OP_JLT_EQ_LL: return OP_JLT_EQ_LL_K;
+        case OP_JEQ_LL: return OP_JEQ_LL_K;
+        case OP_JNE_LL: return OP_JNE_LL_K;
+
+        case OP_JGT_DD: return OP_JGT_DD_K;
+        case OP_JGT_EQ_DD: return OP_JGT_EQ_DD_K;
+        case OP_JLT_DD: return OP_JLT_DD_K;
+        case OP_JLT_EQ_DD: return OP_JLT_EQ_DD_K;
+        case OP_JEQ_DD: return OP_JEQ_DD_K;
+        case OP_JNE_DD: return OP_JNE_DD_K;
+        default: return OP_EXIT;
+    }
+}
+
+/* Where the jump offset of an instruction ends, which is where the jump is counted from */
+static uint32_t jump_end(uint8_t code, uint32_t offset)
+{
+    return offset + vm_op_length(code);
+}
+
+/* Finds the instruction starting at offset. The instructions are in offset order */
+static uint32_t find_insn(peephole_t *p, uint32_t offset)
+{
+    uint32_t low = 0;
+    uint32_t high = p->count;
+
+    while (low < high)
+    {
+        uint32_t mid = low + (high - low) / 2;
+
+        if (p->insns[mid].offset < offset) low = mid + 1;
+        else high = mid;
+    }
+
+    return p->insns[low].offset == offset ? low : UINT32_MAX;
+}
+
+static void free_cases(peephole_t *p, chunk_t *chunk)
+{
+    for (uint32_t t = 0; t < chunk->table_count; t++)
+        free(p->cases[t]);
+
+    free(p->cases);
+}
+
+/*
+ * Finds the instruction each case of a match goes to. Returns 0 if a case
+ * doesn't land on an instruction, or if the table is shared with another
+ * match as its offsets can't be right for both once the code moves.
+ */
+static int decode_cases(peephole_t *p, chunk_t *chunk, insn_t *in)
+{
+    if (in->operand >= chunk->table_count || p->cases[in->operand]) return 0;
+
+    chunk_table_t *table = &chunk->tables[in->operand];
+    uint32_t end = jump_end(in->code, in->offset);
+    uint32_t *cases = malloc(sizeof(uint32_t) * (table->count + 1));
+    p->cases[in->operand] = cases;
+
+    for (uint32_t slot = 0; slot < table->count; slot++)
+    {
+        cases[slot] = UINT32_MAX;
+
+        /* Empty slots of a hashed table don't go anywhere */
+        if (in->code == OP_MATCH_HASH && !table->strings[slot]) continue;
+        if (table->offsets[slot] > chunk->count - end) return 0;
+
+        if ((cases[slot] = find_insn(p, end + table->offsets[slot])) == UINT32_MAX) return 0;
+    }
+
+    return 1;
+}
+
+/* Returns 0 if the code doesn't decode cleanly, in which case it is left alone */
+static int decode(peephole_t *p, chunk_t *chunk)
+{
+    uint8_t *code = chunk->code;
+    uint32_t i = 0;
+
+    p->count = 0;
+
+    while (i < chunk->count)
+    {
+        i += vm_op_length(code[i]);
+        p->count++;
+    }
+
+    /* The last instruction is cut short */
+    if (i != chunk->count) return 0;
+
+    p->insns = malloc(sizeof(insn_t) * (p->count + 1));
+
+    i = 0;
+    for (uint32_t k = 0; k < p->count; k++)
+    {
+        insn_t *in = &p->insns[k];
+        in->code = code[i];
+        in->operand = 0;
+        in->target = 0;
+        in->offset = i;
+        in->live = 1;
+
+        /* Jumps are worked out below. Any other operand is kept as it is */
+        uint32_t length = vm_op_length(code[i]);
+        uint32_t operand_end = vm_op_is_jump(code[i]) ? length - CHUNK_JUMP_BYTES : length;
+
+        for (uint32_t b = 1; b < operand_end; b++)
+            in->operand |= (uint32_t)code[i + b] << (8 * (b - 1));
+
+        i += length;
+    }
+
+    p->insns[p->count].offset = chunk->count;
+    p->cases = calloc(chunk->table_count + 1, sizeof(uint32_t *));
+
+    for (uint32_t k = 0; k < p->count; k++)
+    {
+        insn_t *in = &p->insns[k];
+        if (!vm_op_is_jump(in->code)) continue;
+
+        uint32_t end = jump_end(in->code, in->offset);
+        uint32_t offset = CHUNK_READ_U16(code + end - CHUNK_JUMP_BYTES);
+        uint32_t target = in->code == OP_LOOP_END ? end - offset : end + offset;
+
+        if (target > chunk->count || (in->target = find_insn(p, target)) == UINT32_MAX ||
+            (vm_op_has_table(in->code) && !decode_cases(p, chunk, in)))
+        {
+            free_cases(p, chunk);
+            free(p->insns);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static uint32_t next_live(peephole_t *p, uint32_t k)
+{
+    while (k < p->count && !p->insns[k].live) k++;
+
+    return k;
+}
+
+static int is_forward_jump(uint8_t code)
+{
+    return vm_op_is_jump(code) && code != OP_LOOP_END;
+}
+
+/* Follows a forward jump from end through any OP_JUMPs it lands on */
+static uint32_t thread_target(peephole_t *p, uint32_t target, uint32_t end, int *changed)
+{
+    target = next_live(p, target);
+
+    while (target < p->count && p->insns[target].code == OP_JUMP)
+    {
+        uint32_t next = next_live(p, p->insns[target].target);
+
+        /* Code only gets smaller so a jump that fits before optimising still fits after */
+        if (p->insns[next].offset - end > CHUNK_JUMP_MAX) break;
+
+        target = next;
+        *changed = 1;
+    }
+
+    return target;
+}
+
+/* Jumps and match cases that land on an OP_JUMP go straight to where that jump goes */
+static int thread_jumps(peephole_t *p, chunk_t *chunk)
+{
+    int changed = 0;
+
+    for (uint32_t k = 0; k < p->count; k++)
+    {
+        insn_t *in = &p->insns[k];
+        if (!in->live || !is_forward_jump(in->code)) continue;
+
+        uint32_t end = jump_end(in->code, in->offset);
+
+        in->target = thread_target(p, in->target, end, &changed);
+
+        if (!vm_op_has_table(in->code)) continue;
+
+        uint32_t *cases = p->cases[in->operand];
+
+        for (uint32_t slot = 0; slot < chunk->tables[in->operand].count; slot++)
+        {
+            if (cases[slot] != UINT32_MAX) cases[slot] = thread_target(p, cases[slot], end, &changed);
+        }
+    }
+
+    return changed;
+}
+
+static void mark_labels(peephole_t *p, chunk_t *chunk)
+{
+    memset(p->labels, 0, p->count + 1);
+
+    for (uint32_t k = 0; k < p->count; k++)
+    {
+        insn_t *in = &p->insns[k];
+        if (!in->live || !vm_op_is_jump(in->code)) continue;
+
+        p->labels[next_live(p, in->target)] = 1;
+
+        if (!vm_op_has_table(in->code)) continue;
+
+        uint32_t *cases = p->cases[in->operand];
+
+        for (uint32_t slot = 0; slot < chunk->tables[in->operand].count; slot++)
+        {
+            if (cases[slot] != UINT32_MAX) p->labels[next_live(p, cases[slot])] = 1;
+        }
+    }
+}
+
+/*
+ * Slides over neighbouring instructions. Nothing that a jump lands on is
+ * removed or merged into the instruction before it, other than code that
+ * can't be reached at all. The last instruction is always kept as the vm
+ * uses it to tell the end of the code apart from an exit statement.
+ */
+static int simplify(peephole_t *p, chunk_t *chunk)
+{
+    int changed = 0;
+    uint32_t last = p->count - 1;
+
+    for (uint32_t k = next_live(p, 0); k < last; k = next_live(p, k + 1))
+    {
+        insn_t *in = &p->insns[k];
+        uint32_t next = next_live(p, k + 1);
+
+        switch (in->code)
+        {
+            case OP_JUMP:
+            {
+                /* A jump to the next instruction does nothing */
+                if (next_live(p, in->target) == next)
+                {
+                    in->live = 0;
+                    changed = 1;
+                    break;
+                }
+            }
+            /* Fall through */
+            case OP_EXIT:
+            case OP_RETURN:
+            case OP_TAIL_CALL:
+            {
+                /* Nothing after these runs until something jumps there */
+                while (next < last && !p->labels[next])
+                {
+                    p->insns[next].live = 0;
+                    next = next_live(p, next + 1);
+                    changed = 1;
+                }
+
+                break;
+            }
+            case OP_JUMP_IF_FALSE:
+            case OP_JUMP_IF_TRUE:
+            {
+                /* Only the pop of the condition is left */
+                if (next_live(p, in->target) == next)
+                {
+                    in->code = OP_DROP;
+                    changed = 1;
+                }
+
+                break;
+            }
+            case OP_CONST:
+            {
+                if (next >= last || p->labels[next]) break;
+
+                insn_t *after = &p->insns[next];
+
+                if (after->code == OP_DROP)
+                {
+                    in->live = 0;
+                    after->live = 0;
+                    changed = 1;
+                }
+                else if (after->code == OP_JUMP_IF_FALSE || after->code == OP_JUMP_IF_TRUE)
+                {
+                    /* The branch always goes the same way */
+                    int truthy = vm_is_truthy(chunk->constants[in->operand]);
+
+                    if (truthy == (after->code == OP_JUMP_IF_FALSE))
+                    {
+                        in->live = 0;
+                        after->live = 0;
+                    }
+                    else
+                    {
+                        in->code = OP_JUMP;
+                        in->target = after->target;
+                        after->live = 0;
+                    }
+
+                    changed = 1;
+                }
+                else if (compare_const(after->code) != OP_EXIT)
+                {
+                    /* Compare with the constant directly instead of pushing it first */
+                    in->code = compare_const(after->code);
+                    after->live = 0;
+                    changed = 1;
+                }
+                else if (jump_const(after->code, chunk->constants[in->operand]) != OP_EXIT)
+                {
+                    /* The same for a comparison that has already been fused with its branch */
+                    in->code = jump_const(after->code, chunk->constants[in->operand]);
+                    in->target = after->target;
+                    after->live = 0;
+                    changed = 1;
+                }
+
+                break;
+            }
+            default:
+            {
+                if (compare_jump(in->code) == OP_EXIT || next >= last || p->labels[next]) break;
+
+                insn_t *after = &p->insns[next];
+
+                /* Branch on the comparison without pushing its result */
+                if (after->code == OP_JUMP_IF_FALSE)
+                {
+                    in->code = compare_jump(in->code);
+                    in->target = after->target;
+                    after->live = 0;
+                    changed = 1;
+                }
+
+                break;
+            }
+        }
+    }
+
+    return changed;
+}
+
+static void encode(peephole_t *p, chunk_t *chunk)
+{
+    uint32_t pos = 0;
+
+    for (uint32_t k = 0; k < p->count; k++)
+    {
+        p->insns[k].pos = pos;
+        if (p->insns[k].live) pos += vm_op_length(p->insns[k].code);
+    }
+
+    p->insns[p->count].pos = pos;
+
+    /* Each instruction keeps the line it was compiled from wherever it moves to */
+    uint32_t *lines = malloc(sizeof(uint32_t) * (p->count + 1));
+
+    for (uint32_t k = 0; k < p->count; k++)
+        lines[k] = chunk->lines[p->insns[k].offset];
+
+    for (uint32_t k = 0; k < p->count; k++)
+    {
+        insn_t *in = &p->insns[k];
+        if (!in->live) continue;
+
+        chunk->code[in->pos] = in->code;
+
+        for (uint32_t b = in->pos; b < in->pos + vm_op_length(in->code); b++)
+            chunk->lines[b] = lines[k];
+
+        uint32_t end = jump_end(in->code, in->pos);
+
+        if (!vm_op_is_jump(in->code))
+        {
+            chunk_patch_operand(chunk, in->pos + 1, in->operand, end - in->pos - 1);
+            continue;
+        }
+
+        uint32_t target = p->insns[next_live(p, in->target)].pos;
+        uint32_t offset = in->code == OP_LOOP_END ? end - target : target - end;
+
+        chunk_patch_operand(chunk, in->pos + 1, in->operand, end - in->pos - 1 - CHUNK_JUMP_BYTES);
+        chunk_patch_operand(chunk, end - CHUNK_JUMP_BYTES, offset, CHUNK_JUMP_BYTES);
+
+        if (!vm_op_has_table(in->code)) continue;
+
+        chunk_table_t *table = &chunk->tables[in->operand];
+
+        for (uint32_t slot = 0; slot < table->count; slot++)
+        {
+            if (p->cases[in->operand][slot] != UINT32_MAX)
+                table->offsets[slot] = p->insns[next_live(p, p->cases[in->operand][slot])].pos - end;
+        }
+    }
+
+    chunk->count = pos;
+    free(lines);
+}
+
+/*
+ * Cleans up the code the compilers emit once a chunk is finished:
+ *  - jumps and match cases to jumps are threaded through to the final target
+ *  - jumps to the next instruction and constants that are pushed then
+ *    dropped are removed
+ *  - branches on a constant become a jump or nothing
+ *  - code after an exit or a jump that nothing jumps to is removed
+ *  - a constant followed by a comparison, or a fused compare and branch,
+ *    becomes one with the constant as its operand
+ *  - a comparison followed by a branch on its result becomes a fused
+ *    compare and branch
+ * The instructions are rewritten until none of these apply and then the
+ * jump offsets are worked out again for the smaller code.
+ */
+void peephole_optimise(chunk_t *chunk)
+{
+    if (chunk->count == 0) return;
+
+    peephole_t p;
+
+    if (!decode(&p, chunk)) return;
+
+    p.labels = malloc(p.count + 1);
+
+    int changed = 1;
+
+    while (changed)
+    {
+        changed = thread_jumps(&p, chunk);
+        mark_labels(&p, chunk);
+        changed |= simplify(&p, chunk);
+    }
+
+    encode(&p, chunk);
+
+    free_cases(&p, chunk);
+    free(p.labels);
+    free(p.insns);
+}
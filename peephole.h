@@ -0,0 +1,11 @@
+#ifndef __PHANTOM_PEEPHOLE_H_
+#define __PHANTOM_PEEPHOLE_H_
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "chunk.h"
+
+void peephole_optimise(chunk_t *chunk);
+
+#endif // __PHANTOM_PEEPHOLE_H_
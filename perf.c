@@ -0,0 +1,241 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "perf.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <limits.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define JITDUMP_MAGIC 0x4A695444
+#define JITDUMP_VERSION 1
+#define JITDUMP_EM_X86_64 62
+
+/* Record types in a jitdump */
+enum { JIT_CODE_LOAD = 0, JIT_CODE_DEBUG_INFO = 2, JIT_CODE_CLOSE = 3 };
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t total_size;
+    uint32_t elf_mach;
+    uint32_t pad;
+    uint32_t pid;
+    uint64_t timestamp;
+    uint64_t flags;
+} jitdump_header_t;
+
+typedef struct {
+    uint32_t id;
+    uint32_t total_size;
+    uint64_t timestamp;
+} jitdump_record_t;
+
+typedef struct {
+    jitdump_record_t record;
+    uint32_t pid;
+    uint32_t tid;
+    uint64_t vma;
+    uint64_t code_addr;
+    uint64_t code_size;
+    uint64_t code_index;
+} jitdump_load_t;
+
+typedef struct {
+    jitdump_record_t record;
+    uint64_t code_addr;
+    uint64_t nr_entry;
+} jitdump_debug_t;
+
+typedef struct {
+    uint64_t addr;
+    uint32_t line;
+    uint32_t discrim;
+} jitdump_entry_t;
+
+static struct {
+    FILE *map;
+    FILE *dump;
+    void *marker;       /* The dump mapped executable, which is how perf record knows to look for it */
+    size_t marker_size;
+    char source[PATH_MAX];
+    uint64_t code_index;
+} perf = { 0 };
+
+/* perf inject matches the records up with samples on the monotonic clock */
+static uint64_t timestamp()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void open_dump()
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/jit-%d.dump", (int)getpid());
+
+    perf.dump = fopen(path, "w+");
+    if (!perf.dump) return;
+
+    jitdump_header_t header = {
+        .magic = JITDUMP_MAGIC,
+        .version = JITDUMP_VERSION,
+        .total_size = sizeof(jitdump_header_t),
+        .elf_mach = JITDUMP_EM_X86_64,
+        .pid = (uint32_t)getpid(),
+        .timestamp = timestamp(),
+    };
+
+    fwrite(&header, sizeof(header), 1, perf.dump);
+    fflush(perf.dump);
+
+    perf.marker_size = (size_t)sysconf(_SC_PAGESIZE);
+    perf.marker = mmap(NULL, perf.marker_size, PROT_READ | PROT_EXEC, MAP_PRIVATE, fileno(perf.dump), 0);
+
+    if (perf.marker == MAP_FAILED)
+    {
+        perf.marker = NULL;
+        fclose(perf.dump);
+        perf.dump = NULL;
+    }
+}
+
+void perf_open(const char *source, int jitdump)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+
+    perf.map = fopen(path, "w");
+
+    if (!realpath(source, perf.source))
+        snprintf(perf.source, sizeof(perf.source), "%s", source);
+
+    if (jitdump) open_dump();
+}
+
+/* The line each instruction comes from, at the address its code starts, wherever the line changes */
+static void write_debug_info(jit_code_t *jit, chunk_t *chunk)
+{
+    uint64_t base = (uint64_t)(uintptr_t)jit->mem;
+    size_t name_size = strlen(perf.source) + 1;
+    uint32_t count = 0, last = 0;
+
+    for (uint32_t i = 0; i < jit->map_count; i++)
+    {
+        uint32_t line = chunk->lines ? chunk->lines[jit->map[i].offset] : 0;
+
+        if (line != 0 && line != last) count++;
+        if (line != 0) last = line;
+    }
+
+    if (count == 0) return;
+
+    jitdump_debug_t debug = {
+        .record = {
+            .id = JIT_CODE_DEBUG_INFO,
+            .total_size = sizeof(jitdump_debug_t) + count * (sizeof(jitdump_entry_t) + name_size),
+            .timestamp = timestamp(),
+        },
+        .code_addr = base,
+        .nr_entry = count,
+    };
+
+    fwrite(&debug, sizeof(debug), 1, perf.dump);
+    last = 0;
+
+    for (uint32_t i = 0; i < jit->map_count; i++)
+    {
+        uint32_t line = chunk->lines ? chunk->lines[jit->map[i].offset] : 0;
+
+        if (line == 0 || line == last) continue;
+
+        jitdump_entry_t entry = { .addr = base + jit->map[i].code, .line = line };
+        fwrite(&entry, sizeof(entry), 1, perf.dump);
+        fwrite(perf.source, name_size, 1, perf.dump);
+        last = line;
+    }
+}
+
+static void write_load(jit_code_t *jit, const char *name)
+{
+    size_t name_size = strlen(name) + 1;
+    uint64_t addr = (uint64_t)(uintptr_t)jit->mem;
+
+    jitdump_load_t load = {
+        .record = {
+            .id = JIT_CODE_LOAD,
+            .total_size = sizeof(jitdump_load_t) + name_size + jit->code_size,
+            .timestamp = timestamp(),
+        },
+        .pid = (uint32_t)getpid(),
+        .tid = (uint32_t)syscall(SYS_gettid),
+        .vma = addr,
+        .code_addr = addr,
+        .code_size = jit->code_size,
+        .code_index = perf.code_index++,
+    };
+
+    fwrite(&load, sizeof(load), 1, perf.dump);
+    fwrite(name, name_size, 1, perf.dump);
+    fwrite(jit->mem, jit->code_size, 1, perf.dump);
+}
+
+void perf_add_code(jit_code_t *jit, chunk_t *chunk, const char *name)
+{
+    if (!jit || !jit->mem) return;
+
+    if (perf.map)
+    {
+        fprintf(perf.map, "%lx %lx %s\n", (unsigned long)(uintptr_t)jit->mem, (unsigned long)jit->code_size, name);
+        fflush(perf.map);
+    }
+
+    if (perf.dump)
+    {
+        /* perf inject wants the lines before the code they are for */
+        write_debug_info(jit, chunk);
+        write_load(jit, name);
+        fflush(perf.dump);
+    }
+}
+
+void perf_close(void)
+{
+    if (perf.map) fclose(perf.map);
+
+    if (perf.dump)
+    {
+        jitdump_record_t close = { .id = JIT_CODE_CLOSE, .total_size = sizeof(jitdump_record_t), .timestamp = timestamp() };
+        fwrite(&close, sizeof(close), 1, perf.dump);
+
+        munmap(perf.marker, perf.marker_size);
+        fclose(perf.dump);
+    }
+
+    perf.map = NULL;
+    perf.dump = NULL;
+    perf.marker = NULL;
+}
+
+#else
+
+/* Only Linux profilers read these, and only x86-64 has machine code to name */
+void perf_open(const char *source, int jitdump)
+{
+}
+
+void perf_add_code(jit_code_t *jit, chunk_t *chunk, const char *name)
+{
+}
+
+void perf_close(void)
+{
+}
+
+#endif
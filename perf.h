@@ -0,0 +1,25 @@
+#ifndef __PHANTOM_PERF_H_
+#define __PHANTOM_PERF_H_
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "chunk.h"
+#include "jit.h"
+
+/*
+ * Names machine code for profilers that can't see into it otherwise. Every
+ * chunk and trace compiled gets a line in /tmp/perf-<pid>.map, which perf
+ * report reads to put a name to samples in it. With jitdump set the code is
+ * also written to /tmp/jit-<pid>.dump in the format perf inject reads, with
+ * the line in source each instruction came from, so perf annotate can show
+ * the machine code against the script. source is the path of the script.
+ */
+void perf_open(const char *source, int jitdump);
+
+/* Records code just compiled for chunk, under name. Does nothing unless perf_open has been called */
+void perf_add_code(jit_code_t *jit, chunk_t *chunk, const char *name);
+
+void perf_close(void);
+
+#endif // __PHANTOM_PERF_H_
@@ -0,0 +1,98 @@
+#include <stdlib.h>
+
+#include "pipeline.h"
+
+#ifndef _WIN32
+
+#include <sched.h>
+
+#define RING_MASK (TOKEN_RING_SIZE - 1)
+
+static void *lex_tokens(void *arg)
+{
+    token_ring_t *r = arg;
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+
+    for (;;)
+    {
+        token_t tok = lexer_next(r->l);
+
+        /* Back off until the parser has made room in the ring */
+        while (head - r->cached_tail == TOKEN_RING_SIZE)
+        {
+            r->cached_tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+            if (head - r->cached_tail < TOKEN_RING_SIZE) break;
+
+            if (atomic_load_explicit(&r->stop, memory_order_relaxed)) return NULL;
+
+            sched_yield();
+        }
+
+        r->toks[head & RING_MASK] = tok;
+        head++;
+
+        /* Publish the token only once it has been fully written */
+        atomic_store_explicit(&r->head, head, memory_order_release);
+
+        if (tok.type == TOK_EOF) return NULL;
+    }
+}
+
+token_ring_t *token_ring_init(lexer_t *l)
+{
+    token_ring_t *r = malloc(sizeof(token_ring_t));
+
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    atomic_init(&r->stop, 0);
+    r->cached_tail = 0;
+    r->cached_head = 0;
+    r->finished = 0;
+    r->l = l;
+
+    if (pthread_create(&r->thread, NULL, lex_tokens, r) != 0)
+    {
+        free(r);
+        return NULL;
+    }
+
+    return r;
+}
+
+void token_ring_free(token_ring_t *r)
+{
+    /* The parser may stop before eof so make sure the lexer isn't left waiting */
+    atomic_store_explicit(&r->stop, 1, memory_order_relaxed);
+    pthread_join(r->thread, NULL);
+
+    free(r);
+}
+
+token_t token_ring_next(token_ring_t *r)
+{
+    /* Like the lexer keep handing out eof once the end has been reached */
+    if (r->finished) return r->eof;
+
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+
+    while (tail == r->cached_head)
+    {
+        r->cached_head = atomic_load_explicit(&r->head, memory_order_acquire);
+        if (tail != r->cached_head) break;
+
+        sched_yield();
+    }
+
+    token_t tok = r->toks[tail & RING_MASK];
+    atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+
+    if (tok.type == TOK_EOF)
+    {
+        r->finished = 1;
+        r->eof = tok;
+    }
+
+    return tok;
+}
+
+#endif // _WIN32
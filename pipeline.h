@@ -0,0 +1,49 @@
+#ifndef __PHANTOM_PIPELINE_H_
+#define __PHANTOM_PIPELINE_H_
+
+#include "lexer.h"
+
+/* Threads are only supported through pthreads for now */
+#ifndef _WIN32
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#define TOKEN_RING_SIZE 4096 /* Must be a power of two */
+#define CACHE_LINE_SIZE 64
+
+/*
+ * Single producer single consumer ring of tokens. A lexer thread fills the
+ * ring while the parser reads from it on the calling thread. The lexer waits
+ * when the ring is full so it never gets more than a ring ahead of the parser.
+ * Each side keeps its own copy of the other side's position so the shared
+ * counters are only read when the cached copy runs out.
+ */
+typedef struct token_ring {
+    /* Written by the lexer thread */
+    atomic_size_t head;
+    size_t cached_tail;
+    char head_pad[CACHE_LINE_SIZE];
+
+    /* Written by the parser */
+    atomic_size_t tail;
+    size_t cached_head;
+    int finished;       /* The parser has read the eof token */
+    token_t eof;
+    char tail_pad[CACHE_LINE_SIZE];
+
+    atomic_int stop;    /* Tells the lexer thread to give up early */
+    lexer_t *l;
+    pthread_t thread;
+
+    token_t toks[TOKEN_RING_SIZE];
+} token_ring_t;
+
+token_ring_t *token_ring_init(lexer_t *l);
+void token_ring_free(token_ring_t *r);
+token_t token_ring_next(token_ring_t *r);
+
+#endif // _WIN32
+
+#endif // __PHANTOM_PIPELINE_H_
@@ -0,0 +1,182 @@
+#include <string.h>
+
+#include "stream.h"
+#include "parser.h"
+#include "compiler.h"
+#include "ir.h"
+#include "peephole.h"
+#include "debug.h"
+
+stream_t *stream_init(FILE *in)
+{
+    stream_t *s = malloc(sizeof(stream_t));
+    s->in = in;
+    s->prompt = NULL;
+    s->single_pass = 0;
+    s->use_ir = 0;
+    s->unroll_factor = COMPILER_UNROLL_FACTOR;
+    s->inline_budget = COMPILER_INLINE_BUDGET;
+    s->optimise = 1;
+    s->print_code = 0;
+
+    /* Leave room for the terminator the lexer needs at the end of a statement */
+    s->cap = STREAM_CHUNK_SIZE + 1;
+    s->buf = malloc(s->cap);
+    s->len = 0;
+
+    lexer_scanner_reset(&s->scanner, 0);
+    s->line = 1;
+    s->eof = 0;
+
+    return s;
+}
+
+void stream_free(stream_t *s)
+{
+    free(s->buf);
+    free(s);
+}
+
+/* Checks if the buffer only holds whitespace and comments */
+static int is_blank(const char *buf, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        if (buf[i] == '#')
+        {
+            while (i < len && buf[i] != '\n') i++;
+            continue;
+        }
+
+        if (buf[i] != ' ' && buf[i] != '\t' && buf[i] != '\r' && buf[i] != '\n')
+            return 0;
+    }
+
+    return 1;
+}
+
+static void fill(stream_t *s)
+{
+    /* Only grow the buffer when a single statement does not fit in it */
+    if (s->len + STREAM_CHUNK_SIZE + 1 > s->cap)
+    {
+        s->cap *= 2;
+        s->buf = realloc(s->buf, s->cap);
+    }
+
+    if (s->prompt && is_blank(s->buf, s->len))
+        printf("%s", s->prompt);
+
+    /* Make sure any output is visible before we block on the read */
+    fflush(stdout);
+
+    /* A line at most, as OP_STDIN reads whatever comes after it through the same buffer */
+    if (!fgets(s->buf + s->len, STREAM_CHUNK_SIZE + 1, s->in))
+    {
+        s->eof = 1;
+        return;
+    }
+
+    s->len += strlen(s->buf + s->len);
+}
+
+static vm_code_t run_stmt(stream_t *s, vm_t *vm, size_t start, size_t end)
+{
+    vm_code_t code = VM_OK;
+
+    /* Temporarily terminate the statement so the lexer stops at its end */
+    char saved = s->buf[end];
+    s->buf[end] = '\0';
+
+    lexer_t *l = lexer_init(s->buf + start);
+    l->line = s->line;
+
+    parser_t *p = parser_init(l);
+    compiler_t *c = compiler_init(vm->chunk);
+    c->unroll_factor = s->unroll_factor;
+    c->inline_budget = s->inline_budget;
+    c->funcs = vm->funcs;
+    ast_node_t *ast = NULL;
+    compiler_code_t compiled = COMPILER_PARSE_ERROR;
+
+    /* Functions stay defined for the statements after the one that defines them */
+    uint32_t first_func = vm->funcs->count;
+
+    if (s->single_pass)
+    {
+        compiled = parser_compile_program(p, c);
+    }
+    else if ( (ast = parser_parse_program(p)) )
+    {
+        /* Later statements can read any global so none of them are left out */
+        compiled = s->use_ir ? ir_compile_program(c, ast, 0) : compiler_compile_program(c, ast);
+    }
+
+    if (compiled != COMPILER_PARSE_ERROR)
+    {
+        if (s->optimise) peephole_optimise(vm->chunk);
+        if (s->print_code) debug_print_chunk(vm->chunk);
+
+        for (uint32_t i = first_func; i < vm->funcs->count; i++)
+        {
+            if (s->optimise) peephole_optimise(vm->funcs->funcs[i].chunk);
+            if (s->print_code) debug_print_function(&vm->funcs->funcs[i], i);
+        }
+
+        code = vm_run(vm);
+    }
+    else
+    {
+        /* A function from a statement that didn't compile can't be called */
+        func_table_truncate(vm->funcs, first_func);
+    }
+
+    /* The vm copies any strings it keeps so the constants can go */
+    chunk_clear(vm->chunk);
+
+    ast_node_free(ast);
+    compiler_free(c);
+    parser_free(p);
+
+    /* The compiler copies everything it needs out of the source so the */
+    /* statement can be thrown away once it has been run */
+    s->buf[end] = saved;
+
+    for (size_t i = start; i < end; i++)
+        if (s->buf[i] == '\n') s->line++;
+
+    return code;
+}
+
+vm_code_t stream_run(stream_t *s, vm_t *vm)
+{
+    for (;;)
+    {
+        size_t start = 0;
+        size_t end = 0;
+
+        while ( (end = lexer_scan_stmt(&s->scanner, s->buf, s->len, s->eof)) )
+        {
+            if (run_stmt(s, vm, start, end) == VM_EXIT) return VM_EXIT;
+            start = end;
+        }
+
+        /* Drop the statements that have been run from the buffer */
+        if (start > 0)
+        {
+            memmove(s->buf, s->buf + start, s->len - start);
+            s->len -= start;
+            s->scanner.pos -= start;
+        }
+
+        if (s->eof) break;
+
+        fill(s);
+    }
+
+    /* Anything left has no terminator so let the parser report the error */
+    if (!is_blank(s->buf, s->len))
+        return run_stmt(s, vm, 0, s->len);
+
+    return VM_OK;
+}
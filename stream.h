@@ -0,0 +1,42 @@
+#ifndef __PHANTOM_STREAM_H_
+#define __PHANTOM_STREAM_H_
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "lexer.h"
+#include "vm.h"
+
+#define STREAM_CHUNK_SIZE 4096
+
+/*
+ * Reads a script from a file a line at a time and runs each top level
+ * statement as soon as it is complete. Only the statement currently being
+ * read is kept in memory so input of any size can be piped in. Nothing past
+ * the line a statement ends on is read before it runs, so stdin in the script
+ * reads the lines after it from the same file.
+ */
+typedef struct {
+    FILE *in;
+    const char *prompt;   /* Printed before each read if not NULL */
+    int single_pass;      /* Compile without building an ast */
+    int use_ir;           /* Optimise each statement through the ir */
+    int unroll_factor;    /* Passed on to the compiler of each statement */
+    int inline_budget;    /* The same */
+    int optimise;         /* Run the peephole optimiser over each statement */
+    int print_code;       /* Print the bytecode of each statement before it runs */
+
+    char *buf;            /* Input that has not been run yet */
+    size_t len;
+    size_t cap;
+
+    stmt_scanner_t scanner;
+    unsigned line;        /* Line in the script of the first byte in buf */
+    int eof;
+} stream_t;
+
+stream_t *stream_init(FILE *in);
+void stream_free(stream_t *s);
+vm_code_t stream_run(stream_t *s, vm_t *vm);
+
+#endif // __PHANTOM_STREAM_H_
@@ -0,0 +1,269 @@
+/*
+ * Checks incremental reparsing against parsing from scratch. Each script is
+ * edited at random through doc_edit, and after every edit the document has
+ * to match one made from the edited text with doc_init, statement for
+ * statement and token for token, and one parse of the whole text where it
+ * has no errors. Build with make doccheck and run as
+ *
+ *   ./doccheck [-n edits] [-s seed] script...
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../document.h"
+#include "../lexer.h"
+#include "../parser.h"
+
+/* Text typed into the scripts, picked to open and close statements and blocks part way through */
+static const char *fragments[] = {
+    "var a = 1;\n", "a + 2;\n", "if (a == 1) {", "}", "{", "} else {", "loop (3) { a; }\n",
+    "# a comment\n", "\"", "\"text\";\n", "\n", " ", ";", "(", ")", "func f(x) { return x + 1; }\n",
+    "f(2) + 0;\n", "else { a; }\n", "match (a) { 1, 2 { 3; } else { 4; } }\n", "a && 0 || 1;\n", "a++;\n", "#",
+};
+
+#define FRAGMENT_COUNT (sizeof(fragments) / sizeof(fragments[0]))
+
+/* Scripts are kept below this so the edits don't only ever grow them */
+#define MAX_TEXT 8192
+
+static char *read_file(const char *path, size_t *len)
+{
+    FILE *file = fopen(path, "rb");
+
+    if (!file)
+    {
+        fprintf(stderr, "Unable to open file '%s'\n", path);
+        exit(74);
+    }
+
+    fseek(file, 0, SEEK_END);
+    *len = ftell(file);
+    rewind(file);
+
+    char *buffer = malloc(*len + 1);
+    *len = fread(buffer, 1, *len, file);
+    buffer[*len] = '\0';
+    fclose(file);
+
+    return buffer;
+}
+
+/* Tokens match if they say the same thing in the same place. Lines are taken as they are now, after any edits above */
+static int same_expr(expr_t *a, int a_shift, expr_t *b, int b_shift, int cols)
+{
+    if (!a || !b) return a == b;
+
+    if (a->tok.type != b->tok.type || a->tok.len != b->tok.len ||
+        memcmp(a->tok.start, b->tok.start, a->tok.len) != 0 ||
+        (int)a->tok.line + a_shift != (int)b->tok.line + b_shift ||
+        (cols && a->tok.col != b->tok.col))
+        return 0;
+
+    return same_expr(a->left, a_shift, b->left, b_shift, cols) &&
+           same_expr(a->right, a_shift, b->right, b_shift, cols) &&
+           same_expr(a->next, a_shift, b->next, b_shift, cols);
+}
+
+/* Steps both lists along by one statement, returning 0 if they differ */
+static int same_node(ast_node_t **a, int a_shift, ast_node_t **b, int b_shift, int cols)
+{
+    if (!*a || !*b) return *a == *b;
+
+    int same = (*a)->type == (*b)->type && same_expr((*a)->expr, a_shift, (*b)->expr, b_shift, cols);
+
+    *a = (*a)->next;
+    *b = (*b)->next;
+
+    return same;
+}
+
+/* Compares the document that was edited with one parsed from its text in one go */
+static const char *compare(doc_t *d, const char *text, size_t len, FILE *err)
+{
+    doc_t *fresh = doc_init(NULL, 0);
+    fresh->err = err;
+    doc_edit(fresh, 0, 0, text, len);
+
+    const char *diff = NULL;
+    size_t at = 0;
+    int had_error = 0;
+
+    if (d->count != fresh->count) diff = "statement count";
+
+    for (size_t i = 0; !diff && i < d->count; i++)
+    {
+        unsigned a_line, b_line;
+        doc_stmt_t *a = doc_stmt(d, i, &a_line);
+        doc_stmt_t *b = doc_stmt(fresh, i, &b_line);
+
+        if (a->len != b->len || at + a->len > len || memcmp(a->src, text + at, a->len) != 0)
+            diff = "statement text";
+        else if (a_line != b_line || a->newlines != b->newlines)
+            diff = "statement line";
+        else if (a->had_error != b->had_error)
+            diff = "parse errors";
+
+        ast_node_t *na = a->ast;
+        ast_node_t *nb = b->ast;
+
+        while (!diff && (na || nb))
+        {
+            if (!same_node(&na, (int)a_line - (int)a->parse_line, &nb, (int)b_line - (int)b->parse_line, 1))
+                diff = "ast";
+        }
+
+        at += a->len;
+        had_error |= a->had_error;
+    }
+
+    if (!diff && at != len) diff = "document length";
+
+    /* Without errors the statements together are the program a single parse gives */
+    if (!diff && !had_error)
+    {
+        lexer_t *l = lexer_init(text);
+        parser_t *p = parser_init(l);
+        p->err = err;
+
+        ast_node_t *whole = parser_parse_program(p);
+        ast_node_t *nb = whole;
+
+        for (size_t i = 0; !diff && i < d->count; i++)
+        {
+            unsigned line;
+            doc_stmt_t *st = doc_stmt(d, i, &line);
+            ast_node_t *na = st->ast;
+            int shift = (int)line - (int)st->parse_line;
+
+            /* Columns are counted from where each statement starts, so only lines are compared */
+            while (!diff && na)
+            {
+                if (!nb || !same_node(&na, shift, &nb, 0, 0))
+                    diff = "whole program ast";
+            }
+        }
+
+        if (!diff && nb) diff = "whole program ast";
+
+        ast_node_free(whole);
+        parser_free(p);
+    }
+
+    doc_free(fresh);
+
+    return diff;
+}
+
+static int check_script(const char *path, unsigned edits)
+{
+    size_t len;
+    char *text = read_file(path, &len);
+    char *edited = malloc(MAX_TEXT * 2);
+    FILE *err = tmpfile();
+
+    if (len >= MAX_TEXT) len = MAX_TEXT - 1;
+    memcpy(edited, text, len);
+    edited[len] = '\0';
+
+    doc_t *d = doc_init(NULL, 0);
+    d->err = err;
+    doc_edit(d, 0, 0, edited, len);
+
+    size_t parsed = 0;
+    size_t kept = 0;
+    int failed = 0;
+
+    for (unsigned e = 0; e < edits; e++)
+    {
+        size_t offset = len ? (size_t)rand() % (len + 1) : 0;
+        size_t deleted = rand() % 4 == 0 ? (size_t)rand() % 32 : (size_t)rand() % 4;
+        char copy[64];
+        const char *insert;
+
+        /* Half the edits start on a new line, as typing a statement in an editor does */
+        if (rand() % 2 == 0)
+        {
+            while (offset < len && edited[offset] != '\n') offset++;
+            if (offset < len) offset++;
+        }
+
+        if (deleted > len - offset) deleted = len - offset;
+
+        /* Some of the time a piece of the script is pasted somewhere else in it */
+        if (rand() % 4 == 0 && len)
+        {
+            size_t from = rand() % len;
+            size_t n = rand() % sizeof(copy);
+            if (n > len - from) n = len - from;
+
+            memcpy(copy, edited + from, n);
+            copy[n] = '\0';
+            insert = copy;
+        }
+        else insert = rand() % 3 == 0 ? "" : fragments[rand() % FRAGMENT_COUNT];
+
+        size_t inserted = strlen(insert);
+        if (len - deleted + inserted >= MAX_TEXT) inserted = 0;
+
+        memmove(edited + offset + inserted, edited + offset + deleted, len - offset - deleted);
+        memcpy(edited + offset, insert, inserted);
+        len = len - deleted + inserted;
+        edited[len] = '\0';
+
+        size_t count = doc_edit(d, offset, deleted, insert, inserted);
+        parsed += count;
+        kept += d->count - count;
+
+        const char *diff = compare(d, edited, len, err);
+
+        if (diff)
+        {
+            fprintf(stderr, "%s: edit %u at %zu deleting %zu and inserting \"%.*s\" differs from a full parse in its %s\n",
+                    path, e + 1, offset, deleted, (int)inserted, insert, diff);
+            failed = 1;
+            break;
+        }
+
+        /* Errors only need to be written somewhere, so the file isn't left to grow */
+        rewind(err);
+    }
+
+    if (!failed)
+        printf("%s: %u edits, %zu statements reparsed and %zu kept\n", path, edits, parsed, kept);
+
+    doc_free(d);
+    fclose(err);
+    free(edited);
+    free(text);
+
+    return failed;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned edits = 1000;
+    unsigned seed = 1;
+    int failed = 0;
+    int scripts = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) edits = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) seed = atoi(argv[++i]);
+        else
+        {
+            srand(seed);
+            failed |= check_script(argv[i], edits);
+            scripts++;
+        }
+    }
+
+    if (!scripts)
+    {
+        fprintf(stderr, "Usage: doccheck [-n edits] [-s seed] script...\n");
+        return 64;
+    }
+
+    return failed;
+}
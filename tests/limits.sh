@@ -0,0 +1,42 @@
+#!/bin/sh
+# Scripts past the number of constants or match statements a chunk can index
+# have to be rejected, whether they are compiled in one go or split up by -j,
+# where each part is under the limits and only the whole script is over them.
+# The scripts are too big to keep, so they are written out here. Run from the
+# top of the repository after make, or set PHANTOM to the binary.
+
+PHANTOM=${PHANTOM:-./phantom}
+DIR=$(mktemp -d)
+FAILED=0
+
+trap 'rm -rf "$DIR"' EXIT
+
+# 2^24 constants fit, so a hundred more
+yes '1;' | head -n 16777316 | tr -d '\n' > "$DIR/consts.ptn"
+
+# 65536 match statements fit, each with a table
+awk 'BEGIN { for (i = 0; i < 65600; i++) printf "match (%d) { %d { %d; } }\n", i % 3, i % 3, i }' > "$DIR/tables.ptn"
+
+check()
+{
+    script=$1
+    message=$2
+    shift 2
+
+    "$PHANTOM" -n "$@" "$DIR/$script" > "$DIR/out" 2> "$DIR/err"
+
+    if ! grep -q "Error: $message" "$DIR/err" || [ -s "$DIR/out" ]; then
+        echo "FAIL $script $*: expected '$message' and nothing run"
+        FAILED=1
+    else
+        echo "ok   $script $*"
+    fi
+}
+
+check consts.ptn "Too many constants in one chunk"
+check consts.ptn "Too many constants in one chunk" -j 4
+check tables.ptn "Too many match statements in one chunk"
+check tables.ptn "Too many match statements in one chunk" -j 4
+check tables.ptn "Too many match statements in one chunk" -j 4 -s
+
+exit $FAILED
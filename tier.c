@@ -0,0 +1,66 @@
+#include <string.h>
+
+#include "tier.h"
+#include "jit.h"
+
+void tier_init(tier_t *tier)
+{
+    tier->calls = 0;
+    tier->loops = NULL;
+    tier->native = NULL;
+    tier->compiled = 0;
+    tier->traces = NULL;
+    tier->trace_count = 0;
+}
+
+void tier_free(tier_t *tier)
+{
+    free(tier->loops);
+    jit_free(tier->native);
+
+    for (uint32_t i = 0; tier->traces && i < tier->trace_count; i++)
+        jit_free(tier->traces[i]);
+
+    free(tier->traces);
+    tier_init(tier);
+}
+
+/* Counts a call. Returns 1 on the call that makes the function hot */
+int tier_count_call(tier_t *tier, uint32_t threshold)
+{
+    if (tier->compiled) return 0;
+
+    return ++tier->calls >= threshold;
+}
+
+/* Counts a back edge of the loop at offset. Returns how many it has had, or 0 once the chunk is compiled */
+uint32_t tier_count_loop(tier_t *tier, chunk_t *chunk, uint32_t offset)
+{
+    if (tier->compiled) return 0;
+
+    if (!tier->loops) tier->loops = calloc(chunk->count, sizeof(uint32_t));
+
+    return ++tier->loops[offset];
+}
+
+/* Records the result of compiling the chunk, which is NULL if it stays interpreted */
+void tier_set_native(tier_t *tier, struct jit_code *native)
+{
+    free(tier->loops);
+    tier->loops = NULL;
+
+    tier->native = native;
+    tier->compiled = 1;
+}
+
+/* Keeps the trace of the loop at offset */
+void tier_set_trace(tier_t *tier, chunk_t *chunk, uint32_t offset, struct jit_code *trace)
+{
+    if (!tier->traces)
+    {
+        tier->traces = calloc(chunk->count, sizeof(struct jit_code *));
+        tier->trace_count = chunk->count;
+    }
+
+    tier->traces[offset] = trace;
+}
@@ -0,0 +1,40 @@
+#ifndef __PHANTOM_TIER_H_
+#define __PHANTOM_TIER_H_
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "chunk.h"
+
+struct jit_code;
+
+#define TIER_CALL_THRESHOLD 100     /* Calls of a function before it is compiled */
+#define TIER_LOOP_THRESHOLD 1000    /* Back edges of one loop before its chunk is compiled */
+#define TIER_TRACE_THRESHOLD 200    /* Back edges of one loop before an iteration of it is traced */
+
+/*
+ * How hot a chunk is. Chunks start out interpreted and are compiled to
+ * machine code once a function has been called often enough or one of the
+ * loops in it has gone round often enough. Before that a loop that goes
+ * round often gets a trace of its own.
+ */
+typedef struct {
+    uint32_t calls;
+    uint32_t *loops;    /* Back edges taken at each OP_LOOP_END offset, allocated on the first */
+
+    struct jit_code *native;    /* NULL until it is compiled, and if it couldn't be */
+    int compiled;               /* Set once it has been tried, so it isn't tried again */
+
+    struct jit_code **traces;   /* Trace of the loop at each OP_LOOP offset, allocated with the first */
+    uint32_t trace_count;
+} tier_t;
+
+void tier_init(tier_t *tier);
+void tier_free(tier_t *tier);
+
+int tier_count_call(tier_t *tier, uint32_t threshold);
+uint32_t tier_count_loop(tier_t *tier, chunk_t *chunk, uint32_t offset);
+void tier_set_native(tier_t *tier, struct jit_code *native);
+void tier_set_trace(tier_t *tier, chunk_t *chunk, uint32_t offset, struct jit_code *trace);
+
+#endif // __PHANTOM_TIER_H_
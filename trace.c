@@ -0,0 +1,122 @@
+#include <string.h>
+
+#include "trace.h"
+#include "vm.h"
+
+void trace_init(trace_t *trace)
+{
+    trace->header = 0;
+    trace->path = NULL;
+    trace->count = 0;
+    trace->capacity = 0;
+    trace->types = NULL;
+    trace->slot_count = 0;
+    trace->globals = NULL;
+    trace->global_types = NULL;
+    trace->global_count = 0;
+    trace->global_at = NULL;
+}
+
+void trace_free(trace_t *trace)
+{
+    free(trace->path);
+    free(trace->types);
+    free(trace->globals);
+    free(trace->global_types);
+    free(trace->global_at);
+    trace_init(trace);
+}
+
+/* Instructions a trace can be compiled with. Anything else ends the recording */
+static int traceable(uint8_t code)
+{
+    switch (code)
+    {
+        case OP_CONST:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_VAR_GET:
+        case OP_VAR_DECL:
+        case OP_VAR_DECL_K:
+        case OP_INC_LOCAL:
+        case OP_DEC_LOCAL:
+        case OP_DROP:
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+        case OP_LOOP:
+        case OP_LOOP_END:
+            return 1;
+        default:
+            /* Arithmetic and comparisons in all their forms */
+            return (code >= OP_ADD && code <= OP_MOD) || (code >= OP_GT && code <= OP_NE) ||
+                   (code >= OP_GT_K && code <= OP_NE_K) || (code >= OP_ADD_LL && code <= OP_NE_DD) ||
+                   (code >= OP_JGT && code <= OP_JNE_K) || (code >= OP_JGT_LL && code <= OP_JNE_DD_K);
+    }
+}
+
+/* Starts recording at the OP_LOOP at header, with the locals and the stack below it in slots */
+void trace_start(trace_t *trace, uint32_t header, object_t *slots, uint32_t slot_count)
+{
+    trace->header = header;
+    trace->count = 0;
+    trace->slot_count = slot_count;
+    trace->global_count = 0;
+    trace->types = realloc(trace->types, sizeof(object_val_t) * (slot_count ? slot_count : 1));
+
+    for (uint32_t i = 0; i < slot_count; i++)
+        trace->types[i] = slots[i].type;
+}
+
+/* Index in the trace's globals of the one at obj, which is added the first time the iteration uses it */
+static uint32_t add_global(trace_t *trace, object_t *obj)
+{
+    for (uint32_t g = 0; g < trace->global_count; g++)
+    {
+        if (trace->globals[g] == obj) return g;
+    }
+
+    trace->globals = realloc(trace->globals, sizeof(object_t *) * (trace->global_count + 1));
+    trace->global_types = realloc(trace->global_types, sizeof(object_val_t) * (trace->global_count + 1));
+
+    trace->globals[trace->global_count] = obj;
+    trace->global_types[trace->global_count] = obj->type;
+
+    return trace->global_count++;
+}
+
+/*
+ * Records the instruction at offset, which the interpreter is about to run.
+ * A global read or write comes with the global it goes to, or NULL if it
+ * isn't declared yet. Returns 0 if the recording has to be given up, because
+ * the loop finished, the iteration ran something a trace can't do, or went
+ * on too long.
+ */
+int trace_record(trace_t *trace, chunk_t *chunk, uint32_t offset, object_t *global)
+{
+    uint8_t code = chunk->code[offset];
+    int uses_global = code == OP_VAR_GET || code == OP_VAR_DECL || code == OP_VAR_DECL_K;
+
+    if (!traceable(code) || trace->count == TRACE_MAX) return 0;
+
+    /* A global that is declared on the way is only there from the next iteration */
+    if (uses_global && !global) return 0;
+
+    /* Inner loops get their own traces */
+    if (code == OP_LOOP && offset != trace->header) return 0;
+
+    /* The OP_LOOP went past the end of the loop */
+    if (trace->count == 1 && offset != trace->header + vm_op_length(OP_LOOP)) return 0;
+
+    if (trace->count == trace->capacity)
+    {
+        trace->capacity = trace->capacity ? trace->capacity * 2 : 64;
+        trace->path = realloc(trace->path, sizeof(uint32_t) * trace->capacity);
+        trace->global_at = realloc(trace->global_at, sizeof(uint32_t) * trace->capacity);
+    }
+
+    trace->global_at[trace->count] = uses_global ? add_global(trace, global) : UINT32_MAX;
+    trace->path[trace->count++] = offset;
+
+    return 1;
+}
@@ -0,0 +1,46 @@
+#ifndef __PHANTOM_TRACE_H_
+#define __PHANTOM_TRACE_H_
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "object.h"
+#include "chunk.h"
+
+#define TRACE_MAX 512   /* Most instructions one iteration of a traced loop can run */
+
+/* A trace is dropped once it has left the loop part way this often, in more than one iteration in TRACE_EXIT_RATIO */
+#define TRACE_EXIT_MIN 64
+#define TRACE_EXIT_RATIO 16
+
+/*
+ * One iteration of a hot loop as the interpreter ran it. It starts at the
+ * OP_LOOP of the loop and ends at the OP_LOOP_END that goes back to it, and
+ * keeps the offset of every instruction run on the way, so which way each
+ * branch went, along with the type of every slot when the iteration began.
+ * Globals are found by name when the interpreter runs, so the trace also
+ * keeps the object each global read or write went to.
+ */
+typedef struct {
+    uint32_t header;        /* Offset of the OP_LOOP */
+
+    uint32_t *path;
+    uint32_t count;
+    uint32_t capacity;
+
+    object_val_t *types;    /* Type of each local and stack slot on entry */
+    uint32_t slot_count;
+
+    object_t **globals;     /* Each global the iteration used, in the order it first did */
+    object_val_t *global_types; /* Type of each when the iteration first used it */
+    uint32_t global_count;
+    uint32_t *global_at;    /* Index in globals of the one each instruction in the path used */
+} trace_t;
+
+void trace_init(trace_t *trace);
+void trace_free(trace_t *trace);
+
+void trace_start(trace_t *trace, uint32_t header, object_t *slots, uint32_t slot_count);
+int trace_record(trace_t *trace, chunk_t *chunk, uint32_t offset, object_t *global);
+
+#endif // __PHANTOM_TRACE_H_
@@ -0,0 +1,378 @@
+#include "verify.h"
+#include "vm.h"
+
+typedef struct {
+    chunk_t *chunk;
+    func_table_t *funcs;    /* What calls can go to */
+    int in_function;        /* Whether the code returns rather than running off the end */
+    uint8_t *starts;        /* Set for each offset an instruction starts at, and the end */
+    uint32_t *depth;        /* Stack depth when each instruction starts */
+    uint32_t *work;         /* Instructions whose successors haven't been checked */
+    uint32_t work_count;
+    verify_result_t result;
+} verifier_t;
+
+/*
+ * Values an instruction pops and pushes. The loop counter is only looked at
+ * by OP_LOOP so it counts as popped and pushed again. A call pops its
+ * arguments and pushes the result, which a tail call leaves to the caller of
+ * its function. Returns 0 for an op code the vm doesn't know.
+ */
+static int stack_effect(const uint8_t *insn, uint32_t *pops, uint32_t *pushes)
+{
+    switch (insn[0])
+    {
+        case OP_CONST:
+        case OP_STDIN:
+        case OP_GET_LOCAL:
+        case OP_INC_LOCAL:
+        case OP_DEC_LOCAL:
+            *pops = 0; *pushes = 1;
+            return 1;
+
+        case OP_CALL:
+            *pops = insn[1 + CHUNK_FUNC_BYTES]; *pushes = 1;
+            return 1;
+
+        case OP_TAIL_CALL:
+            *pops = insn[1 + CHUNK_FUNC_BYTES]; *pushes = 0;
+            return 1;
+
+        case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_MOD:
+        case OP_GT: case OP_GT_EQ: case OP_LT: case OP_LT_EQ: case OP_EQ: case OP_NE:
+        case OP_ADD_LL: case OP_SUB_LL: case OP_MUL_LL: case OP_DIV_LL: case OP_MOD_LL:
+        case OP_GT_LL: case OP_GT_EQ_LL: case OP_LT_LL: case OP_LT_EQ_LL: case OP_EQ_LL: case OP_NE_LL:
+        case OP_ADD_DD: case OP_SUB_DD: case OP_MUL_DD: case OP_DIV_DD:
+        case OP_GT_DD: case OP_GT_EQ_DD: case OP_LT_DD: case OP_LT_EQ_DD: case OP_EQ_DD: case OP_NE_DD:
+            *pops = 2; *pushes = 1;
+            return 1;
+
+        case OP_VAR_GET:
+        case OP_INC:
+        case OP_DEC:
+        case OP_RAND:
+        case OP_LOOP:
+        case OP_GT_K: case OP_GT_EQ_K: case OP_LT_K: case OP_LT_EQ_K: case OP_EQ_K: case OP_NE_K:
+            *pops = 1; *pushes = 1;
+            return 1;
+
+        case OP_POP:
+        case OP_DROP:
+        case OP_SET_LOCAL:
+        case OP_VAR_DECL_K:
+        case OP_RETURN:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+        case OP_MATCH_TABLE: case OP_MATCH_SEARCH: case OP_MATCH_HASH:
+        case OP_JGT_K: case OP_JGT_EQ_K: case OP_JLT_K: case OP_JLT_EQ_K: case OP_JEQ_K: case OP_JNE_K:
+        case OP_JGT_LL_K: case OP_JGT_EQ_LL_K: case OP_JLT_LL_K: case OP_JLT_EQ_LL_K: case OP_JEQ_LL_K: case OP_JNE_LL_K:
+        case OP_JGT_DD_K: case OP_JGT_EQ_DD_K: case OP_JLT_DD_K: case OP_JLT_EQ_DD_K: case OP_JEQ_DD_K: case OP_JNE_DD_K:
+            *pops = 1; *pushes = 0;
+            return 1;
+
+        case OP_VAR_DECL:
+        case OP_JGT: case OP_JGT_EQ: case OP_JLT: case OP_JLT_EQ: case OP_JEQ: case OP_JNE:
+        case OP_JGT_LL: case OP_JGT_EQ_LL: case OP_JLT_LL: case OP_JLT_EQ_LL: case OP_JEQ_LL: case OP_JNE_LL:
+        case OP_JGT_DD: case OP_JGT_EQ_DD: case OP_JLT_DD: case OP_JLT_EQ_DD: case OP_JEQ_DD: case OP_JNE_DD:
+            *pops = 2; *pushes = 0;
+            return 1;
+
+        case OP_JUMP:
+        case OP_LOOP_END:
+        case OP_EXIT:
+            *pops = 0; *pushes = 0;
+            return 1;
+
+        default: return 0;
+    }
+}
+
+static int fail(verifier_t *v, verify_code_t code, uint32_t offset)
+{
+    v->result.code = code;
+    v->result.offset = offset;
+
+    return 0;
+}
+
+/* Whether a match instruction can use its table without reading past it or probing forever */
+static int table_fits(chunk_t *chunk, uint8_t code, uint32_t index)
+{
+    if (index >= chunk->table_count) return 0;
+
+    chunk_table_t *table = &chunk->tables[index];
+
+    if (table->count > 0 && !table->offsets) return 0;
+    if (code == OP_MATCH_SEARCH) return table->count == 0 || table->keys;
+    if (code != OP_MATCH_HASH) return 1;
+
+    if (table->count == 0 || (table->count & (table->count - 1)) || !table->strings || !table->hashes)
+        return 0;
+
+    for (uint32_t i = 0; i < table->count; i++)
+    {
+        if (!table->strings[i]) return 1;
+    }
+
+    return 0;
+}
+
+/* Whether a call goes to a function that takes as many arguments as it passes */
+static int call_fits(verifier_t *v, const uint8_t *insn)
+{
+    uint32_t index = CHUNK_READ_U16(insn + 1);
+
+    return v->funcs && index < v->funcs->count && v->funcs->funcs[index].arity == insn[1 + CHUNK_FUNC_BYTES];
+}
+
+/* Where a case of a match instruction goes, or past the end if it goes nowhere */
+static uint32_t case_target(chunk_t *chunk, uint32_t offset, uint32_t slot)
+{
+    uint32_t end = offset + vm_op_length(chunk->code[offset]);
+    uint32_t jump = chunk->tables[CHUNK_READ_U16(chunk->code + offset + 1)].offsets[slot];
+
+    return jump > chunk->count - end ? chunk->count + 1 : end + jump;
+}
+
+/* Cases of a match instruction. Empty slots of a hashed table go nowhere and are skipped */
+static uint32_t case_count(chunk_t *chunk, uint32_t offset)
+{
+    return vm_op_has_table(chunk->code[offset]) ? chunk->tables[CHUNK_READ_U16(chunk->code + offset + 1)].count : 0;
+}
+
+static int case_used(chunk_t *chunk, uint32_t offset, uint32_t slot)
+{
+    chunk_table_t *table = &chunk->tables[CHUNK_READ_U16(chunk->code + offset + 1)];
+
+    return chunk->code[offset] != OP_MATCH_HASH || table->strings[slot];
+}
+
+static uint32_t jump_target(chunk_t *chunk, uint32_t offset)
+{
+    uint8_t code = chunk->code[offset];
+    uint32_t end = offset + vm_op_length(code);
+    uint32_t jump = CHUNK_READ_U16(chunk->code + end - CHUNK_JUMP_BYTES);
+
+    /* Wrapping past zero leaves a target past the end, which is caught the same way */
+    return code == OP_LOOP_END ? end - jump : end + jump;
+}
+
+/* Checks the op codes and operands of every instruction, reachable or not */
+static int check_operands(verifier_t *v)
+{
+    chunk_t *chunk = v->chunk;
+    uint32_t pops, pushes;
+    uint32_t i = 0;
+
+    while (i < chunk->count)
+    {
+        uint8_t code = chunk->code[i];
+        uint32_t length = vm_op_length(code);
+
+        /* An unknown op code is one byte long so it is never cut short */
+        if (length > chunk->count - i) return fail(v, VERIFY_TRUNCATED, i);
+        if (!stack_effect(chunk->code + i, &pops, &pushes)) return fail(v, VERIFY_BAD_OP, i);
+
+        if (vm_op_has_const(code) && CHUNK_READ_U24(chunk->code + i + 1) >= chunk->const_count)
+            return fail(v, VERIFY_BAD_CONST, i);
+
+        /* A typed comparison reads its constant as its type without checking */
+        if (vm_op_has_const(code) && vm_op_operand_type(code) >= 0 &&
+            chunk->constants[CHUNK_READ_U24(chunk->code + i + 1)].type != (object_val_t)vm_op_operand_type(code))
+            return fail(v, VERIFY_BAD_CONST, i);
+
+        if (vm_op_has_local(code) && CHUNK_READ_U16(chunk->code + i + 1) >= chunk->local_count)
+            return fail(v, VERIFY_BAD_LOCAL, i);
+
+        if ((code == OP_CALL || code == OP_TAIL_CALL) && !call_fits(v, chunk->code + i))
+            return fail(v, VERIFY_BAD_CALL, i);
+
+        if ((code == OP_RETURN || code == OP_TAIL_CALL) && !v->in_function)
+            return fail(v, VERIFY_BAD_RETURN, i);
+
+        if (vm_op_has_table(code) && !table_fits(chunk, code, CHUNK_READ_U16(chunk->code + i + 1)))
+            return fail(v, VERIFY_BAD_TABLE, i);
+
+        v->starts[i] = 1;
+        i += length;
+    }
+
+    /* Running off the end finishes the code the same as an exit */
+    v->starts[chunk->count] = 1;
+
+    for (i = 0; i < chunk->count; i += vm_op_length(chunk->code[i]))
+    {
+        if (!vm_op_is_jump(chunk->code[i])) continue;
+
+        uint32_t target = jump_target(chunk, i);
+        if (target > chunk->count || !v->starts[target]) return fail(v, VERIFY_BAD_JUMP, i);
+
+        for (uint32_t slot = 0; slot < case_count(chunk, i); slot++)
+        {
+            if (!case_used(chunk, i, slot)) continue;
+
+            target = case_target(chunk, i, slot);
+            if (target > chunk->count || !v->starts[target]) return fail(v, VERIFY_BAD_JUMP, i);
+        }
+    }
+
+    return 1;
+}
+
+/* Every path into an instruction has to leave the stack at the same depth */
+static int reach(verifier_t *v, uint32_t offset, uint32_t depth)
+{
+    if (v->depth[offset] == VERIFY_UNREACHED)
+    {
+        v->depth[offset] = depth;
+        v->work[v->work_count++] = offset;
+        return 1;
+    }
+
+    return v->depth[offset] == depth || offset == v->chunk->count ? 1 : fail(v, VERIFY_MISMATCH, offset);
+}
+
+/* Follows every path from the start of the code, working out the depth at each instruction */
+static int check_depths(verifier_t *v)
+{
+    chunk_t *chunk = v->chunk;
+
+    for (uint32_t i = 0; i <= chunk->count; i++)
+        v->depth[i] = VERIFY_UNREACHED;
+
+    if (!reach(v, 0, 0)) return 0;
+
+    while (v->work_count > 0)
+    {
+        uint32_t i = v->work[--v->work_count];
+
+        /* A function has no exit to fall back to so it has to return */
+        if (i == chunk->count && v->in_function) return fail(v, VERIFY_NO_RETURN, i);
+        if (i == chunk->count) continue;
+
+        uint8_t code = chunk->code[i];
+        uint32_t depth = v->depth[i];
+        uint32_t pops, pushes;
+
+        stack_effect(chunk->code + i, &pops, &pushes);
+
+        if (depth < pops) return fail(v, VERIFY_UNDERFLOW, i);
+
+        uint32_t after = depth - pops + pushes;
+        uint32_t next = i + vm_op_length(code);
+
+        if (after > v->result.max_depth) v->result.max_depth = after;
+        if (v->result.max_depth + chunk->local_count > STACK_MAX) return fail(v, VERIFY_TOO_DEEP, i);
+
+        switch (code)
+        {
+            case OP_EXIT:
+            case OP_RETURN:
+            case OP_TAIL_CALL: break;
+
+            case OP_JUMP:
+            case OP_LOOP_END:
+            {
+                if (!reach(v, jump_target(chunk, i), after)) return 0;
+                break;
+            }
+            case OP_LOOP:
+            {
+                /* The counter is dropped when the loop finishes */
+                if (!reach(v, next, after)) return 0;
+                if (!reach(v, jump_target(chunk, i), after - 1)) return 0;
+                break;
+            }
+            default:
+            {
+                if (!reach(v, next, after)) return 0;
+                if (vm_op_is_jump(code) && !reach(v, jump_target(chunk, i), after)) return 0;
+
+                for (uint32_t slot = 0; slot < case_count(chunk, i); slot++)
+                {
+                    if (case_used(chunk, i, slot) && !reach(v, case_target(chunk, i, slot), after)) return 0;
+                }
+
+                break;
+            }
+        }
+    }
+
+    return 1;
+}
+
+static verify_result_t verify(chunk_t *chunk, func_table_t *funcs, int in_function, uint32_t *depth)
+{
+    verifier_t v;
+    v.chunk = chunk;
+    v.funcs = funcs;
+    v.in_function = in_function;
+    v.starts = calloc(chunk->count + 1, 1);
+    v.depth = depth ? depth : malloc(sizeof(uint32_t) * (chunk->count + 1));
+    v.work = malloc(sizeof(uint32_t) * (chunk->count + 1));
+    v.work_count = 0;
+
+    v.result.code = VERIFY_OK;
+    v.result.offset = 0;
+    v.result.max_depth = 0;
+
+    if (check_operands(&v)) check_depths(&v);
+
+    free(v.starts);
+    free(v.work);
+
+    if (!depth) free(v.depth);
+
+    return v.result;
+}
+
+/*
+ * Checks a chunk before the vm runs it. Op codes, constant indices, local
+ * slots, match tables, calls and jump targets are checked for every
+ * instruction, then each path through the code is followed to make sure
+ * nothing pops more than has been pushed and that paths which meet agree on
+ * the depth of the stack. As every instruction moves the stack by a fixed
+ * amount, the deepest the stack gets is known before running, so the vm can
+ * size its stack once and push and pop without checking bounds.
+ */
+verify_result_t verify_chunk(chunk_t *chunk, func_table_t *funcs)
+{
+    return verify(chunk, funcs, 0, NULL);
+}
+
+/* The same for the body of a function, which has to return on every path */
+verify_result_t verify_function(function_t *fn, func_table_t *funcs)
+{
+    return verify(fn->chunk, funcs, 1, NULL);
+}
+
+/*
+ * Verifies a chunk and keeps the depth of the stack when each instruction
+ * starts, or VERIFY_UNREACHED for code no path gets to. depth needs a slot
+ * for each byte of code and one for the end.
+ */
+verify_result_t verify_depths(chunk_t *chunk, func_table_t *funcs, int in_function, uint32_t *depth)
+{
+    return verify(chunk, funcs, in_function, depth);
+}
+
+const char *verify_message(verify_code_t code)
+{
+    switch (code)
+    {
+        case VERIFY_OK: return "ok";
+        case VERIFY_BAD_OP: return "unknown op code";
+        case VERIFY_TRUNCATED: return "instruction cut short";
+        case VERIFY_BAD_CONST: return "constant index out of range";
+        case VERIFY_BAD_LOCAL: return "local slot out of range";
+        case VERIFY_BAD_JUMP: return "jump that doesn't land on an instruction";
+        case VERIFY_BAD_TABLE: return "match table that doesn't fit its instruction";
+        case VERIFY_BAD_CALL: return "call to a missing function or with the wrong number of arguments";
+        case VERIFY_BAD_RETURN: return "return outside of a function";
+        case VERIFY_NO_RETURN: return "function that runs off the end of its code";
+        case VERIFY_UNDERFLOW: return "stack underflow";
+        case VERIFY_MISMATCH: return "stack depths differ where paths meet";
+        case VERIFY_TOO_DEEP: return "stack too deep";
+        default: return "unknown error";
+    }
+}
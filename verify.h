@@ -0,0 +1,39 @@
+#ifndef __PHANTOM_VERIFY_H_
+#define __PHANTOM_VERIFY_H_
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "chunk.h"
+#include "function.h"
+
+#define VERIFY_UNREACHED UINT32_MAX     /* Depth of an instruction no path gets to */
+
+typedef enum {
+    VERIFY_OK,
+    VERIFY_BAD_OP,          /* An op code the vm doesn't know */
+    VERIFY_TRUNCATED,       /* The last instruction runs past the end of the code */
+    VERIFY_BAD_CONST,       /* A constant index past the end of the pool, or a constant of the wrong type for a typed op */
+    VERIFY_BAD_LOCAL,       /* A slot past the local slots of the chunk */
+    VERIFY_BAD_JUMP,        /* A jump that doesn't land on an instruction */
+    VERIFY_BAD_TABLE,       /* A match table that is missing or can't be searched */
+    VERIFY_BAD_CALL,        /* A call to a function that doesn't exist or takes other arguments */
+    VERIFY_BAD_RETURN,      /* A return in code that wasn't called */
+    VERIFY_NO_RETURN,       /* A function with a path that runs off the end */
+    VERIFY_UNDERFLOW,       /* An instruction pops more than the code has pushed */
+    VERIFY_MISMATCH,        /* Paths that meet have different stack depths */
+    VERIFY_TOO_DEEP,        /* The code needs more than STACK_MAX slots */
+} verify_code_t;
+
+typedef struct {
+    verify_code_t code;
+    uint32_t offset;        /* Instruction the error was found at */
+    uint32_t max_depth;     /* Most values the code has on the stack above its locals at once */
+} verify_result_t;
+
+verify_result_t verify_chunk(chunk_t *chunk, func_table_t *funcs);
+verify_result_t verify_function(function_t *fn, func_table_t *funcs);
+verify_result_t verify_depths(chunk_t *chunk, func_table_t *funcs, int in_function, uint32_t *depth);
+const char *verify_message(verify_code_t code);
+
+#endif // __PHANTOM_VERIFY_H_
@@ -6,7 +6,9 @@ syntax keyword phantomKeywords
 	\ if
 	\ else
 	\ loop
+	\ match
 	\ func
+	\ return
 	\ exit
 	\ stdin
 	\ rand
@@ -15,6 +17,9 @@ syntax keyword phantomKeywords
 syntax match phantomNumber "\v<\d+>"
 syntax match phantomNumber "\v<\d+\.\d+>"
 
+" Match the logical operators
+syntax match phantomOperator "\v\&\&|\|\|"
+
 " Match strings
 syntax region phantomString start=/"/ skip=/\\"/ end=/"/ oneline contains=phantomInterpolatedWrapper
 syntax region phantomInterpolatedWrapper start="\v\\\(\s*" end="\v\s*\)" contained containedin=phantomString contains=phantomInterpolatedString
@@ -1,4 +1,9 @@
+#include <limits.h>
+
 #include "vm.h"
+#include "verify.h"
+#include "perf.h"
+#include "jitcache.h"
 
 #define BINARY_OP(vm, op)                       \
      object_t b           = pop(vm);            \
@@ -23,6 +28,10 @@
 /* TODO: Clean this up */
 #define COMPARE_OBJS(vm, op)                    \
     object_t b = pop(vm);                       \
+    COMPARE_WITH(vm, b, op)
+
+/* Compares the top of the stack with b, which may come from the stack or a constant */
+#define COMPARE_WITH(vm, b, op)                 \
     object_t a = pop(vm);                       \
                                                 \
     if (a.type == OBJ_VAL_LONG && b.type == OBJ_VAL_LONG) \
@@ -36,6 +45,44 @@
     else                                        \
         push(vm, obj_false)     // TODO: For now comparing incombatible types yields false
 
+/* Whether a op b holds, with the same rules as COMPARE_WITH */
+#define COMPARE_TEST(a, b, op)                                                      \
+    ((a).type == OBJ_VAL_LONG && (b).type == OBJ_VAL_LONG ? (a).as.long_num op (b).as.long_num :         \
+     (a).type == OBJ_VAL_DOUBLE && (b).type == OBJ_VAL_DOUBLE ? (a).as.double_num op (b).as.double_num : \
+     (a).type == OBJ_VAL_LONG && (b).type == OBJ_VAL_DOUBLE ? (a).as.long_num op (b).as.double_num :     \
+     (a).type == OBJ_VAL_DOUBLE && (b).type == OBJ_VAL_LONG ? (a).as.double_num op (b).as.long_num : 0)
+
+/* Fused compare and branch. Skips the jump operand, and jumps if the comparison fails */
+#define COMPARE_JUMP(vm, op)                    \
+    object_t b = pop(vm);                       \
+    object_t a = pop(vm);                       \
+    i += jump_unless(code + i + 1, COMPARE_TEST(a, b, op))
+
+#define COMPARE_K_JUMP(vm, op)                  \
+    object_t b = chunk->constants[CHUNK_READ_U24(code + i + 1)]; \
+    object_t a = pop(vm);                       \
+    i += CHUNK_CONST_BYTES + jump_unless(code + i + 1 + CHUNK_CONST_BYTES, COMPARE_TEST(a, b, op))
+
+/* The compiler has proved both operands have the type of field */
+#define TYPED_OP(vm, field, op)                 \
+    object_t b = pop(vm);                       \
+    vm->stack[vm->sp - 1].as.field = vm->stack[vm->sp - 1].as.field op b.as.field
+
+#define TYPED_COMPARE(vm, field, op)            \
+    object_t b = pop(vm);                       \
+    vm->stack[vm->sp - 1] = vm->stack[vm->sp - 1].as.field op b.as.field ? obj_true : obj_false
+
+#define TYPED_COMPARE_JUMP(vm, field, op)       \
+    object_t b = pop(vm);                       \
+    object_t a = pop(vm);                       \
+    i += jump_unless(code + i + 1, a.as.field op b.as.field)
+
+/* The verifier has checked the constant has the type of field */
+#define TYPED_COMPARE_K_JUMP(vm, field, op)     \
+    object_t b = chunk->constants[CHUNK_READ_U24(code + i + 1)]; \
+    object_t a = pop(vm);                       \
+    i += CHUNK_CONST_BYTES + jump_unless(code + i + 1 + CHUNK_CONST_BYTES, a.as.field op b.as.field)
+
 static object_t obj_true = {
     .type = OBJ_VAL_BOOL,
     .as.str = "true"
@@ -46,6 +93,11 @@ static object_t obj_false = {
     .as.str = "false"
 };
 
+static object_t obj_zero = {
+    .type = OBJ_VAL_LONG,
+    .as.long_num = 0
+};
+
 static object_t pop(vm_t *vm)
 {
     return vm->stack[--vm->sp];
@@ -56,6 +108,100 @@ static void push(vm_t *vm, object_t obj)
     vm->stack[vm->sp++] = obj;
 }
 
+/* Bytes to move on past a jump operand, which includes the jump unless cond holds */
+static uint32_t jump_unless(uint8_t *operand, int cond)
+{
+    return CHUNK_JUMP_BYTES + (cond ? 0 : CHUNK_READ_U16(operand));
+}
+
+/* Integer match cases are also matched by doubles that == would find equal */
+static int match_key(object_t val, long *key)
+{
+    if (val.type == OBJ_VAL_LONG)
+    {
+        *key = val.as.long_num;
+        return 1;
+    }
+
+    if (val.type != OBJ_VAL_DOUBLE || !(val.as.double_num >= (double)LONG_MIN && val.as.double_num < (double)LONG_MAX))
+        return 0;
+
+    *key = (long)val.as.double_num;
+
+    return *key == val.as.double_num;
+}
+
+/* Offset to the case of a match table that holds val, or UINT32_MAX if none does */
+static uint32_t match_case(chunk_table_t *table, uint8_t code, object_t val)
+{
+    long key;
+
+    if (code == OP_MATCH_HASH)
+    {
+        if (val.type != OBJ_VAL_STR) return UINT32_MAX;
+
+        uint32_t hash = chunk_hash_str(val.as.str);
+        uint32_t mask = table->count - 1;
+
+        /* The table is never full so the probe always reaches an empty slot */
+        for (uint32_t slot = hash & mask; table->strings[slot]; slot = (slot + 1) & mask)
+        {
+            if (table->hashes[slot] == hash && strcmp(table->strings[slot], val.as.str) == 0)
+                return table->offsets[slot];
+        }
+
+        return UINT32_MAX;
+    }
+
+    if (!match_key(val, &key)) return UINT32_MAX;
+
+    if (code == OP_MATCH_TABLE)
+    {
+        unsigned long slot = (unsigned long)key - (unsigned long)table->min;
+        return key >= table->min && slot < table->count ? table->offsets[slot] : UINT32_MAX;
+    }
+
+    uint32_t low = 0;
+    uint32_t high = table->count;
+
+    while (low < high)
+    {
+        uint32_t mid = low + (high - low) / 2;
+
+        if (table->keys[mid] < key) low = mid + 1;
+        else high = mid;
+    }
+
+    return low < table->count && table->keys[low] == key ? table->offsets[low] : UINT32_MAX;
+}
+
+/* Copies a string so the vm owns it rather than the constants it came from */
+static char *copy_str(const char *str)
+{
+    char *copy = malloc(strlen(str) + 1);
+    strcpy(copy, str);
+
+    return copy;
+}
+
+int vm_is_truthy(object_t obj)
+{
+    /* TODO: Make this a bit cleaner but for now it just works */
+    if (obj.type == OBJ_VAL_BOOL && strcmp(obj.as.str, "true") == 0)
+        return 1;
+
+    if (obj.type == OBJ_VAL_LONG && obj.as.long_num != 0)
+        return 1;
+
+    if (obj.type == OBJ_VAL_DOUBLE && obj.as.double_num != 0)
+        return 1;
+
+    if (obj.type == OBJ_VAL_STR && obj.as.str)
+        return 1;
+
+    return 0;
+}
+
 static void print_obj(object_t obj)
 {
     if (obj.type == OBJ_VAL_DOUBLE)
@@ -155,9 +301,20 @@ static void free_obj_list(vm_t *vm)
 vm_t *vm_init()
 {
     vm_t *vm = malloc(sizeof(vm_t));
+    vm->stack = NULL;
+    vm->stack_size = 0;
     vm->sp = 0;
-    vm->ip = 0;
-    vm->cp = 0;
+    vm->chunk = chunk_init();
+    vm->funcs = func_table_init();
+    vm->frames = NULL;
+    vm->frame_count = 0;
+    vm->frame_capacity = 0;
+    vm->jit = 1;
+    vm->call_threshold = TIER_CALL_THRESHOLD;
+    vm->loop_threshold = TIER_LOOP_THRESHOLD;
+    vm->trace_threshold = TIER_TRACE_THRESHOLD;
+    vm->report_tiers = 0;
+    vm->jit_cache = NULL;
 
     vm->globals = ht_init();
     vm->head = NULL;
@@ -169,22 +326,300 @@ void vm_free(vm_t *vm)
 {
     free_obj_list(vm);
     ht_free(vm->globals);
+    chunk_free(vm->chunk);
+    func_table_free(vm->funcs);
+    free(vm->stack);
+    free(vm->frames);
     free(vm);
 }
 
-void vm_run(vm_t *vm)
+static void declare(vm_t *vm, char *name, object_t val)
+{
+    if (val.type == OBJ_VAL_STR)
+        val.as.str = copy_str(val.as.str);
+
+    /* Redeclaring a variable reuses its object so long running */
+    /* scripts don't allocate a new one for every declaration */
+    object_t *heap_val = ht_get_value(vm->globals, name);
+    if (heap_val)
+    {
+        if (heap_val->type == OBJ_VAL_STR)
+            free(heap_val->as.str);
+
+        memcpy(heap_val, &val, sizeof(object_t));
+        return;
+    }
+
+    heap_val = malloc(sizeof(object_t));
+    memcpy(heap_val, &val, sizeof(object_t));
+
+    add_obj_ptr(vm, heap_val);
+    ht_insert(vm->globals, copy_str(name), heap_val);
+}
+
+/* Names compiled code for profilers, after the function it is for and the loop if it is a trace */
+static void name_code(jit_code_t *native, chunk_t *chunk, function_t *fn, uint32_t header)
+{
+    char name[256];
+    int n = snprintf(name, sizeof(name), "phantom:%s", fn ? fn->name : "top level");
+
+    if (header != UINT32_MAX && n >= 0 && (size_t)n < sizeof(name))
+        snprintf(name + n, sizeof(name) - n, " trace at %u", header);
+
+    perf_add_code(native, chunk, name);
+}
+
+/* Starts a chunk out with the code an earlier run kept for it, if there is any, rather than waiting for it to get hot */
+static void load_cached(vm_t *vm, tier_t *tier, chunk_t *chunk, function_t *fn)
+{
+    jit_code_t *native = jit_cache_load(vm->jit_cache, chunk, vm->funcs, fn != NULL, tier->traces);
+
+    if (!native) return;
+
+    tier_set_native(tier, native);
+    name_code(native, chunk, fn, UINT32_MAX);
+
+    if (!vm->report_tiers) return;
+
+    if (fn) fprintf(stderr, "Tier up: function '%s'", fn->name);
+    else fprintf(stderr, "Tier up: top level");
+
+    fprintf(stderr, " from the code cache, running natively\n");
+}
+
+/* Verifies the functions that haven't been yet. Returns 0 if one is bad */
+static int verify_funcs(vm_t *vm)
+{
+    for (uint32_t i = 0; i < vm->funcs->count; i++)
+    {
+        function_t *fn = &vm->funcs->funcs[i];
+
+        if (!fn->verified)
+        {
+            verify_result_t verified = verify_function(fn, vm->funcs);
+
+            if (verified.code != VERIFY_OK)
+            {
+                printf("Error: bad bytecode in function '%s' at offset %u: %s\n",
+                    fn->name, verified.offset, verify_message(verified.code));
+                return 0;
+            }
+
+            fn->max_depth = verified.max_depth;
+            fn->verified = 1;
+
+            /* A function is only verified the first time it could run, which is when to look for code kept for it */
+            if (vm->jit && vm->jit_cache) load_cached(vm, &fn->tier, fn->chunk, fn);
+        }
+    }
+
+    return 1;
+}
+
+/* Makes the stack at least needed slots. It moves, so pointers into it have to be made again */
+static void grow_stack(vm_t *vm, uint32_t needed)
+{
+    uint32_t size = vm->stack_size < STACK_MIN ? STACK_MIN : vm->stack_size;
+
+    while (size < needed) size *= 2;
+
+    vm->stack = realloc(vm->stack, sizeof(object_t) * size);
+    vm->stack_size = size;
+}
+
+/* Makes room for another frame. Returns 0 once there are FRAMES_MAX */
+static int grow_frames(vm_t *vm)
+{
+    if (vm->frame_capacity == FRAMES_MAX) return 0;
+
+    vm->frame_capacity = vm->frame_capacity ? vm->frame_capacity * 2 : FRAMES_MIN;
+    if (vm->frame_capacity > FRAMES_MAX) vm->frame_capacity = FRAMES_MAX;
+
+    vm->frames = realloc(vm->frames, sizeof(call_frame_t) * vm->frame_capacity);
+
+    return 1;
+}
+
+/*
+ * Compiles a chunk that has got hot, in the function fn or at the top level
+ * if it is NULL. loop_at is the OP_LOOP of the loop that made it hot, or
+ * UINT32_MAX if calls did. The machine code can be entered at any
+ * instruction with the stack as the interpreter left it, so a hot loop
+ * carries on in it from its next iteration.
+ */
+static jit_code_t *tier_up(vm_t *vm, tier_t *tier, chunk_t *chunk, function_t *fn, uint32_t loop_at)
+{
+    uint32_t count = loop_at == UINT32_MAX ? tier->calls : tier->loops ? tier->loops[loop_at] : 0;
+    jit_code_t *native = jit_cache_compile(vm->jit_cache, chunk, vm->funcs, fn != NULL, tier->traces);
+
+    tier_set_native(tier, native);
+    name_code(native, chunk, fn, UINT32_MAX);
+
+    if (!vm->report_tiers) return native;
+
+    if (fn) fprintf(stderr, "Tier up: function '%s'", fn->name);
+    else fprintf(stderr, "Tier up: top level");
+
+    if (loop_at != UINT32_MAX) fprintf(stderr, " at the loop at offset %u after %u iterations", loop_at, count);
+    else if (fn) fprintf(stderr, " after %u calls", count);
+
+    fprintf(stderr, native ? ", running natively\n" : ", left interpreted as it can't be compiled\n");
+
+    return native;
+}
+
+/* The global the instruction at i reads or writes, which it finds by the name on the stack or in its constant */
+static object_t *traced_global(vm_t *vm, chunk_t *chunk, uint32_t i)
+{
+    object_t name;
+
+    switch (chunk->code[i])
+    {
+        case OP_VAR_GET: name = vm->stack[vm->sp - 1]; break;
+        case OP_VAR_DECL: name = vm->stack[vm->sp - 2]; break;
+        case OP_VAR_DECL_K: name = chunk->constants[CHUNK_READ_U24(chunk->code + i + 1)]; break;
+        default: return NULL;
+    }
+
+    return ht_get_value(vm->globals, name.as.str);
+}
+
+/*
+ * Records the instruction at i while a loop in the chunk of fn, or of the
+ * top level if it is NULL, is being traced. The trace is compiled once the
+ * iteration comes back round to the OP_LOOP. Returns 0 once the recording
+ * is over, whether or not it got a trace.
+ */
+static int trace_step(vm_t *vm, trace_t *trace, tier_t *tier, chunk_t *chunk, function_t *fn, uint32_t i)
+{
+    jit_code_t *native = NULL;
+
+    if (i != trace->header || trace->count == 0)
+    {
+        if (trace_record(trace, chunk, i, traced_global(vm, chunk, i))) return 1;
+    }
+    else
+    {
+        native = jit_compile_trace(chunk, vm->funcs, fn != NULL, trace);
+        if (native) tier_set_trace(tier, chunk, trace->header, native);
+        name_code(native, chunk, fn, trace->header);
+    }
+
+    if (!vm->report_tiers) return 0;
+
+    if (fn) fprintf(stderr, "Trace: function '%s'", fn->name);
+    else fprintf(stderr, "Trace: top level");
+
+    fprintf(stderr, " at the loop at offset %u", trace->header);
+
+    if (native) fprintf(stderr, ", %u instructions running natively\n", trace->count);
+    else if (i == trace->header) fprintf(stderr, ", left interpreted as it can't be compiled\n");
+    else fprintf(stderr, ", given up at offset %u\n", i);
+
+    return 0;
+}
+
+/*
+ * Drops the trace of the loop at header. Compiled code for the chunk goes
+ * back through the interpreter at the end of the loop to run the trace, so
+ * it is compiled again without it. Returns the code for the chunk.
+ */
+static jit_code_t *drop_trace(vm_t *vm, tier_t *tier, chunk_t *chunk, function_t *fn, uint32_t header)
+{
+    jit_code_t *loop = tier->traces[header];
+
+    if (vm->report_tiers)
+    {
+        if (fn) fprintf(stderr, "Trace: function '%s'", fn->name);
+        else fprintf(stderr, "Trace: top level");
+
+        fprintf(stderr, " at the loop at offset %u dropped after leaving it part way %llu times in %llu iterations\n",
+            header, (unsigned long long)loop->exits, (unsigned long long)loop->iterations);
+    }
+
+    tier_set_trace(tier, chunk, header, NULL);
+    jit_free(loop);
+
+    if (tier->native)
+    {
+        jit_code_t *old = tier->native;
+
+        tier->native = jit_cache_compile(vm->jit_cache, chunk, vm->funcs, fn != NULL, tier->traces);
+        name_code(tier->native, chunk, fn, UINT32_MAX);
+        jit_free(old);
+    }
+
+    return tier->native;
+}
+
+/*
+ * The interpreter loop. Where a chunk has native code the loop hands each
+ * instruction to it, and it runs until an instruction it leaves to the
+ * interpreter, with the stack where the verifier says it is at that point.
+ * A loop with a trace is handed to the trace at its OP_LOOP in the same way.
+ */
+static vm_code_t execute(vm_t *vm, uint32_t base, tier_t *top, trace_t *trace)
 {
-    vm->cp = 0; // TODO: This is a hack for now
+    chunk_t *chunk = vm->chunk;
+    uint8_t *code = chunk->code;
+    object_t *locals = vm->stack + base;
+
+    /* The function running, NULL at the top level, and how hot its chunk is */
+    function_t *func = NULL;
+    tier_t *tier = top;
+    jit_code_t *native = top->native;
 
-    for (int i = 0; i < vm->ip; i++)
+    /* Set while the interpreter records an iteration of a loop */
+    int recording = 0;
+
+    for (uint32_t i = 0; i < chunk->count; i++)
     {
-        switch (vm->instructions[i])
+        if (recording) recording = trace_step(vm, trace, tier, chunk, func, i);
+
+        if (!recording && tier->traces && tier->traces[i])
+        {
+            jit_code_t *loop = tier->traces[i];
+            uint32_t header = i;
+            uint32_t at = (uint32_t)(locals - vm->stack);
+
+            /* The globals the trace uses are kept in slots of their own above its stack while it runs */
+            if (at + loop->global_slot + loop->global_count > vm->stack_size)
+            {
+                grow_stack(vm, at + loop->global_slot + loop->global_count);
+                locals = vm->stack + at;
+            }
+
+            jit_load_globals(loop, locals);
+            i = loop->entry(locals, i);
+
+            /* A trace that left values in registers has its frame rebuilt before the interpreter carries on */
+            if (i & JIT_DEOPT) i = jit_deopt(loop, locals, i);
+
+            jit_store_globals(loop, locals);
+
+            vm->sp = (uint32_t)(locals - vm->stack) + loop->local_count + loop->depth[i];
+
+            /* A trace that keeps leaving the loop part way costs more than it saves */
+            if (i != header && ++loop->exits > TRACE_EXIT_MIN && loop->exits * TRACE_EXIT_RATIO > loop->iterations)
+                native = drop_trace(vm, tier, chunk, func, header);
+        }
+
+        if (!recording && native && native->native[i])
+        {
+            i = native->entry(locals, i);
+            vm->sp = (uint32_t)(locals - vm->stack) + native->local_count + native->depth[i];
+
+            if (i == chunk->count) break;
+        }
+
+        switch (code[i])
         {
             case OP_CONST:
             {
-                object_t obj = vm->constants[vm->cp++];
+                object_t obj = chunk->constants[CHUNK_READ_U24(code + i + 1)];
                 push(vm, obj);
 
+                i += CHUNK_CONST_BYTES;
                 break;
             }
             case OP_ADD:
@@ -248,21 +683,146 @@ void vm_run(vm_t *vm)
                 object_t val = pop(vm);
                 object_t ident = pop(vm);
 
-                object_t *heap_val = malloc(sizeof(object_t));
-                memcpy(heap_val, &val, sizeof(object_t));
+                declare(vm, ident.as.str, val);
+                break;
+            }
+            case OP_VAR_DECL_K:
+            {
+                object_t ident = chunk->constants[CHUNK_READ_U24(code + i + 1)];
+                declare(vm, ident.as.str, pop(vm));
 
-                add_obj_ptr(vm, heap_val);
+                i += CHUNK_CONST_BYTES;
+                break;
+            }
+            case OP_GET_LOCAL:
+            {
+                push(vm, locals[CHUNK_READ_U16(code + i + 1)]);
 
-                if (!ht_contains_key(vm->globals, ident.as.str))
+                i += CHUNK_LOCAL_BYTES;
+                break;
+            }
+            case OP_SET_LOCAL:
+            {
+                locals[CHUNK_READ_U16(code + i + 1)] = pop(vm);
+
+                i += CHUNK_LOCAL_BYTES;
+                break;
+            }
+            case OP_INC_LOCAL:
+            case OP_DEC_LOCAL:
+            {
+                object_t *val = &locals[CHUNK_READ_U16(code + i + 1)];
+                int step = code[i] == OP_INC_LOCAL ? 1 : -1;
+
+                if (val->type == OBJ_VAL_LONG)
+                    val->as.long_num += step;
+                else if (val->type == OBJ_VAL_DOUBLE)
+                    val->as.double_num += step;
+
+                push(vm, *val);
+
+                i += CHUNK_LOCAL_BYTES;
+                break;
+            }
+            case OP_CALL:
+            {
+                function_t *fn = &vm->funcs->funcs[CHUNK_READ_U16(code + i + 1)];
+
+                if (vm->frame_count == vm->frame_capacity && !grow_frames(vm))
                 {
-                    ht_insert(vm->globals, ident.as.str, heap_val);
+                    printf("Error: too many nested calls to '%s'\n", fn->name);
+
+                    vm->sp = base;
+                    return VM_RUNTIME_ERROR;
                 }
-                else
+
+                /*
+                 * The verifier bounds the slots each chunk uses, so the stack only
+                 * has to be checked here, on the way into a function, rather than
+                 * on every push
+                 */
+                uint32_t first = vm->sp - fn->arity;
+
+                if (first + fn->chunk->local_count + fn->max_depth > vm->stack_size)
                 {
-                    /* TODO: This might not be needed here. Could be put in a set var operation */
-                    ht_update_key(vm->globals, ident.as.str, heap_val);
+                    uint32_t at = (uint32_t)(locals - vm->stack);
+                    grow_stack(vm, first + fn->chunk->local_count + fn->max_depth);
+                    locals = vm->stack + at;
                 }
 
+                call_frame_t *frame = &vm->frames[vm->frame_count++];
+                frame->chunk = chunk;
+                frame->ip = i + CHUNK_FUNC_BYTES + 1;
+                frame->locals = (uint32_t)(locals - vm->stack);
+                frame->func = func;
+
+                /* The arguments already sit where the first local slots go */
+                locals = vm->stack + first;
+
+                for (uint32_t slot = fn->arity; slot < fn->chunk->local_count; slot++)
+                    push(vm, obj_zero);
+
+                chunk = fn->chunk;
+                code = chunk->code;
+                func = fn;
+                tier = &fn->tier;
+
+                if (vm->jit && tier_count_call(tier, vm->call_threshold))
+                    tier_up(vm, tier, chunk, fn, UINT32_MAX);
+
+                native = tier->native;
+
+                /* Wraps to the first instruction as i moves on at the end of the iteration */
+                i = UINT32_MAX;
+                break;
+            }
+            case OP_TAIL_CALL:
+            {
+                function_t *fn = &vm->funcs->funcs[CHUNK_READ_U16(code + i + 1)];
+
+                uint32_t first = (uint32_t)(locals - vm->stack);
+
+                if (first + fn->chunk->local_count + fn->max_depth > vm->stack_size)
+                {
+                    grow_stack(vm, first + fn->chunk->local_count + fn->max_depth);
+                    locals = vm->stack + first;
+                }
+
+                /* No frame is pushed, so the function returns straight to the caller of this one */
+                memmove(locals, vm->stack + vm->sp - fn->arity, sizeof(object_t) * fn->arity);
+                vm->sp = (uint32_t)(locals - vm->stack) + fn->arity;
+
+                for (uint32_t slot = fn->arity; slot < fn->chunk->local_count; slot++)
+                    push(vm, obj_zero);
+
+                chunk = fn->chunk;
+                code = chunk->code;
+                func = fn;
+                tier = &fn->tier;
+
+                if (vm->jit && tier_count_call(tier, vm->call_threshold))
+                    tier_up(vm, tier, chunk, fn, UINT32_MAX);
+
+                native = tier->native;
+                i = UINT32_MAX;
+                break;
+            }
+            case OP_RETURN:
+            {
+                call_frame_t *frame = &vm->frames[--vm->frame_count];
+                object_t result = pop(vm);
+
+                /* Drop the arguments, locals and anything else the function left */
+                vm->sp = (uint32_t)(locals - vm->stack);
+                push(vm, result);
+
+                chunk = frame->chunk;
+                code = chunk->code;
+                locals = vm->stack + frame->locals;
+                func = frame->func;
+                tier = func ? &func->tier : top;
+                native = tier->native;
+                i = frame->ip;
                 break;
             }
             case OP_VAR_GET:
@@ -272,20 +832,16 @@ void vm_run(vm_t *vm)
                 if (!ht_contains_key(vm->globals, ident.as.str))
                 {
                     printf("Error: variable '%s' not declared\n", ident.as.str);
-                    free(ident.as.str);
 
-                    /* TODO: For now skip the next pop operation but in future return a
-                     * runtime error and exit gracefully
-                     */
-                     i++;
-                }
-                else
-                {
-                    object_t *val = ht_get_value(vm->globals, ident.as.str);
-                    push(vm, *val);
-                    //print_obj(*val);
-                    //free(ident.as.str); /* TODO: Garbage collector here? */
+                    /* Nothing that uses the value can run without it, so stop here */
+                    vm->sp = base;
+                    return VM_RUNTIME_ERROR;
                 }
+
+                object_t *val = ht_get_value(vm->globals, ident.as.str);
+                push(vm, *val);
+                //print_obj(*val);
+                //free(ident.as.str); /* TODO: Garbage collector here? */
                 break;
             }
             case OP_GT:
@@ -319,57 +875,240 @@ void vm_run(vm_t *vm)
                 COMPARE_OBJS(vm, !=);
                 break;
             }
-            case OP_IF:
+            case OP_GT_K:
             {
-                // Peek the item on the stack
-                //object_t obj = vm->stack[vm->sp];
-                object_t obj = pop(vm);
+                object_t b = chunk->constants[CHUNK_READ_U24(code + i + 1)];
+                COMPARE_WITH(vm, b, >);
 
-                if (obj.type == OBJ_VAL_BOOL && strcmp(obj.as.str, "true") == 0)
-                    break;
+                i += CHUNK_CONST_BYTES;
+                break;
+            }
+            case OP_GT_EQ_K:
+            {
+                object_t b = chunk->constants[CHUNK_READ_U24(code + i + 1)];
+                COMPARE_WITH(vm, b, >=);
 
-                /* TODO: Make this a bit cleaner but for now it just works */
-                if (obj.type == OBJ_VAL_LONG && obj.as.long_num != 0) 
-                    break;
+                i += CHUNK_CONST_BYTES;
+                break;
+            }
+            case OP_LT_K:
+            {
+                object_t b = chunk->constants[CHUNK_READ_U24(code + i + 1)];
+                COMPARE_WITH(vm, b, <);
 
-                if (obj.type == OBJ_VAL_DOUBLE && obj.as.double_num != 0)
-                    break;
+                i += CHUNK_CONST_BYTES;
+                break;
+            }
+            case OP_LT_EQ_K:
+            {
+                object_t b = chunk->constants[CHUNK_READ_U24(code + i + 1)];
+                COMPARE_WITH(vm, b, <=);
 
-                if (obj.type == OBJ_VAL_STR && obj.as.str)
-                    break;
+                i += CHUNK_CONST_BYTES;
+                break;
+            }
+            case OP_EQ_K:
+            {
+                object_t b = chunk->constants[CHUNK_READ_U24(code + i + 1)];
+                COMPARE_WITH(vm, b, ==);
 
-                //if (obj.type != OBJ_VAL_BOOL && (obj.as.str || obj.as.long_num != 0 || obj.as.double_num != 0))
-                    //break;
+                i += CHUNK_CONST_BYTES;
+                break;
+            }
+            case OP_NE_K:
+            {
+                object_t b = chunk->constants[CHUNK_READ_U24(code + i + 1)];
+                COMPARE_WITH(vm, b, !=);
 
+                i += CHUNK_CONST_BYTES;
+                break;
+            }
+            case OP_ADD_LL:
+            {
+                TYPED_OP(vm, long_num, +);
+                break;
+            }
+            case OP_SUB_LL:
+            {
+                TYPED_OP(vm, long_num, -);
+                break;
+            }
+            case OP_MUL_LL:
+            {
+                TYPED_OP(vm, long_num, *);
+                break;
+            }
+            case OP_DIV_LL:
+            {
+                TYPED_OP(vm, long_num, /);
+                break;
+            }
+            case OP_MOD_LL:
+            {
+                TYPED_OP(vm, long_num, %);
+                break;
+            }
+            case OP_GT_LL:
+            {
+                TYPED_COMPARE(vm, long_num, >);
+                break;
+            }
+            case OP_GT_EQ_LL:
+            {
+                TYPED_COMPARE(vm, long_num, >=);
+                break;
+            }
+            case OP_LT_LL:
+            {
+                TYPED_COMPARE(vm, long_num, <);
+                break;
+            }
+            case OP_LT_EQ_LL:
+            {
+                TYPED_COMPARE(vm, long_num, <=);
+                break;
+            }
+            case OP_EQ_LL:
+            {
+                TYPED_COMPARE(vm, long_num, ==);
+                break;
+            }
+            case OP_NE_LL:
+            {
+                TYPED_COMPARE(vm, long_num, !=);
+                break;
+            }
+            case OP_ADD_DD:
+            {
+                TYPED_OP(vm, double_num, +);
+                break;
+            }
+            case OP_SUB_DD:
+            {
+                TYPED_OP(vm, double_num, -);
+                break;
+            }
+            case OP_MUL_DD:
+            {
+                TYPED_OP(vm, double_num, *);
+                break;
+            }
+            case OP_DIV_DD:
+            {
+                TYPED_OP(vm, double_num, /);
+                break;
+            }
+            case OP_GT_DD:
+            {
+                TYPED_COMPARE(vm, double_num, >);
+                break;
+            }
+            case OP_GT_EQ_DD:
+            {
+                TYPED_COMPARE(vm, double_num, >=);
+                break;
+            }
+            case OP_LT_DD:
+            {
+                TYPED_COMPARE(vm, double_num, <);
+                break;
+            }
+            case OP_LT_EQ_DD:
+            {
+                TYPED_COMPARE(vm, double_num, <=);
+                break;
+            }
+            case OP_EQ_DD:
+            {
+                TYPED_COMPARE(vm, double_num, ==);
+                break;
+            }
+            case OP_NE_DD:
+            {
+                TYPED_COMPARE(vm, double_num, !=);
+                break;
+            }
+            case OP_JUMP_IF_FALSE:
+            {
+                object_t obj = pop(vm);
+                uint32_t offset = CHUNK_READ_U16(code + i + 1);
 
-                // If not then skip out of the statement
-                while (1)
-                {
-                    if (vm->instructions[i + 1] == OP_CONST) vm->cp++;
+                i += CHUNK_JUMP_BYTES;
 
-                    if (vm->instructions[i + 1] == OP_JUMP_END ||
-                        vm->instructions[i + 1] == OP_ELSE)
-                    {
-                        i++;
-                        break;
-                    }
+                /* Skip the true branch */
+                if (!vm_is_truthy(obj)) i += offset;
 
-                    i++;
-                }
-                
+                break;
+            }
+            case OP_JUMP_IF_TRUE:
+            {
+                object_t obj = pop(vm);
+                uint32_t offset = CHUNK_READ_U16(code + i + 1);
+
+                i += CHUNK_JUMP_BYTES;
+
+                if (vm_is_truthy(obj)) i += offset;
 
                 break;
             }
-            case OP_ELSE:
+            case OP_JGT: { COMPARE_JUMP(vm, >); break; }
+            case OP_JGT_EQ: { COMPARE_JUMP(vm, >=); break; }
+            case OP_JLT: { COMPARE_JUMP(vm, <); break; }
+            case OP_JLT_EQ: { COMPARE_JUMP(vm, <=); break; }
+            case OP_JEQ: { COMPARE_JUMP(vm, ==); break; }
+            case OP_JNE: { COMPARE_JUMP(vm, !=); break; }
+            case OP_JGT_K: { COMPARE_K_JUMP(vm, >); break; }
+            case OP_JGT_EQ_K: { COMPARE_K_JUMP(vm, >=); break; }
+            case OP_JLT_K: { COMPARE_K_JUMP(vm, <); break; }
+            case OP_JLT_EQ_K: { COMPARE_K_JUMP(vm, <=); break; }
+            case OP_JEQ_K: { COMPARE_K_JUMP(vm, ==); break; }
+            case OP_JNE_K: { COMPARE_K_JUMP(vm, !=); break; }
+            case OP_JGT_LL: { TYPED_COMPARE_JUMP(vm, long_num, >); break; }
+            case OP_JGT_EQ_LL: { TYPED_COMPARE_JUMP(vm, long_num, >=); break; }
+            case OP_JLT_LL: { TYPED_COMPARE_JUMP(vm, long_num, <); break; }
+            case OP_JLT_EQ_LL: { TYPED_COMPARE_JUMP(vm, long_num, <=); break; }
+            case OP_JEQ_LL: { TYPED_COMPARE_JUMP(vm, long_num, ==); break; }
+            case OP_JNE_LL: { TYPED_COMPARE_JUMP(vm, long_num, !=); break; }
+            case OP_JGT_DD: { TYPED_COMPARE_JUMP(vm, double_num, >); break; }
+            case OP_JGT_EQ_DD: { TYPED_COMPARE_JUMP(vm, double_num, >=); break; }
+            case OP_JLT_DD: { TYPED_COMPARE_JUMP(vm, double_num, <); break; }
+            case OP_JLT_EQ_DD: { TYPED_COMPARE_JUMP(vm, double_num, <=); break; }
+            case OP_JEQ_DD: { TYPED_COMPARE_JUMP(vm, double_num, ==); break; }
+            case OP_JNE_DD: { TYPED_COMPARE_JUMP(vm, double_num, !=); break; }
+            case OP_JGT_LL_K: { TYPED_COMPARE_K_JUMP(vm, long_num, >); break; }
+            case OP_JGT_EQ_LL_K: { TYPED_COMPARE_K_JUMP(vm, long_num, >=); break; }
+            case OP_JLT_LL_K: { TYPED_COMPARE_K_JUMP(vm, long_num, <); break; }
+            case OP_JLT_EQ_LL_K: { TYPED_COMPARE_K_JUMP(vm, long_num, <=); break; }
+            case OP_JEQ_LL_K: { TYPED_COMPARE_K_JUMP(vm, long_num, ==); break; }
+            case OP_JNE_LL_K: { TYPED_COMPARE_K_JUMP(vm, long_num, !=); break; }
+            case OP_JGT_DD_K: { TYPED_COMPARE_K_JUMP(vm, double_num, >); break; }
+            case OP_JGT_EQ_DD_K: { TYPED_COMPARE_K_JUMP(vm, double_num, >=); break; }
+            case OP_JLT_DD_K: { TYPED_COMPARE_K_JUMP(vm, double_num, <); break; }
+            case OP_JLT_EQ_DD_K: { TYPED_COMPARE_K_JUMP(vm, double_num, <=); break; }
+            case OP_JEQ_DD_K: { TYPED_COMPARE_K_JUMP(vm, double_num, ==); break; }
+            case OP_JNE_DD_K: { TYPED_COMPARE_K_JUMP(vm, double_num, !=); break; }
+            case OP_JUMP:
+            {
+                i += CHUNK_JUMP_BYTES + CHUNK_READ_U16(code + i + 1);
+                break;
+            }
+            case OP_MATCH_TABLE:
+            case OP_MATCH_SEARCH:
+            case OP_MATCH_HASH:
             {
-                while (vm->instructions[i] != OP_JUMP_END)
-                    i++;
+                chunk_table_t *table = &chunk->tables[CHUNK_READ_U16(code + i + 1)];
+                uint32_t offset = match_case(table, code[i], pop(vm));
 
+                i += CHUNK_TABLE_BYTES;
+
+                if (offset == UINT32_MAX) offset = CHUNK_READ_U16(code + i + 1);
+
+                i += CHUNK_JUMP_BYTES + offset;
                 break;
             }
-            case OP_JUMP_END:
+            case OP_DROP:
             {
-                //printf("OP_JUMP_END\n");
+                pop(vm);
                 break;
             }
             case OP_INC:
@@ -380,6 +1119,9 @@ void vm_run(vm_t *vm)
                 if (!ht_contains_key(vm->globals, ident.as.str))
                 {
                     printf("Error: variable '%s' not declared\n", ident.as.str);
+
+                    vm->sp = base;
+                    return VM_RUNTIME_ERROR;
                 }
                 else
                 {
@@ -391,7 +1133,6 @@ void vm_run(vm_t *vm)
                         val->as.double_num++;
 
                     push(vm, *val);
-                    free(ident.as.str); /* TODO: Garbage collector here? */
                 }
 
                 break;
@@ -403,6 +1144,9 @@ void vm_run(vm_t *vm)
                 if (!ht_contains_key(vm->globals, ident.as.str))
                 {
                     printf("Error: variable '%s' not declared\n", ident.as.str);
+
+                    vm->sp = base;
+                    return VM_RUNTIME_ERROR;
                 }
                 else
                 {
@@ -414,7 +1158,6 @@ void vm_run(vm_t *vm)
                         val->as.double_num--;
 
                     push(vm, *val);
-                    free(ident.as.str); /* TODO: Garbage collector here? */
                 }
 
                 break;
@@ -422,53 +1165,50 @@ void vm_run(vm_t *vm)
             case OP_LOOP:
             {
                 /* Check the expression on top of the stack */
-                object_t obj = vm->stack[vm->sp - 1];
-
-                static unsigned orig_cp = 0;
-                static unsigned end_cp = 0;
-
-                if (orig_cp == 0)
-                    orig_cp = vm->cp;
-                else
-                {
-                    if (end_cp == 0)
-                        end_cp = vm->cp;
+                object_t *obj = &vm->stack[vm->sp - 1];
+                uint32_t offset = CHUNK_READ_U16(code + i + 1);
 
-                    vm->cp = orig_cp;
-                }
+                i += CHUNK_JUMP_BYTES;
 
-                if (obj.as.str || obj.as.double_num != 0 || obj.as.long_num != 0)
+                if (obj->as.str || obj->as.double_num != 0 || obj->as.long_num != 0)
                 {
                     // If it is then execute the expression
                     // Decrement the expression so we can leave the loop
-                    vm->stack[vm->sp - 1].as.long_num--;
+                    obj->as.long_num--;
                 }
                 else
                 {
-                    // If not then skip out of the statement
-                    while (vm->instructions[i] != OP_LOOP_END)
-                        i++;
-
-                    //vm->cp = orig_cp + 1;
-                    vm->cp = end_cp;
-
-                    // TODO: Make constants cleanup function!!!
-                    //if (vm->constants[orig_cp].type == OBJ_VAL_STR)
-                        //free(vm->constants[orig_cp].as.str);
+                    /* Drop the counter and skip past the end of the loop */
+                    vm->sp--;
+                    i += offset;
                 }
 
                 break;
             }
             case OP_LOOP_END:
             {
-                while(vm->instructions[i] != OP_LOOP)
-                    i--;
+                /*
+                 * The offset is back from the end of this instruction to the
+                 * OP_LOOP. Take one off as i moves on at the end of the iteration
+                 */
+                i = i + CHUNK_JUMP_BYTES - CHUNK_READ_U16(code + i + 1);
 
                 /*
-                 * Decrement i once more so we move into that instruction
-                 * on the next iteration
+                 * Counted by the OP_LOOP. A loop that is getting hot has its next
+                 * iteration traced, and one that is hot has its chunk compiled,
+                 * which is entered at the OP_LOOP
                  */
-                i--;
+                uint32_t count = vm->jit ? tier_count_loop(tier, chunk, i + 1) : 0;
+
+                if (count && count == vm->trace_threshold && !recording)
+                {
+                    trace_start(trace, i + 1, locals, vm->sp - (uint32_t)(locals - vm->stack));
+                    recording = 1;
+                }
+                else if (count && count >= vm->loop_threshold)
+                {
+                    native = tier_up(vm, tier, chunk, func, i + 1);
+                }
 
                 break;
             }
@@ -509,10 +1249,158 @@ void vm_run(vm_t *vm)
 
                 break;
             }
-            case OP_EXIT: return;
+            case OP_EXIT:
+            {
+                vm->sp = base;
+
+                /* The compiler ends every program with an exit so only report */
+                /* the ones that came from the script itself */
+                return i == chunk->count - 1 ? VM_OK : VM_EXIT;
+            }
             default: break;
         }
     }
 
     //print_obj_list(vm);
+
+    vm->sp = base;
+
+    return VM_OK;
+}
+
+vm_code_t vm_run(vm_t *vm)
+{
+    chunk_t *chunk = vm->chunk;
+
+    /* Verified code can't go past the stack it was given so push and pop don't check */
+    verify_result_t verified = verify_chunk(chunk, vm->funcs);
+
+    if (verified.code != VERIFY_OK)
+    {
+        printf("Error: bad bytecode at offset %u: %s\n", verified.offset, verify_message(verified.code));
+        return VM_RUNTIME_ERROR;
+    }
+
+    if (!verify_funcs(vm)) return VM_RUNTIME_ERROR;
+
+    /* Room for the top level. Calls make room for the functions they go into */
+    uint32_t base = vm->sp;
+    uint32_t needed = base + chunk->local_count + verified.max_depth;
+
+    if (needed > vm->stack_size) grow_stack(vm, needed);
+
+    /* The local slots sit under anything the code pushes */
+    vm->sp += chunk->local_count;
+    vm->frame_count = 0;
+
+    /* Without a threshold the top level is compiled before it runs */
+    tier_t top;
+    tier_init(&top);
+
+    if (vm->jit && vm->loop_threshold == 0)
+        tier_up(vm, &top, chunk, NULL, UINT32_MAX);
+    else if (vm->jit && vm->jit_cache)
+        load_cached(vm, &top, chunk, NULL);
+
+    trace_t trace;
+    trace_init(&trace);
+
+    vm_code_t result = execute(vm, base, &top, &trace);
+
+    trace_free(&trace);
+    tier_free(&top);
+
+    return result;
+}
+
+/* A constant or table operand comes before a jump offset when an instruction has both */
+uint32_t vm_op_length(uint8_t code)
+{
+    uint32_t length = 1;
+
+    if (vm_op_has_const(code)) length += CHUNK_CONST_BYTES;
+    if (vm_op_has_table(code)) length += CHUNK_TABLE_BYTES;
+    if (vm_op_is_jump(code)) length += CHUNK_JUMP_BYTES;
+    if (vm_op_has_local(code)) length += CHUNK_LOCAL_BYTES;
+    if (code == OP_CALL || code == OP_TAIL_CALL) length += CHUNK_FUNC_BYTES + 1;
+
+    return length;
+}
+
+int vm_op_has_const(uint8_t code)
+{
+    switch (code)
+    {
+        case OP_CONST:
+        case OP_GT_K:
+        case OP_GT_EQ_K:
+        case OP_LT_K:
+        case OP_LT_EQ_K:
+        case OP_EQ_K:
+        case OP_NE_K:
+        case OP_VAR_DECL_K:
+        case OP_JGT_K:
+        case OP_JGT_EQ_K:
+        case OP_JLT_K:
+        case OP_JLT_EQ_K:
+        case OP_JEQ_K:
+        case OP_JNE_K:
+            return 1;
+
+        default: return code >= OP_JGT_LL_K && code <= OP_JNE_DD_K;
+    }
+}
+
+int vm_op_is_jump(uint8_t code)
+{
+    switch (code)
+    {
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP:
+        case OP_LOOP:
+        case OP_LOOP_END:
+        case OP_JUMP_IF_TRUE:
+        case OP_JGT:
+        case OP_JGT_EQ:
+        case OP_JLT:
+        case OP_JLT_EQ:
+        case OP_JEQ:
+        case OP_JNE:
+        case OP_JGT_K:
+        case OP_JGT_EQ_K:
+        case OP_JLT_K:
+        case OP_JLT_EQ_K:
+        case OP_JEQ_K:
+        case OP_JNE_K:
+        case OP_MATCH_TABLE:
+        case OP_MATCH_SEARCH:
+        case OP_MATCH_HASH:
+            return 1;
+
+        default: return code >= OP_JGT_LL && code <= OP_JNE_DD_K;
+    }
+}
+
+int vm_op_has_table(uint8_t code)
+{
+    return code == OP_MATCH_TABLE || code == OP_MATCH_SEARCH || code == OP_MATCH_HASH;
+}
+
+/* The type a typed op has been proved to have both operands of, or -1 for an op that checks their tags */
+int vm_op_operand_type(uint8_t code)
+{
+    if ((code >= OP_ADD_LL && code <= OP_NE_LL) || (code >= OP_JGT_LL && code <= OP_JNE_LL) ||
+        (code >= OP_JGT_LL_K && code <= OP_JNE_LL_K))
+        return OBJ_VAL_LONG;
+
+    if ((code >= OP_ADD_DD && code <= OP_NE_DD) || (code >= OP_JGT_DD && code <= OP_JNE_DD) ||
+        (code >= OP_JGT_DD_K && code <= OP_JNE_DD_K))
+        return OBJ_VAL_DOUBLE;
+
+    return -1;
+}
+
+int vm_op_has_local(uint8_t code)
+{
+    return code == OP_GET_LOCAL || code == OP_SET_LOCAL || code == OP_INC_LOCAL || code == OP_DEC_LOCAL;
 }
@@ -6,19 +6,24 @@
 #include <stdint.h>
 
 #include "object.h"
+#include "chunk.h"
 #include "hashtable.h"
+#include "function.h"
+#include "jit.h"
 
-#define STACK_MAX     2048
-#define CONSTANTS_MAX 64
+#define STACK_MAX     2048   /* Most slots the verifier lets a chunk use */
+#define STACK_MIN     64     /* Slots the stack has once it is first grown */
+#define FRAMES_MAX    256    /* Calls that can be running at once */
+#define FRAMES_MIN    8      /* Frames there is room for once the first call is made */
 
 typedef enum {
-    OP_CONST    = 0,
+    OP_CONST    = 0,    /* Operand: constant index */
     OP_ADD      = 1,
     OP_SUB      = 2,
     OP_MUL      = 3,
     OP_DIV      = 4,
     OP_MOD      = 5,
-    OP_POP      = 6,
+    OP_POP      = 6,    /* Pops and prints the value */
     OP_VAR_DECL = 7,
     OP_VAR_GET  = 8,
     OP_GT       = 9,
@@ -27,32 +32,177 @@ typedef enum {
     OP_LT_EQ    = 12,
     OP_EQ       = 13,
     OP_NE       = 14,
-    OP_IF       = 15,
-    OP_ELSE     = 16,
-    OP_JUMP_END = 17,
+    OP_JUMP_IF_FALSE = 15,  /* Operand: forward jump offset */
+    OP_JUMP     = 16,       /* Operand: forward jump offset */
+    OP_DROP     = 17,       /* Pops the value without printing it */
     OP_INC      = 18,
     OP_DEC      = 19,
-    OP_LOOP     = 20,
-    OP_LOOP_END = 21,
+    OP_LOOP     = 20,       /* Operand: forward offset to the end of the loop */
+    OP_LOOP_END = 21,       /* Operand: backward offset to its OP_LOOP */
     OP_STDIN    = 22,
     OP_RAND     = 23,
+
+    /* Comparisons against a constant. Operand: constant index */
+    OP_GT_K     = 24,
+    OP_GT_EQ_K  = 25,
+    OP_LT_K     = 26,
+    OP_LT_EQ_K  = 27,
+    OP_EQ_K     = 28,
+    OP_NE_K     = 29,
+
+    /* Local slots at the bottom of the stack for values the ir keeps. Operand: slot */
+    OP_GET_LOCAL = 30,
+    OP_SET_LOCAL = 31,
+
+    OP_VAR_DECL_K = 32,     /* Declares the variable named by the constant. Operand: constant index */
+
+    /* Operators whose operands are known to both be longs, so no tags are checked */
+    OP_ADD_LL   = 33,
+    OP_SUB_LL   = 34,
+    OP_MUL_LL   = 35,
+    OP_DIV_LL   = 36,
+    OP_MOD_LL   = 37,
+    OP_GT_LL    = 38,
+    OP_GT_EQ_LL = 39,
+    OP_LT_LL    = 40,
+    OP_LT_EQ_LL = 41,
+    OP_EQ_LL    = 42,
+    OP_NE_LL    = 43,
+
+    /* The same for doubles, which have no modulo */
+    OP_ADD_DD   = 44,
+    OP_SUB_DD   = 45,
+    OP_MUL_DD   = 46,
+    OP_DIV_DD   = 47,
+    OP_GT_DD    = 48,
+    OP_GT_EQ_DD = 49,
+    OP_LT_DD    = 50,
+    OP_LT_EQ_DD = 51,
+    OP_EQ_DD    = 52,
+    OP_NE_DD    = 53,
+
+    OP_JUMP_IF_TRUE = 54,   /* Operand: forward jump offset */
+
+    /*
+     * A comparison and an OP_JUMP_IF_FALSE in one. They jump when the comparison
+     * doesn't hold, without pushing the result. Operand: forward jump offset
+     */
+    OP_JGT      = 55,
+    OP_JGT_EQ   = 56,
+    OP_JLT      = 57,
+    OP_JLT_EQ   = 58,
+    OP_JEQ      = 59,
+    OP_JNE      = 60,
+
+    /* The same against a constant. Operands: constant index then forward jump offset */
+    OP_JGT_K    = 61,
+    OP_JGT_EQ_K = 62,
+    OP_JLT_K    = 63,
+    OP_JLT_EQ_K = 64,
+    OP_JEQ_K    = 65,
+    OP_JNE_K    = 66,
+
+    /*
+     * Pop a value and jump to the case in a match table that has it, or to the
+     * default when none do. Operands: table index then forward default offset
+     */
+    OP_MATCH_TABLE  = 67,   /* Dense integer cases, indexed directly */
+    OP_MATCH_SEARCH = 68,   /* Sparse integer cases, binary searched */
+    OP_MATCH_HASH   = 69,   /* String cases, looked up by hash */
+
+    /*
+     * Calls a function with the arguments on top of the stack, which become its
+     * first local slots. Operands: function index then argument count
+     */
+    OP_CALL     = 70,
+    OP_RETURN   = 71,       /* Pops the result, drops the frame and pushes the result for the caller */
+
+    /* Increments and decrements of a local slot that push the new value. Operand: slot */
+    OP_INC_LOCAL = 72,
+    OP_DEC_LOCAL = 73,
+
+    /*
+     * A call whose result is returned straight away. The arguments replace the
+     * frame of the function making the call, so a chain of tail calls runs in
+     * one frame. Operands: function index then argument count
+     */
+    OP_TAIL_CALL = 74,
+
+    /*
+     * Fused compare and branch on operands the compiler has proved are both
+     * longs, or both doubles, so no tags are checked. Operand: forward jump offset
+     */
+    OP_JGT_LL    = 75,
+    OP_JGT_EQ_LL = 76,
+    OP_JLT_LL    = 77,
+    OP_JLT_EQ_LL = 78,
+    OP_JEQ_LL    = 79,
+    OP_JNE_LL    = 80,
+
+    OP_JGT_DD    = 81,
+    OP_JGT_EQ_DD = 82,
+    OP_JLT_DD    = 83,
+    OP_JLT_EQ_DD = 84,
+    OP_JEQ_DD    = 85,
+    OP_JNE_DD    = 86,
+
+    /* The same against a constant of the type. Operands: constant index then forward jump offset */
+    OP_JGT_LL_K    = 87,
+    OP_JGT_EQ_LL_K = 88,
+    OP_JLT_LL_K    = 89,
+    OP_JLT_EQ_LL_K = 90,
+    OP_JEQ_LL_K    = 91,
+    OP_JNE_LL_K    = 92,
+
+    OP_JGT_DD_K    = 93,
+    OP_JGT_EQ_DD_K = 94,
+    OP_JLT_DD_K    = 95,
+    OP_JLT_EQ_DD_K = 96,
+    OP_JEQ_DD_K    = 97,
+    OP_JNE_DD_K    = 98,
+
     OP_EXIT     = 255,
 } op_code;
 
+typedef enum {
+    VM_EXIT,    /* The script ran an exit statement */
+    VM_OK,
+    VM_RUNTIME_ERROR,   /* The chunk failed verification or stopped on an error */
+} vm_code_t;
+
 struct object_node {
     struct object_node *next;
     object_t *obj;
 };
 
+/* Where a caller carries on once the function it called returns */
+typedef struct {
+    chunk_t *chunk;
+    uint32_t ip;        /* Last byte of the call, as the vm moves on past it */
+    uint32_t locals;    /* Stack index of the first local slot, as the stack moves when it grows */
+    function_t *func;       /* The caller, or NULL for the top level */
+} call_frame_t;
+
 typedef struct {
-    object_t stack[STACK_MAX];
+    object_t *stack;    /* Grown to what each chunk needs when it is run or called */
+    uint32_t stack_size;
     uint32_t sp;
 
-    uint8_t instructions[UINT8_MAX]; /* TODO: Dynamic array */
-    uint8_t ip;
+    chunk_t *chunk;  /* The code being run */
+    func_table_t *funcs;
 
-    object_t constants[CONSTANTS_MAX]; /* TODO: Dynamic array */
-    uint8_t cp;
+    /* Frames of the calls that are running, kept by the vm and grown as calls nest deeper, up to FRAMES_MAX */
+    call_frame_t *frames;
+    uint32_t frame_count;
+    uint32_t frame_capacity;
+
+    /* Chunks are translated to machine code once they get hot */
+    int jit;
+    uint32_t call_threshold;    /* Calls of a function before it is compiled */
+    uint32_t loop_threshold;    /* Back edges of a loop before its chunk is compiled, 0 compiles the top level up front */
+    uint32_t trace_threshold;   /* Back edges of a loop before an iteration is traced, 0 turns tracing off */
+    int report_tiers;           /* Print each chunk that is compiled to stderr */
+    const char *jit_cache;      /* Directory machine code is kept in between runs, or NULL */
 
     struct object_node *head;    /* List of all objects that have been allocated */
     struct hash_table *globals;
@@ -60,6 +210,15 @@ typedef struct {
 
 vm_t *vm_init();
 void vm_free(vm_t *vm);
-void vm_run(vm_t *vm);
+vm_code_t vm_run(vm_t *vm);
+
+int vm_is_truthy(object_t obj);
+
+uint32_t vm_op_length(uint8_t code);
+int vm_op_has_const(uint8_t code);
+int vm_op_is_jump(uint8_t code);
+int vm_op_has_table(uint8_t code);
+int vm_op_operand_type(uint8_t code);
+int vm_op_has_local(uint8_t code);
 
 #endif // __VM_H_